@@ -1,5 +1,10 @@
 
 #include "./laynii_lib.h"
+#include <sys/stat.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
 
 // ============================================================================
 // Command-line log messages
@@ -119,29 +124,74 @@ double ren_autocor(double arr[], int size) {
 //    }
 //}
 
-int ren_most_occurred_number(int nums[], int size){
-		int returnvalue = 0;
-		int max_count = 0;
-		//cout << "\nMost occurred number: ";
-		for (int i=0; i<size; i++){
-			int count=1;
-			for (int j=i+1;j<size;j++)
-			if (nums[i]==nums[j])
-				count++;
-			if (count>max_count)
-				max_count = count;
-		}
-
-	for (int i=0;i<size;i++){
-		int count=1;
-			for (int j=i+1;j<size;j++)
-				if (nums[i]==nums[j])
-					count++;
-				if (count==max_count)
-					//cout << nums[i] << endl;
-					returnvalue =  nums[i]; 
-		}
-     return returnvalue ; 
+Moments ren_moments(const double arr[], int size) {
+    // NOTE: The mean is found first and all centered sums are then fused into
+    // a second sweep. Raw power sums in a single sweep would lose precision
+    // for signals with a large mean (e.g. BOLD) in the 3rd and 4th moments.
+    int i;
+    double sum = 0;
+    for (i = 0; i < size; ++i) {
+        sum += arr[i];
+    }
+    const double mean = sum / size;
+
+    double sum2 = 0, sum3 = 0, sum4 = 0, sum_lag = 0;
+    if (size > 0) {  // First element has no lag-1 partner
+        const double d = arr[0] - mean;
+        sum2 = d * d;
+        sum3 = sum2 * d;
+        sum4 = sum2 * sum2;
+    }
+    for (i = 1; i < size; ++i) {
+        const double d = arr[i] - mean;
+        const double d2 = d * d;
+        sum2 += d2;
+        sum3 += d2 * d;
+        sum4 += d2 * d2;
+        sum_lag += d * (arr[i - 1] - mean);
+    }
+
+    // Same definitions as ren_stdev, ren_skew, ren_kurt and ren_autocor
+    Moments m;
+    m.mean = mean;
+    m.stdev = sqrt(sum2 / ((double)size - 1));
+    m.skew = (sum3 / size) / pow(sum2 / ((double)size - 1), 1.5);
+    m.kurt = (sum4 / size) / ((sum2 / size) * (sum2 / size)) - 3;
+    m.autocor = sum_lag / sum2;
+    return m;
+}
+
+int ren_most_occurred_number(int nums[], int size) {
+    // Single pass with a histogram of the values seen. On ties the value
+    // whose first occurrence comes last wins. Returns 0 for empty input.
+    std::unordered_map<int, std::pair<int, int> > histogram;  // count, first
+    for (int i = 0; i < size; ++i) {
+        histogram.insert(std::make_pair(nums[i], std::make_pair(0, i))).first->second.first += 1;
+    }
+    int returnvalue = 0;
+    int max_count = 0, max_first = 0;
+    for (auto it = histogram.begin(); it != histogram.end(); ++it) {
+        if (it->second.first > max_count
+            || (it->second.first == max_count && it->second.second > max_first)) {
+            max_count = it->second.first;
+            max_first = it->second.second;
+            returnvalue = it->first;
+        }
+    }
+    return returnvalue;
+}
+
+double ren_median(float arr[], uint64_t size) {
+    // Expected linear time with nth_element. Reorders arr.
+    if (size == 0) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    std::nth_element(arr, arr + size / 2, arr + size);
+    double median = arr[size / 2];
+    if (size % 2 == 0) {  // Average of the two middle values
+        median = (median + *std::max_element(arr, arr + size / 2)) / 2.;
+    }
+    return median;
 }
 
 float dist(float x1, float y1, float z1, float x2, float y2, float z2,
@@ -171,34 +221,10 @@ float gaus(float distance, float sigma) {
 // Utility functions
 // ============================================================================
 
-void save_output_nifti(const string path, const string tag,  nifti_image* nii,
-                       const bool log, const bool use_outpath) {
-    ///////////////////////////////////////////////////////////////////////////
-    // Note:
-    // - 1st argument is the string of the output file name
-    //       if there is no explicit output path given, this will be the file
-    //       name of the main input data
-    //       if there is an explicit output file name given, this will be the
-    //       user-defined name following the -output
-    //       (including the path and including the file extension)
-    // - 2nd argument is the output file name tag, that will be added to the
-    //       above argument, this field is ignored, when the flag "use_outpath"
-    //       (last argument) is selected.
-    // - 3rd argument is the pointer to the data set that is supposed to be
-    //       written
-    // - 4th argument states if, during the execution of the program an the
-    //   writing process should be logged
-    //       this argument is optional with the default: TRUE
-    // - 5th argument states if the output tag (second argument) should be
-    //   ignored or not. This argument is optional the default: FALSE
-    //
-    // example: save_output_nifti(fout, "VASO_LN", nii_boco_vaso, true, use_outpath);
-    ///////////////////////////////////////////////////////////////////////////
-
-    string path_out;
-
+string output_path(const string path, const string tag, const bool use_outpath) {
+    // Same naming rules as save_output_nifti, for outputs written in pieces
     if (use_outpath) {
-        path_out = path;
+        return path;
     } else {
         // Parse path
         string dir, file, basename, ext, sep;
@@ -231,102 +257,180 @@ void save_output_nifti(const string path, const string tag,  nifti_image* nii,
         }
 
         // Prepare output path
-        path_out = dir + sep + basename + "_" + tag + ext;
+        return dir + sep + basename + "_" + tag + ext;
+    }
+}
+
+// ============================================================================
+// Background output writer
+// ============================================================================
+// Queued images are private copies, written and freed by one writer thread.
+// Writing blocks the caller only while more than max_bytes are queued.
+struct AsyncOutput {
+    bool enabled = false;
+    bool stop = false;
+    uint64_t queued_bytes = 0;
+    const uint64_t max_bytes = static_cast<uint64_t>(1) << 30;
+    std::deque<nifti_image*> queue;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread writer;
+
+    ~AsyncOutput() { wait_for_outputs(); }
+};
+
+static AsyncOutput async_output;
+
+static bool async_output_enabled() {
+    return async_output.enabled;
+}
+
+static void write_queued_outputs() {
+    std::unique_lock<std::mutex> lock(async_output.mutex);
+    while (true) {
+        async_output.changed.wait(lock, [] {
+            return async_output.stop || !async_output.queue.empty(); });
+        if (async_output.queue.empty()) break;  // Stopped and done
+
+        nifti_image* nii = async_output.queue.front();
+        lock.unlock();
+        nifti_image_write(nii);
+        const uint64_t nr_bytes = nii->nvox * nii->nbyper;
+        nifti_image_free(nii);
+        lock.lock();
+
+        async_output.queue.pop_front();
+        async_output.queued_bytes -= nr_bytes;
+        async_output.changed.notify_all();
+    }
+}
+
+static void queue_output(nifti_image* nii) {
+    const uint64_t nr_bytes = nii->nvox * nii->nbyper;
+    nifti_image* nii_copy = nifti_copy_nim_info(nii);
+    nii_copy->data = malloc(max(nr_bytes, static_cast<uint64_t>(1)));
+    if (!nii_copy->data) {  // Fall back to writing right away
+        nifti_image_free(nii_copy);
+        nifti_image_write(nii);
+        return;
+    }
+    memcpy(nii_copy->data, nii->data, nr_bytes);
+
+    std::unique_lock<std::mutex> lock(async_output.mutex);
+    async_output.changed.wait(lock, [nr_bytes] {
+        return async_output.queue.empty()
+            || async_output.queued_bytes + nr_bytes <= async_output.max_bytes; });
+    if (!async_output.writer.joinable()) {
+        async_output.stop = false;
+        async_output.writer = std::thread(write_queued_outputs);
+    }
+    async_output.queue.push_back(nii_copy);
+    async_output.queued_bytes += nr_bytes;
+    async_output.changed.notify_all();
+}
+
+void set_async_output(const bool enable) {
+    if (!enable) {
+        wait_for_outputs();
+    }
+    async_output.enabled = enable;
+}
+
+void wait_for_outputs() {
+    {
+        std::lock_guard<std::mutex> lock(async_output.mutex);
+        if (!async_output.writer.joinable()) return;
+        async_output.stop = true;
+        async_output.changed.notify_all();
     }
+    async_output.writer.join();
+}
+
+void save_output_nifti(const string path, const string tag,  nifti_image* nii,
+                       const bool log, const bool use_outpath) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - 1st argument is the string of the output file name
+    //       if there is no explicit output path given, this will be the file
+    //       name of the main input data
+    //       if there is an explicit output file name given, this will be the
+    //       user-defined name following the -output
+    //       (including the path and including the file extension)
+    // - 2nd argument is the output file name tag, that will be added to the
+    //       above argument, this field is ignored, when the flag "use_outpath"
+    //       (last argument) is selected.
+    // - 3rd argument is the pointer to the data set that is supposed to be
+    //       written
+    // - 4th argument states if, during the execution of the program an the
+    //   writing process should be logged
+    //       this argument is optional with the default: TRUE
+    // - 5th argument states if the output tag (second argument) should be
+    //   ignored or not. This argument is optional the default: FALSE
+    //
+    // example: save_output_nifti(fout, "VASO_LN", nii_boco_vaso, true, use_outpath);
+    ///////////////////////////////////////////////////////////////////////////
+
+    string path_out = output_path(path, tag, use_outpath);
 
     // Save nifti
     nifti_set_filenames(nii, path_out.c_str(), 1, 1);
-    nifti_image_write(nii);
+    if (async_output_enabled()) {
+        queue_output(nii);
+    } else {
+        nifti_image_write(nii);
+    }
     if (log) {
         log_output(path_out.c_str());
     }
 }
 
 
-nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii) {
-    nifti_image* nii_new = nifti_copy_nim_info(nii);
-    nii_new->datatype = NIFTI_TYPE_FLOAT32;
-    nii_new->nbyper = sizeof(float);
-    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    float* nii_new_data = static_cast<float*>(nii_new->data);
-    int nr_voxels = nii_new->nvox;
+// NOTE(Faruk): See nifti1.h for notes on data types
+template <typename T> struct NiftiType;
+template <> struct NiftiType<uint8_t> { static const int code = NIFTI_TYPE_UINT8; };
+template <> struct NiftiType<int16_t> { static const int code = NIFTI_TYPE_INT16; };
+template <> struct NiftiType<int32_t> { static const int code = NIFTI_TYPE_INT32; };
+template <> struct NiftiType<float> { static const int code = NIFTI_TYPE_FLOAT32; };
+template <> struct NiftiType<double> { static const int code = NIFTI_TYPE_FLOAT64; };
 
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
+template <typename Tin, typename T>
+static void cast_values(const void* data, const uint64_t nr_values, T* out) {
+    const Tin* in = static_cast<const Tin*>(data);
+    for (uint64_t i = 0; i != nr_values; ++i) {
+        *(out + i) = static_cast<T>(*(in + i));
     }
+}
 
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!= *(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
-        }
+template <typename T>
+static bool convert_nifti_values(const int datatype, const void* data,
+                                 const uint64_t nr_values, T* out) {
+    switch (datatype) {
+        case NIFTI_TYPE_UINT8:   cast_values<uint8_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_UINT16:  cast_values<uint16_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_UINT32:  cast_values<uint32_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_UINT64:  cast_values<uint64_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_INT8:    cast_values<int8_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_INT16:   cast_values<int16_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_INT32:   cast_values<int32_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_INT64:   cast_values<int64_t>(data, nr_values, out); break;
+        case NIFTI_TYPE_FLOAT32: cast_values<float>(data, nr_values, out); break;
+        case NIFTI_TYPE_FLOAT64: cast_values<double>(data, nr_values, out); break;
+        default:
+            cout << "Warning! Unrecognized nifti data type!" << endl;
+            return false;
     }
 
-    //  Incorporate scaling (scl_slope) and translation (scl_inter) headers
-    for (int i = 0; i < nr_voxels; ++i) {
-        *(nii_new_data + i) *= nii->scl_slope;
-        *(nii_new_data + i) += nii->scl_inter;
+    // Replace nans with zeros
+    for (uint64_t i = 0; i != nr_values; ++i) {
+        if (*(out + i) != *(out + i)) {
+            *(out + i) = 0;
+        }
     }
-    nii_new->scl_slope = 1.;
-    nii_new->scl_inter = 0.;
-
-    return nii_new;
+    return true;
 }
 
-
-nifti_image* copy_nifti_as_float32(nifti_image* nii) {
+template <typename T>
+static nifti_image* copy_nifti_as(nifti_image* nii) {
     ///////////////////////////////////////////////////////////////////////////
     // NOTE(Renzo): Fixing potential problems with different input datatypes //
     // here, I am loading them in their native datatype and cast them        //
@@ -341,71 +445,193 @@ nifti_image* copy_nifti_as_float32(nifti_image* nii) {
     //                                 int datatype, int data_fill)
 
     nifti_image* nii_new = nifti_copy_nim_info(nii);
-    nii_new->datatype = NIFTI_TYPE_FLOAT32;
-    nii_new->nbyper = sizeof(float);
+    nii_new->datatype = NiftiType<T>::code;
+    nii_new->nbyper = sizeof(T);
     nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
+    convert_nifti_values(nii->datatype, nii->data, nii_new->nvox,
+                         static_cast<T*>(nii_new->data));
+    return nii_new;
+}
+
+template <typename T>
+T* nifti_data_as(nifti_image* nii) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - The buffer is converted chunk by chunk through a small copy. Going
+    //   forward when the type shrinks (or stays), backward after growing the
+    //   buffer, never overwrites values that are not converted yet.
+    // - Memory mapped data (see nifti_image_load) is only written where there
+    //   are nans, so untouched pages stay shared with the file. Converted
+    //   mapped data goes to a new buffer.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint64_t nr_values = nii->nvox;
+    const int nbyper_in = nii->nbyper;
+    const int datatype_in = nii->datatype;
+    if (datatype_in == NiftiType<T>::code) {
+        T* data = static_cast<T*>(nii->data);
+        for (uint64_t i = 0; i != nr_values; ++i) {
+            if (*(data + i) != *(data + i)) {
+                *(data + i) = 0;
+            }
+        }
+        return data;
+    }
+
+    if (nifti_data_is_mapped(nii->data)) {
+        T* out = static_cast<T*>(malloc(max(nr_values, static_cast<uint64_t>(1)) * sizeof(T)));
+        if (!out) {
+            fprintf(stderr, "** failed to allocate memory for data conversion\n");
+            exit(EXIT_FAILURE);
+        }
+        convert_nifti_values(datatype_in, nii->data, nr_values, out);
+        nifti_image_unload(nii);
+        nii->data = out;
+        nii->datatype = NiftiType<T>::code;
+        nii->nbyper = sizeof(T);
+        return out;
+    }
+
+    const uint64_t chunk = 1 << 16;
+    vector<char> tmp(chunk * nbyper_in);
+    if (sizeof(T) <= static_cast<size_t>(nbyper_in)) {
+        char* raw = static_cast<char*>(nii->data);
+        T* out = static_cast<T*>(nii->data);
+        for (uint64_t start = 0; start < nr_values; start += chunk) {
+            const uint64_t n = min(chunk, nr_values - start);
+            memcpy(tmp.data(), raw + start * nbyper_in, n * nbyper_in);
+            convert_nifti_values(datatype_in, tmp.data(), n, out + start);
+        }
+        void* data = realloc(nii->data, max(nr_values, static_cast<uint64_t>(1)) * sizeof(T));
+        if (data) nii->data = data;
+    } else {
+        void* data = realloc(nii->data, nr_values * sizeof(T));
+        if (!data) {
+            fprintf(stderr, "** failed to allocate memory for data conversion\n");
+            exit(EXIT_FAILURE);
+        }
+        nii->data = data;
+        char* raw = static_cast<char*>(nii->data);
+        T* out = static_cast<T*>(nii->data);
+        for (uint64_t end = nr_values; end > 0;) {
+            const uint64_t n = min(chunk, end);
+            end -= n;
+            memcpy(tmp.data(), raw + end * nbyper_in, n * nbyper_in);
+            convert_nifti_values(datatype_in, tmp.data(), n, out + end);
+        }
+    }
+    nii->datatype = NiftiType<T>::code;
+    nii->nbyper = sizeof(T);
+    return static_cast<T*>(nii->data);
+}
+
+template uint8_t* nifti_data_as<uint8_t>(nifti_image* nii);
+template int16_t* nifti_data_as<int16_t>(nifti_image* nii);
+template int32_t* nifti_data_as<int32_t>(nifti_image* nii);
+template float* nifti_data_as<float>(nifti_image* nii);
+template double* nifti_data_as<double>(nifti_image* nii);
+
+nifti_image* copy_nifti_as_float32(nifti_image* nii) {
+    return copy_nifti_as<float>(nii);
+}
+
+nifti_image* copy_nifti_as_double(nifti_image* nii) {
+    return copy_nifti_as<double>(nii);
+}
+
+nifti_image* copy_nifti_as_int32(nifti_image* nii) {
+    return copy_nifti_as<int32_t>(nii);
+}
+
+nifti_image* copy_nifti_as_int16(nifti_image* nii) {
+    return copy_nifti_as<int16_t>(nii);
+}
+
+nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii) {
+    nifti_image* nii_new = copy_nifti_as<float>(nii);
     float* nii_new_data = static_cast<float*>(nii_new->data);
     int nr_voxels = nii_new->nvox;
 
+    //  Incorporate scaling (scl_slope) and translation (scl_inter) headers
+    for (int i = 0; i < nr_voxels; ++i) {
+        *(nii_new_data + i) *= nii->scl_slope;
+        *(nii_new_data + i) += nii->scl_inter;
+    }
+    nii_new->scl_slope = 1.;
+    nii_new->scl_inter = 0.;
+
+    return nii_new;
+}
+
+nifti_image* copy_nifti_as_float16(nifti_image* nii) {
+    nifti_image* nii_new = nifti_copy_nim_info(nii);
+    // NOTE(Renzo): I know that it is not suppoded to look like INT. This is an
+    // unlucky naming convention. It is a float16, trust me.
+    nii_new->datatype = NIFTI_TYPE_INT16;
+    nii_new->nbyper = sizeof(short);
+    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
+    int nr_voxels = nii_new->nvox;
+
+    short *nii_new_data = static_cast<short*>(nii_new->data);
+
     // NOTE(Faruk): See nifti1.h for notes on data types
     // ------------------------------------------------------------------------
     if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
         uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
         uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
         uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
         uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
         int8_t* nii_data = static_cast<int8_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
         int16_t* nii_data = static_cast<int16_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
         int32_t* nii_data = static_cast<int32_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
         int64_t* nii_data = static_cast<int64_t*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
         float* nii_data = static_cast<float*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
         double* nii_data = static_cast<double*>(nii->data);
         for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else {
         cout << "Warning! Unrecognized nifti data type!" << endl;
     }
-
+    nii_new->scl_slope = nii->scl_slope / 1000.;
     // Replace nans with zeros
     for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!= *(nii_new_data + i)) {
+        if (*(nii_new_data + i)!=*(nii_new_data + i)) {
             *(nii_new_data + i) = 0;
         }
     }
@@ -413,535 +639,1630 @@ nifti_image* copy_nifti_as_float32(nifti_image* nii) {
     return nii_new;
 }
 
-nifti_image* copy_nifti_as_double(nifti_image* nii) {
-    ///////////////////////////////////////////////////////////////////////////
-    // NOTE(Renzo): Fixing potential problems with different input datatypes //
-    // here, I am loading them in their native datatype and cast them        //
-    // to the datatype I like best.                                          //
-    ///////////////////////////////////////////////////////////////////////////
 
-    // NOTE(for future reference): Rick's comments:
-    // nifti_copy_nim_info(). It will return with data == NULL.
-    // If you need the data allocated, memory use would not change once you do
-    // so. There is also nifti_make_new_nim()
-    // nifti_image* nifti_make_new_nim(const int64_t dims[],
-    //                                 int datatype, int data_fill)
 
-    nifti_image* nii_new = nifti_copy_nim_info(nii);
-    nii_new->datatype = NIFTI_TYPE_FLOAT32;
-    nii_new->nbyper = sizeof(double);
-    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    double* nii_new_data = static_cast<double*>(nii_new->data);
+// ============================================================================
+// Faruk's favorite functions
+// ============================================================================
+std::tuple<uint32_t, uint32_t, uint32_t> ind2sub_3D(
+    const uint32_t linear_index,
+    const uint32_t size_x,
+    const uint32_t size_y) {
 
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
-            *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
-        }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
+    uint32_t z = linear_index / (size_x * size_y);
+    uint32_t temp = linear_index % (size_x * size_y);
+    uint32_t y = temp / size_x;
+    uint32_t x = temp % size_x;
+
+    return std::make_tuple(x, y, z);
+}
+
+std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> ind2sub_4D(
+    const uint32_t linear_index,
+    const uint32_t size_x,
+    const uint32_t size_y,
+    const uint32_t size_z) {
+
+    uint32_t t = linear_index / (size_x * size_y * size_z);
+    uint32_t temp = linear_index % (size_x * size_y * size_z);
+    uint32_t z = temp / (size_x * size_y);
+    temp = linear_index % (size_x * size_y);
+    uint32_t y = temp / size_x;
+    uint32_t x = temp % size_x;
+
+    return std::make_tuple(x, y, z, t);
+}
+
+
+uint32_t sub2ind_3D(const uint32_t x, const uint32_t y, const uint32_t z,
+                    const uint32_t size_x, const uint32_t size_y) {
+    return size_x * size_y * z + size_x * y + x;
+}
+
+uint32_t sub2ind_4D(const uint32_t x, const uint32_t y, const uint32_t z, const uint32_t t,
+                    const uint32_t size_x, const uint32_t size_y, const uint32_t size_z) {
+    return size_x * size_y * size_z * t + size_x * size_y * z + size_x * y + x;
+}
+
+Neighbourhood make_neighbourhood(const int connectivity, const uint32_t size_x,
+                                 const uint32_t size_y, const float dX,
+                                 const float dY, const float dZ) {
+    // Short diagonals
+    const float dia_xy = sqrt(dX * dX + dY * dY);
+    const float dia_xz = sqrt(dX * dX + dZ * dZ);
+    const float dia_yz = sqrt(dY * dY + dZ * dZ);
+    // Long diagonals
+    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
+
+    const int8_t nb_x[26] = {-1, 1, 0, 0, 0, 0,
+                             -1, -1, 1, 1, 0, 0, 0, 0, -1, 1, -1, 1,
+                             -1, -1, -1, 1, -1, 1, 1, 1};
+    const int8_t nb_y[26] = {0, 0, -1, 1, 0, 0,
+                             -1, 1, -1, 1, -1, -1, 1, 1, 0, 0, 0, 0,
+                             -1, -1, 1, -1, 1, -1, 1, 1};
+    const int8_t nb_z[26] = {0, 0, 0, 0, -1, 1,
+                             0, 0, 0, 0, -1, 1, -1, 1, -1, -1, 1, 1,
+                             -1, 1, -1, -1, 1, 1, -1, 1};
+    const float nb_d[26] = {dX, dX, dY, dY, dZ, dZ,
+                            dia_xy, dia_xy, dia_xy, dia_xy,
+                            dia_yz, dia_yz, dia_yz, dia_yz,
+                            dia_xz, dia_xz, dia_xz, dia_xz,
+                            dia_xyz, dia_xyz, dia_xyz, dia_xyz,
+                            dia_xyz, dia_xyz, dia_xyz, dia_xyz};
+
+    Neighbourhood nb;
+    nb.nr = connectivity == 6 ? 6 : (connectivity == 18 ? 18 : 26);
+    const int64_t sx = size_x, sy = size_y;
+    for (int k = 0; k != 26; ++k) {
+        nb.dx[k] = nb_x[k];
+        nb.dy[k] = nb_y[k];
+        nb.dz[k] = nb_z[k];
+        nb.dist[k] = nb_d[k];
+        nb.offset[k] = sx * sy * nb_z[k] + sx * nb_y[k] + nb_x[k];
+        nb.pad_offset[k] = (sx + 2) * (sy + 2) * nb_z[k] + (sx + 2) * nb_y[k] + nb_x[k];
     }
+    return nb;
+}
 
-    // Replace nans with zeros
-    for (int i = 0; i < nii->nvox; ++i) {
-        if (*(nii_new_data + i)!= *(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
-        }
+uint32_t pad_index(const uint32_t i, const uint32_t size_x, const uint32_t size_y) {
+    uint32_t ix, iy, iz;
+    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+    return ((iz + 1) * (size_y + 2) + iy + 1) * (size_x + 2) + ix + 1;
+}
+
+void parallel_for(const uint32_t nr_items, const int nr_threads,
+                  const std::function<void(uint32_t, uint32_t)>& func) {
+    // Split [0, nr_items) into contiguous chunks and run each chunk on its
+    // own thread. func receives the [begin, end) range of its chunk. Callers
+    // are responsible for only writing to per-item outputs inside func.
+    if (nr_threads <= 1 || nr_items < 2) {
+        func(0, nr_items);
+        return;
+    }
+    uint32_t chunk = (nr_items + nr_threads - 1) / nr_threads;
+    vector<std::thread> workers;
+    for (uint32_t begin = 0; begin < nr_items; begin += chunk) {
+        uint32_t end = std::min(begin + chunk, nr_items);
+        workers.push_back(std::thread(func, begin, end));
+    }
+    for (uint32_t n = 0; n != workers.size(); ++n) {
+        workers[n].join();
     }
+}
 
-    return nii_new;
+std::tuple<float, float> simplex_closure_2D(float x, float y) {
+    float component_sum = x + y;
+    float x_new = x / component_sum;
+    float y_new = y / component_sum;
+    return std::make_tuple(x_new, y_new);
 }
 
-nifti_image* copy_nifti_as_int32(nifti_image* nii) {
-    nifti_image* nii_new = nifti_copy_nim_info(nii);
-    nii_new->datatype = NIFTI_TYPE_INT32;
-    nii_new->nbyper = sizeof(int32_t);
-    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    int nr_voxels = nii_new->nvox;
+std::tuple<float, float> simplex_perturb_2D(float x, float y, float a, float b) {
+    float x_new = x * a;
+    float y_new = y * b;
+    tie(x_new, y_new) = simplex_closure_2D(x_new, y_new);
+    return std::make_tuple(x_new, y_new);
+}
 
-    int32_t* nii_new_data = static_cast<int32_t*>(nii_new->data);
+// std::tuple<float, float> simplex_power_2D(float x, float y, float a) {
+//     float x_new = std::pow(x, a);
+//     float y_new = std::pow(y, a);
+//     tie(x_new, y_new) = simplex_closure_2D(x_new, y_new);
+//     return std::make_tuple(x_new, y_new);
+// }
+
+// ============================================================================
+// Smoothing
+// ============================================================================
+nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
+                                 nifti_image* nii_mask, int32_t mask_value,
+                                 int nr_threads, int connectivity) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Only voxels with mask_value are smoothed, and only with neighbours
+    //   that have mask_value too. Their neighbour lists and weights are built
+    //   once (CSR). Iterations then run on a compact copy of these voxels,
+    //   swapping two buffers.
+    // - Volumes are smoothed independently. Several volumes are smoothed in
+    //   parallel, the voxels of a single volume are split otherwise.
+    // - The first output volume is zero outside of the smoothed voxels,
+    //   later volumes keep their input values there.
+    ///////////////////////////////////////////////////////////////////////////
+    nifti_image* nii_smooth = copy_nifti_as_float32(nii_in);
+    float* nii_smooth_data = static_cast<float*>(nii_smooth->data);
+
+    // Get dimensions of input
+    const uint32_t size_x = nii_smooth->nx;
+    const uint32_t size_y = nii_smooth->ny;
+    const uint32_t size_z = nii_smooth->nz;
+    const uint32_t size_t = nii_smooth->nt;
+    const float dX = nii_smooth->pixdim[1];
+    const float dY = nii_smooth->pixdim[2];
+    const float dZ = nii_smooth->pixdim[3];
+
+    const uint32_t nr_voxels = size_z * size_y * size_x;
 
-    // NOTE(Faruk): See nifti1.h for notes on data types
     // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+    // Voxels of interest and their neighbours within the mask
+    // ------------------------------------------------------------------------
+    nifti_image* nii_mask_int = copy_nifti_as_int32(nii_mask);
+    const int32_t* nii_mask_data = static_cast<int32_t*>(nii_mask_int->data);
+    auto is_in = [mask_value](int32_t v) {return v != 0 && v == mask_value;};
+    const vector<uint8_t> mask_pad = make_padded_mask(
+        nii_mask_data, size_x, size_y, size_z, is_in);
+
+    vector<uint32_t> voi_id;
+    vector<uint32_t> voi_number(nr_voxels, 0);  // Compact index of each voxel
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (is_in(*(nii_mask_data + i))) {
+            voi_number[i] = voi_id.size();
+            voi_id.push_back(i);
         }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+    }
+    nifti_image_free(nii_mask_int);
+    const uint32_t nr_voi = voi_id.size();
+
+    // Pre-compute weights
+    const Neighbourhood nb = make_neighbourhood(connectivity, size_x, size_y, dX, dY, dZ);
+    float FWHM_val = 1;  // TODO(Faruk): Might tweak this one
+    float w_0 = gaus(0, FWHM_val);
+    float w_nb[26];
+    for (int k = 0; k != nb.nr; ++k) {
+        w_nb[k] = gaus(nb.dist[k], FWHM_val);
+    }
+
+    vector<uint32_t> nb_start(nr_voi + 1, 0), nb_id;
+    vector<float> nb_weight, total_weight(nr_voi);
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        const uint32_t i = voi_id[ii];
+        const uint32_t p = pad_index(i, size_x, size_y);
+        float total = 0;
+        total += w_0;
+        for (int k = 0; k != nb.nr; ++k) {
+            if (mask_pad[p + nb.pad_offset[k]] != 0) {
+                nb_id.push_back(voi_number[i + nb.offset[k]]);
+                nb_weight.push_back(w_nb[k]);
+                total += w_nb[k];
+            }
         }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+        nb_start[ii + 1] = nb_id.size();
+        total_weight[ii] = total;
+    }
+    vector<uint32_t>().swap(voi_number);
+
+    // ------------------------------------------------------------------------
+    // Smooth
+    // ------------------------------------------------------------------------
+    auto smooth_volume = [&](const uint32_t t, vector<float>& a, vector<float>& b,
+                             const int threads, const bool log) {
+        float* vol = nii_smooth_data + static_cast<uint64_t>(nr_voxels) * t;
+        a.resize(nr_voi);
+        b.resize(nr_voi);
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            a[ii] = *(vol + voi_id[ii]);
+        }
+        if (t == 0) {
+            std::fill(vol, vol + nr_voxels, 0.f);
+        }
+        for (int n = 0; n < iter_smooth; ++n) {
+            if (log) cout << "\r    Iteration: " << n+1 << "/" << iter_smooth << flush;
+            const float* src = a.data();
+            float* dst = b.data();
+            parallel_for(nr_voi, threads, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t ii = begin; ii != end; ++ii) {
+                    // Start with the voxel itself
+                    float new_val = 0;
+                    new_val += src[ii] * w_0;
+                    for (uint32_t m = nb_start[ii]; m != nb_start[ii + 1]; ++m) {
+                        new_val += src[nb_id[m]] * nb_weight[m];
+                    }
+                    dst[ii] = new_val / total_weight[ii];
+                }
+            });
+            a.swap(b);
         }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+        if (iter_smooth > 0) {
+            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+                *(vol + voi_id[ii]) = a[ii];
+            }
         }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+    };
+
+    if (size_t > 1 && nr_threads > 1) {
+        cout << "    Smoothing " << size_t << " volumes, " << iter_smooth
+             << " iterations..." << endl;
+        parallel_for(size_t, nr_threads, [&](uint32_t begin, uint32_t end) {
+            vector<float> a, b;
+            for (uint32_t t = begin; t != end; ++t) {
+                smooth_volume(t, a, b, 1, false);
+            }
+        });
+    } else {
+        vector<float> a, b;
+        for (uint32_t t = 0; t != size_t; ++t) {  // Over 4th dim (e.g. timepoints)
+            smooth_volume(t, a, b, nr_threads, true);
+            cout << endl;
         }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+    }
+    return nii_smooth;
+}
+
+static void convolve_lines(const float* src, float* dst, const uint32_t length,
+                           const uint32_t stride, const uint32_t nr_lines,
+                           const uint32_t line_step, const uint32_t line_wrap,
+                           const uint32_t wrap_step, const vector<float>& w,
+                           const int vic) {
+    // 1D convolution along lines of a box. Lines start at
+    // (n % line_wrap) * line_step + (n / line_wrap) * wrap_step.
+    for (uint32_t n = 0; n != nr_lines; ++n) {
+        const uint32_t base = (n % line_wrap) * line_step + (n / line_wrap) * wrap_step;
+        for (int p = 0; p != static_cast<int>(length); ++p) {
+            const int k_start = max(-vic, -p);
+            const int k_stop = min(vic, static_cast<int>(length) - 1 - p);
+            float sum = 0;
+            for (int k = k_start; k <= k_stop; ++k) {
+                sum += w[k + vic] * *(src + base + (p + k) * stride);
+            }
+            *(dst + base + p * stride) = sum;
         }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+    }
+}
+
+static void convolve_separable(float* a, float* b, const uint32_t bx,
+                               const uint32_t by, const uint32_t bz,
+                               const vector<float>& w_x, const vector<float>& w_y,
+                               const vector<float>& w_z, const int vic,
+                               const int nr_threads) {
+    // Convolve box a along x, y and z. Result ends up in b, a is overwritten.
+    const uint32_t bxy = bx * by;
+    parallel_for(bz, nr_threads, [&](uint32_t begin, uint32_t end) {
+        convolve_lines(a + begin * bxy, b + begin * bxy, bx, 1,
+                       (end - begin) * by, bx, by, bxy, w_x, vic);
+    });
+    parallel_for(bz, nr_threads, [&](uint32_t begin, uint32_t end) {
+        convolve_lines(b + begin * bxy, a + begin * bxy, by, bx,
+                       (end - begin) * bx, 1, bx, bxy, w_y, vic);
+    });
+    parallel_for(by, nr_threads, [&](uint32_t begin, uint32_t end) {
+        convolve_lines(a + begin * bx, b + begin * bx, bz, bxy,
+                       (end - begin) * bx, 1, bx, bx, w_z, vic);
+    });
+}
+
+void smooth_within_labels(const float* input, const int32_t* labels,
+                          float* output, const uint32_t size_x,
+                          const uint32_t size_y, const uint32_t size_z,
+                          const uint32_t size_time, const float dX,
+                          const float dY, const float dZ, const float FWHM_val,
+                          const int vic, const int nr_threads) {
+    const uint32_t nr_voxels = size_z * size_y * size_x;
+
+    // Kernel lookup tables. The 3D Gaussian is the product of these, up to a
+    // constant factor that cancels in the normalization.
+    vector<float> w_x(2 * vic + 1), w_y(2 * vic + 1), w_z(2 * vic + 1);
+    for (int k = -vic; k <= vic; ++k) {
+        w_x[k + vic] = gaus(k * dX, FWHM_val) / gaus(0, FWHM_val);
+        w_y[k + vic] = gaus(k * dY, FWHM_val) / gaus(0, FWHM_val);
+        w_z[k + vic] = gaus(k * dZ, FWHM_val) / gaus(0, FWHM_val);
+    }
+
+    // Voxels without a label keep their input values
+    for (uint64_t i = 0; i != static_cast<uint64_t>(nr_voxels) * size_time; ++i) {
+        *(output + i) = *(input + i);
+    }
+
+    // Bounding box of each label
+    int32_t nr_labels = 0;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        nr_labels = max(nr_labels, *(labels + i));
+    }
+    vector<uint32_t> min_x(nr_labels + 1, size_x), max_x(nr_labels + 1, 0);
+    vector<uint32_t> min_y(nr_labels + 1, size_y), max_y(nr_labels + 1, 0);
+    vector<uint32_t> min_z(nr_labels + 1, size_z), max_z(nr_labels + 1, 0);
+    vector<uint32_t> count(nr_labels + 1, 0);
+    uint32_t ix, iy, iz;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        int32_t l = *(labels + i);
+        if (l > 0) {
+            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+            min_x[l] = min(min_x[l], ix), max_x[l] = max(max_x[l], ix);
+            min_y[l] = min(min_y[l], iy), max_y[l] = max(max_y[l], iy);
+            min_z[l] = min(min_z[l], iz), max_z[l] = max(max_z[l], iz);
+            count[l] += 1;
         }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+    }
+
+    // Masked normalized convolution within each label: the smoothed signal
+    // is divided by the smoothed mask. Only the bounding box of the label
+    // grown by the kernel radius is visited.
+    const uint32_t u_vic = vic;
+    vector<float> a, b, weight;
+    for (int32_t l = 1; l <= nr_labels; ++l) {
+        if (count[l] == 0) continue;
+        cout << "\r    Label " << l << "/" << nr_labels << flush;
+
+        const uint32_t x0 = min_x[l] > u_vic ? min_x[l] - u_vic : 0;
+        const uint32_t y0 = min_y[l] > u_vic ? min_y[l] - u_vic : 0;
+        const uint32_t z0 = min_z[l] > u_vic ? min_z[l] - u_vic : 0;
+        const uint32_t bx = min(max_x[l] + u_vic, size_x - 1) - x0 + 1;
+        const uint32_t by = min(max_y[l] + u_vic, size_y - 1) - y0 + 1;
+        const uint32_t bz = min(max_z[l] + u_vic, size_z - 1) - z0 + 1;
+        const uint32_t nr_box = bx * by * bz;
+
+        // Image indices of the label voxels, in box order
+        vector<uint32_t> box_i, img_i;
+        box_i.reserve(count[l]), img_i.reserve(count[l]);
+        for (uint32_t jz = 0; jz != bz; ++jz) {
+            for (uint32_t jy = 0; jy != by; ++jy) {
+                for (uint32_t jx = 0; jx != bx; ++jx) {
+                    uint32_t i = sub2ind_3D(x0 + jx, y0 + jy, z0 + jz, size_x, size_y);
+                    if (*(labels + i) == l) {
+                        box_i.push_back((jz * by + jy) * bx + jx);
+                        img_i.push_back(i);
+                    }
+                }
+            }
         }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+
+        // Sum of weights within the label
+        a.assign(nr_box, 0);
+        weight.assign(nr_box, 0);
+        for (uint32_t n = 0; n != box_i.size(); ++n) {
+            a[box_i[n]] = 1;
         }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
+        convolve_separable(&a[0], &weight[0], bx, by, bz, w_x, w_y, w_z, vic,
+                           nr_threads);
+
+        // Weighted sum of signal within the label, for every volume
+        b.resize(nr_box);
+        for (uint32_t t = 0; t != size_time; ++t) {
+            const float* in_t = input + static_cast<uint64_t>(nr_voxels) * t;
+            float* out_t = output + static_cast<uint64_t>(nr_voxels) * t;
+            a.assign(nr_box, 0);
+            for (uint32_t n = 0; n != box_i.size(); ++n) {
+                a[box_i[n]] = *(in_t + img_i[n]);
+            }
+            convolve_separable(&a[0], &b[0], bx, by, bz, w_x, w_y, w_z, vic,
+                               nr_threads);
+            for (uint32_t n = 0; n != box_i.size(); ++n) {
+                *(out_t + img_i[n]) = b[box_i[n]] / weight[box_i[n]];
+            }
         }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
     }
+    cout << endl;
+}
 
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!=*(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
+// ============================================================================
+// Geodesic distances
+// ============================================================================
+uint32_t grow_geodesic(const uint8_t* domain, const vector<uint32_t>& seeds,
+                       const uint32_t size_x, const uint32_t size_y,
+                       const uint32_t size_z, const float dX, const float dY,
+                       const float dZ, int32_t* step, float* dist,
+                       int32_t* id, int32_t* prevstep_id,
+                       const bool strict_minus_x) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Grows geodesic distances from seed voxels through the 26-neighbourhood
+    //   of the voxels marked as non-zero in the domain array.
+    // - Replaces the step-scanning flood fill loops (checking all voxels of
+    //   interest at every grow step) with a bucket queue keyed on grow steps.
+    //   Only the voxels updated in the previous step are visited in the next
+    //   one, so cost scales with the number of updates instead of
+    //   voxels x steps.
+    // - Visit order within a step follows the linear voxel index and the
+    //   neighbour order matches the original flood fill loops. Therefore
+    //   step, dist, id and prevstep_id outputs are identical to them.
+    // - Seeds start at step 1 with zero distance and carry their own index as
+    //   id. Voxels that are never reached keep step 0.
+    // - Output arrays must be allocated with size_x * size_y * size_z
+    //   elements. Returns the number of grow steps.
+    // - With strict_minus_x, the -x face neighbour is only entered when its
+    //   domain value is 1. This matches the inner GM growth of LN2_LAYERS,
+    //   which only steps to rim 3 voxels (not rim 1) in that direction.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint32_t nr_voxels = size_x * size_y * size_z;
+    const Neighbourhood nb = make_neighbourhood(26, size_x, size_y, dX, dY, dZ);
+    const vector<uint8_t> domain_pad = make_padded_mask(
+        domain, size_x, size_y, size_z, [](uint8_t v) {return v;});
+
+    // Initialize
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(step + i) = 0;
+        *(dist + i) = 0;
+    }
+    // Frontier holds image and padded indices of voxels
+    typedef std::pair<uint32_t, uint32_t> Voxel;
+    vector<Voxel> front_curr, front_next;
+    for (uint32_t n = 0; n != seeds.size(); ++n) {
+        uint32_t i = seeds[n];
+        if (*(step + i) == 0) {
+            *(step + i) = 1;
+            *(id + i) = i;
+            front_curr.push_back(Voxel(i, pad_index(i, size_x, size_y)));
         }
     }
-
-    return nii_new;
+    std::sort(front_curr.begin(), front_curr.end());
+
+    int32_t grow_step = 1;
+    uint32_t j;
+    float d;
+    while (!front_curr.empty()) {
+        front_next.clear();
+        for (uint32_t n = 0; n != front_curr.size(); ++n) {
+            uint32_t i = front_curr[n].first;
+            uint32_t p = front_curr[n].second;
+            // Skip voxels that are updated again earlier within this step
+            if (*(step + i) != grow_step) continue;
+
+            for (int k = 0; k != nb.nr; ++k) {
+                uint8_t m = domain_pad[p + nb.pad_offset[k]];
+                if (m != 0 && !(strict_minus_x && k == 0 && m != 1)) {
+                    j = i + nb.offset[k];
+                    d = *(dist + i) + nb.dist[k];
+                    if (d < *(dist + j) || *(step + j) == 0) {
+                        *(dist + j) = d;
+                        *(id + j) = *(id + i);
+                        *(prevstep_id + j) = i;
+                        if (*(step + j) != grow_step + 1) {
+                            *(step + j) = grow_step + 1;
+                            front_next.push_back(Voxel(j, p + nb.pad_offset[k]));
+                        }
+                    }
+                }
+            }
+        }
+        std::sort(front_next.begin(), front_next.end());
+        front_curr.swap(front_next);
+        grow_step += 1;
+    }
+    return grow_step - 1;
 }
 
-nifti_image* copy_nifti_as_float16(nifti_image* nii) {
-    nifti_image* nii_new = nifti_copy_nim_info(nii);
-    // NOTE(Renzo): I know that it is not suppoded to look like INT. This is an
-    // unlucky naming convention. It is a float16, trust me.
-    nii_new->datatype = NIFTI_TYPE_INT16;
-    nii_new->nbyper = sizeof(short);
-    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    int nr_voxels = nii_new->nvox;
-
-    short *nii_new_data = static_cast<short*>(nii_new->data);
+void grow_dijkstra(const uint8_t* domain, const vector<uint32_t>& sources,
+                   const uint32_t size_x, const uint32_t size_y,
+                   const uint32_t size_z, const float dX, const float dY,
+                   const float dZ, float* dist, int32_t* label,
+                   const float max_dist, vector<uint32_t>* updated) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Dijkstra's shortest paths from source voxels through the
+    //   26-neighbourhood of the voxels marked as non-zero in the domain array.
+    // - The dist array is not reset. A voxel is only relaxed when its distance
+    //   decreases, so the caller can keep a running minimum over many calls
+    //   (e.g. farthest point sampling) and each call only visits the region
+    //   that got closer to the new sources. Initialize dist with infinity.
+    // - Sources get zero distance. When label is given, labels are copied
+    //   from the voxel a distance was reached from (caller sets source labels).
+    // - Voxels farther than max_dist are not reached.
+    // - dX, dY and dZ must be positive (callers fall back to unit spacing).
+    // - Indices of all voxels whose distance changed (including sources) are
+    //   appended to updated when it is given. A voxel can appear more than
+    //   once.
+    ///////////////////////////////////////////////////////////////////////////
+    const Neighbourhood nb = make_neighbourhood(26, size_x, size_y, dX, dY, dZ);
+    const vector<uint8_t> domain_pad = make_padded_mask(
+        domain, size_x, size_y, size_z, [](uint8_t v) {return v != 0;});
+
+    // NOTE: Bucket queue (Dial's algorithm) rather than a binary heap. Buckets
+    // are as wide as the shortest neighbour step, so a voxel can not improve
+    // another voxel within its own bucket and every bucket holds final
+    // distances by the time it is visited. Buckets are reused cyclically.
+    struct Entry {
+        float d;
+        uint32_t i, p;  // Image and padded indices
+    };
+    const float width = std::min(dX, std::min(dY, dZ));
+    const uint32_t nr_buckets = static_cast<uint32_t>(nb.dist[25] / width) + 3;
+    vector<vector<Entry> > buckets(nr_buckets);
+    uint64_t nr_pending = 0;
+    for (uint32_t n = 0; n != sources.size(); ++n) {
+        uint32_t i = sources[n];
+        if (*(dist + i) != 0) {
+            *(dist + i) = 0;
+            if (updated) updated->push_back(i);
+        }
+        buckets[0].push_back({0, i, pad_index(i, size_x, size_y)});
+        nr_pending += 1;
+    }
 
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+    uint32_t j;
+    float d;
+    for (uint64_t b = 0; nr_pending != 0; ++b) {
+        vector<Entry>& bucket = buckets[b % nr_buckets];
+        for (size_t n = 0; n < bucket.size(); ++n) {
+            Entry top = bucket[n];
+            nr_pending -= 1;
+            if (top.d != *(dist + top.i)) continue;  // Stale entry
+
+            for (int k = 0; k != nb.nr; ++k) {
+                if (domain_pad[top.p + nb.pad_offset[k]] != 0) {
+                    j = top.i + nb.offset[k];
+                    d = top.d + nb.dist[k];
+                    if (d < *(dist + j) && d <= max_dist) {
+                        *(dist + j) = d;
+                        if (label) *(label + j) = *(label + top.i);
+                        if (updated) updated->push_back(j);
+                        // Rounding can not move a voxel to an earlier bucket
+                        uint64_t bj = std::max(b, static_cast<uint64_t>(d / width));
+                        buckets[bj % nr_buckets].push_back(
+                            {d, j, static_cast<uint32_t>(top.p + nb.pad_offset[k])});
+                        nr_pending += 1;
+                    }
+                }
+            }
         }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+        bucket.clear();
+    }
+}
+
+uint32_t grow_voronoi(const uint8_t* domain, const vector<uint32_t>& seeds,
+                      const uint32_t size_x, const uint32_t size_y,
+                      const uint32_t size_z, const float dX, const float dY,
+                      const float dZ, const float seed_dist, int32_t* step,
+                      float* dist, int32_t* id) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Step-ordered flood like grow_geodesic, with the neighbour rule of the
+    //   Voronoi loops in LN2_COLUMNS and LN2_MULTILATERATE: 2 and 3-jump
+    //   neighbours are skipped once a face neighbour is marked 2.
+    // - Seeds start at step 1 with seed_dist (must be above zero, zero marks
+    //   unreached voxels) and carry their own index as id. Unreached voxels
+    //   keep step 0 and id -1.
+    // - Ids only depend on the visit order, not on any seed values. Copying
+    //   a seed value through id gives the same result as flooding the values.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint32_t nr_voxels = size_x * size_y * size_z;
+    const Neighbourhood nb = make_neighbourhood(26, size_x, size_y, dX, dY, dZ);
+    const vector<uint8_t> domain_pad = make_padded_mask(
+        domain, size_x, size_y, size_z, [](uint8_t v) {return v;});
+
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(step + i) = 0;
+        *(dist + i) = 0;
+        *(id + i) = -1;
+    }
+    typedef std::pair<uint32_t, uint32_t> Voxel;
+    vector<Voxel> front_curr, front_next;
+    for (uint32_t n = 0; n != seeds.size(); ++n) {
+        uint32_t i = seeds[n];
+        if (*(step + i) == 0 && *(domain + i) == 1) {
+            *(step + i) = 1;
+            *(dist + i) = seed_dist;
+            *(id + i) = i;
+            front_curr.push_back(Voxel(i, pad_index(i, size_x, size_y)));
         }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+    }
+    std::sort(front_curr.begin(), front_curr.end());
+
+    int32_t grow_step = 1;
+    uint32_t j;
+    float d;
+    while (!front_curr.empty()) {
+        front_next.clear();
+        for (uint32_t n = 0; n != front_curr.size(); ++n) {
+            uint32_t i = front_curr[n].first;
+            uint32_t p = front_curr[n].second;
+            if (*(step + i) != grow_step) continue;
+
+            bool jump_lock = false;
+            for (int k = 0; k != nb.nr; ++k) {
+                if (k == 6 && jump_lock) {
+                    break;
+                }
+                uint8_t m = domain_pad[p + nb.pad_offset[k]];
+                if (m == 1) {
+                    j = i + nb.offset[k];
+                    d = *(dist + i) + nb.dist[k];
+                    if (d < *(dist + j) || *(dist + j) == 0) {
+                        *(dist + j) = d;
+                        *(id + j) = *(id + i);
+                        if (*(step + j) != grow_step + 1) {
+                            *(step + j) = grow_step + 1;
+                            front_next.push_back(Voxel(j, p + nb.pad_offset[k]));
+                        }
+                    }
+                } else if (m == 2 && k < 6) {
+                    jump_lock = true;
+                }
+            }
         }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+        std::sort(front_next.begin(), front_next.end());
+        front_curr.swap(front_next);
+        grow_step += 1;
+    }
+    return grow_step - 1;
+}
+
+uint32_t label_connected_clusters(const uint8_t* mask, const uint32_t size_x,
+                                  const uint32_t size_y, const uint32_t size_z,
+                                  int32_t* labels, const int connectivity) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Two pass union-find. The first pass joins every mask voxel with its
+    //   neighbours that come before it in memory. Each set is represented by
+    //   its lowest voxel index.
+    // - Clusters are numbered in the order of their last voxel in memory,
+    //   starting from the end of the image. This is the numbering of the
+    //   cluster growing loops of LN2_COLUMNS and LN2_CONNECTED_CLUSTERS.
+    // - Returns the number of clusters.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint32_t nr_voxels = size_x * size_y * size_z;
+    const Neighbourhood nb = make_neighbourhood(connectivity, size_x, size_y, 1, 1, 1);
+    const vector<uint8_t> mask_pad = make_padded_mask(
+        mask, size_x, size_y, size_z, [](uint8_t v) {return v != 0;});
+
+    // Neighbours that are visited before the current voxel in a linear scan
+    vector<int> prev_k;
+    for (int k = 0; k != nb.nr; ++k) {
+        if (nb.offset[k] < 0) {
+            prev_k.push_back(k);
         }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+    }
+
+    vector<uint32_t> parent(nr_voxels);
+    auto find_root = [&parent](uint32_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];  // Path halving
+            i = parent[i];
         }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+        return i;
+    };
+
+    // First pass: union-find over voxel indices
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(mask + i) == 0) continue;
+        parent[i] = i;
+        uint32_t p = pad_index(i, size_x, size_y);
+        for (uint32_t n = 0; n != prev_k.size(); ++n) {
+            const int k = prev_k[n];
+            if (mask_pad[p + nb.pad_offset[k]] != 0) {
+                uint32_t ri = find_root(i), rj = find_root(i + nb.offset[k]);
+                if (ri < rj) {
+                    parent[rj] = ri;
+                } else if (rj < ri) {
+                    parent[ri] = rj;
+                }
+            }
         }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+    }
+
+    // Second pass: number clusters
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(labels + i) = 0;
+    }
+    int32_t nr_clusters = 0;
+    for (uint32_t i = nr_voxels; i-- != 0;) {
+        if (*(mask + i) == 0) continue;
+        uint32_t r = find_root(i);
+        if (*(labels + r) == 0) {  // Last voxel of a new cluster
+            nr_clusters += 1;
+            *(labels + r) = nr_clusters;
+        }
+        *(labels + i) = *(labels + r);
+    }
+    return nr_clusters;
+}
+
+// ============================================================================
+// UV point cloud index
+// ============================================================================
+void uv_grid_build(UVGrid& grid, const vector<float>& vec_u,
+                   const vector<float>& vec_v, const float cell_size) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Cell size is usually the query radius, so that a query only visits
+    //   the 3x3 neighbourhood of cells around a point.
+    // - Points with non-finite coordinates are not inserted into any cell.
+    // - The number of cells is capped. Very small cell sizes relative to
+    //   the UV extent are enlarged to keep the grid memory bounded.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint32_t nr_points = vec_u.size();
+    const uint32_t max_cells = 1 << 24;
+
+    float u_min = std::numeric_limits<float>::max();
+    float v_min = std::numeric_limits<float>::max();
+    float u_max = std::numeric_limits<float>::lowest();
+    float v_max = std::numeric_limits<float>::lowest();
+    for (uint32_t i = 0; i != nr_points; ++i) {
+        if (std::isfinite(vec_u[i]) && std::isfinite(vec_v[i])) {
+            u_min = std::min(u_min, vec_u[i]);
+            v_min = std::min(v_min, vec_v[i]);
+            u_max = std::max(u_max, vec_u[i]);
+            v_max = std::max(v_max, vec_v[i]);
         }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+    }
+    if (u_min > u_max) {  // No valid points
+        u_min = 0, v_min = 0, u_max = 0, v_max = 0;
+    }
+
+    double cell = cell_size > 0 ? cell_size : 1;
+    double extent = std::max(u_max - u_min, v_max - v_min);
+    if ((extent / cell + 1) * (extent / cell + 1) > max_cells) {
+        cell = extent / (sqrt(static_cast<double>(max_cells)) - 1);
+    }
+
+    grid.u_min = u_min;
+    grid.v_min = v_min;
+    grid.cell_size = cell;
+    grid.size_u = static_cast<uint32_t>((u_max - u_min) / grid.cell_size) + 1;
+    grid.size_v = static_cast<uint32_t>((v_max - v_min) / grid.cell_size) + 1;
+    const uint32_t nr_cells = grid.size_u * grid.size_v;
+
+    // Counting sort of points into cells
+    vector<uint32_t> point_cell(nr_points, nr_cells);
+    grid.cell_start.assign(nr_cells + 1, 0);
+    for (uint32_t i = 0; i != nr_points; ++i) {
+        if (std::isfinite(vec_u[i]) && std::isfinite(vec_v[i])) {
+            uint32_t cu = std::min(grid.size_u - 1, static_cast<uint32_t>(
+                (vec_u[i] - grid.u_min) / grid.cell_size));
+            uint32_t cv = std::min(grid.size_v - 1, static_cast<uint32_t>(
+                (vec_v[i] - grid.v_min) / grid.cell_size));
+            point_cell[i] = grid.size_u * cv + cu;
+            grid.cell_start[point_cell[i] + 1] += 1;
         }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+    }
+    for (uint32_t c = 0; c != nr_cells; ++c) {
+        grid.cell_start[c + 1] += grid.cell_start[c];
+    }
+    grid.cell_points.resize(grid.cell_start[nr_cells]);
+    vector<uint32_t> fill(grid.cell_start.begin(), grid.cell_start.end() - 1);
+    for (uint32_t i = 0; i != nr_points; ++i) {
+        if (point_cell[i] != nr_cells) {
+            grid.cell_points[fill[point_cell[i]]] = i;
+            fill[point_cell[i]] += 1;
         }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
+    }
+}
+
+void uv_grid_query(const UVGrid& grid, const vector<float>& vec_u,
+                   const vector<float>& vec_v, const vector<float>& vec_d,
+                   const uint32_t i, const float radius, const float height,
+                   vector<uint32_t>& found) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Finds all points within a cylinder centered at point i. The cylinder
+    //   axis is along depth (D) and the cross-section is a disk in UV.
+    // - Inclusion tests are the same as the brute force search over all
+    //   points and found indices are returned in ascending order. Results
+    //   are therefore identical to a loop over all j.
+    ///////////////////////////////////////////////////////////////////////////
+    found.clear();
+    const float half_height = height / 2;
+    const float radius_sqr = radius * radius;
+    if (!std::isfinite(vec_u[i]) || !std::isfinite(vec_v[i]) || !(radius > 0)) {
+        return;
+    }
+
+    // Cell range of the window, padded by one cell against rounding
+    double cu_lo = floor((vec_u[i] - radius - grid.u_min) / grid.cell_size) - 1;
+    double cu_hi = floor((vec_u[i] + radius - grid.u_min) / grid.cell_size) + 1;
+    double cv_lo = floor((vec_v[i] - radius - grid.v_min) / grid.cell_size) - 1;
+    double cv_hi = floor((vec_v[i] + radius - grid.v_min) / grid.cell_size) + 1;
+    cu_lo = std::max(cu_lo, 0.);
+    cv_lo = std::max(cv_lo, 0.);
+    cu_hi = std::min(cu_hi, static_cast<double>(grid.size_u - 1));
+    cv_hi = std::min(cv_hi, static_cast<double>(grid.size_v - 1));
+
+    for (uint32_t cv = cv_lo; cv <= cv_hi; ++cv) {
+        for (uint32_t cu = cu_lo; cu <= cu_hi; ++cu) {
+            uint32_t c = grid.size_u * cv + cu;
+            for (uint32_t n = grid.cell_start[c]; n != grid.cell_start[c + 1]; ++n) {
+                uint32_t j = grid.cell_points[n];
+                if (abs(vec_d[i] - vec_d[j]) < half_height) {  // Check height
+                    float dist_uv = (vec_u[i] - vec_u[j])*(vec_u[i] - vec_u[j])
+                        + (vec_v[i] - vec_v[j])*(vec_v[i] - vec_v[j]);
+                    if (dist_uv < radius_sqr) {  // Check Euclidean distance
+                        found.push_back(j);
+                    }
+                }
+            }
         }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
     }
-    nii_new->scl_slope = nii->scl_slope / 1000.;
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!=*(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
+    std::sort(found.begin(), found.end());
+}
+
+void uv_index_build(UVIndex& index, const float* coords_uv_data,
+                    const uint32_t nr_voxels, const vector<int>& voi_id,
+                    const float cell_size) {
+    // NOTE: coords_uv_data is a 4D image with U in the first and V in the
+    // second volume.
+    const uint32_t nr_points = voi_id.size();
+    index.nr_voxels = nr_voxels;
+    index.voi_id = voi_id;
+    index.vec_u.resize(nr_points);
+    index.vec_v.resize(nr_points);
+    for (uint32_t i = 0; i != nr_points; ++i) {
+        index.vec_u[i] = *(coords_uv_data + nr_voxels*0 + voi_id[i]);
+        index.vec_v[i] = *(coords_uv_data + nr_voxels*1 + voi_id[i]);
+    }
+    uv_grid_build(index.grid, index.vec_u, index.vec_v, cell_size);
+}
+
+static uint64_t fnv1a_mix(uint64_t key, const uint64_t value) {
+    for (int b = 0; b != 8; ++b) {
+        key ^= (value >> (8 * b)) & 0xFF;
+        key *= 1099511628211ULL;
+    }
+    return key;
+}
+
+static uint64_t path_key(const char* path) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - FNV-1a of file size, inode, modification time (with nanoseconds) and
+    //   the bytes of the first and last 64 KiB of the file (header and a
+    //   data sample). A file rewritten within the same second with the same
+    //   size keeps its key only if these bytes are unchanged too.
+    ///////////////////////////////////////////////////////////////////////////
+    uint64_t key = 14695981039346656037ULL;
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return key;
+    }
+    key = fnv1a_mix(key, static_cast<uint64_t>(st.st_size));
+    key = fnv1a_mix(key, static_cast<uint64_t>(st.st_ino));
+    key = fnv1a_mix(key, static_cast<uint64_t>(st.st_mtime));
+#if defined(__APPLE__)
+    key = fnv1a_mix(key, static_cast<uint64_t>(st.st_mtimespec.tv_nsec));
+#elif !defined(_WIN32)
+    key = fnv1a_mix(key, static_cast<uint64_t>(st.st_mtim.tv_nsec));
+#endif
+
+    FILE* f = fopen(path, "rb");
+    if (f) {
+        const long sample = 1 << 16;
+        vector<unsigned char> buf(sample);
+        size_t nr_read = fread(buf.data(), 1, sample, f);
+        if (st.st_size > 2 * sample && fseek(f, -sample, SEEK_END) == 0) {
+            buf.resize(nr_read + sample);
+            nr_read += fread(buf.data() + nr_read, 1, sample, f);
+        }
+        fclose(f);
+        for (size_t n = 0; n != nr_read; ++n) {
+            key ^= buf[n];
+            key *= 1099511628211ULL;
         }
     }
+    return key;
+}
 
-    return nii_new;
+string uv_index_path(const string uv_path) {
+    // Strip extension(s) the same way as save_output_nifti
+    auto pos1 = uv_path.find_last_of("/\\");
+    auto pos2 = uv_path.find_first_of('.', pos1 == string::npos ? 0 : pos1 + 1);
+    return uv_path.substr(0, pos2) + "_UVindex.bin";
 }
 
-nifti_image* copy_nifti_as_int16(nifti_image* nii) {
-    nifti_image* nii_new = nifti_copy_nim_info(nii);
-    nii_new->datatype = NIFTI_TYPE_INT16;
-    nii_new->nbyper = sizeof(int16_t);
-    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    int nr_voxels = nii_new->nvox;
+uint64_t uv_index_key(const char* uv_path, const vector<int>& voi_id) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Identifies the inputs an index was built from: path_key of the UV
+    //   coordinates file mixed with the selected voxels (FNV-1a).
+    // - An empty voi_id means the voxels are selected from the UV file itself.
+    ///////////////////////////////////////////////////////////////////////////
+    uint64_t key = path_key(uv_path);
+    key = fnv1a_mix(key, voi_id.size());
+    for (uint32_t i = 0; i != voi_id.size(); ++i) {
+        key = fnv1a_mix(key, static_cast<uint64_t>(voi_id[i]));
+    }
+    return key;
+}
 
-    int16_t* nii_new_data = static_cast<int16_t*>(nii_new->data);
+// NOTE: Bump when the layout of the index file changes.
+static const char uv_index_magic[8] = {'L', 'N', 'U', 'V', 'I', 'D', 'X', '1'};
 
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+bool uv_index_save(const string path, const uint64_t key, const UVIndex& index) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    const uint32_t nr_points = index.voi_id.size();
+    const uint32_t nr_cells = index.grid.size_u * index.grid.size_v;
+    const uint32_t nr_cell_points = index.grid.cell_points.size();
+
+    bool ok = fwrite(uv_index_magic, 1, 8, f) == 8;
+    ok = ok && fwrite(&key, sizeof(key), 1, f) == 1;
+    ok = ok && fwrite(&index.nr_voxels, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&nr_points, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(index.voi_id.data(), sizeof(int), nr_points, f) == nr_points;
+    ok = ok && fwrite(index.vec_u.data(), sizeof(float), nr_points, f) == nr_points;
+    ok = ok && fwrite(index.vec_v.data(), sizeof(float), nr_points, f) == nr_points;
+    ok = ok && fwrite(&index.grid.u_min, sizeof(float), 1, f) == 1;
+    ok = ok && fwrite(&index.grid.v_min, sizeof(float), 1, f) == 1;
+    ok = ok && fwrite(&index.grid.cell_size, sizeof(float), 1, f) == 1;
+    ok = ok && fwrite(&index.grid.size_u, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&index.grid.size_v, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&nr_cell_points, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(index.grid.cell_start.data(), sizeof(uint32_t), nr_cells + 1, f) == nr_cells + 1;
+    ok = ok && fwrite(index.grid.cell_points.data(), sizeof(uint32_t), nr_cell_points, f) == nr_cell_points;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        remove(path.c_str());
+    }
+    return ok;
+}
+
+bool uv_index_load(const string path, const uint64_t key, UVIndex& index) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Returns false when the file is missing, truncated, or was built from
+    //   different inputs (key mismatch). The index is left in an unspecified
+    //   state in that case and should be rebuilt by the caller.
+    ///////////////////////////////////////////////////////////////////////////
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    char magic[8];
+    uint64_t file_key = 0;
+    uint32_t nr_points = 0, nr_cell_points = 0;
+
+    bool ok = fread(magic, 1, 8, f) == 8 && !memcmp(magic, uv_index_magic, 8);
+    ok = ok && fread(&file_key, sizeof(file_key), 1, f) == 1 && file_key == key;
+    ok = ok && fread(&index.nr_voxels, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&nr_points, sizeof(uint32_t), 1, f) == 1;
+    if (ok) {
+        index.voi_id.resize(nr_points);
+        index.vec_u.resize(nr_points);
+        index.vec_v.resize(nr_points);
+    }
+    ok = ok && fread(index.voi_id.data(), sizeof(int), nr_points, f) == nr_points;
+    ok = ok && fread(index.vec_u.data(), sizeof(float), nr_points, f) == nr_points;
+    ok = ok && fread(index.vec_v.data(), sizeof(float), nr_points, f) == nr_points;
+    ok = ok && fread(&index.grid.u_min, sizeof(float), 1, f) == 1;
+    ok = ok && fread(&index.grid.v_min, sizeof(float), 1, f) == 1;
+    ok = ok && fread(&index.grid.cell_size, sizeof(float), 1, f) == 1;
+    ok = ok && fread(&index.grid.size_u, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&index.grid.size_v, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&nr_cell_points, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && nr_cell_points <= nr_points;
+    const uint64_t nr_cells = static_cast<uint64_t>(index.grid.size_u) * index.grid.size_v;
+    ok = ok && nr_cells < (1 << 25);
+    if (ok) {
+        index.grid.cell_start.resize(nr_cells + 1);
+        index.grid.cell_points.resize(nr_cell_points);
+    }
+    ok = ok && fread(index.grid.cell_start.data(), sizeof(uint32_t), nr_cells + 1, f) == nr_cells + 1;
+    ok = ok && fread(index.grid.cell_points.data(), sizeof(uint32_t), nr_cell_points, f) == nr_cell_points;
+    fclose(f);
+
+    // Guard against corrupt offsets before they are used for indexing
+    if (ok) {
+        ok = index.grid.cell_start[0] == 0 && index.grid.cell_start[nr_cells] == nr_cell_points;
+        for (uint64_t c = 0; ok && c != nr_cells; ++c) {
+            ok = index.grid.cell_start[c] <= index.grid.cell_start[c + 1];
         }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+        for (uint32_t n = 0; ok && n != nr_cell_points; ++n) {
+            ok = index.grid.cell_points[n] < nr_points;
         }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+        for (uint32_t i = 0; ok && i != nr_points; ++i) {
+            ok = index.voi_id[i] >= 0 && static_cast<uint32_t>(index.voi_id[i]) < index.nr_voxels;
         }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+    }
+    return ok;
+}
+
+// ============================================================================
+// Label index
+// ============================================================================
+
+template <typename T>
+void label_index_build(LabelIndex& index, const T* data,
+                       const uint32_t size_x, const uint32_t size_y,
+                       const uint32_t size_z) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Label values are mapped to label numbers with a lookup table when
+    //   their range is not larger than the image, otherwise with a binary
+    //   search in the sorted values.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint32_t nr_voxels = size_x * size_y * size_z;
+    index.size_x = size_x;
+    index.size_y = size_y;
+    index.size_z = size_z;
+    index.labels.clear();
+
+    int32_t lo = std::numeric_limits<int32_t>::max();
+    int32_t hi = std::numeric_limits<int32_t>::min();
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(data + i) != 0) {
+            lo = std::min(lo, static_cast<int32_t>(*(data + i)));
+            hi = std::max(hi, static_cast<int32_t>(*(data + i)));
         }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+    }
+
+    vector<int32_t> lut;  // Label number of value lo + k, -1 if unused
+    if (lo <= hi && static_cast<int64_t>(hi) - lo < nr_voxels) {
+        lut.assign(static_cast<int64_t>(hi) - lo + 1, -1);
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            if (*(data + i) != 0) {
+                lut[*(data + i) - lo] = 0;
+            }
         }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+        for (uint32_t k = 0; k != lut.size(); ++k) {
+            if (lut[k] == 0) {
+                lut[k] = index.labels.size();
+                index.labels.push_back(lo + static_cast<int32_t>(k));
+            }
         }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+    } else if (lo <= hi) {
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            if (*(data + i) != 0) {
+                index.labels.push_back(*(data + i));
+            }
         }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
+        std::sort(index.labels.begin(), index.labels.end());
+        index.labels.erase(std::unique(index.labels.begin(), index.labels.end()),
+                           index.labels.end());
+    }
+    auto number = [&](const int32_t value) -> uint32_t {
+        if (!lut.empty()) {
+            return lut[value - lo];
+        }
+        return std::lower_bound(index.labels.begin(), index.labels.end(), value)
+            - index.labels.begin();
+    };
+
+    // Count voxels and find bounding boxes
+    const uint32_t nr_labels = index.labels.size();
+    index.start.assign(nr_labels + 1, 0);
+    index.box.resize(6 * nr_labels);
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        uint32_t* b = &index.box[6 * n];
+        b[0] = size_x, b[1] = size_y, b[2] = size_z;
+        b[3] = 0, b[4] = 0, b[5] = 0;
+    }
+    vector<uint32_t> voxel_number(nr_voxels);
+    uint32_t i = 0;
+    for (uint32_t iz = 0; iz != size_z; ++iz) {
+        for (uint32_t iy = 0; iy != size_y; ++iy) {
+            for (uint32_t ix = 0; ix != size_x; ++ix, ++i) {
+                if (*(data + i) != 0) {
+                    const uint32_t n = number(*(data + i));
+                    voxel_number[i] = n;
+                    index.start[n + 1] += 1;
+                    uint32_t* b = &index.box[6 * n];
+                    b[0] = std::min(b[0], ix), b[3] = std::max(b[3], ix);
+                    b[1] = std::min(b[1], iy), b[4] = std::max(b[4], iy);
+                    b[2] = std::min(b[2], iz), b[5] = std::max(b[5], iz);
+                }
+            }
         }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
+    }
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        index.start[n + 1] += index.start[n];
     }
 
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!= *(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
+    // Scatter voxels into their label ranges
+    index.voxels.resize(index.start[nr_labels]);
+    vector<uint32_t> fill_pos(index.start.begin(), index.start.end() - 1);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(data + i) != 0) {
+            index.voxels[fill_pos[voxel_number[i]]++] = i;
         }
     }
+}
 
-    return nii_new;
+template void label_index_build<int16_t>(LabelIndex& index, const int16_t* data,
+                                         const uint32_t size_x, const uint32_t size_y,
+                                         const uint32_t size_z);
+template void label_index_build<int32_t>(LabelIndex& index, const int32_t* data,
+                                         const uint32_t size_x, const uint32_t size_y,
+                                         const uint32_t size_z);
+
+int32_t label_index_find(const LabelIndex& index, const int32_t value) {
+    // Label number of a label value, -1 if the value does not occur
+    auto it = std::lower_bound(index.labels.begin(), index.labels.end(), value);
+    if (it == index.labels.end() || *it != value) {
+        return -1;
+    }
+    return it - index.labels.begin();
 }
 
+string label_index_path(const string label_path) {
+    auto pos1 = label_path.find_last_of("/\\");
+    auto pos2 = label_path.find_first_of('.', pos1 == string::npos ? 0 : pos1 + 1);
+    return label_path.substr(0, pos2) + "_labelindex.bin";
+}
 
-// ============================================================================
-// Faruk's favorite functions
-// ============================================================================
-std::tuple<uint32_t, uint32_t, uint32_t> ind2sub_3D(
-    const uint32_t linear_index,
-    const uint32_t size_x,
-    const uint32_t size_y) {
+uint64_t label_index_key(const char* label_path) {
+    return path_key(label_path);
+}
 
-    uint32_t z = linear_index / (size_x * size_y);
-    uint32_t temp = linear_index % (size_x * size_y);
-    uint32_t y = temp / size_x;
-    uint32_t x = temp % size_x;
+// NOTE: Bump when the layout of the index file changes.
+static const char label_index_magic[8] = {'L', 'N', 'L', 'A', 'B', 'I', 'X', '1'};
 
-    return std::make_tuple(x, y, z);
+bool label_index_save(const string path, const uint64_t key, const LabelIndex& index) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    const uint32_t nr_labels = index.labels.size();
+    const uint32_t nr_points = index.voxels.size();
+
+    bool ok = fwrite(label_index_magic, 1, 8, f) == 8;
+    ok = ok && fwrite(&key, sizeof(key), 1, f) == 1;
+    ok = ok && fwrite(&index.size_x, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&index.size_y, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&index.size_z, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&nr_labels, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&nr_points, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(index.labels.data(), sizeof(int32_t), nr_labels, f) == nr_labels;
+    ok = ok && fwrite(index.start.data(), sizeof(uint32_t), nr_labels + 1, f) == nr_labels + 1;
+    ok = ok && fwrite(index.voxels.data(), sizeof(uint32_t), nr_points, f) == nr_points;
+    ok = ok && fwrite(index.box.data(), sizeof(uint32_t), 6 * nr_labels, f) == 6 * nr_labels;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        remove(path.c_str());
+    }
+    return ok;
 }
 
-std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> ind2sub_4D(
-    const uint32_t linear_index,
-    const uint32_t size_x,
-    const uint32_t size_y,
-    const uint32_t size_z) {
-
-    uint32_t t = linear_index / (size_x * size_y * size_z);
-    uint32_t temp = linear_index % (size_x * size_y * size_z);
-    uint32_t z = temp / (size_x * size_y);
-    temp = linear_index % (size_x * size_y);
-    uint32_t y = temp / size_x;
-    uint32_t x = temp % size_x;
+bool label_index_load(const string path, const uint64_t key, LabelIndex& index) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Same contract as uv_index_load: false for missing, truncated or
+    //   outdated files, in which case the index should be rebuilt.
+    ///////////////////////////////////////////////////////////////////////////
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    char magic[8];
+    uint64_t file_key = 0;
+    uint32_t nr_labels = 0, nr_points = 0;
+
+    bool ok = fread(magic, 1, 8, f) == 8 && !memcmp(magic, label_index_magic, 8);
+    ok = ok && fread(&file_key, sizeof(file_key), 1, f) == 1 && file_key == key;
+    ok = ok && fread(&index.size_x, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&index.size_y, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&index.size_z, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&nr_labels, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&nr_points, sizeof(uint32_t), 1, f) == 1;
+    const uint64_t nr_voxels = static_cast<uint64_t>(index.size_x) * index.size_y * index.size_z;
+    ok = ok && nr_points <= nr_voxels && nr_labels <= nr_points;
+    if (ok) {
+        index.labels.resize(nr_labels);
+        index.start.resize(nr_labels + 1);
+        index.voxels.resize(nr_points);
+        index.box.resize(6 * nr_labels);
+    }
+    ok = ok && fread(index.labels.data(), sizeof(int32_t), nr_labels, f) == nr_labels;
+    ok = ok && fread(index.start.data(), sizeof(uint32_t), nr_labels + 1, f) == nr_labels + 1;
+    ok = ok && fread(index.voxels.data(), sizeof(uint32_t), nr_points, f) == nr_points;
+    ok = ok && fread(index.box.data(), sizeof(uint32_t), 6 * nr_labels, f) == 6 * nr_labels;
+    fclose(f);
 
-    return std::make_tuple(x, y, z, t);
+    // Guard against corrupt offsets before they are used for indexing
+    if (ok) {
+        ok = index.start[0] == 0 && index.start[nr_labels] == nr_points;
+        for (uint32_t n = 0; ok && n != nr_labels; ++n) {
+            ok = index.start[n] <= index.start[n + 1];
+        }
+        for (uint32_t n = 0; ok && n + 1 < nr_labels; ++n) {
+            ok = index.labels[n] < index.labels[n + 1];
+        }
+        for (uint32_t n = 0; ok && n != nr_points; ++n) {
+            ok = index.voxels[n] < nr_voxels;
+        }
+    }
+    return ok;
 }
 
+// ============================================================================
+// Geometry cache
+// ============================================================================
 
-uint32_t sub2ind_3D(const uint32_t x, const uint32_t y, const uint32_t z,
-                    const uint32_t size_x, const uint32_t size_y) {
-    return size_x * size_y * z + size_x * y + x;
+string geometry_cache_path(const string rim_path) {
+    auto pos1 = rim_path.find_last_of("/\\");
+    auto pos2 = rim_path.find_first_of('.', pos1 == string::npos ? 0 : pos1 + 1);
+    return rim_path.substr(0, pos2) + "_geometry.bin";
 }
 
-uint32_t sub2ind_4D(const uint32_t x, const uint32_t y, const uint32_t z, const uint32_t t,
-                    const uint32_t size_x, const uint32_t size_y, const uint32_t size_z) {
-    return size_x * size_y * size_z * t + size_x * size_y * z + size_x * y + x;
+uint64_t geometry_cache_key(const char* rim_path) {
+    return path_key(rim_path);
 }
 
+// NOTE: Bump when the layout of the cache file changes.
+static const char geometry_cache_magic[8] = {'L', 'N', 'G', 'E', 'O', 'M', 'C', '3'};
 
-std::tuple<float, float> simplex_closure_2D(float x, float y) {
-    float component_sum = x + y;
-    float x_new = x / component_sum;
-    float y_new = y / component_sum;
-    return std::make_tuple(x_new, y_new);
+bool geometry_cache_save(const string path, const uint64_t key, const GeometryCache& cache) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Only voxels that differ from the defaults (zero for midgm, -1 for
+    //   midgm_anchor) are written, which are the gray matter voxels.
+    ///////////////////////////////////////////////////////////////////////////
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    const uint32_t nr_voxels = cache.size_x * cache.size_y * cache.size_z;
+
+    vector<uint32_t> voxels;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (cache.midgm[i] != 0 || cache.midgm_anchor[i] != -1) {
+            voxels.push_back(i);
+        }
+    }
+    const uint32_t nr_points = voxels.size();
+    vector<int32_t> buf_i(nr_points);
+    auto write_i = [&](const vector<int32_t>& v) {
+        for (uint32_t n = 0; n != nr_points; ++n) buf_i[n] = v[voxels[n]];
+        return fwrite(buf_i.data(), sizeof(int32_t), nr_points, f) == nr_points;
+    };
+
+    bool ok = fwrite(geometry_cache_magic, 1, 8, f) == 8;
+    ok = ok && fwrite(&key, sizeof(key), 1, f) == 1;
+    ok = ok && fwrite(&cache.size_x, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&cache.size_y, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&cache.size_z, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&cache.midgm_equivol, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&cache.midgm_iter_smooth, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&cache.midgm_incl_borders, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(&nr_points, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fwrite(voxels.data(), sizeof(uint32_t), nr_points, f) == nr_points;
+    ok = ok && write_i(cache.midgm) && write_i(cache.midgm_anchor);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        remove(path.c_str());
+    }
+    return ok;
 }
 
-std::tuple<float, float> simplex_perturb_2D(float x, float y, float a, float b) {
-    float x_new = x * a;
-    float y_new = y * b;
-    tie(x_new, y_new) = simplex_closure_2D(x_new, y_new);
-    return std::make_tuple(x_new, y_new);
+bool geometry_cache_load(const string path, const uint64_t key, GeometryCache& cache) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Same contract as uv_index_load: false for missing, truncated or
+    //   outdated files, in which case the caller computes the geometry.
+    // - Callers still need to compare the dimensions with their own inputs.
+    ///////////////////////////////////////////////////////////////////////////
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    char magic[8];
+    uint64_t file_key = 0;
+    uint32_t nr_points = 0;
+
+    bool ok = fread(magic, 1, 8, f) == 8 && !memcmp(magic, geometry_cache_magic, 8);
+    ok = ok && fread(&file_key, sizeof(file_key), 1, f) == 1 && file_key == key;
+    ok = ok && fread(&cache.size_x, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&cache.size_y, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&cache.size_z, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&cache.midgm_equivol, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&cache.midgm_iter_smooth, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&cache.midgm_incl_borders, sizeof(uint32_t), 1, f) == 1;
+    ok = ok && fread(&nr_points, sizeof(uint32_t), 1, f) == 1;
+    const uint64_t nr_voxels64 = static_cast<uint64_t>(cache.size_x) * cache.size_y * cache.size_z;
+    ok = ok && nr_voxels64 < static_cast<uint64_t>(std::numeric_limits<int32_t>::max())
+         && nr_points <= nr_voxels64;
+    const uint32_t nr_voxels = ok ? static_cast<uint32_t>(nr_voxels64) : 0;
+
+    vector<uint32_t> voxels(ok ? nr_points : 0);
+    ok = ok && fread(voxels.data(), sizeof(uint32_t), nr_points, f) == nr_points;
+    // Guard against corrupt indices before they are used for indexing
+    for (uint32_t n = 0; ok && n != nr_points; ++n) {
+        ok = voxels[n] < nr_voxels && (n == 0 || voxels[n - 1] < voxels[n]);
+    }
+
+    vector<int32_t> buf_i(ok ? nr_points : 0);
+    auto read_i = [&](vector<int32_t>& v, const int32_t fill) {
+        v.assign(nr_voxels, fill);
+        if (fread(buf_i.data(), sizeof(int32_t), nr_points, f) != nr_points) return false;
+        for (uint32_t n = 0; n != nr_points; ++n) v[voxels[n]] = buf_i[n];
+        return true;
+    };
+    ok = ok && read_i(cache.midgm, 0) && read_i(cache.midgm_anchor, -1);
+    fclose(f);
+
+    const int32_t nr_ids = static_cast<int32_t>(nr_voxels);
+    for (uint32_t n = 0; ok && n != nr_points; ++n) {
+        uint32_t i = voxels[n];
+        ok = cache.midgm[i] >= 0
+             && cache.midgm_anchor[i] >= -1 && cache.midgm_anchor[i] < nr_ids;
+    }
+    return ok;
 }
 
-// std::tuple<float, float> simplex_power_2D(float x, float y, float a) {
-//     float x_new = std::pow(x, a);
-//     float y_new = std::pow(y, a);
-//     tie(x_new, y_new) = simplex_closure_2D(x_new, y_new);
-//     return std::make_tuple(x_new, y_new);
-// }
+string geometry_cache_midgm_name(const GeometryCache& cache) {
+    // Named like the LN2_LAYERS output the middle gray matter matches
+    string name = cache.midgm_equivol ? "midGM_equivol" : "midGM_equidist";
+    if (cache.midgm_equivol) {
+        name += " (-iter_smooth " + std::to_string(cache.midgm_iter_smooth) + ")";
+    }
+    if (cache.midgm_incl_borders) {
+        name += " (-incl_borders)";
+    }
+    return name;
+}
 
 // ============================================================================
-// Smoothing
+// Streaming NIfTI access
 // ============================================================================
-nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
-                                 nifti_image* nii_mask, int32_t mask_value) {
 
-    // Copy input niftis TODO[Faruk]: Understand why I have to do this
-    nifti_image* temp1 = copy_nifti_as_float32(nii_in);
-    nifti_image* temp2 = copy_nifti_as_int32(nii_mask);
+static bool nifti_reader_read_run(NiftiReader& reader, const uint64_t first,
+                                  const uint64_t nr_values, float* out,
+                                  const bool apply_scaling) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Reads nr_values consecutive values, starting at value index first,
+    //   and converts them like copy_nifti_as_float32 (nans become zeros).
+    // - Seeks are skipped for consecutive runs. This matters for compressed
+    //   files, where every backwards seek decompresses from the start.
+    ///////////////////////////////////////////////////////////////////////////
+    nifti_image* nii = reader.nii;
+    const int nbyper = nii->nbyper;
+    const uint64_t nr_bytes = nr_values * nbyper;
+    const uint64_t pos = static_cast<uint64_t>(nii->iname_offset) + first * nbyper;
 
-    float* nii_in_data = static_cast<float*>(temp1->data);
-    int32_t* nii_mask_data = static_cast<int32_t*>(temp2->data);
+    if (pos != reader.pos) {
+        if (znzseek(reader.fp, static_cast<long>(pos), SEEK_SET) < 0) {
+            fprintf(stderr, "** failed to seek in '%s'\n", nii->iname);
+            return false;
+        }
+    }
 
-    // Get dimensions of input
-    const uint32_t size_x = temp1->nx;
-    const uint32_t size_y = temp1->ny;
-    const uint32_t size_z = temp1->nz;
-    const uint32_t size_t = temp1->nt;
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-    const float dX = temp1->pixdim[1];
-    const float dY = temp1->pixdim[2];
-    const float dZ = temp1->pixdim[3];
+    // Float32 data can be read in place
+    char* raw;
+    if (nii->datatype == NIFTI_TYPE_FLOAT32) {
+        raw = reinterpret_cast<char*>(out);
+    } else {
+        if (reader.buffer.size() < nr_bytes) reader.buffer.resize(nr_bytes);
+        raw = reader.buffer.data();
+    }
+    if (znzread(raw, 1, nr_bytes, reader.fp) != nr_bytes) {
+        fprintf(stderr, "** failed to read data from '%s'\n", nii->iname);
+        reader.pos = std::numeric_limits<uint64_t>::max();
+        return false;
+    }
+    reader.pos = pos + nr_bytes;
 
-    const uint32_t nr_voxels = size_z * size_y * size_x;
+    if (nii->byteorder != nifti_short_order() && nbyper > 1) {
+        nifti_swap_Nbytes(nr_values, nbyper, raw);
+    }
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
+    if (!convert_nifti_values(nii->datatype, raw, nr_values, out)) {
+        return false;
+    }
 
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain voxel visits
-    // Find the subset voxels that will be used many times
-    uint32_t nr_voi = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_mask_data + i) != 0){
-            nr_voi += 1;
+    if (apply_scaling && nii->scl_slope != 0) {
+        const float slope = nii->scl_slope, inter = nii->scl_inter;
+        for (uint64_t i = 0; i != nr_values; ++i) {
+            *(out + i) = *(out + i) * slope + inter;
         }
     }
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
+    return true;
+}
+
+bool nifti_reader_open(NiftiReader& reader, const char* path) {
+    reader.nii = NULL;
+    reader.pos = std::numeric_limits<uint64_t>::max();
+    reader.fp = nifti_image_open(path, (char*)"rb", &reader.nii);
+    if (znz_isnull(reader.fp)) {
+        if (reader.nii) nifti_image_free(reader.nii);
+        reader.nii = NULL;
+        return false;
+    }
+    if (reader.nii->iname_offset < 0) {
+        fprintf(stderr, "** unknown data offset in '%s'\n", path);
+        nifti_reader_close(reader);
+        return false;
+    }
+    return true;
+}
 
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_mask_data + i) != 0){
-            *(voi_id + ii) = i;
-            ii += 1;
+bool nifti_reader_read_volume(NiftiReader& reader, const uint32_t t, float* out,
+                              const bool apply_scaling) {
+    const uint64_t nr_voxels = static_cast<uint64_t>(reader.nii->nx)
+                               * reader.nii->ny * reader.nii->nz;
+    return nifti_reader_read_run(reader, nr_voxels * t, nr_voxels, out,
+                                 apply_scaling);
+}
+
+bool nifti_reader_read_slab(NiftiReader& reader, const uint32_t z_start,
+                            const uint32_t nr_slices, float* out,
+                            const bool apply_scaling) {
+    const uint64_t nxy = static_cast<uint64_t>(reader.nii->nx) * reader.nii->ny;
+    const uint64_t nr_voxels = nxy * reader.nii->nz;
+    const uint64_t nr_slab = nxy * nr_slices;
+    const uint64_t size_time = reader.nii->nvox / nr_voxels;
+    for (uint64_t t = 0; t != size_time; ++t) {
+        if (!nifti_reader_read_run(reader, nr_voxels * t + nxy * z_start,
+                                   nr_slab, out + nr_slab * t, apply_scaling)) {
+            return false;
         }
     }
+    return true;
+}
 
-    // ------------------------------------------------------------------------
-    // Prepare output nifti
-    nifti_image* nii_smooth = copy_nifti_as_float32(nii_in);
-    float* nii_smooth_data = static_cast<float*>(nii_smooth->data);
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_smooth_data + i) = 0;
+void nifti_reader_close(NiftiReader& reader) {
+    if (!znz_isnull(reader.fp)) znzclose(reader.fp);
+    if (reader.nii) nifti_image_free(reader.nii);
+    reader.nii = NULL;
+    vector<char>().swap(reader.buffer);
+}
+
+static bool nifti_writer_write_run(NiftiWriter& writer, const uint64_t first,
+                                   const uint64_t nr_values, const float* data) {
+    const uint64_t pos = static_cast<uint64_t>(writer.nii->iname_offset)
+                         + first * sizeof(float);
+    if (pos != writer.pos) {
+        if (znzseek(writer.fp, static_cast<long>(pos), SEEK_SET) < 0) {
+            fprintf(stderr, "** failed to seek in '%s'\n", writer.raw_path.c_str());
+            return false;
+        }
+    }
+    if (znzwrite(data, sizeof(float), nr_values, writer.fp) != nr_values) {
+        fprintf(stderr, "** failed to write to '%s'\n", writer.raw_path.c_str());
+        writer.pos = std::numeric_limits<uint64_t>::max();
+        return false;
     }
+    writer.pos = pos + nr_values * sizeof(float);
+    writer.end = max(writer.end, writer.pos);
+    return true;
+}
 
-    // Pre-compute weights
-    float FWHM_val = 1;  // TODO(Faruk): Might tweak this one
-    float w_0 = gaus(0, FWHM_val);
-    float w_dX = gaus(dX, FWHM_val);
-    float w_dY = gaus(dY, FWHM_val);
-    float w_dZ = gaus(dZ, FWHM_val);
-
-    uint32_t ix, iy, iz, j;
-    for (uint16_t t = 0; t != size_t; ++t) {  // Over 4th dim (e.g. timepoints)
-        for (uint16_t n = 0; n != iter_smooth; ++n) {
-            cout << "\r    Iteration: " << n+1 << "/" << iter_smooth << flush;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                uint32_t i = *(voi_id + ii);
+bool nifti_writer_open(NiftiWriter& writer, const nifti_image* header,
+                       const uint32_t size_time, const string path) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Output is float32 with the header of the given image, size_time
+    //   volumes and the same naming rules as save_output_nifti.
+    // - Data goes to a temporary file next to the output, which replaces the
+    //   output in nifti_writer_close. Inputs that are still being read are
+    //   therefore safe when the output has the same name.
+    // - Compressed data can not be written at random positions. For .nii.gz
+    //   outputs the temporary file is uncompressed and compressed once in
+    //   nifti_writer_close.
+    ///////////////////////////////////////////////////////////////////////////
+    writer.path = path;
+    writer.fp = NULL;
+    writer.pos = std::numeric_limits<uint64_t>::max();
+    writer.end = 0;
+    writer.nii = nifti_copy_nim_info(header);
+    writer.nii->datatype = NIFTI_TYPE_FLOAT32;
+    writer.nii->nbyper = sizeof(float);
+    writer.nii->nt = size_time;
+    writer.nii->nvox = static_cast<int64_t>(header->nx) * header->ny
+                       * header->nz * size_time;
+
+    if (nifti_set_filenames(writer.nii, path.c_str(), 1, 1) != 0) {
+        fprintf(stderr, "** bad output file name '%s'\n", path.c_str());
+        nifti_image_free(writer.nii);
+        writer.nii = NULL;
+        return false;
+    }
+    writer.final_path = writer.nii->fname;
+    writer.final_data_path = writer.nii->iname;
+    writer.compress = nifti_is_gzfile(writer.nii->fname);
+    const bool single_file = writer.nii->nifti_type == NIFTI_FTYPE_NIFTI1_1
+                             || writer.nii->nifti_type == NIFTI_FTYPE_NIFTI2_1;
+    if (writer.compress && !single_file) {
+        fprintf(stderr, "** compressed .hdr/.img output is not supported, "
+                "'%s'\n", path.c_str());
+        nifti_image_free(writer.nii);
+        writer.nii = NULL;
+        return false;
+    }
+    string tmp_prefix = writer.final_path + (single_file ? ".tmp.nii" : ".tmp.hdr");
+    nifti_set_filenames(writer.nii, tmp_prefix.c_str(), 0, 1);
+    writer.tmp_path = writer.nii->fname;
+    writer.raw_path = writer.nii->iname;
+
+    // Header (and extensions) are written, data file is left open
+    writer.fp = nifti_image_write_hdr_img2(writer.nii, 2, "wb", NULL, NULL);
+    if (znz_isnull(writer.fp)) {
+        fprintf(stderr, "** failed to open '%s' for writing\n", writer.raw_path.c_str());
+        nifti_image_free(writer.nii);
+        writer.nii = NULL;
+        return false;
+    }
+    return true;
+}
 
-                if (*(nii_mask_data + i) == mask_value) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    float new_val = 0, total_weight = 0;
+bool nifti_writer_write_volume(NiftiWriter& writer, const uint32_t t,
+                               const float* data) {
+    const uint64_t nr_voxels = static_cast<uint64_t>(writer.nii->nx)
+                               * writer.nii->ny * writer.nii->nz;
+    return nifti_writer_write_run(writer, nr_voxels * t, nr_voxels, data);
+}
 
-                    // Start with the voxel itself
-                    new_val += *(nii_in_data + nr_voxels * t + i) * w_0;
-                    total_weight += w_0;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dX;
-                            total_weight += w_dX;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dX;
-                            total_weight += w_dX;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dY;
-                            total_weight += w_dY;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dY;
-                            total_weight += w_dY;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dZ;
-                            total_weight += w_dZ;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dZ;
-                            total_weight += w_dZ;
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    // TODO
+bool nifti_writer_write_slab(NiftiWriter& writer, const uint32_t z_start,
+                             const uint32_t nr_slices, const float* data) {
+    const uint64_t nxy = static_cast<uint64_t>(writer.nii->nx) * writer.nii->ny;
+    const uint64_t nr_voxels = nxy * writer.nii->nz;
+    const uint64_t nr_slab = nxy * nr_slices;
+    for (uint64_t t = 0; t != static_cast<uint64_t>(writer.nii->nt); ++t) {
+        if (!nifti_writer_write_run(writer, nr_voxels * t + nxy * z_start,
+                                    nr_slab, data + nr_slab * t)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    // TODO
+bool nifti_writer_close(NiftiWriter& writer, const bool log) {
+    bool ok = true;
+    if (!znz_isnull(writer.fp)) {
+        // Pad the file in case the last volumes or slabs were never written
+        const uint64_t end = static_cast<uint64_t>(writer.nii->iname_offset)
+                             + writer.nii->nvox * sizeof(float);
+        if (writer.end < end) {
+            const float zero = 0;
+            ok = nifti_writer_write_run(writer, writer.nii->nvox - 1, 1, &zero);
+        }
+        znzclose(writer.fp);
+    }
 
-                    *(nii_smooth_data + nr_voxels * t + i) = new_val / total_weight;
-                }
-            }
-            // Swap image data for the next iteration
-            for (uint32_t i = 0; i != nr_voxels * size_t; ++i) {
-                *(nii_in_data + i) = *(nii_smooth_data + i);
-            }
+    if (writer.compress) {
+        // Compress into a second temporary file, renamed like the others
+        const string gz_path = writer.raw_path + ".gz";
+        FILE* f_in = fopen(writer.raw_path.c_str(), "rb");
+        znzFile f_out = znzopen(gz_path.c_str(), "wb", 1);
+        ok = ok && f_in != NULL && !znz_isnull(f_out);
+        vector<char> chunk(1 << 24);
+        size_t nr_read;
+        while (ok && (nr_read = fread(chunk.data(), 1, chunk.size(), f_in)) > 0) {
+            ok = znzwrite(chunk.data(), 1, nr_read, f_out) == nr_read;
+        }
+        if (f_in) fclose(f_in);
+        if (!znz_isnull(f_out)) ok = (znzclose(f_out) == 0) && ok;
+        remove(writer.raw_path.c_str());
+        ok = ok && nifti_rename_output(gz_path.c_str(), writer.final_path.c_str()) == 0;
+        if (!ok) remove(gz_path.c_str());
+    } else {
+        ok = ok && nifti_rename_output(writer.tmp_path.c_str(),
+                                       writer.final_path.c_str()) == 0;
+        if (ok && writer.raw_path != writer.tmp_path) {
+            ok = nifti_rename_output(writer.raw_path.c_str(),
+                                     writer.final_data_path.c_str()) == 0;
+        }
+        if (!ok) {
+            remove(writer.tmp_path.c_str());
+            remove(writer.raw_path.c_str());
         }
-        cout << endl;
     }
-    return nii_smooth;
+    if (!ok) {
+        fprintf(stderr, "** failed to write '%s'\n", writer.final_path.c_str());
+    }
+    if (ok && log) {
+        log_output(writer.path.c_str());
+    }
+    nifti_image_free(writer.nii);
+    writer.nii = NULL;
+    return ok;
+}
+
+uint32_t nifti_slab_size(const nifti_image* nii, const uint64_t max_bytes,
+                         const uint32_t nr_series) {
+    // Number of z slices per slab so that nr_series float32 time series
+    // buffers of one slab fit into max_bytes. At least one slice.
+    const uint64_t size_time = max(static_cast<int64_t>(1), nii->nt);
+    const uint64_t slice_bytes = static_cast<uint64_t>(nii->nx) * nii->ny
+                                 * size_time * sizeof(float) * nr_series;
+    uint64_t nr_slices = max_bytes / max(slice_bytes, static_cast<uint64_t>(1));
+    nr_slices = max(nr_slices, static_cast<uint64_t>(1));
+    nr_slices = min(nr_slices, static_cast<uint64_t>(nii->nz));
+    return static_cast<uint32_t>(nr_slices);
 }
@@ -6,6 +6,11 @@
 #include <iostream>
 #include <string>
 #include <tuple>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <functional>
+#include <thread>
 #include "./nifti2_io.h"
 
 using namespace std;
@@ -21,6 +26,14 @@ double ren_kurt(double arr[], int size);
 double ren_autocor(double arr[], int size);
 int ren_most_occurred_number(int nums[], int size);
 //int ren_add_if_new(int arr[], int size); 
+double ren_median(float arr[], uint64_t size);
+
+// Mean, stdev, skew, kurtosis and lag-1 autocorrelation of an array, as
+// returned by the separate ren_* functions above, in two sweeps in total.
+struct Moments {
+    double mean, stdev, skew, kurt, autocor;
+};
+Moments ren_moments(const double arr[], int size);
 
 float dist(float x1, float y1, float z1, float x2, float y2, float z2,
            float dX, float dY, float dZ);
@@ -35,6 +48,12 @@ void log_nifti_descriptives(nifti_image* nii);
 void save_output_nifti(string filename, string prefix, nifti_image* nii,
                        bool log = true, bool use_outpath = false);
 
+// Background writing of outputs. When enabled, save_output_nifti copies the
+// image and returns right away, and a writer thread saves the copies in
+// order. All outputs are complete after wait_for_outputs() (also at exit).
+void set_async_output(const bool enable);
+void wait_for_outputs();
+
 nifti_image* copy_nifti_as_double(nifti_image* nii);
 nifti_image* copy_nifti_as_float32(nifti_image* nii);
 nifti_image* copy_nifti_as_float16(nifti_image* nii);
@@ -42,6 +61,14 @@ nifti_image* copy_nifti_as_int32(nifti_image* nii);
 nifti_image* copy_nifti_as_int16(nifti_image* nii);
 nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii);
 
+// Typed view of the data of an image, for images that are not needed in
+// their original datatype anymore. Data that already has type T is used as is
+// (no copy). Otherwise it is converted in place like copy_nifti_as_* (nans
+// become zeros), and datatype and nbyper of the image are updated.
+// Available for uint8_t, int16_t, int32_t, float and double.
+template <typename T>
+T* nifti_data_as(nifti_image* nii);
+
 std::tuple<uint32_t, uint32_t, uint32_t> ind2sub_3D(
     const uint32_t linear_index,
     const uint32_t size_x,
@@ -67,11 +94,250 @@ uint32_t sub2ind_4D(const uint32_t x,
                     const uint32_t size_y,
                     const uint32_t size_z);
 
+void parallel_for(const uint32_t nr_items, const int nr_threads,
+                  const std::function<void(uint32_t, uint32_t)>& func);
+
+// ============================================================================
+// Voxel neighbourhoods
+// ============================================================================
+// Neighbours in the order used throughout LayNii: 6 faces (-x, +x, -y, +y,
+// -z, +z), 12 edges (xy, yz, xz) and 8 corners. The first 6, 18 or 26
+// entries form the respective neighbourhood.
+struct Neighbourhood {
+    int nr;                  // Number of neighbours (6, 18 or 26)
+    int8_t dx[26], dy[26], dz[26];
+    float dist[26];          // Step length in voxel dimension units
+    int64_t offset[26];      // Linear index offset in the image
+    int64_t pad_offset[26];  // Linear index offset in the padded image
+};
+
+Neighbourhood make_neighbourhood(const int connectivity, const uint32_t size_x,
+                                 const uint32_t size_y, const float dX,
+                                 const float dY, const float dZ);
+
+// Padded images have a one voxel border around the image. Every image voxel
+// has all 26 neighbours in the padded layout, so kernels only check the mask
+// value of a neighbour instead of the image bounds.
+uint32_t pad_index(const uint32_t i, const uint32_t size_x, const uint32_t size_y);
+
+template <typename T, typename Pred>
+vector<uint8_t> make_padded_mask(const T* data, const uint32_t size_x,
+                                 const uint32_t size_y, const uint32_t size_z,
+                                 Pred is_in, const uint8_t border = 0) {
+    // Mask holds is_in(value) for image voxels (1 or 0 for a predicate, or a
+    // small class code) and the border value on the padding.
+    const uint32_t px = size_x + 2, py = size_y + 2, pz = size_z + 2;
+    vector<uint8_t> mask(static_cast<size_t>(px) * py * pz, border);
+    uint32_t i = 0;
+    for (uint32_t iz = 0; iz != size_z; ++iz) {
+        for (uint32_t iy = 0; iy != size_y; ++iy) {
+            uint8_t* row = &mask[(static_cast<size_t>(iz + 1) * py + iy + 1) * px + 1];
+            for (uint32_t ix = 0; ix != size_x; ++ix, ++i) {
+                row[ix] = static_cast<uint8_t>(is_in(*(data + i)));
+            }
+        }
+    }
+    return mask;
+}
+
 std::tuple<float, float> simplex_closure_2D(float x, float y);
 std::tuple<float, float> simplex_perturb_2D(float x, float y, float a, float b);
 
+// Repeated averaging with the face (or 18, 26 connected) neighbours within
+// the voxels that have mask_value. Returns a new float32 image.
 nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
-                                 nifti_image* nii_mask, int32_t mask_value);
+                                 nifti_image* nii_mask, int32_t mask_value,
+                                 int nr_threads = 1, int connectivity = 6);
+
+// Gaussian smoothing within labels (e.g. layers) as masked normalized
+// convolution with separable passes. Same result as summing gaus(d) over the
+// voxels of the same label in a (2 * vic + 1)^3 window. Voxels with label 0
+// keep their input values. Input and output hold size_time volumes.
+void smooth_within_labels(const float* input, const int32_t* labels,
+                          float* output, const uint32_t size_x,
+                          const uint32_t size_y, const uint32_t size_z,
+                          const uint32_t size_time, const float dX,
+                          const float dY, const float dZ, const float FWHM_val,
+                          const int vic, const int nr_threads = 1);
+
+uint32_t grow_geodesic(const uint8_t* domain, const vector<uint32_t>& seeds,
+                       const uint32_t size_x, const uint32_t size_y,
+                       const uint32_t size_z, const float dX, const float dY,
+                       const float dZ, int32_t* step, float* dist,
+                       int32_t* id, int32_t* prevstep_id,
+                       const bool strict_minus_x = false);
+
+void grow_dijkstra(const uint8_t* domain, const vector<uint32_t>& sources,
+                   const uint32_t size_x, const uint32_t size_y,
+                   const uint32_t size_z, const float dX, const float dY,
+                   const float dZ, float* dist, int32_t* label = NULL,
+                   const float max_dist = std::numeric_limits<float>::max(),
+                   vector<uint32_t>* updated = NULL);
+
+// Voronoi flood from seed voxels through the voxels marked 1 in the domain.
+// Face neighbours marked 2 (e.g. other rim labels) block the diagonal steps
+// of a voxel, which avoids leaking across kissing gyri.
+uint32_t grow_voronoi(const uint8_t* domain, const vector<uint32_t>& seeds,
+                      const uint32_t size_x, const uint32_t size_y,
+                      const uint32_t size_z, const float dX, const float dY,
+                      const float dZ, const float seed_dist, int32_t* step,
+                      float* dist, int32_t* id);
+
+// Connected clusters (6, 18 or 26 neighbourhood) of the non-zero mask voxels,
+// numbered from 1. The cluster holding the highest voxel index is numbered
+// first. Voxels outside the mask get 0.
+uint32_t label_connected_clusters(const uint8_t* mask, const uint32_t size_x,
+                                  const uint32_t size_y, const uint32_t size_z,
+                                  int32_t* labels, const int connectivity = 26);
+
+// ============================================================================
+// UV point cloud index
+// ============================================================================
+// Uniform 2D grid over flat (UV) coordinates. Points are bucketed into square
+// cells with counting sort, so each cell owns a contiguous range of point
+// indices (CSR layout). Used for cylinder windows in UVD space.
+struct UVGrid {
+    float u_min, v_min, cell_size;
+    uint32_t size_u, size_v;
+    vector<uint32_t> cell_start;   // Offsets into cell_points, nr_cells + 1
+    vector<uint32_t> cell_points;  // Point indices ordered by cell
+};
+
+void uv_grid_build(UVGrid& grid, const vector<float>& vec_u,
+                   const vector<float>& vec_v, const float cell_size);
+
+void uv_grid_query(const UVGrid& grid, const vector<float>& vec_u,
+                   const vector<float>& vec_v, const vector<float>& vec_d,
+                   const uint32_t i, const float radius, const float height,
+                   vector<uint32_t>& found);
+
+// Flat point cloud (voxels of interest with their UV coordinates) together
+// with its grid. Can be cached on disk next to the UV coordinates file.
+struct UVIndex {
+    uint32_t nr_voxels;
+    vector<int> voi_id;  // Linear voxel index of each point
+    vector<float> vec_u, vec_v;
+    UVGrid grid;
+};
+
+void uv_index_build(UVIndex& index, const float* coords_uv_data,
+                    const uint32_t nr_voxels, const vector<int>& voi_id,
+                    const float cell_size);
+string uv_index_path(const string uv_path);
+uint64_t uv_index_key(const char* uv_path, const vector<int>& voi_id);
+bool uv_index_save(const string path, const uint64_t key, const UVIndex& index);
+bool uv_index_load(const string path, const uint64_t key, UVIndex& index);
+
+// ============================================================================
+// Label index
+// ============================================================================
+// Voxels of each nonzero label of a 3D label image, grouped with a counting
+// sort in one pass over the image. Each label owns a contiguous range of
+// voxel indices (CSR layout), in ascending voxel order. Labels are numbered
+// 0 to nr_labels - 1 by ascending value. Can be cached on disk next to the
+// label file.
+struct LabelIndex {
+    uint32_t size_x, size_y, size_z;
+    vector<int32_t> labels;   // Label value of each label number, ascending
+    vector<uint32_t> start;   // Offsets into voxels, nr_labels + 1
+    vector<uint32_t> voxels;  // Linear voxel indices ordered by label
+    vector<uint32_t> box;     // Bounding box of label n at [6 * n]: min x, y, z,
+                              // max x, y, z (inclusive)
+};
+
+// Available for int16_t and int32_t label data.
+template <typename T>
+void label_index_build(LabelIndex& index, const T* data,
+                       const uint32_t size_x, const uint32_t size_y,
+                       const uint32_t size_z);
+int32_t label_index_find(const LabelIndex& index, const int32_t value);
+string label_index_path(const string label_path);
+uint64_t label_index_key(const char* label_path);
+bool label_index_save(const string path, const uint64_t key, const LabelIndex& index);
+bool label_index_load(const string path, const uint64_t key, LabelIndex& index);
+
+// ============================================================================
+// Geometry cache
+// ============================================================================
+// Middle gray matter of a rim file as computed by LN2_LAYERS: its connected
+// clusters and the middle gray matter voxel each pure gray matter voxel is
+// reached from. Written next to the rim file so that LN2_COLUMNS and
+// LN2_MULTILATERATE can load it instead of recomputing. The middle gray
+// matter is the equi-volume one when LN2_LAYERS ran with '-equivol', so the
+// options it depends on are stored along with it.
+//
+// NOTE: Only what the other programs would recompute from the rim file alone
+// is cached. Inner and outer distances, their anchor ids and curvature are
+// not used by LN2_COLUMNS or LN2_MULTILATERATE, and their column and
+// coordinate floods start from centroids and control points, so they cannot
+// be cached. The reuse is therefore limited to the middle gray matter
+// clusters (LN2_COLUMNS) and the Voronoi cells of the middle gray matter
+// (LN2_MULTILATERATE, only when its control points lie on the cached middle
+// gray matter).
+struct GeometryCache {
+    uint32_t size_x, size_y, size_z;
+    uint32_t midgm_equivol;        // LN2_LAYERS options of the middle GM
+    uint32_t midgm_iter_smooth;
+    uint32_t midgm_incl_borders;
+    vector<int32_t> midgm;         // Connected cluster of middle GM voxels
+                                   // (label_connected_clusters), 0 elsewhere
+    vector<int32_t> midgm_anchor;  // Middle GM voxel each pure GM voxel is
+                                   // reached from (grow_voronoi), -1 if none
+};
+
+string geometry_cache_path(const string rim_path);
+uint64_t geometry_cache_key(const char* rim_path);
+bool geometry_cache_save(const string path, const uint64_t key, const GeometryCache& cache);
+bool geometry_cache_load(const string path, const uint64_t key, GeometryCache& cache);
+string geometry_cache_midgm_name(const GeometryCache& cache);
+
+// ============================================================================
+// Streaming NIfTI access
+// ============================================================================
+// Reads and writes the data of large (4D) images in pieces: single volumes or
+// slabs of whole z slices with all their time points. Only headers are kept
+// in memory. Slab buffers are ordered as [time][slab voxel], i.e. volume t of
+// the slab starts at t * nx * ny * nr_slices.
+struct NiftiReader {
+    nifti_image* nii;     // Header only, data is not loaded
+    znzFile fp;
+    uint64_t pos;         // Current position in the data file (bytes)
+    vector<char> buffer;  // Raw values before conversion to float32
+};
+
+// Values are converted to float32 like copy_nifti_as_float32 (nans become
+// zeros). scl_slope and scl_inter are applied only when asked for.
+bool nifti_reader_open(NiftiReader& reader, const char* path);
+bool nifti_reader_read_volume(NiftiReader& reader, const uint32_t t, float* out,
+                              const bool apply_scaling = false);
+bool nifti_reader_read_slab(NiftiReader& reader, const uint32_t z_start,
+                            const uint32_t nr_slices, float* out,
+                            const bool apply_scaling = false);
+void nifti_reader_close(NiftiReader& reader);
+
+struct NiftiWriter {
+    nifti_image* nii;     // Output header, data is never allocated
+    znzFile fp;
+    uint64_t pos, end;    // Current and furthest written position (bytes)
+    bool compress;        // Compress raw_path into final_path when closing
+    string path;          // Output path as given (used for logging)
+    string final_path;    // Output file name
+    string final_data_path;  // Output data file name (.img of .hdr/.img pairs)
+    string tmp_path;      // Temporary header file, renamed when closing
+    string raw_path;      // Uncompressed temporary file the data is written to
+};
+
+bool nifti_writer_open(NiftiWriter& writer, const nifti_image* header,
+                       const uint32_t size_time, const string path);
+bool nifti_writer_write_volume(NiftiWriter& writer, const uint32_t t,
+                               const float* data);
+bool nifti_writer_write_slab(NiftiWriter& writer, const uint32_t z_start,
+                             const uint32_t nr_slices, const float* data);
+bool nifti_writer_close(NiftiWriter& writer, const bool log = true);
+
+uint32_t nifti_slab_size(const nifti_image* nii, const uint64_t max_bytes,
+                         const uint32_t nr_series);
+string output_path(const string path, const string tag, const bool use_outpath);
 
 // ============================================================================
 // Preprocessor macros.
@@ -412,6 +412,7 @@ static nifti_global_options g_opts = {
         0, /* skip_blank_ext    - skip extender if no extensions  */
         1, /* allow_upper_fext  - allow uppercase file extensions */
         0, /* alter_cifti       - alter CIFTI dims to use nx,t,u,v*/
+        1, /* use_mmap          - map uncompressed data on load   */
 };
 
 char nifti1_magic[4] = { 'n', '+', '1', '\0' };
@@ -3640,6 +3641,24 @@ void nifti_set_alter_cifti( int alter_cifti )
     g_opts.alter_cifti = alter_cifti ? 1 : 0;
 }
 
+/*----------------------------------------------------------------------*/
+/*! get nifti's global use_mmap flag
+*//*--------------------------------------------------------------------*/
+int nifti_get_use_mmap( void )
+{
+    return g_opts.use_mmap;
+}
+
+/*----------------------------------------------------------------------*/
+/*! set nifti's global use_mmap flag
+
+    explicitly set to 0 or 1 (see nifti_image_load)
+*//*--------------------------------------------------------------------*/
+void nifti_set_use_mmap( int use_mmap )
+{
+    g_opts.use_mmap = use_mmap ? 1 : 0;
+}
+
 /*----------------------------------------------------------------------*/
 /*! check current directory for existing header file
 
@@ -6676,13 +6695,169 @@ static znzFile nifti_image_load_prep( nifti_image *nim )
 }
 
 
+/*----------------------------------------------------------------------
+ * memory mapped image data
+ *
+ * Uncompressed data in native byte order is mapped read-only and private
+ * (copy-on-write), instead of being read into allocated memory.  Pages are
+ * read on demand and shared between processes mapping the same file, and
+ * a write to the data only copies the touched pages.  Mapped blocks are
+ * kept in a small list, so that unload/free can munmap() instead of free().
+ * The list is locked, since outputs may be written from another thread.
+ * Outputs are written to a temporary file that is renamed into place, so a
+ * file that is mapped (by any process) is never truncated.
+ *----------------------------------------------------------------------*/
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define NIFTI_HAVE_MMAP
+#endif
+
+#include <mutex>
+
+#define NIFTI_MAX_MMAP 64
+
+typedef struct {
+   void    *data;          /* start of the image data (inside the map) */
+   void    *base;          /* start of the mapping                     */
+   size_t   length;        /* length of the mapping                    */
+   int64_t  dev, ino;      /* mapped file, to detect overwrites        */
+} nifti_mmap_ele;
+
+static nifti_mmap_ele nifti_mmap_list[NIFTI_MAX_MMAP];
+static int            nifti_mmap_count = 0;
+static std::mutex     nifti_mmap_mutex;
+
+static int nifti_mmap_find( const void * data )
+{
+   int c;
+   if( data == NULL ) return -1;
+   for( c = 0; c < nifti_mmap_count; c++ )
+      if( nifti_mmap_list[c].data == data ) return c;
+   return -1;
+}
+
+/*----------------------------------------------------------------------*/
+/*! return whether the data pointer belongs to a mapped image
+*//*--------------------------------------------------------------------*/
+int nifti_data_is_mapped( const void * data )
+{
+   std::lock_guard<std::mutex> lock(nifti_mmap_mutex);
+   return nifti_mmap_find(data) >= 0;
+}
+
+/* munmap data if it is mapped, return 1 if so */
+static int nifti_unmap_data( void * data )
+{
+   std::lock_guard<std::mutex> lock(nifti_mmap_mutex);
+   int c = nifti_mmap_find(data);
+   if( c < 0 ) return 0;
+#ifdef NIFTI_HAVE_MMAP
+   munmap(nifti_mmap_list[c].base, nifti_mmap_list[c].length);
+#endif
+   nifti_mmap_list[c] = nifti_mmap_list[--nifti_mmap_count];
+   return 1;
+}
+
+/*----------------------------------------------------------------------*/
+/*! name of the temporary sibling file an output is written to (malloc'd)
+
+    Outputs are written to this file and renamed over fname when complete,
+    so that a file mapped by this or any other process is never truncated.
+    The mapping keeps the old data, which stays valid after the rename.
+*//*--------------------------------------------------------------------*/
+static char * nifti_tmp_output_name( const char * fname )
+{
+   size_t len = strlen(fname) + 5;
+   char * tmpname = (char *)malloc(len);
+   if( tmpname ) snprintf(tmpname, len, "%s.tmp", fname);
+   else fprintf(stderr,"** failed to alloc tmp name for '%s'\n", fname);
+   return tmpname;
+}
+
+/*----------------------------------------------------------------------*/
+/*! move a complete output file over fname, return 0 on success
+
+    The temporary file is removed on failure.
+*//*--------------------------------------------------------------------*/
+int nifti_rename_output( const char * tmpname, const char * fname )
+{
+#if defined(_WIN32)
+   remove(fname);  /* rename() does not replace existing files on Windows */
+#endif
+   if( rename(tmpname, fname) == 0 ) return 0;
+   fprintf(stderr,"** failed to rename '%s' to '%s'\n", tmpname, fname);
+   remove(tmpname);
+   return -1;
+}
+
+/* try to map the data of nim, return 0 on success */
+static int nifti_image_load_mmap( nifti_image *nim )
+{
+#ifdef NIFTI_HAVE_MMAP
+   struct stat buf;
+   char   *imgname;
+   int     fd;
+   void   *base;
+   int64_t ntot, length;
+
+   if( ! g_opts.use_mmap ) return -1;
+   if( nim->iname == NULL || nim->iname_offset < 0 ) return -1;
+   if( nim->swapsize > 1 && nim->byteorder != nifti_short_order() ) return -1;
+
+   imgname = nifti_findimgname(nim->iname, nim->nifti_type);
+   if( imgname == NULL ) return -1;
+   if( nifti_is_gzfile(imgname) ){ free(imgname); return -1; }
+
+   fd = open(imgname, O_RDONLY);
+   free(imgname);
+   if( fd < 0 ) return -1;
+
+   ntot   = nifti_get_volsize(nim);
+   length = nim->iname_offset + ntot;
+   if( ntot <= 0 || fstat(fd, &buf) != 0 || buf.st_size < length ){
+      close(fd);
+      return -1;
+   }
+
+   base = mmap(NULL, (size_t)length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);  /* the mapping keeps the file open */
+   if( base == MAP_FAILED ) return -1;
+
+   std::lock_guard<std::mutex> lock(nifti_mmap_mutex);
+   if( nifti_mmap_count >= NIFTI_MAX_MMAP ){  /* read it instead */
+      munmap(base, (size_t)length);
+      return -1;
+   }
+   nim->data = (char *)base + nim->iname_offset;
+   nifti_mmap_list[nifti_mmap_count].data   = nim->data;
+   nifti_mmap_list[nifti_mmap_count].base   = base;
+   nifti_mmap_list[nifti_mmap_count].length = (size_t)length;
+   nifti_mmap_list[nifti_mmap_count].dev    = (int64_t)buf.st_dev;
+   nifti_mmap_list[nifti_mmap_count].ino    = (int64_t)buf.st_ino;
+   nifti_mmap_count++;
+
+   if( g_opts.debug > 2 )
+      fprintf(stderr,"+d nifti_image_load: mapped %" PRId64 " bytes of '%s'\n",
+              ntot, nim->iname);
+   return 0;
+#else
+   (void)nim;
+   return -1;
+#endif
+}
+
+
 /*----------------------------------------------------------------------
  * nifti_image_load
  *----------------------------------------------------------------------*/
 /*! \fn int nifti_image_load( nifti_image *nim )
     \brief Load the image blob into a previously initialized nifti_image.
 
-        - If not yet set, the data buffer is allocated with calloc().
+        - If not yet set, uncompressed data in native byte order is mapped
+          copy-on-write (see nifti_set_use_mmap), other data is read into
+          a buffer allocated with calloc().
         - The data buffer will be byteswapped if necessary.
         - The data buffer will not be scaled.
 
@@ -6709,6 +6884,12 @@ int nifti_image_load( nifti_image *nim )
       return -1;
    }
 
+   /**- map the data instead of reading it, when possible */
+   if( nim->data == NULL && nifti_image_load_mmap( nim ) == 0 ){
+      znzclose(fp);
+      return 0;
+   }
+
    ntot = nifti_get_volsize(nim);
 
    /**- if the data pointer is not yet set, get memory space for the image */
@@ -6837,7 +7018,8 @@ int64_t nifti_read_buffer(znzFile fp, void* dataptr, int64_t ntot,
 void nifti_image_unload( nifti_image *nim )
 {
    if( nim != NULL && nim->data != NULL ){
-     free(nim->data) ; nim->data = NULL ;
+     if( ! nifti_unmap_data(nim->data) ) free(nim->data) ;
+     nim->data = NULL ;
    }
    return ;
 }
@@ -6857,7 +7039,7 @@ void nifti_image_free( nifti_image *nim )
    if( nim == NULL ) return ;
    if( nim->fname != NULL ) free(nim->fname) ;
    if( nim->iname != NULL ) free(nim->iname) ;
-   if( nim->data  != NULL ) free(nim->data ) ;
+   if( nim->data  != NULL && ! nifti_unmap_data(nim->data) ) free(nim->data ) ;
    (void)nifti_free_extensions( nim ) ;
    free(nim) ; return ;
 }
@@ -7830,6 +8012,7 @@ znzFile nifti_image_write_hdr_img2(nifti_image *nim, int write_opts,
    int            write_data, leave_open;
    int            nver=1, hsize=(int)sizeof(nifti_1_header);  /* 5 Aug 2015 */
    char           func[] = { "nifti_image_write_hdr_img2" };
+   char         * tmp_hname=NULL, * tmp_iname=NULL;  /* renamed when done */
 
    write_data = write_opts & 1;  /* just separate the bits now */
    leave_open = write_opts & 2;
@@ -7920,9 +8103,15 @@ znzFile nifti_image_write_hdr_img2(nifti_image *nim, int write_opts,
       }
       #endif //HAVE_ZLIB
       #endif //PIGZ        
-      fp = znzopen( nim->fname , opts , nifti_is_gzfile(nim->fname) ) ;
+      if( opts[0] == 'w' && ! leave_open ){
+         tmp_hname = nifti_tmp_output_name( nim->fname );
+         if( tmp_hname == NULL ) return NULL;
+      }
+      fp = znzopen( tmp_hname ? tmp_hname : nim->fname , opts ,
+                    nifti_is_gzfile(nim->fname) ) ;
       if( znz_isnull(fp) ){
          LNI_FERR(func,"cannot open output file",nim->fname);
+         free(tmp_hname);
          return fp;
       }
    }
@@ -7933,7 +8122,9 @@ znzFile nifti_image_write_hdr_img2(nifti_image *nim, int write_opts,
 
    if( ss < hsize ){
       LNI_FERR(func,"bad header write to output file",nim->fname);
-      znzclose(fp); return fp;
+      znzclose(fp);
+      if( tmp_hname ){ remove(tmp_hname); free(tmp_hname); }
+      return fp;
    }
 
    /* partial file exists, and errors have been printed, so ignore return */
@@ -7943,11 +8134,17 @@ znzFile nifti_image_write_hdr_img2(nifti_image *nim, int write_opts,
    /* if the header is all we want, we are done */
    if( ! write_data && ! leave_open ){
       if( g_opts.debug > 2 ) fprintf(stderr,"-d header is all we want: done\n");
-      znzclose(fp); return(fp);
+      znzclose(fp);
+      if( tmp_hname ){ nifti_rename_output(tmp_hname, nim->fname); free(tmp_hname); }
+      return(fp);
    }
    //if ( nim->nifti_type != NIFTI_FTYPE_NIFTI1_1 ){ /* get a new file pointer */
    if (( nim->nifti_type != NIFTI_FTYPE_NIFTI1_1 ) && ( nim->nifti_type != NIFTI_FTYPE_NIFTI2_1 )){ /* get a new file pointer */
       znzclose(fp);         /* first, close header file */
+      if( tmp_hname ){
+         nifti_rename_output(tmp_hname, nim->fname);
+         free(tmp_hname); tmp_hname = NULL;
+      }
       if( ! znz_isnull(imgfile) ){
          if(g_opts.debug > 2) fprintf(stderr,"+d using passed file for img\n");
          fp = imgfile;
@@ -7955,8 +8152,13 @@ znzFile nifti_image_write_hdr_img2(nifti_image *nim, int write_opts,
       else {
          if( g_opts.debug > 2 )
             fprintf(stderr,"+d opening img file '%s'\n", nim->iname);
-         fp = znzopen( nim->iname , opts , nifti_is_gzfile(nim->iname) ) ;
-         if( znz_isnull(fp) ) ERREX("cannot open image file") ;
+         if( opts[0] == 'w' && ! leave_open ){
+            tmp_iname = nifti_tmp_output_name( nim->iname );
+            if( tmp_iname == NULL ) return NULL;
+         }
+         fp = znzopen( tmp_iname ? tmp_iname : nim->iname , opts ,
+                       nifti_is_gzfile(nim->iname) ) ;
+         if( znz_isnull(fp) ){ free(tmp_iname); ERREX("cannot open image file"); }
       }
    }
 
@@ -7964,6 +8166,8 @@ znzFile nifti_image_write_hdr_img2(nifti_image *nim, int write_opts,
 
    if( write_data ) nifti_write_all_data(fp,nim,NBL);
    if( ! leave_open ) znzclose(fp);
+   if( tmp_hname ){ nifti_rename_output(tmp_hname, nim->fname); free(tmp_hname); }
+   if( tmp_iname ){ nifti_rename_output(tmp_iname, nim->iname); free(tmp_iname); }
    return fp;
 }
 
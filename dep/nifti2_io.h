@@ -479,6 +479,10 @@ void   nifti_set_skip_blank_ext( int skip ) ;
 void   nifti_set_allow_upper_fext( int allow ) ;
 int    nifti_get_alter_cifti( void );
 void   nifti_set_alter_cifti( int alter_cifti );
+int    nifti_get_use_mmap( void );
+void   nifti_set_use_mmap( int use_mmap );
+int    nifti_data_is_mapped( const void * data );
+int    nifti_rename_output( const char * tmpname, const char * fname );
 
 int    nifti_alter_cifti_dims(nifti_image * nim);
 
@@ -684,6 +688,7 @@ typedef struct {
     int skip_blank_ext;      /*!< skip extender if no extensions  */
     int allow_upper_fext;    /*!< allow uppercase file extensions */
     int alter_cifti;         /*!< convert CIFTI dimensions        */
+    int use_mmap;            /*!< map uncompressed data on load   */
 } nifti_global_options;
 
 typedef struct {
@@ -24,6 +24,17 @@ NB: seeks for writable files with compression are quite restricted
 #include "./znzlib.h"
 #include <stdio.h>
 
+#ifdef HAVE_ZLIB
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#endif
+
 
 /*
 znzlib.c  (zipped or non-zipped library)
@@ -41,6 +52,625 @@ znzlib.c  (zipped or non-zipped library)
 */
 
 
+#ifdef HAVE_ZLIB
+/*
+Parallel gzip output and input.
+
+Output is written as a series of gzip members of up to 1 MB of data each
+(multi-member gzip, readable by any gzip tool).  The members of a batch are
+deflated on nr_threads threads and written in order.  Every member header
+carries an extra field 'LN' with the size of the member in bytes, so that a
+reader can find the members without decompressing.
+
+Input is read ahead by a background thread.  Members with a known size
+('LN' fields, or 'BC' fields of BGZF files as written by bgzip) are inflated
+in parallel, everything else is inflated as one stream.  With HAVE_LIBDEFLATE
+the members are inflated with libdeflate instead of zlib.
+*/
+
+#define ZNZ_GZ_BLOCK_SIZE   (1<<20)
+#define ZNZ_GZ_CHUNK_MIN    (1<<16)        /* first read-ahead chunk        */
+#define ZNZ_GZ_CHUNK_MAX    (1<<22)        /* chunks double up to this size */
+#define ZNZ_GZ_QUEUE_BYTES  (1<<25)        /* read-ahead limit              */
+#define ZNZ_GZ_HEADER_SIZE  20             /* gzip header with 'LN' field   */
+
+static int znz_gz_threads = -1;  /* -1: not set, read the environment */
+static int znz_gz_level = -2;
+
+void znz_set_gz_threads(int nr_threads) { znz_gz_threads = nr_threads; }
+void znz_set_gz_level(int level) { znz_gz_level = level; }
+
+static int znz_get_gz_threads(void)
+{
+  int n = znz_gz_threads;
+  if (n == -1) {
+    const char *env = getenv("LAYNII_GZ_THREADS");
+    n = env ? atoi(env) : 0;
+  }
+  if (n <= 0) n = (int)std::thread::hardware_concurrency();
+  return n < 1 ? 1 : n;
+}
+
+static int znz_get_gz_level(const char *mode)
+{
+  int level = znz_gz_level;
+  const char *c;
+  for (c = mode; *c; c++)  /* gzopen style level in the mode, e.g. "wb9" */
+    if (*c >= '0' && *c <= '9') return *c - '0';
+  if (level == -2) {
+    const char *env = getenv("LAYNII_GZ_LEVEL");
+    level = env ? atoi(env) : Z_DEFAULT_COMPRESSION;
+  }
+  return (level < 0 || level > 9) ? Z_DEFAULT_COMPRESSION : level;
+}
+
+static void znz_put_le32(unsigned char* p, unsigned long v)
+{
+  p[0] = (unsigned char)(v & 0xff);
+  p[1] = (unsigned char)((v >> 8) & 0xff);
+  p[2] = (unsigned char)((v >> 16) & 0xff);
+  p[3] = (unsigned char)((v >> 24) & 0xff);
+}
+
+static unsigned long znz_get_le32(const unsigned char* p)
+{
+  return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+         ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/*---------------------------------------------------------------------------*/
+/* gzip output                                                               */
+/*---------------------------------------------------------------------------*/
+
+struct znz_gzwriter {
+  FILE* fp;
+  int level;
+  int nr_threads;
+  int error;
+  unsigned long long total;          /* uncompressed bytes so far */
+  unsigned long long nr_members;
+  std::vector<unsigned char> batch;  /* pending data, < one batch */
+};
+
+struct znz_gzmember {
+  const unsigned char* data;   /* uncompressed data */
+  size_t size;
+  std::vector<unsigned char> out;
+  int error;
+};
+
+static void znz_gz_deflate_member(znz_gzmember* m, int level)
+{
+  static const unsigned char header[ZNZ_GZ_HEADER_SIZE] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3,  /* FEXTRA, unix     */
+    8, 0, 'L', 'N', 4, 0, 0, 0, 0, 0     /* member size      */
+  };
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  m->error = 0;
+  if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    m->error = 1;
+    return;
+  }
+  m->out.resize(ZNZ_GZ_HEADER_SIZE + deflateBound(&strm, m->size) + 8);
+  memcpy(m->out.data(), header, ZNZ_GZ_HEADER_SIZE);
+  strm.next_in = (Bytef *)m->data;
+  strm.avail_in = (uInt)m->size;
+  strm.next_out = m->out.data() + ZNZ_GZ_HEADER_SIZE;
+  strm.avail_out = (uInt)(m->out.size() - ZNZ_GZ_HEADER_SIZE - 8);
+  if (deflate(&strm, Z_FINISH) != Z_STREAM_END) m->error = 1;
+  size_t size = ZNZ_GZ_HEADER_SIZE + strm.total_out + 8;
+  deflateEnd(&strm);
+
+  unsigned char* trailer = m->out.data() + size - 8;
+  znz_put_le32(trailer, crc32(crc32(0L, Z_NULL, 0), m->data, (uInt)m->size));
+  znz_put_le32(trailer + 4, (unsigned long)m->size);
+  znz_put_le32(m->out.data() + 16, (unsigned long)size);
+  m->out.resize(size);
+}
+
+/* compress size bytes at data as members of one block each and write them */
+static void znz_gz_compress(znz_gzwriter* w, const unsigned char* data,
+                            size_t size)
+{
+  size_t nr_members = (size + ZNZ_GZ_BLOCK_SIZE - 1) / ZNZ_GZ_BLOCK_SIZE;
+  std::vector<znz_gzmember> members(nr_members);
+  for (size_t i = 0; i != nr_members; ++i) {
+    size_t start = i * ZNZ_GZ_BLOCK_SIZE;
+    members[i].data = data + start;
+    members[i].size = (size - start < ZNZ_GZ_BLOCK_SIZE) ? size - start : ZNZ_GZ_BLOCK_SIZE;
+  }
+
+  /* nr_threads members at a time, the caller thread takes one */
+  for (size_t first = 0; first < nr_members; first += w->nr_threads) {
+    size_t end = first + w->nr_threads;
+    if (end > nr_members) end = nr_members;
+    std::vector<std::thread> threads;
+    for (size_t i = first + 1; i < end; ++i)
+      threads.push_back(std::thread(znz_gz_deflate_member, &members[i], w->level));
+    znz_gz_deflate_member(&members[first], w->level);
+    for (size_t i = 0; i != threads.size(); ++i) threads[i].join();
+
+    for (size_t i = first; i < end; ++i) {
+      znz_gzmember& m = members[i];
+      if (m.error) w->error = 1;
+      if (fwrite(m.out.data(), 1, m.out.size(), w->fp) != m.out.size())
+        w->error = 1;
+      std::vector<unsigned char>().swap(m.out);
+    }
+  }
+  w->nr_members += nr_members;
+}
+
+static znz_gzwriter* znz_gzwriter_open(const char *path, const char *mode)
+{
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) return NULL;
+  znz_gzwriter* w = new znz_gzwriter;
+  w->fp = fp;
+  w->level = znz_get_gz_level(mode);
+  w->nr_threads = znz_get_gz_threads();
+  w->error = 0;
+  w->total = 0;
+  w->nr_members = 0;
+  return w;
+}
+
+static size_t znz_gzwriter_write(znz_gzwriter* w, const void* buf, size_t size)
+{
+  const size_t batch_size = (size_t)w->nr_threads * ZNZ_GZ_BLOCK_SIZE;
+  const unsigned char* data = (const unsigned char*)buf;
+  size_t remain = size;
+  while (remain > 0) {
+    if (w->batch.empty() && remain >= batch_size) {  /* no copy needed */
+      znz_gz_compress(w, data, batch_size);
+      data += batch_size;
+      remain -= batch_size;
+      continue;
+    }
+    size_t n = batch_size - w->batch.size();
+    if (n > remain) n = remain;
+    w->batch.insert(w->batch.end(), data, data + n);
+    data += n;
+    remain -= n;
+    if (w->batch.size() == batch_size) {
+      znz_gz_compress(w, w->batch.data(), batch_size);
+      w->batch.clear();
+    }
+  }
+  w->total += size;
+  return w->error ? 0 : size;
+}
+
+static int znz_gzwriter_close(znz_gzwriter* w)
+{
+  znz_gz_compress(w, w->batch.data(), w->batch.size());
+  if (w->nr_members == 0) {  /* empty file, still a valid gzip stream */
+    znz_gzmember m;
+    m.data = NULL;
+    m.size = 0;
+    znz_gz_deflate_member(&m, w->level);
+    if (m.error || fwrite(m.out.data(), 1, m.out.size(), w->fp) != m.out.size())
+      w->error = 1;
+  }
+  if (fclose(w->fp) != 0) w->error = 1;
+  int retval = w->error ? Z_ERRNO : Z_OK;
+  if (w->error) fprintf(stderr,"** ERROR: znzclose failed to write compressed data\n");
+  delete w;
+  return retval;
+}
+
+/* forward seeks only, filled with zeros (as gzseek does for writing) */
+static long znz_gzwriter_seek(znz_gzwriter* w, long offset, int whence)
+{
+  long long target = (whence == SEEK_CUR) ? (long long)w->total + offset : offset;
+  static const unsigned char zeros[4096] = {0};
+  if (whence == SEEK_END || target < (long long)w->total) return -1;
+  while ((long long)w->total < target) {
+    long long n = target - (long long)w->total;
+    if (n > (long long)sizeof(zeros)) n = sizeof(zeros);
+    znz_gzwriter_write(w, zeros, (size_t)n);
+  }
+  return (long)w->total;
+}
+
+/*---------------------------------------------------------------------------*/
+/* gzip input                                                                */
+/*---------------------------------------------------------------------------*/
+
+/* Parse the gzip header at p (n bytes available).  Returns the header length
+   or 0 if more bytes are needed, -1 if this is not a gzip header.  member_size
+   is set from an 'LN' or 'BC' extra field, or to 0 if unknown. */
+static long znz_gz_parse_header(const unsigned char* p, size_t n,
+                                unsigned long* member_size)
+{
+  size_t len = 10;
+  *member_size = 0;
+  if (n < 10) return 0;
+  if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8) return -1;
+  int flags = p[3];
+  if (flags & 4) {  /* FEXTRA */
+    if (n < 12) return 0;
+    size_t xlen = p[10] | (p[11] << 8);
+    if (n < 12 + xlen) return 0;
+    const unsigned char* x = p + 12;
+    size_t i = 0;
+    while (i + 4 <= xlen) {
+      size_t slen = x[i + 2] | (x[i + 3] << 8);
+      if (i + 4 + slen > xlen) break;
+      if (x[i] == 'L' && x[i + 1] == 'N' && slen == 4)
+        *member_size = znz_get_le32(x + i + 4);
+      else if (x[i] == 'B' && x[i + 1] == 'C' && slen == 2)
+        *member_size = (x[i + 4] | (x[i + 5] << 8)) + 1;
+      i += 4 + slen;
+    }
+    len = 12 + xlen;
+  }
+  if (flags & 8) {  /* FNAME */
+    while (len < n && p[len] != 0) len++;
+    if (len++ >= n) return 0;
+  }
+  if (flags & 16) {  /* FCOMMENT */
+    while (len < n && p[len] != 0) len++;
+    if (len++ >= n) return 0;
+  }
+  if (flags & 2) len += 2;  /* FHCRC */
+  return (len <= n) ? (long)len : 0;
+}
+
+/* compressed data handed from the read-ahead thread to the reader */
+struct znz_gzchunk {
+  std::vector<unsigned char> data;
+  int member;  /* 1: one complete member of known size, 0: stream data */
+};
+
+struct znz_gzreader {
+  FILE* fp;
+  int nr_threads;
+  int error;
+  unsigned long long pos;            /* uncompressed position */
+
+  /* read-ahead thread */
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<znz_gzchunk*> queue;
+  size_t queued_bytes;
+  int started, stop, done;
+
+  /* stream inflate state */
+  z_stream strm;
+  int strm_ready;                    /* inflateInit2 was called */
+  int strm_end;                      /* a member ended, reset before more */
+  int plain;                         /* not gzip data, pass through */
+  int finished;                      /* no more data after this stream */
+  int eof;                           /* a read came up short */
+  znz_gzchunk* cur;
+
+  /* inflated members not read yet */
+  std::vector<unsigned char> out;
+  size_t out_pos;
+};
+
+static void znz_gz_read_ahead(znz_gzreader* r)
+{
+  size_t chunk_size = ZNZ_GZ_CHUNK_MIN;
+  int members = 1;  /* read members while their size is known */
+  std::vector<unsigned char> head;
+  for (;;) {
+    znz_gzchunk* c = new znz_gzchunk;
+    c->member = 0;
+    if (members) {
+      unsigned long member_size = 0;
+      long hlen = znz_gz_parse_header(head.data(), head.size(), &member_size);
+      while (hlen == 0) {  /* headers are short, read a few bytes at a time */
+        size_t old = head.size();
+        head.resize(old + 64);
+        size_t n = fread(head.data() + old, 1, 64, r->fp);
+        head.resize(old + n);
+        if (n == 0) break;
+        hlen = znz_gz_parse_header(head.data(), head.size(), &member_size);
+      }
+      if (hlen > 0 && member_size >= (unsigned long)hlen + 8) {
+        c->member = 1;
+        if (head.size() >= member_size) {  /* small member, keep the rest */
+          c->data.assign(head.begin(), head.begin() + member_size);
+          head.erase(head.begin(), head.begin() + member_size);
+        } else {
+          c->data.swap(head);
+          head.clear();
+          size_t old = c->data.size();
+          c->data.resize(member_size);
+          size_t n = fread(c->data.data() + old, 1, member_size - old, r->fp);
+          if (n != member_size - old) {  /* truncated, let inflate report it */
+            c->data.resize(old + n);
+            c->member = 0;
+            members = 0;
+          }
+        }
+      } else {
+        members = 0;  /* stream data from here on */
+        c->data.swap(head);
+        head.clear();
+      }
+    } else {
+      c->data.resize(chunk_size);
+      c->data.resize(fread(c->data.data(), 1, chunk_size, r->fp));
+      if (chunk_size < ZNZ_GZ_CHUNK_MAX) chunk_size *= 2;
+    }
+
+    int at_end = c->data.empty();
+    std::unique_lock<std::mutex> lock(r->mutex);
+    if (at_end) {
+      delete c;
+      r->done = 1;
+      r->changed.notify_all();
+      return;
+    }
+    r->queued_bytes += c->data.size();
+    r->queue.push_back(c);
+    r->changed.notify_all();
+    r->changed.wait(lock, [r] {
+      return r->stop || r->queued_bytes < ZNZ_GZ_QUEUE_BYTES; });
+    if (r->stop) return;
+  }
+}
+
+static znz_gzchunk* znz_gzreader_next_chunk(znz_gzreader* r, int wait)
+{
+  std::unique_lock<std::mutex> lock(r->mutex);
+  if (wait) r->changed.wait(lock, [r] { return r->done || !r->queue.empty(); });
+  if (r->queue.empty()) return NULL;
+  znz_gzchunk* c = r->queue.front();
+  r->queue.pop_front();
+  r->queued_bytes -= c->data.size();
+  r->changed.notify_all();
+  return c;
+}
+
+static void znz_gzreader_start(znz_gzreader* r)
+{
+  r->started = 1;
+  r->stop = 0;
+  r->done = 0;
+  r->queued_bytes = 0;
+  r->thread = std::thread(znz_gz_read_ahead, r);
+}
+
+static void znz_gzreader_stop(znz_gzreader* r)
+{
+  if (r->started) {
+    {
+      std::lock_guard<std::mutex> lock(r->mutex);
+      r->stop = 1;
+      r->changed.notify_all();
+    }
+    r->thread.join();
+    r->started = 0;
+  }
+  while (!r->queue.empty()) {
+    delete r->queue.front();
+    r->queue.pop_front();
+  }
+  delete r->cur;
+  r->cur = NULL;
+  if (r->strm_ready) inflateEnd(&r->strm);
+  r->strm_ready = 0;
+  r->strm_end = 0;
+  r->plain = 0;
+  r->finished = 0;
+  r->eof = 0;
+  r->out.clear();
+  r->out_pos = 0;
+  r->pos = 0;
+}
+
+/* inflate one complete member into out, return 0 on success */
+static int znz_gz_inflate_member(const znz_gzchunk* c, unsigned char* out,
+                                 size_t out_size)
+{
+  unsigned long member_size;
+  long hlen = znz_gz_parse_header(c->data.data(), c->data.size(), &member_size);
+  size_t in_size = c->data.size() - hlen - 8;
+  const unsigned char* trailer = c->data.data() + c->data.size() - 8;
+#ifdef HAVE_LIBDEFLATE
+  struct libdeflate_decompressor* d = libdeflate_alloc_decompressor();
+  enum libdeflate_result res = libdeflate_deflate_decompress(
+      d, c->data.data() + hlen, in_size, out, out_size, NULL);
+  libdeflate_free_decompressor(d);
+  if (res != LIBDEFLATE_SUCCESS) return -1;
+#else
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, -15) != Z_OK) return -1;
+  strm.next_in = (Bytef *)(c->data.data() + hlen);
+  strm.avail_in = (uInt)in_size;
+  strm.next_out = out;
+  strm.avail_out = (uInt)out_size;
+  int ret = inflate(&strm, Z_FINISH);
+  size_t nr_out = strm.total_out;
+  inflateEnd(&strm);
+  if (ret != Z_STREAM_END || nr_out != out_size) return -1;
+#endif
+  if (crc32(crc32(0L, Z_NULL, 0), out, (uInt)out_size) != znz_get_le32(trailer))
+    return -1;
+  return 0;
+}
+
+/* inflate a run of members (up to nr_threads) into r->out */
+static void znz_gzreader_inflate_members(znz_gzreader* r, znz_gzchunk* first)
+{
+  std::vector<znz_gzchunk*> chunks(1, first);
+  while ((int)chunks.size() < r->nr_threads) {
+    std::unique_lock<std::mutex> lock(r->mutex);
+    r->changed.wait(lock, [r] { return r->done || !r->queue.empty(); });
+    if (r->queue.empty() || !r->queue.front()->member) break;
+    znz_gzchunk* c = r->queue.front();
+    r->queue.pop_front();
+    r->queued_bytes -= c->data.size();
+    r->changed.notify_all();
+    chunks.push_back(c);
+  }
+
+  std::vector<size_t> offsets(chunks.size() + 1, 0);
+  for (size_t i = 0; i != chunks.size(); ++i)
+    offsets[i + 1] = offsets[i] + znz_get_le32(chunks[i]->data.data() + chunks[i]->data.size() - 4);
+  r->out.resize(offsets.back());
+  r->out_pos = 0;
+
+  std::vector<int> errors(chunks.size(), 0);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < chunks.size(); ++i)
+    threads.push_back(std::thread([&, i] {
+      errors[i] = znz_gz_inflate_member(chunks[i], r->out.data() + offsets[i],
+                                        offsets[i + 1] - offsets[i]); }));
+  errors[0] = znz_gz_inflate_member(chunks[0], r->out.data(), offsets[1]);
+  for (size_t i = 0; i != threads.size(); ++i) threads[i].join();
+
+  for (size_t i = 0; i != chunks.size(); ++i) {
+    if (errors[i]) r->error = 1;
+    delete chunks[i];
+  }
+  if (r->error) {
+    fprintf(stderr,"** ERROR: znzread: corrupt compressed data\n");
+    r->out.clear();
+  }
+}
+
+/* inflate stream data into buf, return bytes written (0: need more input) */
+static size_t znz_gzreader_inflate_stream(znz_gzreader* r, unsigned char* buf,
+                                          size_t size)
+{
+  if (r->plain) {
+    size_t n = r->strm.avail_in < size ? r->strm.avail_in : size;
+    memcpy(buf, r->strm.next_in, n);
+    r->strm.next_in += n;
+    r->strm.avail_in -= n;
+    return n;
+  }
+  if (r->strm_end) {  /* next member, or trailing garbage */
+    if (r->strm.avail_in < 2) return 0;
+    if (r->strm.next_in[0] != 0x1f || r->strm.next_in[1] != 0x8b) {
+      r->finished = 1;
+      return 0;
+    }
+    inflateReset(&r->strm);
+    r->strm_end = 0;
+  }
+  r->strm.next_out = buf;
+  r->strm.avail_out = (uInt)(size < (1u << 30) ? size : (1u << 30));
+  uInt avail_out = r->strm.avail_out;
+  int ret = inflate(&r->strm, Z_NO_FLUSH);
+  if (ret == Z_STREAM_END) {
+    r->strm_end = 1;
+  } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+    fprintf(stderr,"** ERROR: znzread: corrupt compressed data\n");
+    r->error = 1;
+  }
+  return avail_out - r->strm.avail_out;
+}
+
+static znz_gzreader* znz_gzreader_open(const char *path)
+{
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) return NULL;
+  znz_gzreader* r = new znz_gzreader;
+  r->fp = fp;
+  r->nr_threads = znz_get_gz_threads();
+  r->error = 0;
+  r->started = 0;
+  r->strm_ready = 0;
+  r->cur = NULL;
+  znz_gzreader_stop(r);  /* reset the state */
+  return r;
+}
+
+static size_t znz_gzreader_read(znz_gzreader* r, void* buf, size_t size)
+{
+  unsigned char* cbuf = (unsigned char*)buf;
+  size_t nread = 0;
+  if (!r->started) znz_gzreader_start(r);
+  while (nread < size && !r->error) {
+    if (r->out_pos < r->out.size()) {  /* inflated members */
+      size_t n = r->out.size() - r->out_pos;
+      if (n > size - nread) n = size - nread;
+      memcpy(cbuf + nread, r->out.data() + r->out_pos, n);
+      r->out_pos += n;
+      nread += n;
+      continue;
+    }
+    if (r->cur != NULL && !r->finished) {  /* stream data */
+      size_t n = znz_gzreader_inflate_stream(r, cbuf + nread, size - nread);
+      nread += n;
+      if (n > 0 || r->finished || r->error) continue;
+      if (!r->strm_end && r->strm.avail_in > 0) continue;  /* output pending */
+    }
+    if (r->finished) break;
+
+    znz_gzchunk* c = znz_gzreader_next_chunk(r, 1);
+    if (c == NULL) {  /* end of file */
+      if (r->cur != NULL && !r->strm_end && !r->plain) {
+        fprintf(stderr,"** ERROR: znzread: unexpected end of compressed data\n");
+        r->error = 1;
+      }
+      break;
+    }
+    if (c->member && r->cur == NULL) {
+      znz_gzreader_inflate_members(r, c);
+      continue;
+    }
+
+    /* stream data: keep unused input of the previous chunk */
+    if (r->cur != NULL && r->strm.avail_in > 0) {
+      c->data.insert(c->data.begin(), r->strm.next_in,
+                     r->strm.next_in + r->strm.avail_in);
+    }
+    delete r->cur;
+    r->cur = c;
+    if (!r->strm_ready) {
+      memset(&r->strm, 0, sizeof(r->strm));
+      if (inflateInit2(&r->strm, 15 + 16) != Z_OK) { r->error = 1; break; }
+      r->strm_ready = 1;
+      r->strm_end = 0;
+      if (c->data.size() >= 2 && (c->data[0] != 0x1f || c->data[1] != 0x8b))
+        r->plain = 1;  /* as gzread, read data that is not compressed as is */
+    }
+    r->strm.next_in = c->data.data();
+    r->strm.avail_in = (uInt)c->data.size();
+  }
+  if (nread < size) r->eof = 1;
+  r->pos += nread;
+  return nread;
+}
+
+static long znz_gzreader_seek(znz_gzreader* r, long offset, int whence)
+{
+  long long target = (whence == SEEK_CUR) ? (long long)r->pos + offset : offset;
+  if (whence == SEEK_END || target < 0) return -1;
+  if (target < (long long)r->pos) {  /* restart from the beginning */
+    znz_gzreader_stop(r);
+    r->error = 0;
+    if (fseek(r->fp, 0L, SEEK_SET) != 0) return -1;
+  }
+  std::vector<unsigned char> skip(1 << 16);
+  while ((long long)r->pos < target) {
+    long long n = target - (long long)r->pos;
+    if (n > (long long)skip.size()) n = (long long)skip.size();
+    if (znz_gzreader_read(r, skip.data(), (size_t)n) != (size_t)n) return -1;
+  }
+  return (long)r->pos;
+}
+
+static int znz_gzreader_close(znz_gzreader* r)
+{
+  znz_gzreader_stop(r);
+  int retval = fclose(r->fp);
+  delete r;
+  return retval;
+}
+#endif
+
+
 /* Note extra argument (use_compression) where
    use_compression==0 is no compression
    use_compression!=0 uses zlib (gzip) compression
@@ -59,8 +689,22 @@ znzFile znzopen(const char *path, const char *mode, int use_compression)
 
 #ifdef HAVE_ZLIB
   file->zfptr = NULL;
+  file->gzwptr = NULL;
+  file->gzrptr = NULL;
 
-  if (use_compression) {
+  if (use_compression && mode[0] == 'r' && strchr(mode, '+') == NULL) {
+    file->withz = 1;
+    if((file->gzrptr = znz_gzreader_open(path)) == NULL) {
+        free(file);
+        file = NULL;
+    }
+  } else if (use_compression && mode[0] == 'w') {
+    file->withz = 1;
+    if((file->gzwptr = znz_gzwriter_open(path,mode)) == NULL) {
+        free(file);
+        file = NULL;
+    }
+  } else if (use_compression) {
     file->withz = 1;
     if((file->zfptr = gzopen(path,mode)) == NULL) {
         free(file);
@@ -95,6 +739,8 @@ znzFile znzdopen(int fd, const char *mode, int use_compression)
   if (use_compression) {
     file->withz = 1;
     file->zfptr = gzdopen(fd,mode);
+    file->gzwptr = NULL;
+    file->gzrptr = NULL;
     file->nzfptr = NULL;
   } else {
 #endif
@@ -104,6 +750,8 @@ znzFile znzdopen(int fd, const char *mode, int use_compression)
 #endif
 #ifdef HAVE_ZLIB
     file->zfptr = NULL;
+    file->gzwptr = NULL;
+    file->gzrptr = NULL;
   };
 #endif
   return file;
@@ -116,6 +764,8 @@ int Xznzclose(znzFile * file)
   if (*file!=NULL) {
 #ifdef HAVE_ZLIB
     if ((*file)->zfptr!=NULL)  { retval = gzclose((*file)->zfptr); }
+    if ((*file)->gzwptr!=NULL) { retval = znz_gzwriter_close((*file)->gzwptr); }
+    if ((*file)->gzrptr!=NULL) { retval = znz_gzreader_close((*file)->gzrptr); }
 #endif
     if ((*file)->nzfptr!=NULL) { retval = fclose((*file)->nzfptr); }
 
@@ -139,6 +789,10 @@ size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file)
 
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) { return 0; }  /* write only */
+  if (file->gzrptr!=NULL) {
+    return znz_gzreader_read(file->gzrptr, buf, remain) / (size ? size : 1);
+  }
   if (file->zfptr!=NULL) {
     /* gzread/write take unsigned int length, so maybe read in int pieces
        (noted by M Hanke, example given by M Adler)   6 July 2010 [rickr] */
@@ -173,6 +827,10 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file)
 
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) {
+    return znz_gzwriter_write(file->gzwptr, buf, remain) / (size ? size : 1);
+  }
+  if (file->gzrptr!=NULL) { return 0; }  /* read only */
   if (file->zfptr!=NULL) {
     while( remain > 0 ) {
        n2write = (remain < ZNZ_MAX_BLOCK_SIZE) ? remain : ZNZ_MAX_BLOCK_SIZE;
@@ -202,6 +860,8 @@ long znzseek(znzFile file, long offset, int whence)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) return znz_gzwriter_seek(file->gzwptr,offset,whence);
+  if (file->gzrptr!=NULL) return znz_gzreader_seek(file->gzrptr,offset,whence);
   if (file->zfptr!=NULL) return (long) gzseek(file->zfptr,offset,whence);
 #endif
   return fseek(file->nzfptr,offset,whence);
@@ -217,6 +877,8 @@ int znzrewind(znzFile stream)
      if (stream->zfptr!=NULL) return gzrewind(stream->zfptr);
   */
 
+  if (stream->gzwptr!=NULL) return -1;
+  if (stream->gzrptr!=NULL) return (int)znz_gzreader_seek(stream->gzrptr, 0L, SEEK_SET);
   if (stream->zfptr!=NULL) return (int)gzseek(stream->zfptr, 0L, SEEK_SET);
 #endif
   rewind(stream->nzfptr);
@@ -227,6 +889,8 @@ long znztell(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) return (long) file->gzwptr->total;
+  if (file->gzrptr!=NULL) return (long) file->gzrptr->pos;
   if (file->zfptr!=NULL) return (long) gztell(file->zfptr);
 #endif
   return ftell(file->nzfptr);
@@ -236,6 +900,8 @@ int znzputs(const char * str, znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) return (int)znz_gzwriter_write(file->gzwptr,str,strlen(str));
+  if (file->gzrptr!=NULL) return -1;
   if (file->zfptr!=NULL) return gzputs(file->zfptr,str);
 #endif
   return fputs(str,file->nzfptr);
@@ -246,6 +912,15 @@ char * znzgets(char* str, int size, znzFile file)
 {
   if (file==NULL) { return NULL; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) return NULL;
+  if (file->gzrptr!=NULL) {
+    int n = 0;
+    if (size <= 0) return NULL;
+    while (n < size - 1 && znz_gzreader_read(file->gzrptr, str + n, 1) == 1)
+      if (str[n++] == '\n') break;
+    str[n] = '\0';
+    return n > 0 ? str : NULL;
+  }
   if (file->zfptr!=NULL) return gzgets(file->zfptr,str,size);
 #endif
   return fgets(str,size,file->nzfptr);
@@ -256,6 +931,8 @@ int znzflush(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) return 0;  /* blocks are written when complete */
+  if (file->gzrptr!=NULL) return 0;
   if (file->zfptr!=NULL) return gzflush(file->zfptr,Z_SYNC_FLUSH);
 #endif
   return fflush(file->nzfptr);
@@ -266,6 +943,8 @@ int znzeof(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) return 0;
+  if (file->gzrptr!=NULL) return file->gzrptr->eof;
   if (file->zfptr!=NULL) return gzeof(file->zfptr);
 #endif
   return feof(file->nzfptr);
@@ -276,6 +955,11 @@ int znzputc(int c, znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) {
+    unsigned char b = (unsigned char)c;
+    return znz_gzwriter_write(file->gzwptr,&b,1) == 1 ? b : -1;
+  }
+  if (file->gzrptr!=NULL) return -1;
   if (file->zfptr!=NULL) return gzputc(file->zfptr,c);
 #endif
   return fputc(c,file->nzfptr);
@@ -286,6 +970,11 @@ int znzgetc(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->gzwptr!=NULL) return -1;
+  if (file->gzrptr!=NULL) {
+    unsigned char b;
+    return znz_gzreader_read(file->gzrptr,&b,1) == 1 ? b : -1;
+  }
   if (file->zfptr!=NULL) return gzgetc(file->zfptr);
 #endif
   return fgetc(file->nzfptr);
@@ -300,7 +989,7 @@ int znzprintf(znzFile stream, const char *format, ...)
   if (stream==NULL) { return 0; }
   va_start(va, format);
 #ifdef HAVE_ZLIB
-  if (stream->zfptr!=NULL) {
+  if (stream->zfptr!=NULL || stream->gzwptr!=NULL || stream->gzrptr!=NULL) {
     int size;  /* local to HAVE_ZLIB block */
     size = strlen(format) + 1000000;  /* overkill I hope */
     tmpstr = (char *)calloc(1, size);
@@ -309,7 +998,12 @@ int znzprintf(znzFile stream, const char *format, ...)
        return retval;
     }
     vsnprintf(tmpstr,256,format,va);
-    retval=gzprintf(stream->zfptr,"%s",tmpstr);
+    if (stream->gzwptr!=NULL)
+      retval=(int)znz_gzwriter_write(stream->gzwptr,tmpstr,strlen(tmpstr));
+    else if (stream->gzrptr!=NULL)
+      retval=-1;
+    else
+      retval=gzprintf(stream->zfptr,"%s",tmpstr);
     free(tmpstr);
   } else
 #endif
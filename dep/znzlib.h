@@ -33,6 +33,15 @@ are required:
 
 NB: seeks for writable files with compression are quite restricted
 
+Compressed files opened for writing ("w" modes) are written as multi-member
+gzip, with members of 1 MB of data deflated on several threads.  Compressed
+files opened for reading ("r" modes) are read ahead on a background thread,
+and members of known size (written here, or by bgzip) are inflated on
+several threads.  The number of threads and the compression level are set
+with znz_set_gz_threads() and znz_set_gz_level(), or with the
+LAYNII_GZ_THREADS and LAYNII_GZ_LEVEL environment variables.  Building with
+HAVE_LIBDEFLATE (and -ldeflate) inflates members with libdeflate.
+
 */
 
 
@@ -63,11 +72,18 @@ extern "C" {
 #endif
 #endif
 
+#ifdef HAVE_ZLIB
+struct znz_gzwriter;  /* parallel block compressor, see znzlib.cpp */
+struct znz_gzreader;  /* read-ahead decompressor, see znzlib.cpp */
+#endif
+
 struct znzptr {
   int withz;
   FILE* nzfptr;
 #ifdef HAVE_ZLIB
   gzFile zfptr;
+  struct znz_gzwriter* gzwptr;
+  struct znz_gzreader* gzrptr;
 #endif
 } ;
 
@@ -87,6 +103,10 @@ typedef struct znzptr * znzFile;
 
 znzFile znzopen(const char *path, const char *mode, int use_compression);
 
+/* nr_threads <= 0 uses all cores, level < 0 the zlib default */
+void znz_set_gz_threads(int nr_threads);
+void znz_set_gz_level(int level);
+
 znzFile znzdopen(int fd, const char *mode, int use_compression);
 
 int Xznzclose(znzFile * file);
@@ -96,8 +96,8 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_rim = copy_nifti_as_int32(nii1);
-    int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
+    nifti_image* nii_rim = nii1;
+    int32_t* nii_rim_data = nifti_data_as<int32_t>(nii_rim);
 
     // Prepare output
     nifti_image* nii_borders = copy_nifti_as_int32(nii_rim);
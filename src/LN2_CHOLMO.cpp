@@ -134,8 +134,8 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_layers = copy_nifti_as_int16(nii1);
-    int16_t* nii_layers_data = static_cast<int16_t*>(nii_layers->data);
+    nifti_image* nii_layers = nii1;
+    int16_t* nii_layers_data = nifti_data_as<int16_t>(nii_layers);
 
     nifti_image* step = copy_nifti_as_int16(nii_layers);
     int16_t* step_data = static_cast<int16_t*>(step->data);
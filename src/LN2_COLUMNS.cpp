@@ -18,12 +18,21 @@ int show_help(void) {
     "                    voxels. This program only generates columns in the \n"
     "                    voxels coded with 3.\n"
     "    -midgm        : Middle gray matter file (from LN2_LAYERS output).\n"
+    "                    Optional when '-geometry_cache' is used.\n"
     "    -nr_columns   : Number of columns.\n"
     "    -centroids    : (Optional) Output of LN2_COLUMNS. Can be given as an\n"
     "                    input to speed up generation of new columns or reduce\n"
     "                    the desired number of columns. Acts as a checkpoint.\n"
     "                    Especially useful for large images that takes long\n"
     "                    time to process.\n"
+    "    -geometry_cache: (Optional) Load the geometry cache saved by\n"
+    "                    'LN2_LAYERS -geometry_cache' for the same rim file.\n"
+    "                    Middle gray matter and its connected clusters are\n"
+    "                    taken from the cache. When '-midgm' is also given,\n"
+    "                    the clusters are only reused if both match. The\n"
+    "                    cache holds the middle gray matter of the last\n"
+    "                    'LN2_LAYERS -geometry_cache' run (equivol or equidist,\n"
+    "                    printed when loaded).\n"
     "    -debug        : (Optional) Save extra intermediate outputs.\n"
     "    -incl_borders : (Optional) Include inner and outer gray matter borders\n"
     "                    into the layering. This treats the borders as \n"
@@ -44,6 +53,7 @@ int main(int argc, char*  argv[]) {
     int ac;
     int32_t nr_columns = 5;
     bool mode_debug = false, mode_initialize_with_centroids = false, mode_incl_borders = false;
+    bool mode_geometry_cache = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -84,6 +94,8 @@ int main(int argc, char*  argv[]) {
             fout = argv[ac];
         } else if (!strcmp(argv[ac], "-incl_borders")) {
             mode_incl_borders = true;
+        } else if (!strcmp(argv[ac], "-geometry_cache")) {
+            mode_geometry_cache = true;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else {
@@ -96,7 +108,7 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** missing option '-rim'\n");
         return 1;
     }
-    if (!fin2) {
+    if (!fin2 && !mode_geometry_cache) {
         fprintf(stderr, "** missing option '-midgm'\n");
         return 1;
     }
@@ -113,10 +125,26 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
         return 2;
     }
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
+    GeometryCache geometry;
+    bool geometry_loaded = false;
+    if (mode_geometry_cache) {
+        string cache_path = geometry_cache_path(fin1);
+        geometry_loaded = geometry_cache_load(cache_path, geometry_cache_key(fin1), geometry)
+            && geometry.size_x == static_cast<uint32_t>(nii1->nx)
+            && geometry.size_y == static_cast<uint32_t>(nii1->ny)
+            && geometry.size_z == static_cast<uint32_t>(nii1->nz);
+        if (!geometry_loaded && !fin2) {
+            fprintf(stderr, "** missing or outdated geometry cache '%s', use '-midgm'\n",
+                    cache_path.c_str());
+            return 2;
+        }
+    }
+    if (fin2) {
+        nii2 = nifti_image_read(fin2, 1);
+        if (!nii2) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+            return 2;
+        }
     }
     if (mode_initialize_with_centroids) {
         nii3 = nifti_image_read(fin3, 1);
@@ -128,7 +156,13 @@ int main(int argc, char*  argv[]) {
 
     log_welcome("LN2_COLUMNS");
     log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
+    if (nii2) {
+        log_nifti_descriptives(nii2);
+    }
+    if (geometry_loaded) {
+        cout << "  Loaded geometry cache from:\n    " << geometry_cache_path(fin1) << endl;
+        cout << "    Middle gray matter: " << geometry_cache_midgm_name(geometry) << endl;
+    }
 
     if (mode_initialize_with_centroids) {
         log_nifti_descriptives(nii3);
@@ -158,10 +192,20 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_rim = copy_nifti_as_int32(nii1);
-    int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
-    nifti_image* nii_midgm = copy_nifti_as_int32(nii2);
-    int32_t* nii_midgm_data = static_cast<int32_t*>(nii_midgm->data);
+    nifti_image* nii_rim = nii1;
+    int32_t* nii_rim_data = nifti_data_as<int32_t>(nii_rim);
+    nifti_image* nii_midgm;
+    int32_t* nii_midgm_data;
+    if (nii2) {
+        nii_midgm = nii2;
+        nii_midgm_data = nifti_data_as<int32_t>(nii_midgm);
+    } else {
+        nii_midgm = copy_nifti_as_int32(nii_rim);
+        nii_midgm_data = static_cast<int32_t*>(nii_midgm->data);
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            *(nii_midgm_data + i) = geometry.midgm[i] != 0;
+        }
+    }
 
     // Prepare required nifti images
     nifti_image* nii_columns  = copy_nifti_as_int32(nii_rim);
@@ -180,8 +224,8 @@ int main(int argc, char*  argv[]) {
     // Find initial number of columns if the optional input is given
     int32_t max_column_id = 0;
     if (mode_initialize_with_centroids) {
-        nifti_image* nii_centroids = copy_nifti_as_int32(nii3);
-        int32_t* nii_centroids_data = static_cast<int32_t*>(nii_centroids->data);
+        nifti_image* nii_centroids = nii3;
+        int32_t* nii_centroids_data = nifti_data_as<int32_t>(nii_centroids);
 
         // Find maximum column id
         for (uint32_t i = 0; i != nr_voxels; ++i) {
@@ -237,218 +281,34 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     cout << "  Start finding connected clusters..." << endl;
 
-    // Loop until all clusters have one initial voxel
-    uint32_t voxel_counter = 0, prev_voxel_counter = 0;
-    int32_t init_voxel_id = 1;
-    bool terminate_switch1 = true;
-    while (terminate_switch1) {
-        uint32_t ix, iy, iz, i, j;
-
-        if (voxel_counter == nr_voi) {
-            // Indicates all clusters are reached. Terminate condition.
-            terminate_switch1 = false;
-            cout << "    Nr. of connected clusters within midgm input: "
-                << init_voxel_id - 1 << endl;
-        } else if (voxel_counter == prev_voxel_counter) {
-            // Find the initial voxel for each disconnected cluster
-            uint32_t start_voxel;
-            for (uint32_t i = 0; i != nr_voxels; ++i) {
-                if (*(nii_midgm_data + i) == 1) {
-                    start_voxel = i;
-                }
-            }
-            voxel_counter += 1;
-            init_voxel_id += 1;
-            *(nii_midgm_data + start_voxel) = init_voxel_id;
+    // NOTE: Clusters are numbered from 2 on (1 marks unassigned midgm)
+    int32_t nr_clusters = 0;
+    bool clusters_cached = geometry_loaded;
+    for (uint32_t i = 0; clusters_cached && i != nr_voxels; ++i) {
+        clusters_cached = (*(nii_midgm_data + i) == 1) == (geometry.midgm[i] != 0);
+    }
+    if (clusters_cached) {
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            uint32_t i = *(voi_id + ii);
+            *(nii_midgm_data + i) = geometry.midgm[i] + 1;
+            nr_clusters = std::max(nr_clusters, geometry.midgm[i]);
         }
-
-        while (prev_voxel_counter != voxel_counter) {
-            prev_voxel_counter = voxel_counter;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                // Map subset to full set
-                i = *(voi_id + ii);
-                if (*(nii_midgm_data + i) == init_voxel_id) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                }
-            }
-
-            // Count cluster assigned voxels
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(nii_midgm_data + i) > 1) {
-                    voxel_counter += 1;
-                }
-            }
+    } else {
+        vector<uint8_t> midgm_mask(nr_voxels, 0);
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            midgm_mask[*(voi_id + ii)] = 1;
+        }
+        vector<int32_t> clusters(nr_voxels);
+        nr_clusters = label_connected_clusters(midgm_mask.data(), size_x, size_y,
+                                               size_z, clusters.data());
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            uint32_t i = *(voi_id + ii);
+            *(nii_midgm_data + i) = clusters[i] + 1;
         }
     }
+    int32_t init_voxel_id = nr_clusters + 1;
+    cout << "    Nr. of connected clusters within midgm input: "
+        << init_voxel_id - 1 << endl;
     if (mode_debug) {
         save_output_nifti(fout, "connected_clusters", nii_midgm, false);
     }
@@ -471,7 +331,7 @@ int main(int argc, char*  argv[]) {
     }
 
     // Initialize new voxel
-    uint32_t new_voxel_id;
+    uint32_t new_voxel_id, voxel_counter;
     float flood_dist_thr = std::numeric_limits<float>::infinity();
 
     // Loop until desired number of columns reached
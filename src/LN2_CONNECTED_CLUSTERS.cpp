@@ -1,6 +1,7 @@
 
 #include "../dep/laynii_lib.h"
 #include <sstream>
+#include <fstream>
 
 int show_help(void) {
     printf(
@@ -13,6 +14,11 @@ int show_help(void) {
     "Options:\n"
     "    -help         : Show this help.\n"
     "    -input        : Binary nifti image (only consists of 0s and 1s).\n"
+    "    -connectivity : (Optional) 6 (faces), 18 (faces and edges) or 26\n"
+    "                    (faces, edges and corners) neighbourhood. Default\n"
+    "                    is 26.\n"
+    "    -stats        : (Optional) Write size and bounding box (in voxel\n"
+    "                    indices) of each cluster into a csv file.\n"
     "    -output       : (Optional) Output basename for all outputs.\n"
     "\n");
     return 0;
@@ -23,6 +29,8 @@ int main(int argc, char*  argv[]) {
     nifti_image *nii1 = NULL;
     char *fin1 = NULL, *fout = NULL;
     int ac;
+    int connectivity = 26;
+    bool mode_stats = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -36,6 +44,18 @@ int main(int argc, char*  argv[]) {
             }
             fin1 = argv[ac];
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-connectivity")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -connectivity\n");
+                return 1;
+            }
+            connectivity = atoi(argv[ac]);
+            if (connectivity != 6 && connectivity != 18 && connectivity != 26) {
+                fprintf(stderr, "** -connectivity must be 6, 18 or 26\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[ac], "-stats")) {
+            mode_stats = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -76,266 +96,92 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_input = copy_nifti_as_int32(nii1);
-    int32_t* nii_input_data = static_cast<int32_t*>(nii_input->data);
-
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain the big iterative
-    // flooding distance loop to the subset of voxels. Required for substantial
-    // speed boost.
-    // Find the subset voxels that will be used many times
-    uint32_t nr_voi = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_input_data + i) != 0){
-            *(nii_input_data + i) = 1;
-            nr_voi += 1;
-        }
-    }
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
+    nifti_image* nii_input = nii1;
+    int32_t* nii_input_data = nifti_data_as<int32_t>(nii_input);
 
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
+    // Binarize
+    vector<uint8_t> mask(nr_voxels);
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_input_data + i) != 0){
-            *(voi_id + ii) = i;
-            ii += 1;
-        }
+        mask[i] = *(nii_input_data + i) != 0;
     }
 
     // ========================================================================
     // Find connected clusters
     // ========================================================================
-    cout << "  Start finding connected clusters (3-jump neighbourhood)..." << endl;
+    cout << "  Start finding connected clusters (" << connectivity
+        << " neighbourhood)..." << endl;
 
-    // Loop until all clusters have one initial voxel
-    uint32_t voxel_counter = 0, prev_voxel_counter = 0;
-    int32_t init_voxel_id = 1;
-    bool terminate_switch1 = true;
-    while (terminate_switch1) {
-        uint32_t ix, iy, iz, i, j;
-        // cout << "  " << voxel_counter << "/" << nr_voi << flush;
+    int32_t nr_clusters = label_connected_clusters(
+        mask.data(), size_x, size_y, size_z, nii_input_data, connectivity);
+    cout << "    Nr. of connected clusters within midgm input: "
+        << nr_clusters << endl;
+    cout << endl;
+    cout << "  Nr. connected clusters = " << nr_clusters << endl;
 
-        if (voxel_counter == nr_voi) {
-            // Indicates all clusters are reached. Terminate condition.
-            terminate_switch1 = false;
-            cout << "    Nr. of connected clusters within midgm input: "
-                << init_voxel_id - 1 << endl;
-        } else if (voxel_counter == prev_voxel_counter) {
-            // Find the initial voxel for each disconnected cluster
-            uint32_t start_voxel;
-            for (uint32_t i = 0; i != nr_voxels; ++i) {
-                if (*(nii_input_data + i) == 1) {
-                    start_voxel = i;
-                }
-            }
-            voxel_counter += 1;
-            init_voxel_id += 1;
-            *(nii_input_data + start_voxel) = init_voxel_id;
+    // ------------------------------------------------------------------------
+    // Cluster sizes and bounding boxes
+    // ------------------------------------------------------------------------
+    if (mode_stats) {
+        uint32_t ix, iy, iz, i;
+        vector<uint32_t> size(nr_clusters + 1, 0);
+        vector<uint32_t> min_x(nr_clusters + 1, end_x), max_x(nr_clusters + 1, 0);
+        vector<uint32_t> min_y(nr_clusters + 1, end_y), max_y(nr_clusters + 1, 0);
+        vector<uint32_t> min_z(nr_clusters + 1, end_z), max_z(nr_clusters + 1, 0);
+        for (i = 0; i != nr_voxels; ++i) {
+            int32_t c = *(nii_input_data + i);
+            if (c == 0) continue;
+            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+            size[c] += 1;
+            min_x[c] = std::min(min_x[c], ix), max_x[c] = std::max(max_x[c], ix);
+            min_y[c] = std::min(min_y[c], iy), max_y[c] = std::max(max_y[c], iy);
+            min_z[c] = std::min(min_z[c], iz), max_z[c] = std::max(max_z[c], iz);
         }
 
-        while (prev_voxel_counter != voxel_counter) {
-            prev_voxel_counter = voxel_counter;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                // Map subset to full set
-                i = *(voi_id + ii);
-                if (*(nii_input_data + i) == init_voxel_id) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                }
-            }
-
-            // Count cluster assigned voxels
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(nii_input_data + i) > 1) {
-                    voxel_counter += 1;
-                }
+        // Parse output path
+        string path = fout;
+        std::string dir, file, basename, sep, csv_path_out;
+        auto pos1 = path.find_last_of('/');
+        if (pos1 != string::npos) {  // For Unix
+            sep = "/";
+            dir = path.substr(0, pos1);
+            file = path.substr(pos1 + 1);
+        } else {  // For Windows
+            pos1 = path.find_last_of('\\');
+            if (pos1 != string::npos) {
+                sep = "\\";
+                dir = path.substr(0, pos1);
+                file = path.substr(pos1 + 1);
+            } else {  // Only the filename
+                sep = "";
+                dir = "";
+                file = path;
             }
         }
-    }
-    cout << endl;
-    cout << "  Nr. connected clusters = " << init_voxel_id - 1 << endl;
-
-    // Make uniqute cluster ids start from 1 instead of 2
-    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-        uint32_t i = *(voi_id + ii);  // Map subset to full set
-        if (*(nii_input_data + i) != 0) {
-            *(nii_input_data + i) -= 1;
+        auto const pos2 = file.find_first_of('.');
+        basename = file.substr(0, pos2);
+        std::ostringstream tag;
+        tag << nr_clusters;
+        csv_path_out = dir + sep + basename + "_connected_clusters" + tag.str()
+            + "_stats.csv";
+
+        std::ofstream output_file(csv_path_out);
+        if (!output_file.is_open()) {
+            std::cout << "  Unable to open text file!\n";
+            return 1;
+        }
+        output_file << "Label,Size,MinX,MinY,MinZ,MaxX,MaxY,MaxZ\n";
+        for (int32_t c = 1; c <= nr_clusters; ++c) {
+            output_file << c << "," << size[c] << ","
+                << min_x[c] << "," << min_y[c] << "," << min_z[c] << ","
+                << max_x[c] << "," << max_y[c] << "," << max_z[c] << "\n";
         }
+        output_file.close();
+        log_output(csv_path_out.c_str());
     }
 
     // Add number of clusters into the output tag
     std::ostringstream tag;
-    tag << init_voxel_id - 1;
+    tag << nr_clusters;
     save_output_nifti(fout, "connected_clusters" + tag.str(), nii_input, true);
 
     cout << "\n  Finished." << endl;
@@ -33,6 +33,12 @@ int show_help(void) {
     "                   ALF file is given. \n"
     "    -lambda      : (Optional) For peak to tail ratio. Default is 0.25\n"
     "                   from Markuerkiaga et al. 2016, Fig. 5B, at 7T.\n"
+    "    -column_index: (Optional) Cache the voxels of each column in a file next\n"
+    "                   to the '-column_file' file (named '*_labelindex.bin').\n"
+    "                   When the file exists and matches, the column file is\n"
+    "                   not read.\n"
+    "    -threads     : (Optional) Number of threads for the deconvolution of\n"
+    "                   columns. Default is 1.\n"
     "    -output      : (Optional) Output filename, including .nii or\n"
     "                   .nii.gz, and path if needed. Overwrites existing files.\n"
     "\n"
@@ -57,8 +63,9 @@ int main(int argc, char* argv[]) {
     char *f_input = NULL, *f_layer = NULL, *f_column = NULL, *f_ALF = NULL;
     char *f_out = NULL;
     string tag = "deveinDeconv";
-    int ac;
+    int ac, nr_threads = 1;
     bool mode_linear = false;  // Default is linear as it requires least inputs
+    bool use_column_index = false;
     bool mode_CBV = false;
 
     // Peak to tail ratio from Markuerkiaga et al. 2016 Fig. 5B at 7T.
@@ -95,6 +102,14 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             lambda = atof(argv[ac]);  // No string copy, pointer assignment
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            nr_threads = std::max(1, atoi(argv[ac]));
+        } else if (!strcmp(argv[ac], "-column_index")) {
+            use_column_index = true;
         } else if (!strcmp(argv[ac], "-CBV")) {
             mode_CBV = true;
         } else if (!strcmp(argv[ac], "-linear")) {
@@ -176,10 +191,10 @@ int main(int argc, char* argv[]) {
 
     // ========================================================================
     // Fix datatype issues
-    nifti_image* nii_input = copy_nifti_as_float32(nii);
-    float *nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* nii_layer = copy_nifti_as_float32(nii_layeri);
-    float *nii_layer_data = static_cast<float*>(nii_layer->data);
+    nifti_image* nii_input = nii;
+    float* nii_input_data = nifti_data_as<float>(nii_input);
+    nifti_image* nii_layer = nii_layeri;
+    float* nii_layer_data = nifti_data_as<float>(nii_layer);
 
     // Allocate new niftis
     nifti_image *nii_output = copy_nifti_as_float32(nii_input);
@@ -269,157 +284,162 @@ int main(int argc, char* argv[]) {
         }
 
         // Read additional inputs
-        nifti_image* nii_columni = nifti_image_read(f_column, 1);
-        if (!nii_columni) {
-            fprintf(stderr, "** failed to read NIfTI from '%s'\n", f_column);
-            return 2;
-        }
         nifti_image* nii_ALFi = nifti_image_read(f_ALF, 1);
         if (!nii_ALFi) {
             fprintf(stderr, "** failed to read NIfTI from '%s'\n", f_ALF);
             return 2;
         }
-
-        log_nifti_descriptives(nii_columni);
         log_nifti_descriptives(nii_ALFi);
+        nifti_image* nii_ALF = nii_ALFi;
+        float* nii_ALF_data = nifti_data_as<float>(nii_ALF);
 
-        // Prepare additional inputs
-        nifti_image* nii_column = copy_nifti_as_int32(nii_columni);
-        int32_t *nii_column_data = static_cast<int32_t*>(nii_column->data);
-        nifti_image* nii_ALF = copy_nifti_as_float32(nii_ALFi);
-        float* nii_ALF_data = static_cast<float*>(nii_ALF->data);
+        // ====================================================================
+        // Index voxels by column
+        // ====================================================================
+        // NOTE: Each column owns a contiguous list of its voxels, so columns
+        // only visit their own voxels. The column file is not read when a
+        // cached index matches it.
+        LabelIndex columns;
+        bool index_loaded = false;
+        string index_path = label_index_path(f_column);
+        uint64_t index_key = label_index_key(f_column);
+        if (use_column_index) {
+            index_loaded = label_index_load(index_path, index_key, columns)
+                && columns.size_x == static_cast<uint32_t>(size_x)
+                && columns.size_y == static_cast<uint32_t>(size_y)
+                && columns.size_z == static_cast<uint32_t>(size_z);
+        }
+        if (index_loaded) {
+            cout << "  Loaded column index from:\n    " << index_path << endl;
+        } else {
+            nifti_image* nii_columni = nifti_image_read(f_column, 1);
+            if (!nii_columni) {
+                fprintf(stderr, "** failed to read NIfTI from '%s'\n", f_column);
+                return 2;
+            }
+            log_nifti_descriptives(nii_columni);
+            nifti_image* nii_column = nii_columni;
+            int32_t* nii_column_data = nifti_data_as<int32_t>(nii_column);
+            label_index_build(columns, nii_column_data, size_x, size_y, size_z);
+            nifti_image_free(nii_column);
+
+            if (use_column_index) {
+                if (label_index_save(index_path, index_key, columns)) {
+                    cout << "  Saved column index as:\n    " << index_path << endl;
+                } else {
+                    cout << "  WARNING: Could not save column index as:\n    " << index_path << endl;
+                }
+            }
+        }
+        const uint32_t nr_labels = columns.labels.size();
 
-        // --------------------------------------------------------------------
-        // Find number of columns
-        // --------------------------------------------------------------------
         int nr_columns = 0;
-        for (int i = 0; i < nr_voxels; ++i) {
-            if (*(nii_column_data + i) > nr_columns) {
-                nr_columns = *(nii_column_data + i);
-            }
+        if (nr_labels > 0 && columns.labels.back() > 0) {
+            nr_columns = columns.labels.back();
         }
         cout << "  Number of columns = " << nr_columns << endl;
 
         // --------------------------------------------------------------------
         // Making sure that every column voxel has a layer
         // --------------------------------------------------------------------
-        for (int ivox = 0; ivox < nr_voxels; ++ivox) {
-            if (*(nii_column_data + ivox) > 0 &&  *(nii_layer_data + ivox) == 0 ){
+        // NOTE: Column voxels without a layer are skipped below.
+        for (uint32_t n = 0; n != columns.voxels.size(); ++n) {
+            if (*(nii_layer_data + columns.voxels[n]) == 0) {
                 cout << "  Some column voxels don't have layers in this file.\n";
                 cout << "  It is likely that you provided wrong data.\n";
                 cout << "  Though, the program will proceed." << endl;
-                *(nii_column_data + ivox) = 0;
-            }
-        }
-
-        // ====================================================================
-        // Do deconvolution column by column. First, I allocate all.
-        // ====================================================================
-        float vec1[nr_layers][size_t], vec2[nr_layers][size_t], vecALF[nr_layers];
-        int vec_nr_voxels[nr_layers];
-
-        for (int i = 0; i < nr_layers; ++i) {
-            for (int t = 0; t < size_t; t++) {
-                vec1[i][t] = 0.;
-                vec2[i][t] = 0.;
+                break;
             }
-            vecALF[i] = 0.;
-            vec_nr_voxels[i] = 0;
         }
 
         // ====================================================================
         // Big loop across columns
         // ====================================================================
-        for (int icol = 1; icol <= nr_columns; ++icol) {
-
-            // Reset vector
-            for (int i = 0; i < nr_layers; ++i) {
-                for (int t = 0; t < size_t; t++){
-                    vec1[i][t] = 0.;
-                    vec2[i][t] = 0.;
-                }
-                vecALF[i] = 0.;
-                vec_nr_voxels[i] = 0;
-            }
-
-            // Fill vector of column #icol
-            for (int ivox = 0; ivox < nr_voxels; ++ivox) {
-                if (icol == *(nii_column_data + ivox)) {
+        parallel_for(nr_labels, nr_threads, [&](uint32_t begin, uint32_t end) {
+            // Layer profiles of the current column, vec1[i * size_t + t]
+            vector<float> vec1(nr_layers * size_t), vecALF(nr_layers);
+            vector<float> tail(size_t);
+            vector<int> vec_nr_voxels(nr_layers);
+
+            for (uint32_t c = begin; c < end; ++c) {
+                if (columns.labels[c] <= 0) continue;
+                std::fill(vec1.begin(), vec1.end(), 0.);
+                std::fill(vecALF.begin(), vecALF.end(), 0.);
+                std::fill(vec_nr_voxels.begin(), vec_nr_voxels.end(), 0);
+
+                // Fill vector of the column
+                for (uint32_t n = columns.start[c]; n < columns.start[c + 1]; ++n) {
+                    uint32_t ivox = columns.voxels[n];
                     int i = *(nii_layer_data + ivox) - 1;  // current layer
-
-                    if (!mode_linear) {
-                        vecALF[i] += *(nii_ALF_data + ivox);
-                    }
-
+                    if (i < 0 || i >= nr_layers) continue;
+                    vecALF[i] += *(nii_ALF_data + ivox);
                     vec_nr_voxels[i] += 1;
-
+                    float* v = &vec1[i * size_t];
                     for (int t = 0; t < size_t; t++) {
-                        vec1[i][t] += *(nii_input_data + t * nr_voxels + ivox);
+                        v[t] += *(nii_input_data + t * nr_voxels + ivox);
                     }
                 }
-            }
 
-            // Get mean of values within column vector
-            for (int i = 0; i < nr_layers; ++i) {
-                for (int t = 0; t < size_t; t++) {
-                    vec1[i][t] /= (float)vec_nr_voxels[i];
+                // Get mean of values within column vector
+                for (int i = 0; i < nr_layers; ++i) {
+                    float* v = &vec1[i * size_t];
+                    for (int t = 0; t < size_t; t++) {
+                        v[t] /= (float)vec_nr_voxels[i];
+                    }
+                    vecALF[i] /= (float)vec_nr_voxels[i];
                 }
-                vecALF[i] /= (float)vec_nr_voxels[i];
-            }
 
-            // ----------------------------------------------------------------
-            // Do voxel deconvolution
-            // ----------------------------------------------------------------
+                // ------------------------------------------------------------
+                // Do voxel deconvolution
+                // ------------------------------------------------------------
 
-            // Normalize amplitude of low frequencies (ALF)
-            float ALF_sum = 0 ;
-            for (int i = 0; i < nr_layers; ++i) {
-                if (vec_nr_voxels[i] > 0) {
-                    ALF_sum += vecALF[i];
+                // Normalize amplitude of low frequencies (ALF)
+                float ALF_sum = 0 ;
+                for (int i = 0; i < nr_layers; ++i) {
+                    if (vec_nr_voxels[i] > 0) {
+                        ALF_sum += vecALF[i];
+                    }
                 }
-            }
-            for (int i = 0; i < nr_layers; ++i) {
-                if (vec_nr_voxels[i] > 0) {
-                    vecALF[i] /= ALF_sum;
+                for (int i = 0; i < nr_layers; ++i) {
+                    if (vec_nr_voxels[i] > 0) {
+                        vecALF[i] /= ALF_sum;
+                    }
                 }
-            }
-
-            for (int t = 0; t < size_t; t++){
 
+                // Deconvolved values replace the layer means. The macrovascular
+                // contribution of all deeper layers is kept as a running sum,
+                // so each layer subtracts it once instead of summing again.
+                std::fill(tail.begin(), tail.end(), 0.);
                 for (int i = 0; i < nr_layers; ++i) {
+                    if (vec_nr_voxels[i] == 0) continue;
+                    float* v = &vec1[i * size_t];
                     if (mode_CBV) {  // Just CBV normalization
-                        if (vec_nr_voxels[i] > 0) {
-                            vec2[i][t] = vec1[i][t] / vecALF[i] * (float)nr_layers;
+                        for (int t = 0; t < size_t; t++) {
+                            v[t] = v[t] / vecALF[i] * (float)nr_layers;
                         }
                     } else {  // Deconvolution
-                        // Macrovascular contribution value, that needs to be
-                        // subtracted from the current voxel.
-                        float sum = 0;
-                        for (int j = i-1; j >= 0; --j) {
-                            // This is the deconvolution, It is weighted with CBV.
-                            // Lambda is the inverse of peak to tail ratio
-                            // from from Markuerkiaga et al. 2016 Fig. 5B at 7T.
-                            if (vec_nr_voxels[j] > 0) {
-                                sum += vec1[j][t] / (float)nr_layers / vecALF[j] * lambda;
-                            }
-                        }
-                        if (vec_nr_voxels[i] > 0) {
-                            vec2[i][t] = (vec1[i][t] - sum);
+                        // This is the deconvolution, It is weighted with CBV.
+                        // Lambda is the inverse of peak to tail ratio
+                        // from from Markuerkiaga et al. 2016 Fig. 5B at 7T.
+                        for (int t = 0; t < size_t; t++) {
+                            float drain = v[t] / (float)nr_layers / vecALF[i] * lambda;
+                            v[t] -= tail[t];
+                            tail[t] += drain;
                         }
                     }
                 }
-            }
 
-            // Fill file with the deconvolved values
-            for (int ivox = 0; ivox < nr_voxels; ++ivox) {
-                if (icol == *(nii_column_data + ivox)) {
+                // Fill file with the deconvolved values
+                for (uint32_t n = columns.start[c]; n < columns.start[c + 1]; ++n) {
+                    uint32_t ivox = columns.voxels[n];
                     int i = *(nii_layer_data + ivox) - 1;
+                    if (i < 0 || i >= nr_layers) continue;
                     for (int t = 0; t < size_t; t++) {
-                        *(nii_output_data + t * nr_voxels + ivox ) = vec2[i][t];
+                        *(nii_output_data + t * nr_voxels + ivox) = vec1[i * size_t + t];
                     }
                 }
             }
-        }
+        });
     }
 
     // ------------------------------------------------------------------------
@@ -20,6 +20,8 @@ int show_help(void) {
     "    -output      : (Optional) Output filename, including .nii or\n"
     "                   .nii.gz, and path if needed. Overwrites existing files.\n"
     "                   If not given, the prefix 'fPSF' is added.\n"
+    "    -threads     : (Optional) Number of threads for finding the most\n"
+    "                   common value in each parcel. Default is 1.\n"
     "\n"
     "Notes:\n"
     "    This is written foir Richard as a side project.  \n"
@@ -36,6 +38,7 @@ int main(int argc, char * argv[]) {
     char *fin = NULL;
     char *fin_layers = NULL, *fin_columns = NULL;
     int ac;
+    int nr_threads = 1;
     int kernel_size = 11; // This is the maximal number of layers. I don't know how to allocate it dynamically. this should be an odd number. That is smaller than half of the shortest matrix size to make sense
     if (argc < 2) return show_help();
 
@@ -68,6 +71,12 @@ int main(int argc, char * argv[]) {
             }
             use_outpath = true;
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            nr_threads = std::max(1, atoi(argv[ac]));
         }
     }
     if (!fin) {
@@ -118,14 +127,14 @@ int main(int argc, char * argv[]) {
 
     // ========================================================================
     // Fix data type issues
-    nifti_image* nii = copy_nifti_as_float32(nii_input);
-    float* nii_data = static_cast<float*>(nii->data);
+    nifti_image* nii = nii_input;
+    float* nii_data = nifti_data_as<float>(nii);
 
-    nifti_image* nim_layers = copy_nifti_as_int32(nim_layers_r);
-    int32_t* nim_layers_data = static_cast<int32_t*>(nim_layers->data);
+    nifti_image* nim_layers = nim_layers_r;
+    int32_t* nim_layers_data = nifti_data_as<int32_t>(nim_layers);
 
-    nifti_image* nim_columns = copy_nifti_as_int32(nim_column_r);
-    int32_t* nim_columns_data = static_cast<int32_t*>(nim_columns->data);
+    nifti_image* nim_columns = nim_column_r;
+    int32_t* nim_columns_data = nifti_data_as<int32_t>(nim_columns);
 
     // Allocate new nifti images
     nifti_image * nii_laminarity = nifti_copy_nim_info(nii);
@@ -181,132 +190,75 @@ int main(int argc, char * argv[]) {
     
     // ========================================================================
     /////////////////////////////////////////////////////////////////////
-    // finding approximate number of voxels per parcel (layer column combination) ///////
+    // grouping voxels by parcel (layer column combination) ///////
     /////////////////////////////////////////////////////////////////////
-    int layeridx = 0; 
-    int columnindx = 0; 
-    int voxelidx = 0;
-    int runningidx = 0; 
-    
-    double vec_nrVox_pacels[Nr_parcels] ; // Access the parcel as; vec_nrVox_pacels[ Nr_columns * LayerIndex + ColumnIndex]
-    double vec_mostcommonval_pacels[Nr_parcels] ; // Access the parcel as; vec_mostcommonval_pacels[ Nr_columns * LayerIndex + ColumnIndex]
+    // NOTE: Voxels are bucketed with a counting sort, so every parcel owns a
+    // contiguous range of values. Memory scales with the number of voxels and
+    // large parcels are not truncated anymore.
+    int layeridx = 0;
+    int columnindx = 0;
 
-    
-    for (int ip=0; ip<Nr_parcels; ++ip){
-			vec_nrVox_pacels[ip] = 0.; 
-			vec_mostcommonval_pacels[ip] = 0.; 
-	}
-	
-	for(int iy=0; iy<size_y; ++iy){
-     for(int ix=0; ix<size_x; ++ix){
-       for(int iz=0; iz<size_z; ++iz){
-		 //  vec_val_pacels[(int)*(nim_columns_data +  nxy*iz + nx*iy + ix)][(int)*(nim_layers_data +  nxy*iz + nx*iy + ix)] =+  ;
-		 //cout <<  Nr_columns * (int)*(nim_layers_data +  nxy*iz + nx*iy + ix) + (int)*(nim_columns_data +  nxy*iz + nx*iy + ix) << endl; 
-		 layeridx = (int)*(nim_layers_data +  nxy*iz + nx*iy + ix)-1;
-		 columnindx = (int)*(nim_columns_data +  nxy*iz + nx*iy + ix)-1; 
-		 vec_nrVox_pacels[ Nr_columns * layeridx + columnindx]++ ; 
-	    }
-	  }
+    // Parcel of each voxel, -1 where layer or column is not defined
+    vector<int32_t> voxel_parcel(nxyz, -1);
+    vector<uint32_t> parcel_start(Nr_parcels + 1, 0);
+    for (uint32_t i = 0; i != nxyz; ++i) {
+        layeridx = *(nim_layers_data + i) - 1;
+        columnindx = *(nim_columns_data + i) - 1;
+        if (layeridx >= 0 && columnindx >= 0) {
+            voxel_parcel[i] = Nr_columns * layeridx + columnindx;
+            parcel_start[voxel_parcel[i] + 1] += 1;
+        }
     }
-        
-    double mean_Nr_voxels_per_parcel = 0; 
-    double stdev_Nr_voxels_per_parcel = 0; 
-    
-    mean_Nr_voxels_per_parcel =  ren_average(vec_nrVox_pacels, Nr_layers*Nr_columns); 
-    stdev_Nr_voxels_per_parcel = ren_stdev(vec_nrVox_pacels, Nr_layers*Nr_columns); 
-    
-    cout << "Mean number of voxels per pacel is " << mean_Nr_voxels_per_parcel << endl; 
-    cout << "Stdev number of voxels per pacel is " << stdev_Nr_voxels_per_parcel << endl;   
-    
-    
+
+    vector<double> vec_nrVox_pacels(Nr_parcels);
+    uint32_t largest_parcel = 0;
+    for (int ip = 0; ip != Nr_parcels; ++ip) {
+        vec_nrVox_pacels[ip] = parcel_start[ip + 1];
+        largest_parcel = max(largest_parcel, parcel_start[ip + 1]);
+        parcel_start[ip + 1] += parcel_start[ip];
+    }
+
+    const Moments parcel_sizes = ren_moments(vec_nrVox_pacels.data(), Nr_parcels);
+
+    cout << "Mean number of voxels per pacel is " << parcel_sizes.mean << endl;
+    cout << "Stdev number of voxels per pacel is " << parcel_sizes.stdev << endl;
+    cout << "Largest parcel has " << largest_parcel << " voxels" << endl;
+
+    // NOTE: Values are filled in the y, x, z order of the loops below, which
+    // decides ties between equally common values (see ren_most_occurred_number).
+    vector<int> val_Vox_pacels(parcel_start[Nr_parcels]);
+    vector<uint32_t> fill_pos(parcel_start.begin(), parcel_start.end() - 1);
+    for (int iy = 0; iy < size_y; ++iy) {
+        for (int ix = 0; ix < size_x; ++ix) {
+            for (int iz = 0; iz < size_z; ++iz) {
+                int i = nxy * iz + nx * iy + ix;
+                if (voxel_parcel[i] >= 0) {
+                    val_Vox_pacels[fill_pos[voxel_parcel[i]]++] = *(nii_data + i);
+                }
+            }
+        }
+    }
+
     // ========================================================================
     /////////////////////////////////////////////////////////////////////
     // finding most common value in each parcel ///////
-    /////////////////////////////////////////////////////////////////////   
-    
-    int MaxVoxelPerParcel = (int) mean_Nr_voxels_per_parcel + (int) stdev_Nr_voxels_per_parcel; // for very very large columns, some voxels are missed.
-      cout << "MaxVoxelPerParcel is " << MaxVoxelPerParcel << endl;   
-
-    int* val_Vox_pacels = new int[Nr_parcels*MaxVoxelPerParcel]; 
-    //Access the parcel as: val_Vox_pacels[ MaxVoxelPerParcel * Nr_columns * LayerIndex + MaxVoxelPerParcel * ColumnIndex + VoxelIndex]
-    
-    
     /////////////////////////////////////////////////////////////////////
-    // loop across voxels for filling vector across parcels  ///////
-    /////////////////////////////////////////////////////////////////////   
-    
-    for (int il=0; il<Nr_layers; ++il){
-		for (int ic=0; ic<Nr_columns; ++ic){	
-			    vec_nrVox_pacels[Nr_columns * il +  ic] = 0.; 
-			    
-			   for (int iv=0; iv<MaxVoxelPerParcel; ++iv){
-			    val_Vox_pacels[ MaxVoxelPerParcel * Nr_columns * il + MaxVoxelPerParcel * ic + iv] = 0 ; 
-		       }
-		}
-	}
-                  cout << " Hi1 "  << endl;   
-
-    
-   for(int iy=0; iy<size_y; ++iy){
-     for(int ix=0; ix<size_x; ++ix){
-       for(int iz=0; iz<size_z; ++iz){
-		   if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) {     // NOTE(Renzo): include a check somewhere above that the layer-file makes sense in all voxles where columns are defined.
-			layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1 ;
-			columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1 ; 
-			vec_nrVox_pacels[Nr_columns * layeridx +  columnindx] += 1 ; 
-			voxelidx = vec_nrVox_pacels[Nr_columns * layeridx +  columnindx] - 1 ; 
-			voxelidx = min(voxelidx,MaxVoxelPerParcel-1);  // ignore the last voxels of gigantic column outliers. 
-		 
-			//cout << layeridx << " " << columnindx << "  "<< voxelidx << endl ; 
-			val_Vox_pacels[MaxVoxelPerParcel * Nr_columns * layeridx + MaxVoxelPerParcel * columnindx + voxelidx] =  *(nii_data +  nxy*iz + nx*iy + ix) ; 
-		   }
-	   }
-	 }
-   }
-   
-    ///////////////////////////////////////////////////////////
-    // finding most common value in each parcel output  ///////
-    ///////////////////////////////////////////////////////////
-    
-    cout << " Hi1a "  << endl;  
-    //vec_mostcommonval_pacels[ Nr_columns * LayerIndex + ColumnIndex]
-    
-    //double vec_val_in_parcel[MaxVoxelPerParcel] ; 
-    int* vec_val_in_parcel = new int[MaxVoxelPerParcel];
-    for (int ivox=0; ivox<MaxVoxelPerParcel; ++ivox) vec_val_in_parcel[ivox] = 0; 
-	int NRvoxel_in_this_parcel = 0; 
-   
+    // Histogram of the values of each parcel, empty parcels get 0.
+    vector<int> vec_mostcommonval_pacels(Nr_parcels, 0);
+    parallel_for(Nr_parcels, nr_threads, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t ip = begin; ip != end; ++ip) {
+            vec_mostcommonval_pacels[ip] = ren_most_occurred_number(
+                val_Vox_pacels.data() + parcel_start[ip],
+                parcel_start[ip + 1] - parcel_start[ip]);
+        }
+    });
 
-    for (int il=0; il<Nr_layers; ++il){
-		for (int ic=0; ic<Nr_columns; ++ic){
-			  
-			    NRvoxel_in_this_parcel = vec_nrVox_pacels[Nr_columns * il +  ic]; 
-			    NRvoxel_in_this_parcel = min(MaxVoxelPerParcel,NRvoxel_in_this_parcel); 
-			    
-			  
-				for (int ivox=0; ivox<NRvoxel_in_this_parcel; ++ivox){
-                    vec_val_in_parcel[ivox] =  val_Vox_pacels[MaxVoxelPerParcel * Nr_columns * il + MaxVoxelPerParcel * ic + ivox]; 
-			    }
-			    
-			    vec_mostcommonval_pacels[ Nr_columns * il + ic] = ren_most_occurred_number(vec_val_in_parcel, NRvoxel_in_this_parcel); 
-			    
-			   // cout << il << " " << ic << "  "<< vec_mostcommonval_pacels[ Nr_columns * il + ic]<< endl;
-		}
-	}
-    
+    for (uint32_t i = 0; i != nxyz; ++i) {
+        if (voxel_parcel[i] >= 0) {
+            *(nii_parcelval_data + i) = vec_mostcommonval_pacels[voxel_parcel[i]];
+        }
+    }
 
-   for(int iy=0; iy<size_y; ++iy){
-     for(int ix=0; ix<size_x; ++ix){
-       for(int iz=0; iz<size_z; ++iz){
-		   if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) { 
-			layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1 ;
-			columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1 ; 
-		    *(nii_parcelval_data +  nxy*iz + nx*iy + ix) = vec_mostcommonval_pacels[ Nr_columns * layeridx + columnindx];
-		   }
-	   }
-	 }
-   }
-   
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "parcel_val", nii_parcelval, true, use_outpath);
    
@@ -318,7 +270,7 @@ int main(int argc, char * argv[]) {
 	// Voxels of interest
     uint32_t nr_voi = 0;
     for (uint32_t i = 0; i != nxyz; ++i) {
-        if (*(nim_columns_data + i) > 0){
+        if (*(nim_columns_data + i) > 0 && *(nim_layers_data + i) > 0){
             nr_voi += 1;
         }
     }
@@ -329,7 +281,7 @@ int main(int argc, char * argv[]) {
     // Fill in indices to be able to remap from subset to full set of voxels
     uint32_t ii = 0;
     for (uint32_t i = 0; i != nxyz; ++i) {
-        if (*(nim_columns_data + i) > 0){
+        if (*(nim_columns_data + i) > 0 && *(nim_layers_data + i) > 0){
             *(voi_id + ii) = i;
             ii += 1;
         }
@@ -364,7 +316,7 @@ int main(int argc, char * argv[]) {
    }
       
 
-   int runidx_neigh_parcel[Nr_parcels];
+   vector<int> runidx_neigh_parcel(Nr_parcels);
       //Access the parcel as: [ parcelID ]  
    // center parcelID: Nr_columns * layeridx + columnindx
    for (int j=0; j<Nr_parcels; ++j) {
@@ -421,7 +373,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -479,7 +431,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -505,7 +457,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -514,7 +466,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (ix < size_x) {
+        if (ix + 1 < size_x) {
             int j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -531,7 +483,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -540,7 +492,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (iy < size_y) {
+        if (iy + 1 < size_y) {
             int j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -557,7 +509,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -566,7 +518,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (iz < size_z) {
+        if (iz + 1 < size_z) {
             int j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -583,7 +535,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -611,7 +563,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -620,7 +572,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (ix > 0 && iy < size_y) {
+        if (ix > 0 && iy + 1 < size_y) {
             int j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -637,7 +589,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -646,7 +598,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (ix < size_x && iy > 0) {
+        if (ix + 1 < size_x && iy > 0) {
             int j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -663,7 +615,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -672,8 +624,8 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (ix < size_x && iy < size_y) {
-            int j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
+        if (ix + 1 < size_x && iy + 1 < size_y) {
+            int j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
 				 current_column_neighbor  = (int)*(nim_columns_data + j)-1;
@@ -689,7 +641,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -715,7 +667,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -724,7 +676,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (iy > 0 && iz < size_z) {
+        if (iy > 0 && iz + 1 < size_z) {
             int j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -741,7 +693,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -750,7 +702,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (iy < size_y && iz > 0) {
+        if (iy + 1 < size_y && iz > 0) {
             int j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -767,7 +719,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -776,7 +728,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (iy < size_y && iz < size_z) {
+        if (iy + 1 < size_y && iz + 1 < size_z) {
             int j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -793,7 +745,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -819,7 +771,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -828,7 +780,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (ix < size_x && iz > 0) {
+        if (ix + 1 < size_x && iz > 0) {
             int j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                				 is_notnew_parcel_nighbor = 0; 
@@ -845,7 +797,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -854,7 +806,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (ix > 0 && iz < size_z) {
+        if (ix > 0 && iz + 1 < size_z) {
             int j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -871,7 +823,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -880,7 +832,7 @@ int main(int argc, char * argv[]) {
 				 }	 
             }
         }
-        if (ix < size_x && iz < size_z) {
+        if (ix + 1 < size_x && iz + 1 < size_z) {
             int j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 				 is_notnew_parcel_nighbor = 0; 
@@ -897,7 +849,7 @@ int main(int argc, char * argv[]) {
 				 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
 			 
 				 if ( is_notnew_parcel_nighbor == 0 ){
-					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
+					 niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 26) ; // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
 					 ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
 					 val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j) ; 
 					 Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor ; 
@@ -914,43 +866,43 @@ int main(int argc, char * argv[]) {
                 //*(neighbours + 19) = *(nim_columns_data + j);
             }
         }
-        if (ix > 0 && iy > 0 && iz < size_z) {
+        if (ix > 0 && iy > 0 && iz + 1 < size_z) {
             int j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                // *(neighbours + 20) = *(nim_columns_data + j);
             }
         }
-        if (ix > 0 && iy < size_y && iz > 0) {
+        if (ix > 0 && iy + 1 < size_y && iz > 0) {
             int j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 //*(neighbours + 21) = *(nim_columns_data + j);
             }
         }
-        if (ix < size_x && iy > 0 && iz > 0) {
+        if (ix + 1 < size_x && iy > 0 && iz > 0) {
             int j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 //*(neighbours + 22) = *(nim_columns_data + j);
             }
         }
-        if (ix > 0 && iy < size_y && iz < size_z) {
+        if (ix > 0 && iy + 1 < size_y && iz + 1 < size_z) {
             int j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 //*(neighbours + 23) = *(nim_columns_data + j);
             }
         }
-        if (ix < size_x && iy > 0 && iz < size_z) {
+        if (ix + 1 < size_x && iy > 0 && iz + 1 < size_z) {
             int j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 //*(neighbours + 24) = *(nim_columns_data + j);
             }
         }
-        if (ix < size_x && iy < size_y && iz > 0) {
+        if (ix + 1 < size_x && iy + 1 < size_y && iz > 0) {
             int j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 //*(neighbours + 25) = *(nim_columns_data + j);
             }
         }
-        if (ix < size_x && iy < size_y && iz < size_z) {
+        if (ix + 1 < size_x && iy + 1 < size_y && iz + 1 < size_z) {
             int j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
             if (*(nim_columns_data + j) > 0) {
                 //*(neighbours + 26) = *(nim_columns_data + j);
@@ -997,7 +949,7 @@ cout << " I am done filling the neighbor array "<< endl;
 ////////////  Loop over parcels and quantifying their similary of valued across layers and columns
 //////////////////////////////////////////////////////////////////////
 
-double laminarity[Nr_parcels];      //Access the parcel as: [ parcelID ]  // center parcelID: Nr_columns * layeridx + columnindx
+vector<double> laminarity(Nr_parcels);      //Access the parcel as: [ parcelID ]  // center parcelID: Nr_columns * layeridx + columnindx
 for (int j=0; j<Nr_parcels; ++j)   laminarity [j] = 0;  
 int count_same_val_layer = 0;    
 int count_same_layer = 0;       
@@ -1023,7 +975,7 @@ for (int paridx=0; paridx<Nr_parcels; ++paridx) {
    for(int iy=0; iy<size_y; ++iy){
      for(int ix=0; ix<size_x; ++ix){
        for(int iz=0; iz<size_z; ++iz){
-		   if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) { 
+		   if (voxel_parcel[nxy*iz + nx*iy + ix] >= 0) { 
 			layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1 ;
 			columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1 ; 
 		    *(nii_laminarity_data +  nxy*iz + nx*iy + ix)  = laminarity [ Nr_columns * layeridx + columnindx];
@@ -1037,7 +989,7 @@ for (int paridx=0; paridx<Nr_parcels; ++paridx) {
     save_output_nifti(fout, "output_laminarity", nii_laminarity, true, use_outpath);
     
 
-double columnarity[Nr_parcels];      //Access the parcel as: [ parcelID ]  // center parcelID: Nr_columns * layeridx + columnindx
+vector<double> columnarity(Nr_parcels, 0.);      //Access the parcel as: [ parcelID ]  // center parcelID: Nr_columns * layeridx + columnindx
 for (int j=0; j<Nr_parcels; ++j)   laminarity [j] = 0;  
 int count_same_val_col = 0;    
 int count_same_col = 0;       
@@ -1064,7 +1016,7 @@ for (int paridx=0; paridx<Nr_parcels; ++paridx) {
    for(int iy=0; iy<size_y; ++iy){
      for(int ix=0; ix<size_x; ++ix){
        for(int iz=0; iz<size_z; ++iz){
-		   if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) { 
+		   if (voxel_parcel[nxy*iz + nx*iy + ix] >= 0) { 
 			layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1 ;
 			columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1 ; 
 		    *(nii_laminarity_data +  nxy*iz + nx*iy + ix)  = laminarity [ Nr_columns * layeridx + columnindx];
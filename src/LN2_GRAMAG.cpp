@@ -100,6 +100,7 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     nifti_image* nii_input = copy_nifti_as_float32_with_scl_slope_and_scl_inter(nii1);
     float* nii_input_data = static_cast<float*>(nii_input->data);
+    nifti_image_free(nii1);
 
     // Prepare output image
     nifti_image* nii_gramag = copy_nifti_as_float32(nii_input);
@@ -78,8 +78,8 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
-    float* nii_input_data = static_cast<float*>(nii_input->data);
+    nifti_image* nii_input = nii1;
+    float* nii_input_data = nifti_data_as<float>(nii_input);
 
     // nifti_image* nii_bins = copy_nifti_as_int32(nii1);
     // float* nii_bins_data = static_cast<float*>(nii_bins->data);
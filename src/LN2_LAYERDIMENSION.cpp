@@ -137,12 +137,12 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Fix input datatype issues
     // ========================================================================
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
-    float* nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* layers = copy_nifti_as_int16(nii3);
-    int16_t* layers_data = static_cast<int16_t*>(layers->data);
-    nifti_image* columns = copy_nifti_as_int16(nii2);
-    int16_t* columns_data = static_cast<int16_t*>(columns->data);
+    nifti_image* nii_input = nii1;
+    float* nii_input_data = nifti_data_as<float>(nii_input);
+    nifti_image* layers = nii3;
+    int16_t* layers_data = nifti_data_as<int16_t>(layers);
+    nifti_image* columns = nii2;
+    int16_t* columns_data = nifti_data_as<int16_t>(columns);
 
     // ========================================================================
     // Make sure there is nothing weird with the slope of the nii header
@@ -161,26 +161,23 @@ int main(int argc, char*  argv[]) {
     // Look how many layers and columns we have and allocate arrays accordingly
     // ========================================================================
     int nr_layers = 0;
-    int nr_columns = 0;
     for (int i = 0; i != nr_voxels; ++i) {
         if (*(layers_data + i) >= nr_layers){
             nr_layers = *(layers_data + i);
         }
-        if (*(columns_data + i) >= nr_columns){
-            nr_columns = *(columns_data + i);
-        }
     }
-    cout << "    There are " << nr_layers<< " layers. " << endl ;
-    cout << "    There are " << nr_columns<< " columns. " << endl << endl;
 
-    double numb_voxels[nr_layers][nr_columns] ;
-    double mean_val[nr_layers][nr_columns] ;
-    for (int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j < nr_columns; j++) {
-            mean_val   [i][j] = 0.;
-            numb_voxels[i][j] = 0.;
-        }
+    // Group voxels by column
+    LabelIndex index;
+    label_index_build(index, columns_data, size_x, size_y, size_z);
+    const uint32_t nr_labels = index.labels.size();
+
+    int nr_columns = 0;
+    if (nr_labels > 0 && index.labels.back() > 0) {
+        nr_columns = index.labels.back();
     }
+    cout << "    There are " << nr_layers<< " layers. " << endl ;
+    cout << "    There are " << nr_columns<< " columns. " << endl << endl;
 
     // ========================================================================
     // Prepare outputs
@@ -210,31 +207,33 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Average within columns and layers
     // ========================================================================
-    for (int i = 0; i != nr_voxels; ++i) {
-        if ( *(columns_data + i) !=0 && *(layers_data + i) != 0 ){
-            mean_val   [*(layers_data + i) -1 ][ *(columns_data + i) -1 ] += *(nii_input_data + i) ;
-            numb_voxels[*(layers_data + i) -1 ][ *(columns_data + i) -1 ] += 1;
+    // NOTE: One column at a time, each column only visits its own voxels.
+    vector<double> numb_voxels(nr_layers), mean_val(nr_layers);
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        if (index.labels[n] <= 0) continue;
+        std::fill(mean_val.begin(), mean_val.end(), 0.);
+        std::fill(numb_voxels.begin(), numb_voxels.end(), 0.);
+        for (uint32_t k = index.start[n]; k != index.start[n + 1]; ++k) {
+            const uint32_t voxi = index.voxels[k];
+            if (*(layers_data + voxi) > 0) {
+                mean_val   [*(layers_data + voxi) - 1] += *(nii_input_data + voxi);
+                numb_voxels[*(layers_data + voxi) - 1] += 1;
+            }
         }
-    }
-
-    for (int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j < nr_columns; j++) {
-            if (numb_voxels[i][j] != 0){
-                mean_val[i][j] /= (float)numb_voxels[i][j] ;
-               // cout << "layer " << i+1 << " and column " << j+1 << " has value " << mean_val[i][j] << endl;
+        for (int i = 0; i < nr_layers; i++) {
+            if (numb_voxels[i] != 0){
+                mean_val[i] /= (float)numb_voxels[i] ;
             }
         }
-    }
 
-    // ========================================================================
-    // Fill average results into layer dimension file
-    // ========================================================================
-    for (int voxi = 0; voxi < nr_voxels; voxi++) {
-        if ( *(columns_data + voxi) !=0 && *(layers_data + voxi) != 0){
-            for (int l = 0; l < nr_layers; ++l) {
-                *(layerdim_data + nr_voxels * l + voxi) = mean_val[ l ][ *(columns_data + voxi) - 1 ] ;
+        // Fill average results into layer dimension file
+        for (uint32_t k = index.start[n]; k != index.start[n + 1]; ++k) {
+            const uint32_t voxi = index.voxels[k];
+            if (*(layers_data + voxi) > 0) {
+                for (int l = 0; l < nr_layers; ++l) {
+                    *(layerdim_data + nr_voxels * l + voxi) = mean_val[l];
+                }
             }
-            // *(layerdim_data + nr_voxels * 0 + voxi) = voxi;
         }
     }
 
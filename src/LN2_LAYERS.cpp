@@ -53,6 +53,22 @@ int show_help(void) {
     "                    output is given with file name addition `*layers_equicount*.\n"
     "                    Useful for ~0.8 mm inputs where no upsampling is done.\n"
     "    -no_smooth    : (Optional) Disable smoothing on cortical depth metric.\n"
+    "    -geometry_cache: (Optional) Save middle gray matter clusters and the\n"
+    "                    middle gray matter voxel each gray matter voxel is\n"
+    "                    reached from in a file next to the rim file (named\n"
+    "                    '*_geometry.bin'). LN2_COLUMNS and LN2_MULTILATERATE\n"
+    "                    load it with their '-geometry_cache' option. The\n"
+    "                    cached middle gray matter is 'midGM_equivol' when\n"
+    "                    '-equivol' is used, 'midGM_equidist' otherwise.\n"
+    "                    LN2_COLUMNS reuses the clusters. LN2_MULTILATERATE\n"
+    "                    reuses the Voronoi cells only when its control point\n"
+    "                    file has exactly this middle gray matter. Distances,\n"
+    "                    anchor ids and curvature are not cached because\n"
+    "                    neither program uses them.\n"
+    "    -threads      : (Optional) Number of threads. Default is 1. Inner and\n"
+    "                    outer gray matter growth run concurrently and per-voxel\n"
+    "                    stages are split across threads. Outputs are identical\n"
+    "                    to the single threaded run.\n"
     "    -debug        : (Optional) Save extra intermediate outputs.\n"
     "    -output       : (Optional) Output basename for all outputs.\n"
     "\n"
@@ -71,9 +87,11 @@ int main(int argc, char*  argv[]) {
     char *fin = NULL, *fout = NULL;
     uint16_t ac, nr_layers = 3;
     uint16_t iter_smooth = 100;
+    int nr_threads = 1;
     bool mode_equivol = false, mode_debug = false, mode_incl_borders = false;
     bool mode_curvature =false, mode_streamlines = false, mode_smooth = true;
     bool mode_thickness = false, mode_equal_counts = false;
+    bool mode_geometry_cache = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -119,6 +137,14 @@ int main(int argc, char*  argv[]) {
             mode_equal_counts = true;
         } else if (!strcmp(argv[ac], "-no_smooth")) {
             mode_smooth = false;
+        } else if (!strcmp(argv[ac], "-geometry_cache")) {
+            mode_geometry_cache = true;
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+            } else {
+                nr_threads = std::max(1, atoi(argv[ac]));
+            }
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else {
@@ -140,37 +166,27 @@ int main(int argc, char*  argv[]) {
     }
 
     log_welcome("LN2_LAYERS");
+    set_async_output(true);  // Keep computing while outputs are written
     log_nifti_descriptives(nii1);
 
     cout << "  Nr. layers: " << nr_layers << endl;
+    cout << "  Nr. threads: " << nr_threads << endl;
 
     // Get dimensions of input
     const uint32_t size_x = nii1->nx;
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     const float dX = nii1->pixdim[1];
     const float dY = nii1->pixdim[2];
     const float dZ = nii1->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_rim = copy_nifti_as_int16(nii1);
-    int16_t* nii_rim_data = static_cast<int16_t*>(nii_rim->data);
-    free(nii1);
+    nifti_image* nii_rim = nii1;
+    int16_t* nii_rim_data = nifti_data_as<int16_t>(nii_rim);
 
     // ------------------------------------------------------------------------
     // NOTE(Faruk): This section is written to constrain voxel visits
@@ -204,13 +220,13 @@ int main(int argc, char*  argv[]) {
         *(nii_layers_data + i) = 0;
     }
 
-    nifti_image* innerGM_step = copy_nifti_as_int16(nii_layers);
-    int16_t* innerGM_step_data = static_cast<int16_t*>(innerGM_step->data);
+    nifti_image* innerGM_step = copy_nifti_as_int32(nii_layers);
+    int32_t* innerGM_step_data = static_cast<int32_t*>(innerGM_step->data);
     nifti_image* innerGM_dist = copy_nifti_as_float32(nii_layers);
     float* innerGM_dist_data = static_cast<float*>(innerGM_dist->data);
 
-    nifti_image* outerGM_step = copy_nifti_as_int16(nii_layers);
-    int16_t* outerGM_step_data = static_cast<int16_t*>(outerGM_step->data);
+    nifti_image* outerGM_step = copy_nifti_as_int32(nii_layers);
+    int32_t* outerGM_step_data = static_cast<int32_t*>(outerGM_step->data);
     nifti_image* outerGM_dist = copy_nifti_as_float32(nii_layers);
     float* outerGM_dist_data = static_cast<float*>(outerGM_dist->data);
 
@@ -247,859 +263,105 @@ int main(int argc, char*  argv[]) {
     float* curvature_data = static_cast<float*>(curvature->data);
 
     // ========================================================================
-    // Grow from WM
+    // Grow from WM and CSF
     // ========================================================================
-    cout << "\n  Start growing from inner GM (WM-facing border)..." << endl;
-
-    // Initialize grow volume
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
+    // Inner GM border voxels are the seeds growing into GM and outer border.
+    // Outer GM border voxels are the seeds growing into GM and inner border.
+    vector<uint8_t> domain_inner(nr_voxels, 0), domain_outer(nr_voxels, 0);
+    vector<uint32_t> seeds_inner, seeds_outer;
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        uint32_t i = *(voi_id + ii);
         if (*(nii_rim_data + i) == 2) {  // WM boundary voxels within GM
-            *(innerGM_step_data + i) = 1;
-            *(innerGM_dist_data + i) = 0.;
-            *(innerGM_id_data + i) = i;
-        } else {
-            *(innerGM_step_data + i) = 0.;
-            *(innerGM_dist_data + i) = 0.;
+            seeds_inner.push_back(i);
+            domain_outer[i] = 1;
+        } else if (*(nii_rim_data + i) == 1) {  // CSF boundary voxels within GM
+            seeds_outer.push_back(i);
+            domain_inner[i] = 2;  // Not entered through the -x face
+        } else if (*(nii_rim_data + i) == 3) {
+            domain_inner[i] = 1;
+            domain_outer[i] = 1;
         }
     }
 
-    uint16_t grow_step = 1;
-    uint32_t voxel_counter = nr_voxels;
-    uint32_t ix, iy, iz, j, k;
-    float d;
-    while (voxel_counter != 0) {
-        voxel_counter = 0;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            uint32_t i = *(voi_id + ii);
-
-            if (*(innerGM_step_data + i) == grow_step) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3) {
-                        d = *(innerGM_dist_data + i) + dX;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dX;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dY;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dY;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dZ;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dZ;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 3-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-            }
-        }
-        grow_step += 1;
+    auto grow_inner = [&]() {
+        grow_geodesic(domain_inner.data(), seeds_inner, size_x, size_y, size_z,
+                      dX, dY, dZ, innerGM_step_data, innerGM_dist_data,
+                      innerGM_id_data, innerGM_prevstep_id_data, true);
+    };
+    auto grow_outer = [&]() {
+        grow_geodesic(domain_outer.data(), seeds_outer, size_x, size_y, size_z,
+                      dX, dY, dZ, outerGM_step_data, outerGM_dist_data,
+                      outerGM_id_data, outerGM_prevstep_id_data);
+    };
+
+    if (nr_threads > 1) {
+        // NOTE: Both fronts only read the rim and write their own outputs
+        cout << "\n  Start growing from inner GM (WM-facing border) and outer GM"
+             << " in parallel..." << endl;
+        std::thread thread_outer(grow_outer);
+        grow_inner();
+        thread_outer.join();
+    } else {
+        cout << "\n  Start growing from inner GM (WM-facing border)..." << endl;
+        grow_inner();
+        cout << "\n  Start growing from outer GM..." << endl;
+        grow_outer();
     }
+    domain_inner.clear();
+    domain_inner.shrink_to_fit();
+    domain_outer.clear();
+    domain_outer.shrink_to_fit();
+
     if (mode_debug) {
+        // Steps are saved as int16 like before (they are not used anymore)
+        nifti_data_as<int16_t>(innerGM_step);
+        nifti_data_as<int16_t>(outerGM_step);
         save_output_nifti(fout, "innerGM_step", innerGM_step, false);
         save_output_nifti(fout, "innerGM_dist", innerGM_dist, false);
         save_output_nifti(fout, "innerGM_id", innerGM_id, false);
+        save_output_nifti(fout, "outerGM_step", outerGM_step, false);
+        save_output_nifti(fout, "outerGM_dist", outerGM_dist, false);
+        save_output_nifti(fout, "outerGM_id", outerGM_id, false);
     }
+    nifti_image_free(innerGM_step);
+    nifti_image_free(outerGM_step);
 
     // ========================================================================
-    // Grow from CSF
+    // Layers
     // ========================================================================
-    cout << "\n  Start growing from outer GM..." << endl;
-
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_rim_data + i) == 1) {
-            *(outerGM_step_data + i) = 1.;
-            *(outerGM_dist_data + i) = 0.;
-            *(outerGM_id_data + i) = i;
-        } else {
-            *(outerGM_step_data + i) = 0.;
-            *(outerGM_dist_data + i) = 0.;
-        }
-    }
+    cout << "\n  Start layering (equi-distant)..." << endl;
+    uint32_t j, k;
+    float x, y, z;
 
-    grow_step = 1, voxel_counter = nr_voxels;
-    while (voxel_counter != 0) {
-        voxel_counter = 0;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+    parallel_for(nr_voi, nr_threads, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t ii = begin; ii != end; ++ii) {
             uint32_t i = *(voi_id + ii);
 
-            if (*(outerGM_step_data + i) == grow_step) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dX;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dX;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dY;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dY;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dZ;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dZ;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
+            if (*(nii_rim_data + i) == 3) {
+                // // Normalize distance
+                // float dist1 = dist(x, y, z, wm_x, wm_y, wm_z, dX, dY, dZ);
+                // float dist2 = dist(x, y, z, gm_x, gm_y, gm_z, dX, dY, dZ);
+                // float dist_normalized = dist1 / (dist1 + dist2);
 
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
+                // Normalize distance (completely discrete)
+                float dist1 = *(innerGM_dist_data + i);
+                float dist2 = *(outerGM_dist_data + i);
+                float total_dist = dist1 + dist2;;
+                float dist_normalized = dist1 / total_dist;
 
-                // ------------------------------------------------------------
-                // 3-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
+                // To export equi-distant metric in a simple 0-1 range
+                *(normdist_data + i) = dist_normalized;
+                // Difference of normalized distances
+                *(normdistdiff_data + i) = (dist1 - dist2) / total_dist;
             }
         }
-        grow_step += 1;
-    }
-    if (mode_debug) {
-        save_output_nifti(fout, "outerGM_step", outerGM_step, false);
-        save_output_nifti(fout, "outerGM_dist", outerGM_dist, false);
-        save_output_nifti(fout, "outerGM_id", outerGM_id, false);
-    }
-
-    // ========================================================================
-    // Layers
-    // ========================================================================
-    cout << "\n  Start layering (equi-distant)..." << endl;
-    float x, y, z, wm_x, wm_y, wm_z, gm_x, gm_y, gm_z;
+    });
 
+    // Count inner and outer GM anchor voxels
+    // NOTE: Kept serial as many voxels write to the same anchor
     for (uint32_t ii = 0; ii != nr_voi; ++ii) {
         uint32_t i = *(voi_id + ii);
-
         if (*(nii_rim_data + i) == 3) {
-            tie(x, y, z) = ind2sub_3D(i, size_x, size_y);
-            tie(wm_x, wm_y, wm_z) = ind2sub_3D(*(innerGM_id_data + i),
-                                               size_x, size_y);
-            tie(gm_x, gm_y, gm_z) = ind2sub_3D(*(outerGM_id_data + i),
-                                               size_x, size_y);
-
-            // // Normalize distance
-            // float dist1 = dist(x, y, z, wm_x, wm_y, wm_z, dX, dY, dZ);
-            // float dist2 = dist(x, y, z, gm_x, gm_y, gm_z, dX, dY, dZ);
-            // float dist_normalized = dist1 / (dist1 + dist2);
-
-            // Normalize distance (completely discrete)
-            float dist1 = *(innerGM_dist_data + i);
-            float dist2 = *(outerGM_dist_data + i);
-            float total_dist = dist1 + dist2;;
-            float dist_normalized = dist1 / total_dist;
-
-            // To export equi-distant metric in a simple 0-1 range
-            *(normdist_data + i) = dist_normalized;
-            // Difference of normalized distances
-            *(normdistdiff_data + i) = (dist1 - dist2) / total_dist;
-
-            // Count inner and outer GM anchor voxels
             j = *(innerGM_id_data + i);
             *(hotspots_data + j) += 1;
             j = *(outerGM_id_data + i);
@@ -1136,7 +398,7 @@ int main(int argc, char*  argv[]) {
                 *(temp_mask_data + i) = 1;
             }
         }
-        normdist = iterative_smoothing(normdist, 3, temp_mask, 1);
+        normdist = iterative_smoothing(normdist, 3, temp_mask, 1, nr_threads);
         normdist_data = static_cast<float*>(normdist->data);
         free(temp_mask_data);
         free(temp_mask);
@@ -1184,6 +446,7 @@ int main(int argc, char*  argv[]) {
             }
         }
         save_output_nifti(fout, "layers_equicount", nii_binlayers);
+        nifti_image_free(nii_binlayers);
     }
 
     // ------------------------------------------------------------------------
@@ -1280,30 +543,33 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Columns
     // ========================================================================
-    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-        uint32_t i = *(voi_id + ii);
+    parallel_for(nr_voi, nr_threads, [&](uint32_t begin, uint32_t end) {
+        uint32_t j, k;
+        for (uint32_t ii = begin; ii != end; ++ii) {
+            uint32_t i = *(voi_id + ii);
 
-        if (*(nii_rim_data + i) == 3) {
-            // Approximate curvature measurement per column/streamline
-            j = *(innerGM_id_data + i);
-            k = *(outerGM_id_data + i);  // These values are negative
-            *(curvature_data + i) = *(hotspots_data + j) + *(hotspots_data + k);
-            *(curvature_data + i) /=
-                max(*(hotspots_data + j), -*(hotspots_data + k));  // normalize
-
-            // Re-assign mid-GM id based on curvature
-            if (*(curvature_data + i) >= 0) {  // Gyrus
-                *(nii_columns_data + i) = j;
-            } else {
-                *(nii_columns_data + i) = k;
-            }
+            if (*(nii_rim_data + i) == 3) {
+                // Approximate curvature measurement per column/streamline
+                j = *(innerGM_id_data + i);
+                k = *(outerGM_id_data + i);  // These values are negative
+                *(curvature_data + i) = *(hotspots_data + j) + *(hotspots_data + k);
+                *(curvature_data + i) /=
+                    max(*(hotspots_data + j), -*(hotspots_data + k));  // normalize
+
+                // Re-assign mid-GM id based on curvature
+                if (*(curvature_data + i) >= 0) {  // Gyrus
+                    *(nii_columns_data + i) = j;
+                } else {
+                    *(nii_columns_data + i) = k;
+                }
 
-            // MiddleGM ids are used to find centroids in the next step
-            if (*(midGM_data + i) == 1) {
-                *(midGM_id_data + i) = *(nii_columns_data + i);
+                // MiddleGM ids are used to find centroids in the next step
+                if (*(midGM_data + i) == 1) {
+                    *(midGM_id_data + i) = *(nii_columns_data + i);
+                }
             }
         }
-    }
+    });
     if (mode_debug) {
         save_output_nifti(fout, "curvature_init", curvature, false);
     }
@@ -1379,6 +645,11 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "midGM_equidist_id", midGM_id, false);
         save_output_nifti(fout, "columns", midGM_centroid_id, false);
     }
+    nifti_image_free(coords_x);
+    nifti_image_free(coords_y);
+    nifti_image_free(coords_z);
+    nifti_image_free(coords_count);
+    nifti_image_free(centroid);
 
     // ========================================================================
     // Equi-volume layers
@@ -1440,26 +711,29 @@ int main(int argc, char*  argv[]) {
             *(equivol_factors_data + i) = 0;
         }
 
-        float w;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            uint32_t i = *(voi_id + ii);
+        parallel_for(nr_voi, nr_threads, [&](uint32_t begin, uint32_t end) {
+            uint32_t j, k;
+            float w;
+            for (uint32_t ii = begin; ii != end; ++ii) {
+                uint32_t i = *(voi_id + ii);
 
-            if (*(nii_rim_data + i) == 3) {
-                // Find mass at each end of the given column
-                j = *(innerGM_id_data + i);
-                k = *(outerGM_id_data + i);
-                if (*(curvature_data + i) == 0) {
-                    w = 0.5;
-                } else if (*(curvature_data + i) < 0) {
-                    w = *(hotspots_i_data + k)
-                        / (*(hotspots_i_data + k) + *(hotspots_o_data + k));
-                } else if (*(curvature_data + i) > 0) {
-                    w = *(hotspots_i_data + j)
-                        / (*(hotspots_i_data + j) + *(hotspots_o_data + j));
+                if (*(nii_rim_data + i) == 3) {
+                    // Find mass at each end of the given column
+                    j = *(innerGM_id_data + i);
+                    k = *(outerGM_id_data + i);
+                    if (*(curvature_data + i) == 0) {
+                        w = 0.5;
+                    } else if (*(curvature_data + i) < 0) {
+                        w = *(hotspots_i_data + k)
+                            / (*(hotspots_i_data + k) + *(hotspots_o_data + k));
+                    } else if (*(curvature_data + i) > 0) {
+                        w = *(hotspots_i_data + j)
+                            / (*(hotspots_i_data + j) + *(hotspots_o_data + j));
+                    }
+                    *(equivol_factors_data + i) = w;
                 }
-                *(equivol_factors_data + i) = w;
             }
-        }
+        });
 
         if (mode_debug) {
             save_output_nifti(fout, "equivol_factors", equivol_factors, false);
@@ -1471,7 +745,7 @@ int main(int argc, char*  argv[]) {
         cout << "\n  Start smoothing equi-volume transitions..." << endl;
 
         nifti_image* equivol_factors_smooth = iterative_smoothing(
-            equivol_factors, iter_smooth, nii_rim, 3);
+            equivol_factors, iter_smooth, nii_rim, 3, nr_threads);
         float* equivol_factors_smooth_data = static_cast<float*>(equivol_factors_smooth->data);
         free(equivol_factors);
 
@@ -1483,35 +757,37 @@ int main(int argc, char*  argv[]) {
         // Apply equi-volume factors
         // --------------------------------------------------------------------
         cout << "\n  Start final layering..." << endl;
-        float d1_new, d2_new, a, b;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            uint32_t i = *(voi_id + ii);
+        parallel_for(nr_voi, nr_threads, [&](uint32_t begin, uint32_t end) {
+            float d1_new, d2_new, a, b;
+            for (uint32_t ii = begin; ii != end; ++ii) {
+                uint32_t i = *(voi_id + ii);
 
-            if (*(nii_rim_data + i) == 3) {
-                // Find normalized distances from a given point on a column
-                float dist1 = *(innerGM_dist_data + i);
-                float dist2 = *(outerGM_dist_data + i);
-                float total_dist = dist1 + dist2;;
-                dist1 /= total_dist;
-                dist2 /= total_dist;
+                if (*(nii_rim_data + i) == 3) {
+                    // Find normalized distances from a given point on a column
+                    float dist1 = *(innerGM_dist_data + i);
+                    float dist2 = *(outerGM_dist_data + i);
+                    float total_dist = dist1 + dist2;;
+                    dist1 /= total_dist;
+                    dist2 /= total_dist;
 
-                a = *(equivol_factors_smooth_data + i);
-                b = 1 - a;
+                    a = *(equivol_factors_smooth_data + i);
+                    b = 1 - a;
 
-                // Perturb using masses to modify distances in simplex space
-                tie(d1_new, d2_new) = simplex_perturb_2D(dist1, dist2, a, b);
+                    // Perturb using masses to modify distances in simplex space
+                    tie(d1_new, d2_new) = simplex_perturb_2D(dist1, dist2, a, b);
 
-                // Difference of normalized distances (used in finding midGM)
-                *(normdistdiff_data + i) = d1_new - d2_new;
+                    // Difference of normalized distances (used in finding midGM)
+                    *(normdistdiff_data + i) = d1_new - d2_new;
 
-                // // Cast distances to integers as number of desired layers
-                // if (d1_new != 0 && isfinite(d1_new)) {
-                //     *(nii_layers_data + i) =  ceil(nr_layers * d1_new);
-                // } else {
-                //     *(nii_layers_data + i) = 1;
-                // }
+                    // // Cast distances to integers as number of desired layers
+                    // if (d1_new != 0 && isfinite(d1_new)) {
+                    //     *(nii_layers_data + i) =  ceil(nr_layers * d1_new);
+                    // } else {
+                    //     *(nii_layers_data + i) = 1;
+                    // }
+                }
             }
-        }
+        });
 
         save_output_nifti(fout, "layers_equivol", nii_layers, true);
 
@@ -1553,7 +829,8 @@ int main(int argc, char*  argv[]) {
                     *(temp_mask_data + i) = 1;
                 }
             }
-            normdistdiff = iterative_smoothing(normdistdiff, 3, temp_mask, 1);
+            normdistdiff = iterative_smoothing(normdistdiff, 3, temp_mask, 1,
+                                               nr_threads);
             normdistdiff_data = static_cast<float*>(normdistdiff->data);
             free(temp_mask_data);
             free(temp_mask);
@@ -1600,6 +877,7 @@ int main(int argc, char*  argv[]) {
                 }
             }
             save_output_nifti(fout, "layerbins_equivol", nii_bineqlayers);
+            nifti_image_free(nii_bineqlayers);
         }
 
         // --------------------------------------------------------------------
@@ -1720,7 +998,7 @@ int main(int argc, char*  argv[]) {
         }
 
         nifti_image* thickness = iterative_smoothing(
-            innerGM_dist, iter_smooth, temp_mask, 1);
+            innerGM_dist, iter_smooth, temp_mask, 1, nr_threads);
         float* thickness_data = static_cast<float*>(thickness->data);
         free(temp_mask_data);
         free(temp_mask);
@@ -1761,53 +1039,56 @@ int main(int argc, char*  argv[]) {
         svec->scl_slope = 1;
         float* svec_data = static_cast<float*>(svec->data);
 
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            uint32_t i = *(voi_id + ii);
+        parallel_for(nr_voi, nr_threads, [&](uint32_t begin, uint32_t end) {
+            float x, y, z, wm_x, wm_y, wm_z, gm_x, gm_y, gm_z;
+            for (uint32_t ii = begin; ii != end; ++ii) {
+                uint32_t i = *(voi_id + ii);
 
-            if (*(nii_rim_data + i) == 3) {
-                tie(x, y, z) = ind2sub_3D(i, size_x, size_y);
-                tie(wm_x, wm_y, wm_z) = ind2sub_3D(*(innerGM_id_data + i),
-                                                   size_x, size_y);
-                tie(gm_x, gm_y, gm_z) = ind2sub_3D(*(outerGM_id_data + i),
-                                                   size_x, size_y);
-
-                // Vector 1 [white matter to center]
-                float vec1_x = x - wm_x;
-                float vec1_y = y - wm_y;
-                float vec1_z = z - wm_z;
-                // Vector 2 [center to gray matter]
-                float vec2_x = gm_x - x;
-                float vec2_y = gm_y - y;
-                float vec2_z = gm_z - z;
-                // Average (smoother curv in streamlines)
-                float svec_x = (vec1_x + vec2_x) / 2;
-                float svec_y = (vec1_y + vec2_y) / 2;
-                float svec_z = (vec1_z + vec2_z) / 2;
-                // Normalize with norm
-                float svec_norm = sqrt(svec_x * svec_x + svec_y * svec_y + svec_z * svec_z);
-                if (svec_norm > 0) {
-                    svec_x /= svec_norm;
-                    svec_y /= svec_norm;
-                    svec_z /= svec_norm;
+                if (*(nii_rim_data + i) == 3) {
+                    tie(x, y, z) = ind2sub_3D(i, size_x, size_y);
+                    tie(wm_x, wm_y, wm_z) = ind2sub_3D(*(innerGM_id_data + i),
+                                                       size_x, size_y);
+                    tie(gm_x, gm_y, gm_z) = ind2sub_3D(*(outerGM_id_data + i),
+                                                       size_x, size_y);
+
+                    // Vector 1 [white matter to center]
+                    float vec1_x = x - wm_x;
+                    float vec1_y = y - wm_y;
+                    float vec1_z = z - wm_z;
+                    // Vector 2 [center to gray matter]
+                    float vec2_x = gm_x - x;
+                    float vec2_y = gm_y - y;
+                    float vec2_z = gm_z - z;
+                    // Average (smoother curv in streamlines)
+                    float svec_x = (vec1_x + vec2_x) / 2;
+                    float svec_y = (vec1_y + vec2_y) / 2;
+                    float svec_z = (vec1_z + vec2_z) / 2;
+                    // Normalize with norm
+                    float svec_norm = sqrt(svec_x * svec_x + svec_y * svec_y + svec_z * svec_z);
+                    if (svec_norm > 0) {
+                        svec_x /= svec_norm;
+                        svec_y /= svec_norm;
+                        svec_z /= svec_norm;
+                    }
+                    // Put vector components into nifti
+                    *(svec_data + nr_voxels*0 + i) = svec_x;
+                    *(svec_data + nr_voxels*1 + i) = svec_y;
+                    *(svec_data + nr_voxels*2 + i) = svec_z;
+
+                    // Angular difference
+                    // float ref_x = 0, ref_y = 0, ref_z = 1;
+                    // float temp_dot = ref_x * vec_x + ref_y * vec_y + ref_z * vec_z;
+                    // float term1 = ref_x * ref_x + ref_y * ref_y + ref_z * ref_z;
+                    // float term2 = vec_x * vec_x + vec_y * vec_y + vec_z * vec_z;
+                    // float temp_angle = std::acos(temp_dot / std::sqrt(term1 * term2));
+                    // *(curvature_data + i) = temp_angle * 180 / PI;
+                    // ----------------------------------------------------------------
                 }
-                // Put vector components into nifti
-                *(svec_data + nr_voxels*0 + i) = svec_x;
-                *(svec_data + nr_voxels*1 + i) = svec_y;
-                *(svec_data + nr_voxels*2 + i) = svec_z;
-
-                // Angular difference
-                // float ref_x = 0, ref_y = 0, ref_z = 1;
-                // float temp_dot = ref_x * vec_x + ref_y * vec_y + ref_z * vec_z;
-                // float term1 = ref_x * ref_x + ref_y * ref_y + ref_z * ref_z;
-                // float term2 = vec_x * vec_x + vec_y * vec_y + vec_z * vec_z;
-                // float temp_angle = std::acos(temp_dot / std::sqrt(term1 * term2));
-                // *(curvature_data + i) = temp_angle * 180 / PI;
-                // ----------------------------------------------------------------
             }
-        }
+        });
         // --------------------------------------------------------------------
         cout << "\n  Start smoothing streamline vector components..." << endl;
-        svec = iterative_smoothing(svec, iter_smooth, nii_rim, 3);
+        svec = iterative_smoothing(svec, iter_smooth, nii_rim, 3, nr_threads);
         // --------------------------------------------------------------------
         save_output_nifti(fout, "streamline_vectors", svec, true);
         free(svec);
@@ -1833,7 +1114,7 @@ int main(int argc, char*  argv[]) {
         cout << "\n  Start smoothing curvature..." << endl;
 
         nifti_image* curvature_smooth = iterative_smoothing(
-            curvature, iter_smooth, nii_rim, 3);
+            curvature, iter_smooth, nii_rim, 3, nr_threads);
         float* curvature_smooth_data = static_cast<float*>(curvature_smooth->data);
 
         save_output_nifti(fout, "curvature", curvature_smooth, true);
@@ -1864,6 +1145,55 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "curvature_binned", nii_columns, true);
     }
 
+    // ========================================================================
+    // Geometry cache
+    // ========================================================================
+    if (mode_geometry_cache) {
+        cout << "\n  Start preparing geometry cache..." << endl;
+        GeometryCache geometry;
+        geometry.size_x = size_x;
+        geometry.size_y = size_y;
+        geometry.size_z = size_z;
+        geometry.midgm_equivol = mode_equivol;
+        geometry.midgm_iter_smooth = iter_smooth;
+        geometry.midgm_incl_borders = mode_incl_borders;
+
+        // Middle GM clusters, as found by LN2_COLUMNS
+        vector<uint8_t> midgm_mask(nr_voxels, 0), rim_class(nr_voxels, 0);
+        vector<uint32_t> midgm_seeds;
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            uint32_t i = *(voi_id + ii);
+            rim_class[i] = *(nii_rim_data + i) == 3 ? 1 : 2;
+            if (*(midGM_data + i) == 1) {
+                midgm_mask[i] = 1;
+                if (*(nii_rim_data + i) == 3) {
+                    midgm_seeds.push_back(i);
+                }
+            }
+        }
+        geometry.midgm.resize(nr_voxels);
+        label_connected_clusters(midgm_mask.data(), size_x, size_y, size_z,
+                                 geometry.midgm.data());
+
+        // Middle GM voxel reached by each pure GM voxel, as in the final
+        // Voronoi propagation of LN2_MULTILATERATE
+        vector<int32_t> voronoi_step(nr_voxels);
+        vector<float> voronoi_dist(nr_voxels);
+        geometry.midgm_anchor.resize(nr_voxels);
+        grow_voronoi(rim_class.data(), midgm_seeds, size_x, size_y, size_z,
+                     dX, dY, dZ, 1, voronoi_step.data(), voronoi_dist.data(),
+                     geometry.midgm_anchor.data());
+
+        const string cache_path = geometry_cache_path(fin);
+        if (geometry_cache_save(cache_path, geometry_cache_key(fin), geometry)) {
+            cout << "  Saved geometry cache as:\n    " << cache_path << endl;
+            cout << "    Middle gray matter: " << geometry_cache_midgm_name(geometry) << endl;
+        } else {
+            cout << "  WARNING: Could not save geometry cache as:\n    " << cache_path << endl;
+        }
+    }
+
+    wait_for_outputs();
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -136,10 +136,10 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
-    float* nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* columns = copy_nifti_as_int16(nii2);
-    int16_t* columns_data = static_cast<int16_t*>(columns->data);
+    nifti_image* nii_input = nii1;
+    float* nii_input_data = nifti_data_as<float>(nii_input);
+    nifti_image* columns = nii2;
+    int16_t* columns_data = nifti_data_as<int16_t>(columns);
 
     // ========================================================================
     // Make sure there is nothing weird with the slope of the nifti header
@@ -152,25 +152,18 @@ int main(int argc, char*  argv[]) {
     }
 
     // ========================================================================
-    // Allocate array based on how many layers and columns we have
+    // Group voxels by column
     // ========================================================================
+    LabelIndex index;
+    label_index_build(index, columns_data, size_x, size_y, size_z);
+    const uint32_t nr_labels = index.labels.size();
+
     int nr_columns = 0;
-    for (int i = 0; i != nr_voxels; ++i) {
-        if (*(columns_data + i) >= nr_columns){
-            nr_columns = *(columns_data + i);
-        }
+    if (nr_labels > 0 && index.labels.back() > 0) {
+        nr_columns = index.labels.back();
     }
     cout << "    There are " << nr_columns<< " columns, total. " << endl << endl;
 
-    double numb_voxels[nr_columns] ;
-    bool  thresh_exeed[nr_columns] ;
-    double mean_val[nr_columns] ;
-    for (int j = 0; j < nr_columns; j++) {
-        mean_val   [j] = 0.;
-        numb_voxels[j] = 0.;
-        thresh_exeed[j] = false;
-    }
-
     // ========================================================================
     // considering necative activation too
     // ========================================================================
@@ -181,39 +174,29 @@ int main(int argc, char*  argv[]) {
     }
 
     // ========================================================================
-    // Thresholding each column based on its maximally activated voxel
+    // Threshold each column
     // ========================================================================
-    if (mode_max) {
-        for (int i = 0; i != nr_voxels; ++i) {
-            if (*(nii_input_data + i) * nii_input->scl_slope  >= thresh){
-                thresh_exeed [*(columns_data + i)-1] = true ;
+    // NOTE: Either based on its maximally activated voxel or on the mean
+    // activated signal within the column.
+    vector<bool> thresh_exeed(nr_labels, false);
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        if (index.labels[n] <= 0) continue;
+        if (mode_max) {
+            for (uint32_t k = index.start[n]; k != index.start[n + 1]; ++k) {
+                if (*(nii_input_data + index.voxels[k]) * nii_input->scl_slope >= thresh) {
+                    thresh_exeed[n] = true;
+                    break;
+                }
             }
         }
-    }
-
-    // ========================================================================
-    // Threshold each column based on mean activated signal within
-    // ========================================================================
-    if (mode_mean) {
-
-        // ====================================================================
-        // average within columns and see if average is above threshold
-        // ====================================================================
-        for (int i = 0; i != nr_voxels; ++i) {
-            if ( *(columns_data + i) > 0 ){
-                mean_val   [ *(columns_data + i) -1 ] += *(nii_input_data + i) ;
-                numb_voxels[ *(columns_data + i) -1 ] += 1;
-            }
-        }
-
-        for (int j = 0; j < nr_columns; j++) {
-            if (numb_voxels[j] != 0){
-                mean_val[j] /= (float)numb_voxels[j] ;
-                // cout << "layer " << i+1 << " and column " << j+1 << " has value " << mean_val[i][j] << endl;
+        if (mode_mean) {
+            double mean_val = 0.;
+            for (uint32_t k = index.start[n]; k != index.start[n + 1]; ++k) {
+                mean_val += *(nii_input_data + index.voxels[k]);
             }
-
-            if (mean_val[j] >= thresh){
-                thresh_exeed [j] = true ;
+            mean_val /= (float)(index.start[n + 1] - index.start[n]);
+            if (mean_val >= thresh) {
+                thresh_exeed[n] = true;
             }
         }
     }
@@ -227,12 +210,14 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Set all voxels in columns that have been selected
     // ========================================================================
-    for (int i = 0; i < nr_voxels; ++i) {
-        if ( (thresh_exeed [*(columns_data + i) - 1] == true ) && *(columns_data + i) > 0 ){
-           *(mask_data + i) =  1;
-       } else {
-           *(columns_data + i) = 0;  // Also provide masked columns
-       }
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        for (uint32_t k = index.start[n]; k != index.start[n + 1]; ++k) {
+            if (thresh_exeed[n]) {
+                *(mask_data + index.voxels[k]) = 1;
+            } else {
+                *(columns_data + index.voxels[k]) = 0;  // Also provide masked columns
+            }
+        }
     }
 
     // ========================================================================
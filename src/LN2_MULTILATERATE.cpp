@@ -34,6 +34,15 @@ int show_help(void) {
     "    -incl_borders   : (Conditional) Include borders as if they are labeled with 3.\n"
     "    -norms          : (Optional) Save L2 and Linf norm of the UV coordinates.\n"
     "    -angles         : (Optional) Save angles in radians and 4 quadrants.\n"
+    "    -geometry_cache : (Optional) Load the geometry cache saved by\n"
+    "                      'LN2_LAYERS -geometry_cache' for the same rim file.\n"
+    "                      Its Voronoi cells replace the final Voronoi\n"
+    "                      propagation only when the middle gray matter voxels\n"
+    "                      that get coordinates (within '-radius' of control\n"
+    "                      point 0) match the cached middle gray matter exactly.\n"
+    "                      Otherwise the number of differing voxels is printed\n"
+    "                      and the cells are recomputed.\n"
+    "                      Not used together with '-incl_borders'.\n"
     "    -debug          : (Optional) Save extra intermediate outputs.\n"
     "    -output         : (Optional) Output basename for all outputs.\n"
     "\n"
@@ -58,7 +67,7 @@ int main(int argc, char*  argv[]) {
     float thr_radius = 10;
     int ac;
     bool mode_debug = false, mode_mask=true, mode_incl_borders = false;
-    bool mode_norms = false, mode_angles=false;
+    bool mode_norms = false, mode_angles=false, mode_geometry_cache = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -92,6 +101,8 @@ int main(int argc, char*  argv[]) {
             mode_norms = true;
         } else if (!strcmp(argv[ac], "-angles")) {
             mode_angles = true;
+        } else if (!strcmp(argv[ac], "-geometry_cache")) {
+            mode_geometry_cache = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -128,9 +139,33 @@ int main(int argc, char*  argv[]) {
     }
 
     log_welcome("LN2_MULTILATERATE");
+    set_async_output(true);  // Keep computing while outputs are written
     log_nifti_descriptives(nii1);
     log_nifti_descriptives(nii2);
 
+    // NOTE: Cached Voronoi cells are grown within the unmodified rim labels
+    GeometryCache geometry;
+    bool geometry_loaded = false;
+    if (mode_geometry_cache && mode_incl_borders) {
+        cout << "  WARNING: Geometry cache is ignored with '-incl_borders'." << endl;
+    } else if (mode_geometry_cache) {
+        string cache_path = geometry_cache_path(fin1);
+        geometry_loaded = geometry_cache_load(cache_path, geometry_cache_key(fin1), geometry);
+        if (!geometry_loaded) {
+            cout << "  WARNING: Geometry cache is ignored, missing or outdated for the rim file:\n    "
+                 << cache_path << endl;
+        } else if (geometry.size_x != static_cast<uint32_t>(nii1->nx)
+                   || geometry.size_y != static_cast<uint32_t>(nii1->ny)
+                   || geometry.size_z != static_cast<uint32_t>(nii1->nz)) {
+            geometry_loaded = false;
+            cout << "  WARNING: Geometry cache is ignored, dimensions differ from the rim file:\n    "
+                 << cache_path << endl;
+        } else {
+            cout << "  Loaded geometry cache from:\n    " << cache_path << endl;
+            cout << "    Middle gray matter: " << geometry_cache_midgm_name(geometry) << endl;
+        }
+    }
+
     // Get dimensions of input
     const uint32_t size_x = nii1->nx;
     const uint32_t size_y = nii1->ny;
@@ -146,18 +181,16 @@ int main(int argc, char*  argv[]) {
     const float dY = nii1->pixdim[2];
     const float dZ = nii1->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
+    // Long diagonal
     const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
 
+    // 26-neighbourhood offsets and step lengths
+    const Neighbourhood nb = make_neighbourhood(26, size_x, size_y, dX, dY, dZ);
+
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_rim = copy_nifti_as_int32(nii1);
-    int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
-    free(nii1);
+    nifti_image* nii_rim = nii1;
+    int32_t* nii_rim_data = nifti_data_as<int32_t>(nii_rim);
     // ------------------------------------------------------------------------
     // Include borders adjustment to rim labels
     if (mode_incl_borders) {
@@ -169,9 +202,8 @@ int main(int argc, char*  argv[]) {
     }
     // ------------------------------------------------------------------------
     // Control points file (modified middle gray matter)
-    nifti_image* control_points = copy_nifti_as_int32(nii2);
-    int32_t* control_points_data = static_cast<int32_t*>(control_points->data);
-    free(nii2);
+    nifti_image* control_points = nii2;
+    int32_t* control_points_data = nifti_data_as<int32_t>(control_points);
 
     // Prepare flood fill related nifti images
     nifti_image* flood_step = copy_nifti_as_int32(nii_rim);
@@ -225,9 +257,6 @@ int main(int argc, char*  argv[]) {
     float* pin_coords_data = static_cast<float*>(pin_coords->data);
 
     // ------------------------------------------------------------------------
-    // Final voronoi volume to output midgm distances for whole rim
-    nifti_image* voronoi = copy_nifti_as_float32(flood_dist);
-    float* voronoi_data = static_cast<float*>(voronoi->data);
     nifti_image* smooth = copy_nifti_as_float32(flood_dist);
     float* smooth_data = static_cast<float*>(smooth->data);
 
@@ -249,10 +278,12 @@ int main(int argc, char*  argv[]) {
     int32_t* voi_id;
     voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
     // Fill in indices to be able to remap from subset to full set of voxels
+    uint32_t* voi_pad = (uint32_t*) malloc(nr_voi*sizeof(uint32_t));
     uint32_t ii = 0;
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         if (*(control_points_data + i) > 0){
             *(voi_id + ii) = i;
+            *(voi_pad + ii) = pad_index(i, size_x, size_y);
             ii += 1;
         }
     }
@@ -273,10 +304,12 @@ int main(int argc, char*  argv[]) {
     int32_t* voi_id2;
     voi_id2 = (int32_t*) malloc(nr_voi2*sizeof(int32_t));
     // Fill in indices to be able to remap from subset to full set of voxels
+    uint32_t* voi_pad2 = (uint32_t*) malloc(nr_voi2*sizeof(uint32_t));
     uint32_t iii = 0;
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         if (*(nii_rim_data + i) == 3){
             *(voi_id2 + iii) = i;
+            *(voi_pad2 + iii) = pad_index(i, size_x, size_y);
             iii += 1;
         }
     }
@@ -325,7 +358,7 @@ int main(int argc, char*  argv[]) {
 
     int32_t grow_step = 1;
     uint32_t voxel_counter = nr_voxels;
-    uint32_t ix, iy, iz, i, j;
+    uint32_t ix, iy, iz, i, j, p_i;
     float d;
 
     if (!mode_custom_extrema) {
@@ -338,324 +371,21 @@ int main(int argc, char*  argv[]) {
             }
         }
 
+        // 1, 2 and 3-jump neighbours within the padded domain
+        const vector<uint8_t> domain_pad = make_padded_mask(
+            control_points_data, size_x, size_y, size_z,
+            [](int32_t v) {return v > 0;});
         while (voxel_counter != 0) {
             voxel_counter = 0;
             for (uint32_t ii = 0; ii != nr_voi; ++ii) {
                 i = *(voi_id + ii);  // Map subset to full set
                 if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+                    p_i = *(voi_pad + ii);
                     voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
+                    for (int k = 0; k != nb.nr; ++k) {
+                        if (domain_pad[p_i + nb.pad_offset[k]] != 0) {
+                            j = i + nb.offset[k];
+                            d = *(flood_dist_data + i) + nb.dist[k];
                             if (d < *(flood_dist_data + j)
                                 || *(flood_dist_data + j) == 0) {
                                 *(flood_dist_data + j) = d;
@@ -1158,7 +888,7 @@ int main(int argc, char*  argv[]) {
             for (int32_t n = 4; n < 7; ++n) {
                 int32_t grow_step = 1;
                 uint32_t voxel_counter = nr_voxels;
-                uint32_t ix, iy, iz, i, j;
+                uint32_t i, j, p_i;
                 float d;
 
                 // Initialize grow volume
@@ -1175,54 +905,21 @@ int main(int argc, char*  argv[]) {
                 // Reset some parameters
                 grow_step = 1;
                 voxel_counter = nr_voxels;
+                // 1, 2 and 3-jump neighbours within the padded domain
+                const vector<uint8_t> domain_pad = make_padded_mask(
+                    perimeter_data, size_x, size_y, size_z,
+                    [](int32_t v) {return v == 2;});
                 while (voxel_counter != 0) {
                     voxel_counter = 0;
                     for (uint32_t ii = 0; ii != nr_voi; ++ii) {
                         i = *(voi_id + ii);  // Map subset to full set
                         if (*(flood_step_data + i) == grow_step) {
-                            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+                            p_i = *(voi_pad + ii);
                             voxel_counter += 1;
-
-                            // ------------------------------------------------
-                            // 1-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0) {
-                                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dX;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x) {
-                                j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dX;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0) {
-                                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dY;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y) {
-                                j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dY;
+                            for (int k = 0; k != nb.nr; ++k) {
+                                if (domain_pad[p_i + nb.pad_offset[k]] != 0) {
+                                    j = i + nb.offset[k];
+                                    d = *(flood_dist_data + i) + nb.dist[k];
                                     if (d < *(flood_dist_data + j)
                                         || *(flood_dist_data + j) == 0) {
                                         *(flood_dist_data + j) = d;
@@ -1230,280 +927,10 @@ int main(int argc, char*  argv[]) {
                                     }
                                 }
                             }
-                            if (iz > 0) {
-                                j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dZ;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iz < end_z) {
-                                j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dZ;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            // ------------------------------------------------
-                            // 2-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0 && iy > 0) {
-                                j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y) {
-                                j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0) {
-                                j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y) {
-                                j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-
-                            // ------------------------------------------------
-                            // 3-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0 && iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    grow_step += 1;
-                }
+                        }
+                    }
+                    grow_step += 1;
+                }
 
                 // Find farthest point
                 float max_distance = 0;
@@ -1546,65 +973,21 @@ int main(int argc, char*  argv[]) {
         grow_step = 1;
         voxel_counter = nr_voxels;
 
+        // 1, 2 and 3-jump neighbours within the padded domain
+        const vector<uint8_t> domain_pad = make_padded_mask(
+            control_points_data, size_x, size_y, size_z,
+            [](int32_t v) {return v > 0;});
         while (voxel_counter != 0) {
             voxel_counter = 0;
             for (uint32_t ii = 0; ii != nr_voi; ++ii) {
                 i = *(voi_id + ii);  // Map subset to full set
                 if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+                    p_i = *(voi_pad + ii);
                     voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
+                    for (int k = 0; k != nb.nr; ++k) {
+                        if (domain_pad[p_i + nb.pad_offset[k]] != 0) {
+                            j = i + nb.offset[k];
+                            d = *(flood_dist_data + i) + nb.dist[k];
                             if (d < *(flood_dist_data + j)
                                 || *(flood_dist_data + j) == 0) {
                                 *(flood_dist_data + j) = d;
@@ -1612,307 +995,48 @@ int main(int argc, char*  argv[]) {
                             }
                         }
                     }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
+                }
+            }
+            grow_step += 1;
+        }
 
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
+        if (mode_debug) {
+            save_output_nifti(fout, "control_point" + std::to_string(p-2) + "_dist", flood_dist, false);
+        }
 
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
+        // Record distances into a 4D nifti
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            i = *(voi_id + ii);  // Map subset to full set
+            *(point_dist_data + nr_voxels*(p-3) + i) = *(flood_dist_data + i);
+        }
+    }
 
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
+    // ------------------------------------------------------------------------
+    // Derive coordinates from control point (1, 2, 3, 4) distances
+    // ------------------------------------------------------------------------
+    cout << "\n  Computing control point coordinates..." << endl;
+    // Subtract distances pair-wise to get axis coordinates
+    for (uint32_t t = 0; t != 2; ++t) {
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            i = *(voi_id + ii);
+            float dist1 = *(point_dist_data + nr_voxels*(2 * t) + i);
+            float dist2 = *(point_dist_data + nr_voxels*(2 * t + 1) + i);
+            *(point_coords_data + nr_voxels*t + i) = dist2 - dist1;
+        }
+    }
 
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
-        }
-
-        if (mode_debug) {
-            save_output_nifti(fout, "control_point" + std::to_string(p-2) + "_dist", flood_dist, false);
-        }
-
-        // Record distances into a 4D nifti
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            i = *(voi_id + ii);  // Map subset to full set
-            *(point_dist_data + nr_voxels*(p-3) + i) = *(flood_dist_data + i);
-        }
-    }
-
-    // ------------------------------------------------------------------------
-    // Derive coordinates from control point (1, 2, 3, 4) distances
-    // ------------------------------------------------------------------------
-    cout << "\n  Computing control point coordinates..." << endl;
-    // Subtract distances pair-wise to get axis coordinates
-    for (uint32_t t = 0; t != 2; ++t) {
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            i = *(voi_id + ii);
-            float dist1 = *(point_dist_data + nr_voxels*(2 * t) + i);
-            float dist2 = *(point_dist_data + nr_voxels*(2 * t + 1) + i);
-            *(point_coords_data + nr_voxels*t + i) = dist2 - dist1;
-        }
-    }
-
-    // ------------------------------------------------------------------------
-    // Adjust origin
-    // ------------------------------------------------------------------------
-    if (mode_custom_origin) {
-        float origin_U = *(point_coords_data + nr_voxels*0 + control_point0);
-        float origin_V = *(point_coords_data + nr_voxels*1 + control_point0);
-        for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
-            i = *(voi_id2 + iii);
-            *(point_coords_data + nr_voxels*0 + i) -= origin_U;
-            *(point_coords_data + nr_voxels*1 + i) -= origin_V;
-        }
-    }
+    // ------------------------------------------------------------------------
+    // Adjust origin
+    // ------------------------------------------------------------------------
+    if (mode_custom_origin) {
+        float origin_U = *(point_coords_data + nr_voxels*0 + control_point0);
+        float origin_V = *(point_coords_data + nr_voxels*1 + control_point0);
+        for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
+            i = *(voi_id2 + iii);
+            *(point_coords_data + nr_voxels*0 + i) -= origin_U;
+            *(point_coords_data + nr_voxels*1 + i) -= origin_V;
+        }
+    }
 
     if (mode_debug) {
         save_output_nifti(fout, "control_point_coordinates", point_coords, true);
@@ -2027,324 +1151,21 @@ int main(int argc, char*  argv[]) {
         grow_step = 1;
         voxel_counter = nr_voxels;
 
+        // 1, 2 and 3-jump neighbours within the padded domain
+        const vector<uint8_t> domain_pad = make_padded_mask(
+            control_points_data, size_x, size_y, size_z,
+            [](int32_t v) {return v != 0;});
         while (voxel_counter != 0) {
             voxel_counter = 0;
             for (uint32_t ii = 0; ii != nr_voi; ++ii) {
                 i = *(voi_id + ii);  // Map subset to full set
                 if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+                    p_i = *(voi_pad + ii);
                     voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
+                    for (int k = 0; k != nb.nr; ++k) {
+                        if (domain_pad[p_i + nb.pad_offset[k]] != 0) {
+                            j = i + nb.offset[k];
+                            d = *(flood_dist_data + i) + nb.dist[k];
                             if (d < *(flood_dist_data + j)
                                 || *(flood_dist_data + j) == 0) {
                                 *(flood_dist_data + j) = d;
@@ -2381,402 +1202,66 @@ int main(int argc, char*  argv[]) {
     // Final Voronoi for propagating distances to all gray matter
     // ========================================================================
     cout << "\n  Start Voronoi propagation..." << endl;
+    // NOTE: Voronoi cells only depend on the seeds (non-zero coordinates), so
+    // they are grown as voxel ids and coordinates are copied from the seed of
+    // each cell afterwards. Both coordinates usually share their seeds.
+    // NOTE: Class 2 marks rim voxels other than 3. Only face neighbours of
+    // this class lock the 2 and 3-jump neighbours.
+    vector<uint8_t> rim_class(nr_voxels, 0);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        int32_t v = *(nii_rim_data + i);
+        rim_class[i] = v == 3 ? 1 : (v != 0 ? 2 : 0);
+    }
+    vector<int32_t> voronoi_id, voronoi_step;
+    vector<float> voronoi_dist;
+    vector<uint32_t> seeds, prev_seeds;
     for (uint32_t t = 0; t != 2; ++t) {
         cout << "    Doing coordinate " + std::to_string(t+1) + "/2..." << endl;
-        // Initialize grow volume
+        seeds.clear();
         for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
             i = *(voi_id2 + iii);  // Map subset to full set
             if (*(pin_coords_data + nr_voxels*t + i) != 0) {
-                *(voronoi_data + i) = *(pin_coords_data + nr_voxels*t + i);
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = 1.;
-            } else {
-                *(voronoi_data + i) = 0;
-                *(flood_step_data + i) = 0.;
-                *(flood_dist_data + i) = 0.;
+                seeds.push_back(i);
             }
         }
 
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
+        if (t == 0 || seeds != prev_seeds) {
+            // Cached cells are grown from all middle GM voxels, so the
+            // seeds have to match the cached middle GM exactly
+            uint32_t nr_mismatch = 0;
+            for (uint32_t iii = 0; geometry_loaded && iii != nr_voi2; ++iii) {
                 i = *(voi_id2 + iii);
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    bool jump_lock = false;
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (jump_lock == false) {
-
-                        if (ix > 0 && iy > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y) {
-                            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y) {
-                            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-
-                        // ----------------------------------------------------
-                        // 3-jump neighbours
-                        // ----------------------------------------------------
-                        if (ix > 0 && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                    }
+                if ((*(pin_coords_data + nr_voxels*t + i) != 0)
+                    != (geometry.midgm[i] != 0)) {
+                    nr_mismatch++;
                 }
             }
-            grow_step += 1;
+            if (geometry_loaded && nr_mismatch == 0) {
+                cout << "    Using Voronoi cells from geometry cache." << endl;
+                voronoi_id = geometry.midgm_anchor;
+            } else {
+                if (geometry_loaded) {
+                    cout << "    Geometry cache is ignored, " << nr_mismatch << " voxels differ"
+                         << " between control point and cached middle gray matter"
+                         << " (exact match needed)." << endl;
+                }
+                voronoi_id.resize(nr_voxels);
+                voronoi_step.resize(nr_voxels);
+                voronoi_dist.resize(nr_voxels);
+                grow_voronoi(rim_class.data(), seeds, size_x, size_y, size_z,
+                             dX, dY, dZ, 1, voronoi_step.data(),
+                             voronoi_dist.data(), voronoi_id.data());
+            }
         }
+        prev_seeds.swap(seeds);
 
         // Record into 4D nifti
+        // NOTE: Seeds keep their own coordinates, so this can be done in place
         for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
             i = *(voi_id2 + iii);  // Map subset to full set
-            *(pin_coords_data + nr_voxels * t + i) = *(voronoi_data + i);
+            int32_t seed = voronoi_id[i];
+            *(pin_coords_data + nr_voxels * t + i) =
+                seed >= 0 ? *(pin_coords_data + nr_voxels * t + seed) : 0;
         }
     }
 
@@ -3176,6 +1661,7 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "UV_quadrants", flood_step, true);
     }
 
+    wait_for_outputs();
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -95,52 +95,17 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Fix input datatype issues
     // ========================================================================
-    nifti_image* nii_input = copy_nifti_as_int32(nii1);
-    int32_t* nii_input_data = static_cast<int32_t*>(nii_input->data);
-
-    // TODO[Faruk]: I cannot think of a way to avoid this right now but I think
-    // this nifti can be avoided to decrease RAM load, when needed. E.g. I
-    // might hold a small vector that holds the indices of the labels. But I
-    // need to query that vector by the label value. Grumble grumble...
-    nifti_image* idx_label = copy_nifti_as_int32(nii_input);
-    int32_t* idx_label_data = static_cast<int32_t*>(idx_label->data);
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(idx_label_data + i) = 0;
-    }
-
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain the big iterative
-    // flooding distance loop to the subset of voxels. Required for substantial
-    // speed boost.
-    // Find the subset voxels that will be used many times
-    uint32_t nr_voi = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_input_data + i) != 0){
-            nr_voi += 1;
-        }
-    }
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
-
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_input_data + i) != 0){
-            *(voi_id + ii) = i;
-            ii += 1;
-        }
-    }
+    nifti_image* nii_input = nii1;
+    int32_t* nii_input_data = nifti_data_as<int32_t>(nii_input);
 
     // ========================================================================
-    // Find unique labels
+    // Find unique labels and their voxels
     // ========================================================================
-    set<int> set_labels;
-
-    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-        uint32_t i = *(voi_id + ii);  // Map subset to full set
-        set_labels.insert(*(nii_input_data + i));
-    }
+    // NOTE: Voxels are grouped by label in one pass, so every label only
+    // visits its own voxels below.
+    LabelIndex index;
+    label_index_build(index, nii_input_data, size_x, size_y, size_z);
+    const vector<int32_t>& set_labels = index.labels;
 
     cout << "  Unique labels: ";
     for (int value : set_labels) {
@@ -201,132 +166,127 @@ int main(int argc, char*  argv[]) {
     uint32_t i, j, ix, iy, iz, max_nr_neighbors = 0;
 
     // Loop through all unique labels
-    int c = 0;
-    for (int k : set_labels) {
+    for (uint32_t c = 0; c != set_labels.size(); ++c) {
+        const int k = set_labels[c];
         set<uint32_t> set_neighbors;
-        // Loop though voxels
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            // Map subset to full set
-            i = *(voi_id + ii);
-            if (*(nii_input_data + i) == k) {
-                *(idx_label_data + i) = c;
-
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
+        // Loop though voxels of the label
+        for (uint32_t ii = index.start[c]; ii != index.start[c + 1]; ++ii) {
+            i = index.voxels[ii];
+            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+
+            // ----------------------------------------------------------------
+            // 1-jump neighbours
+            // ----------------------------------------------------------------
+            if (ix > 0) {
+                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x) {
+                j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iy > 0) {
+                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iy < end_y) {
+                j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iz > 0) {
+                j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iz < end_z) {
+                j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            // ----------------------------------------------------------------
+            // 2-jump neighbours
+            // ----------------------------------------------------------------
+            if (ix > 0 && iy > 0) {
+                j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix > 0 && iy < end_y) {
+                j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iy > 0) {
+                j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iy < end_y) {
+                j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iy > 0 && iz > 0) {
+                j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iy > 0 && iz < end_z) {
+                j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iy < end_y && iz > 0) {
+                j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (iy < end_y && iz < end_z) {
+                j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix > 0 && iz > 0) {
+                j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iz > 0) {
+                j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix > 0 && iz < end_z) {
+                j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iz < end_z) {
+                j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
 
-                // ------------------------------------------------------------
-                // 3-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
+            // ----------------------------------------------------------------
+            // 3-jump neighbours
+            // ----------------------------------------------------------------
+            if (ix > 0 && iy > 0 && iz > 0) {
+                j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix > 0 && iy > 0 && iz < end_z) {
+                j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix > 0 && iy < end_y && iz > 0) {
+                j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iy > 0 && iz > 0) {
+                j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix > 0 && iy < end_y && iz < end_z) {
+                j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iy > 0 && iz < end_z) {
+                j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iy < end_y && iz > 0) {
+                j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
+            }
+            if (ix < end_x && iy < end_y && iz < end_z) {
+                j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
+                set_neighbors.insert(*(nii_input_data + j));
             }
         }
 
@@ -348,8 +308,6 @@ int main(int argc, char*  argv[]) {
         if (max_nr_neighbors < set_neighbors.size()) {
             max_nr_neighbors = set_neighbors.size();
         }
-
-        c += 1;
     }
     cout << endl;
     cout << "  Maximum number of neighbors:" << max_nr_neighbors << endl;
@@ -366,14 +324,12 @@ int main(int argc, char*  argv[]) {
     output_file << "\n";
 
     // Insert values in each row
-    c = 0;
-    for (int value : set_labels) {
-        output_file << value << ",";
+    for (uint32_t c = 0; c != set_labels.size(); ++c) {
+        output_file << set_labels[c] << ",";
         for (int m = 0; m != vec_neighbors[c].size(); ++m) {
             output_file << vec_neighbors[c][m] << ",";
         }
         output_file << "\n";
-        c += 1;
     }
 
     output_file.close();
@@ -396,16 +352,17 @@ int main(int argc, char*  argv[]) {
         int32_t* nii_output_data = static_cast<int32_t*>(nii_output->data);
 
         // --------------------------------------------------------------------
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            i = *(voi_id + ii);  // Map subset to full set
+        for (uint32_t c = 0; c != set_labels.size(); ++c) {
+            for (uint32_t ii = index.start[c]; ii != index.start[c + 1]; ++ii) {
+                i = index.voxels[ii];
 
-            // First volume is the input labels
-            *(nii_output_data + i) = *(nii_input_data + i);
+                // First volume is the input labels
+                *(nii_output_data + i) = *(nii_input_data + i);
 
-            // Populate the neighbors
-            j = *(idx_label_data + i);
-            for (int m = 0; m != vec_neighbors[j].size(); ++m) {
-                *(nii_output_data + nr_voxels*(m+1) + i) = vec_neighbors[j][m];
+                // Populate the neighbors
+                for (int m = 0; m != vec_neighbors[c].size(); ++m) {
+                    *(nii_output_data + nr_voxels*(m+1) + i) = vec_neighbors[c][m];
+                }
             }
         }
 
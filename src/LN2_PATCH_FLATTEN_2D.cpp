@@ -162,14 +162,14 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Fix input datatype issues
     // ========================================================================
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
-    float* nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* coords_tan = copy_nifti_as_float32(nii2);
-    float* coords_tan_data = static_cast<float*>(coords_tan->data);
-    nifti_image* coords_rad = copy_nifti_as_float32(nii3);
-    float* coords_rad_data = static_cast<float*>(coords_rad->data);
-    nifti_image* domain = copy_nifti_as_int32(nii4);
-    int32_t* domain_data = static_cast<int32_t*>(domain->data);
+    nifti_image* nii_input = nii1;
+    float* nii_input_data = nifti_data_as<float>(nii_input);
+    nifti_image* coords_tan = nii2;
+    float* coords_tan_data = nifti_data_as<float>(coords_tan);
+    nifti_image* coords_rad = nii3;
+    float* coords_rad_data = nifti_data_as<float>(coords_rad);
+    nifti_image* domain = nii4;
+    int32_t* domain_data = nifti_data_as<int32_t>(domain);
 
     // ========================================================================
     // Determine the type of depth file
@@ -121,16 +121,16 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Fix input datatype issues
     // ========================================================================
-    nifti_image* flat = copy_nifti_as_float32(nii1);
-    float* flat_data = static_cast<float*>(flat->data);
-    nifti_image* coords_xyz = copy_nifti_as_float32(nii2);
-    float* coords_xyz_data = static_cast<float*>(coords_xyz->data);
+    nifti_image* flat = nii1;
+    float* flat_data = nifti_data_as<float>(flat);
+    nifti_image* coords_xyz = nii2;
+    float* coords_xyz_data = nifti_data_as<float>(coords_xyz);
 
     // ========================================================================
     // Prepare outputs
     // ========================================================================
-    nifti_image* folded = copy_nifti_as_float32(nii3);
-    float* folded_data = static_cast<float*>(folded->data);
+    nifti_image* folded = nii3;
+    float* folded_data = nifti_data_as<float>(folded);
 
     for (int i = 0; i != nr_voxels_folded; ++i) {
         *(folded_data + i) = 0;
@@ -1,6 +1,6 @@
 
 // WORK in PROGRESS
-// TODO(Renzo): Think about what to do with time series data.
+// TODO(Renzo): Think about carpet plots for time series data.
 // E.g. carpet plot: https://github.com/layerfMRI/repository/tree/master/Layer_me
 
 #include <fstream>
@@ -17,10 +17,16 @@ int show_help(void) {
     "                 - Column 2 is the mean signal in this layer.\n"
     "                 - Column 3 is the STDEV of the signal variance across all voxels in this layer.\n"
     "                 - Column 4 is the number of voxels per layer.\n"
+    "                 - Column 5 is the median signal in this layer (with -median).\n"
+    "             For 4D input, the output is a layer by time matrix instead.\n"
+    "             Each row is a layer number followed by one mean per time point.\n"
+    "             STDEVs (and medians) are written into separate files with\n"
+    "             '_std' (and '_median') added to the name.\n"
     "\n"
     "Usage:\n"
     "    LN2_PROFILE -input activitymap.nii -layers layers.nii -plot \n"
     "    LN2_PROFILE -input activitymap.nii -layers layers.nii -plot -output layer_profile.txt \n"
+    "    LN2_PROFILE -input timeseries.nii -layers layers.nii -layers columns.nii -median \n"
     "    ../LN2_PROFILE -input sc_VASO_act.nii -layers sc_layers.nii -plot -debug \n"
     "\n"
     "Options:\n"
@@ -29,31 +35,179 @@ int show_help(void) {
     "              It is assumed that it conists of intager numbers of layers\n"
     "              It is assumed that deeper layers have small values \n"
     "              It is assumes that superficial layers have large values.\n"
+    "              Can be given multiple times to get one profile per label file.\n"
+    "              Output names then get the label file name added.\n"
     "    -input  : Specify input dataset of to extract the signal from.\n"
     "              This is usually an activation map.\n"
-    "              This 3D nii file must have the same dimension as the layer file.\n"
+    "              This 3D or 4D nii file must have the same dimension as the layer file.\n"
     "    -plot   : (Optional)\n"
     "              this option tries to plot the profile as ASKII art in the terminal \n"
     "              This option can be useful if you do not have a graphical plotting profile ready\n"
     "              E.g. on a remote server without X11 forwarding.\n"
+    "    -median : (Optional) Also compute the median signal of each layer.\n"
     "    -debug  : (Optional) Save extra intermediate outputs.\n"
     "    -output : (Optional) Output basename.\n"
     "              Default is adding '_padded' as suffix \n"
     "\n"
     "Notes:\n"
     "    - The averaging is done across all voxels layers, independent of their value.\n"
+    "    - All layers are aggregated in a single pass over the voxels.\n"
     "    - If you only want to use average across a subset of layers, consider restricting the layer mask.\n"
     "\n");
     return 0;
 }
 
+// Running mean and variance of one layer (Welford's algorithm)
+struct LayerStats {
+    uint32_t n = 0;
+    double mean = 0, m2 = 0;
+
+    void add(const double x) {
+        n++;
+        const double delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+    double get_mean() const {
+        return n > 0 ? mean : std::numeric_limits<double>::quiet_NaN();
+    }
+    double get_stdev() const { return sqrt(m2 / (static_cast<double>(n) - 1)); }
+};
+
+string profile_path(const string path, const bool use_outpath,
+                    const string label_tag, const string suffix) {
+    // Managing file name, path and extension
+    if (use_outpath) {
+        auto const pos_dir = path.find_last_of("/\\");
+        auto const pos_ext = path.find_last_of('.');
+        if (pos_ext != string::npos && (pos_dir == string::npos || pos_ext > pos_dir)) {
+            return path.substr(0, pos_ext) + label_tag + suffix + path.substr(pos_ext);
+        }
+        return path + label_tag + suffix;
+    }
+
+    // Parse path
+    string dir, file, basename, sep;
+    auto pos1 = path.find_last_of('/');
+    if (pos1 != string::npos) {  // For Unix
+        sep = "/";
+        dir = path.substr(0, pos1);
+        file = path.substr(pos1 + 1);
+    } else {  // For Windows
+        pos1 = path.find_last_of('\\');
+        if (pos1 != string::npos) {
+            sep = "\\";
+            dir = path.substr(0, pos1);
+            file = path.substr(pos1 + 1);
+        } else {  // Only the filename
+            sep = "";
+            dir = "";
+            file = path;
+        }
+    }
+    basename = file.substr(0, file.find_first_of('.'));
+
+    // Prepare output path
+    return dir + sep + basename + "_" + "profile" + label_tag + suffix + ".txt";
+}
+
+void plot_profile(const vector<double>& mean_layers) {
+    const int nr_layers = mean_layers.size();
+    double max_val = -3.4028234664e+38;
+    double min_val = 3.4028234664e+38;
+
+    for (int i = 0; i < nr_layers; i++) {
+        if (mean_layers[i] <= min_val) min_val = mean_layers[i];
+        if (mean_layers[i] >= max_val) max_val = mean_layers[i];
+    }
+
+    const streamsize precision = cout.precision(2);
+    cout << endl<< endl;
+
+    // terminal width. of course this can be set automatically, but then it
+    // will get dependencies of operating system
+    const int termwdth = 80;
+    const int termhght = 20;  // terminal height
+    int matrix[termwdth][termhght] ;
+    for (int w =0 ; w < termwdth ; w++){
+        for (int h =0 ; h < termhght ;h++){
+            matrix [w][h] = 0;
+        }
+    }
+
+    // filling matrix
+    // padding for visually pleasing
+    double max_valp = max_val + 1./(double)termwdth * (max_val-min_val);
+    double min_valp = min_val - 1./(double)termwdth * (max_val-min_val);
+
+    double x_lay = 0.;
+    double y_val = 0.;
+
+    for (int w =0 ; w < termwdth ; w++){
+        for (int h =0 ; h < termhght ;h++){
+
+            x_lay = (double) w / (double) termwdth * (double) nr_layers;
+            y_val = (mean_layers[(int)x_lay] - min_valp) / (max_valp-min_valp) * termhght ;
+
+            if ( ( h - (int)y_val ) < 1 ) {
+                matrix [w][h] = 1;
+            }
+        }
+    }
+
+    // top bar // two lines
+    cout << "       +-" ;
+    for (int w =0 ; w < termwdth ; w++) cout << "-" ;
+    cout << "-+" << endl ;
+    cout << "       | " ;
+    for (int w =0 ; w < termwdth ; w++) cout << " " ;
+    cout << " |" << endl ;
+    for (int h = termhght-1 ; h >= 0 ; h--){
+        if (h == termhght-1 ) {
+            cout << setw(6) << max_val <<  " | ";
+        }
+        else if (h == termhght/2 ){
+            cout  << setw(6)<< (max_val+min_val)/2. <<  " | " ;
+        }
+        else if (h == 0 ){
+            cout << setw(6) << min_val <<  " | ";
+        }
+        else {
+            cout << "       | ";
+        }
+
+        for (int w = termwdth-1 ; w >= 0 ; w--){
+            if (matrix [w][h]==1) cout << "@" ;
+            else if (matrix [w][h]==2) cout << ":" ;
+            else cout << " ";
+        }
+
+        cout << " |" <<  endl;
+    }
+
+
+    // bottom bar
+    cout << "       | " ;
+    for (int w =0 ; w < termwdth ; w++) cout << " " ;
+    cout << " |" << endl ;
+
+    cout << "       +-" ;
+    for (int w =0 ; w < termwdth ; w++) cout << "-" ;
+    cout << "-+" << endl ;
+    cout << "                                                                                           " << endl ;
+    cout << "      CSF                                 cortical depth ->                              WM" << endl ;
+
+    cout << endl;
+    cout.precision(precision);
+}
+
 int main(int argc, char*  argv[]) {
     uint16_t ac;
     nifti_image *nii1 = NULL;
-    nifti_image *niil = NULL;
-    char *fin = NULL, *finl = NULL;
+    char *fin = NULL;
+    vector<char*> fin_layers;
     char const *fout = "profile.txt";
-    bool  mode_debug = false,  mode_plot = false;
+    bool  mode_debug = false,  mode_plot = false, mode_median = false;
     bool  use_outpath = false;
 
     // Process user options
@@ -73,7 +227,7 @@ int main(int argc, char*  argv[]) {
                 fprintf(stderr, "** missing argument for -layers\n");
                 return 1;
             }
-            finl = argv[ac];
+            fin_layers.push_back(argv[ac]);
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -83,6 +237,8 @@ int main(int argc, char*  argv[]) {
             fout = argv[ac];
         } else if (!strcmp(argv[ac], "-plot")) {
             mode_plot = true;
+        } else if (!strcmp(argv[ac], "-median")) {
+            mode_median = true;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else {
@@ -91,7 +247,7 @@ int main(int argc, char*  argv[]) {
         }
     }
 
-    if (!finl) {
+    if (fin_layers.empty()) {
         fprintf(stderr, "** missing option '-layers'\n");
         return 1;
     }
@@ -106,11 +262,6 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
         return 2;
     }
-    niil = nifti_image_read(finl, 1);
-    if (!niil) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", finl);
-        return 2;
-    }
 
     log_welcome("LN2_PROFILE");
     log_nifti_descriptives(nii1);
@@ -120,21 +271,18 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
     const uint32_t nr_voxels = size_z * size_y * size_x;
+    const uint32_t size_time = nii1->nvox / nr_voxels;
 
     // ========================================================================
     // Load input
     // ========================================================================
-    nifti_image* layers = copy_nifti_as_int16(niil);
-    int16_t* layers_data = static_cast<int16_t*>(layers->data);
-
-    nifti_image* act = copy_nifti_as_float32(nii1);
-    float* act_data = static_cast<float*>(act->data);
+    nifti_image* act = nii1;
+    float* act_data = nifti_data_as<float>(act);
 
     // ========================================================================
     // Make sure that there is nothing weird with the slope of the nii header
     // ========================================================================
     if(mode_debug){
-       cout << "   Layer file has slope " << niil->scl_slope  << endl;
        cout << "   Act  file has slope  " << nii1->scl_slope  << endl;
     }
 
@@ -144,40 +292,66 @@ int main(int argc, char*  argv[]) {
         cout << "   I am setting it to 1 instead " << endl;
         act->scl_slope = 1;
     }
-    // ========================================================================
-    // Look how many layers we have and allocating the arrays accordingly
-    // ========================================================================
-    int nr_layers = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(layers_data + i) >= nr_layers){
-            nr_layers = *(layers_data + i);
-        }
-    }
-    cout << "    There are " << nr_layers<< " layers. " << endl << endl;
 
-    double numb_voxels[nr_layers] ;
-    double mean_layers[nr_layers] ;
-    double std_layers [nr_layers] ;
-    for (int i = 0; i < nr_layers; i++) {
-        mean_layers[i] = 0.;
-        std_layers[i] = 0.;
-        numb_voxels[i] = 0.;
-    }
+    for (uint32_t f = 0; f != fin_layers.size(); ++f) {
+        nifti_image* niil = nifti_image_read(fin_layers[f], 1);
+        if (!niil) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin_layers[f]);
+            return 2;
+        }
+        if (niil->nx != nii1->nx || niil->ny != nii1->ny || niil->nz != nii1->nz) {
+            fprintf(stderr, "** '%s' does not match the input dimensions\n", fin_layers[f]);
+            return 2;
+        }
+        if (fin_layers.size() > 1) cout << "    Layer file: " << fin_layers[f] << endl;
+        if (mode_debug) cout << "   Layer file has slope " << niil->scl_slope  << endl;
+
+        nifti_image* layers = niil;
+        int32_t* layers_data = nifti_data_as<int32_t>(layers);
+
+        // Label files get their name into the output names
+        string label_tag = "";
+        if (fin_layers.size() > 1) {
+            string label_file = fin_layers[f];
+            label_file = label_file.substr(label_file.find_last_of("/\\") + 1);
+            label_tag = "_" + label_file.substr(0, label_file.find_first_of('.'));
+        }
 
-    // ========================================================================
-    // Look how many voxels we have per layer
-    // ========================================================================
-    for(int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j != nr_voxels; ++j) {
-            if (*(layers_data + j) == i+1 ) {
-                numb_voxels[i] ++;
+        // ====================================================================
+        // Look how many layers we have and allocating the arrays accordingly
+        // ====================================================================
+        int nr_layers = 0;
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            if (*(layers_data + i) >= nr_layers){
+                nr_layers = *(layers_data + i);
             }
         }
-    }
+        cout << "    There are " << nr_layers<< " layers. " << endl << endl;
+
+        // Statistics of layer i at time point t are at [i * size_time + t]
+        vector<LayerStats> stats(static_cast<size_t>(nr_layers) * size_time);
+
+        // ====================================================================
+        // Accumulate all layers in a single pass over the voxels
+        // ====================================================================
+        for (uint32_t t = 0; t != size_time; ++t) {
+            const float* act_vol = act_data + static_cast<size_t>(t) * nr_voxels;
+            for (uint32_t j = 0; j != nr_voxels; ++j) {
+                const int32_t layer = *(layers_data + j);
+                if (layer > 0) {
+                    stats[static_cast<size_t>(layer - 1) * size_time + t].add(*(act_vol + j));
+                }
+            }
+        }
+
+        vector<uint32_t> numb_voxels(nr_layers);
+        for (int i = 0; i < nr_layers; i++) {
+            numb_voxels[i] = size_time > 0 ? stats[static_cast<size_t>(i) * size_time].n : 0;
+        }
 
-    //-------------- finding layer with maximal number of voxels
-    int max_layer_number = 0 ;
-    int max_layer_number_layer = 0 ;
+        //-------------- finding layer with maximal number of voxels
+        uint32_t max_layer_number = 0 ;
+        int max_layer_number_layer = 0 ;
         for(int i = 0; i < nr_layers; i++) {
             if (numb_voxels[i] >= max_layer_number ){
                 max_layer_number =  numb_voxels[i];
@@ -185,186 +359,123 @@ int main(int argc, char*  argv[]) {
             }
         }
 
-    if(mode_debug) cout << "   Layer  " <<   max_layer_number_layer+1 << " has the most voxels: " <<  max_layer_number << endl;
-
-    // ========================================================================
-    // Go through layers MAIN loop
-    // ========================================================================
-    double vec1[max_layer_number];
-    int dummy_index = 0;
-
-    for(int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j != nr_voxels; ++j) {
-            if (*(layers_data + j) == i+1 ) {
-                vec1[dummy_index] = *(act_data + j) ;
-                dummy_index ++;
+        if(mode_debug) cout << "   Layer  " <<   max_layer_number_layer+1 << " has the most voxels: " <<  max_layer_number << endl;
+
+        // ====================================================================
+        // Medians from the voxel values of each layer
+        // ====================================================================
+        vector<double> median_layers;
+        if (mode_median) {
+            median_layers.resize(stats.size());
+            LabelIndex index;
+            label_index_build(index, layers_data, size_x, size_y, size_z);
+            vector<int32_t> layer_label(nr_layers);
+            for (int i = 0; i < nr_layers; i++) {
+                layer_label[i] = label_index_find(index, i + 1);
             }
-        }
-        dummy_index = 0;
-        mean_layers[i] = ren_average(vec1, numb_voxels[i])*act->scl_slope;
-        std_layers[i]  = ren_stdev  (vec1, numb_voxels[i])*act->scl_slope;
-    }
-
-    // ========================================================================
-    // Write layer profiles to terminal
-    // ========================================================================
-    if (mode_debug){
-        for(int i = 0; i < nr_layers; i++) {
-            cout << "In layer " << i+1 << " with a mean signal of "<<  mean_layers[i] ;
-            cout <<  " +/-  " << std_layers[i] << " with  " <<  numb_voxels[i] <<  " are voxels " << endl;
-        }
-    }
-
-    // ========================================================================
-    // Write layer profiles to text file with the right file name
-    // ========================================================================
-    // Managing file name, path and extension
-    string path_out;
-    const string path = fout ;
-
-    if (use_outpath) {
-        path_out = path;
-    } else {
-        // Parse path
-        string dir, file, basename, ext, sep;
-        auto pos1 = path.find_last_of('/');
-        if (pos1 != string::npos) {  // For Unix
-            sep = "/";
-            dir = path.substr(0, pos1);
-            file = path.substr(pos1 + 1);
-        } else {  // For Windows
-            pos1 = path.find_last_of('\\');
-            if (pos1 != string::npos) {
-                sep = "\\";
-                dir = path.substr(0, pos1);
-                file = path.substr(pos1 + 1);
-            } else {  // Only the filename
-                sep = "";
-                dir = "";
-                file = path;
+            vector<float> bucket(max_layer_number);
+
+            for (uint32_t t = 0; t != size_time; ++t) {
+                const float* act_vol = act_data + static_cast<size_t>(t) * nr_voxels;
+                for (int i = 0; i < nr_layers; i++) {
+                    uint32_t n = 0;
+                    if (layer_label[i] >= 0) {
+                        const uint32_t* voxels = index.voxels.data() + index.start[layer_label[i]];
+                        for (; n != numb_voxels[i]; ++n) {
+                            bucket[n] = *(act_vol + voxels[n]);
+                        }
+                    }
+                    const double median = ren_median(bucket.data(), n);
+                    median_layers[static_cast<size_t>(i) * size_time + t] = median * act->scl_slope;
+                }
             }
         }
 
-        // Parse extension
-        auto const pos2 = file.find_first_of('.');
-        if (pos2 != string::npos) {
-            basename = file.substr(0, pos2);
-            ext = ".txt";
-        } else {  // Determine default extension when no extension given
-            basename = file;
-            ext = ".txt";
+        vector<double> mean_layers(stats.size()), std_layers(stats.size());
+        for (size_t k = 0; k != stats.size(); ++k) {
+            mean_layers[k] = stats[k].get_mean() * act->scl_slope;
+            std_layers[k] = stats[k].get_stdev() * act->scl_slope;
         }
-
-        // Prepare output path
-        path_out = dir + sep + basename + "_" + "profile" + ext;
-    }
-
-    // Writing into file
-    ofstream outf(path_out);
-    if (!outf) {
-        cout<<"error when opening the text file"<<endl;
-    }
-
-    cout<<"    writing to disk "  << path_out<<endl;
-    for(int i = 0; i < nr_layers; i++) {
-      outf << i+1 << "   "<<  mean_layers[i] <<  " " << std_layers[i] << "  " <<  numb_voxels[i] << endl;
-     }
-    outf.close();
-
-    // ========================================================================
-    // Plot in terminal, use ASCII to avoid issues with terminal types
-    // ========================================================================
-    if (mode_plot){
-        double max_val = -3.4028234664e+38;
-        double min_val = 3.4028234664e+38;
-
-        for (int i = 0; i < nr_layers; i++) {
-            if (mean_layers[i] <= min_val) min_val = mean_layers[i];
-            if (mean_layers[i] >= max_val) max_val = mean_layers[i];
+        vector<LayerStats>().swap(stats);
+
+        // ====================================================================
+        // Write layer profiles to terminal
+        // ====================================================================
+        if (mode_debug && size_time == 1){
+            for(int i = 0; i < nr_layers; i++) {
+                cout << "In layer " << i+1 << " with a mean signal of "<<  mean_layers[i] ;
+                cout <<  " +/-  " << std_layers[i] << " with  " <<  numb_voxels[i] <<  " are voxels " << endl;
+            }
+        } else if (mode_debug) {
+            for(int i = 0; i < nr_layers; i++) {
+                cout << "In layer " << i+1 << " are " <<  numb_voxels[i] <<  " voxels " << endl;
+            }
         }
 
-    cout.precision(2);
-    cout << endl<< endl;
+        // ====================================================================
+        // Write layer profiles to text file with the right file name
+        // ====================================================================
+        const string path_out = profile_path(fout, use_outpath, label_tag, "");
 
-    // terminal width. of course this can be set automatically, but then it
-    // will get dependencies of operating system
-    int termwdth = 80;
-    int termhght = 20;  // terminal height
-    int matrix[termwdth][termhght] ;
-    for (int w =0 ; w < termwdth ; w++){
-        for (int h =0 ; h < termhght ;h++){
-            matrix [w][h] = 0;
+        // Writing into file
+        ofstream outf(path_out);
+        if (!outf) {
+            cout<<"error when opening the text file"<<endl;
         }
-    }
 
-    // filling matrix
-    // padding for visually pleasing
-    double max_valp = max_val + 1./(double)termwdth * (max_val-min_val);
-    double min_valp = min_val - 1./(double)termwdth * (max_val-min_val);
-
-    double x_lay = 0.;
-    double y_val = 0.;
-
-    for (int w =0 ; w < termwdth ; w++){
-        for (int h =0 ; h < termhght ;h++){
-
-            x_lay = (double) w / (double) termwdth * (double) nr_layers;
-            y_val = (mean_layers[(int)x_lay] - min_valp) / (max_valp-min_valp) * termhght ;
-
-            if ( ( h - (int)y_val ) < 1 ) {
-                matrix [w][h] = 1;
+        cout<<"    writing to disk "  << path_out<<endl;
+        if (size_time == 1) {
+            for(int i = 0; i < nr_layers; i++) {
+                outf << i+1 << "   "<<  mean_layers[i] <<  " " << std_layers[i] << "  " <<  numb_voxels[i];
+                if (mode_median) outf << "  " << median_layers[i];
+                outf << endl;
+            }
+        } else {
+            // Layer by time matrices, one row per layer
+            vector<std::pair<string, const vector<double>*>> matrices;
+            matrices.push_back(std::make_pair("", &mean_layers));
+            matrices.push_back(std::make_pair("_std", &std_layers));
+            if (mode_median) matrices.push_back(std::make_pair("_median", &median_layers));
+
+            for (uint32_t m = 0; m != matrices.size(); ++m) {
+                ofstream outm;
+                if (m > 0) {
+                    const string path_m = profile_path(fout, use_outpath, label_tag, matrices[m].first);
+                    outm.open(path_m);
+                    if (!outm) {
+                        cout<<"error when opening the text file"<<endl;
+                    }
+                    cout<<"    writing to disk "  << path_m<<endl;
+                }
+                ostream& out = (m > 0) ? outm : outf;
+                const vector<double>& values = *matrices[m].second;
+                for(int i = 0; i < nr_layers; i++) {
+                    out << i+1;
+                    for (uint32_t t = 0; t != size_time; ++t) {
+                        out << " " << values[static_cast<size_t>(i) * size_time + t];
+                    }
+                    out << endl;
+                }
             }
         }
-    }
-
-    // top bar // two lines
-    cout << "       +-" ;
-    for (int w =0 ; w < termwdth ; w++) cout << "-" ;
-    cout << "-+" << endl ;
-    cout << "       | " ;
-    for (int w =0 ; w < termwdth ; w++) cout << " " ;
-    cout << " |" << endl ;
-    for (int h = termhght-1 ; h >= 0 ; h--){
-        if (h == termhght-1 ) {
-            cout << setw(6) << max_val <<  " | ";
-        }
-        else if (h == termhght/2 ){
-            cout  << setw(6)<< (max_val+min_val)/2. <<  " | " ;
-        }
-        else if (h == 0 ){
-            cout << setw(6) << min_val <<  " | ";
-        }
-        else {
-            cout << "       | ";
-        }
-
-        for (int w = termwdth-1 ; w >= 0 ; w--){
-            if (matrix [w][h]==1) cout << "@" ;
-            else if (matrix [w][h]==2) cout << ":" ;
-            else cout << " ";
+        outf.close();
+
+        // ====================================================================
+        // Plot in terminal, use ASCII to avoid issues with terminal types
+        // ====================================================================
+        if (mode_plot && nr_layers > 0){
+            // Time series are plotted as their temporal mean
+            vector<double> profile(nr_layers, 0.);
+            for (int i = 0; i < nr_layers; i++) {
+                for (uint32_t t = 0; t != size_time; ++t) {
+                    profile[i] += mean_layers[static_cast<size_t>(i) * size_time + t] / size_time;
+                }
+            }
+            plot_profile(profile);
         }
-
-        cout << " |" <<  endl;
+        nifti_image_free(niil);
     }
 
-
-    // bottom bar
-    cout << "       | " ;
-    for (int w =0 ; w < termwdth ; w++) cout << " " ;
-    cout << " |" << endl ;
-
-    cout << "       +-" ;
-    for (int w =0 ; w < termwdth ; w++) cout << "-" ;
-    cout << "-+" << endl ;
-    cout << "                                                                                           " << endl ;
-    cout << "      CSF                                 cortical depth ->                              WM" << endl ;
-
-    cout << endl;
-}
-    //if (!use_outpath) fout = fin;
-   // save_output_nifti(fout, "output1", act, true, use_outpath);
-   // save_output_nifti(fout, "output2", layers, true, use_outpath);
-
     cout << "\n  Finished." << endl;
     return 0;
 }
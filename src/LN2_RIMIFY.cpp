@@ -136,8 +136,8 @@ int main(int argc, char *argv[]) {
     const int nr_voxels = size_z * size_y * size_x;
 
     // Prepare images
-    nifti_image *nii_in = copy_nifti_as_int16(nii);
-    int16_t* nii_in_data = static_cast<int16_t*>(nii_in->data);
+    nifti_image* nii_in = nii;
+    int16_t* nii_in_data = nifti_data_as<int16_t>(nii_in);
     nifti_image *nii_rim = copy_nifti_as_int16(nii_in);
     int16_t* nii_rim_data = static_cast<int16_t*>(nii_rim->data);
 
@@ -28,6 +28,7 @@ int show_help(void) {
     "    -steps_voronoi : (Optional) Number of voronoi dilation steps. Useful for\n"
     "                     preventing smoothing artifacts around the edges of partially\n" 
     "                     segmented volumes. '5' by default, chosen for 0.2 mm iso. images.\n"
+    "    -threads       : (Optional) Number of threads. Default is 1.\n"
     "    -debug         : (Optional) Save extra intermediate outputs.\n"
     "    -output        : (Optional) Output filename, including .nii or\n"
     "                     .nii.gz, and path if needed. Overwrites existing files.\n"
@@ -35,11 +36,112 @@ int show_help(void) {
     return 0;
 }
 
+// ============================================================================
+// Frontier dilation and erosion
+// ============================================================================
+static void grow_front(int16_t* data, const int steps, const bool erode,
+                       const uint32_t size_x, const uint32_t size_y,
+                       const uint32_t size_z, const int nr_threads) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Dilation: zero voxels take the value of their last nonzero face
+    //   neighbour (order -x, +x, -y, +y, -z, +z). Erosion: voxels with value
+    //   1 become 0 when a face neighbour is 0.
+    // - Same result as scanning all voxels each step and copying the image
+    //   back, but a step only visits its frontier: the voxels that change.
+    //   The next frontier lies around the voxels that changed.
+    // - The first frontier is found in z slabs, frontier values are computed
+    //   in parallel and applied after the whole step.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint32_t nr_voxels = size_x * size_y * size_z;
+    const Neighbourhood nb = make_neighbourhood(6, size_x, size_y, 1, 1, 1);
+    auto is_source = [erode](const int16_t v) { return erode ? v == 0 : v != 0; };
+    auto is_target = [erode](const int16_t v) { return erode ? v == 1 : v == 0; };
+
+    // Value a frontier voxel takes, -1 when none of its neighbours is a source
+    auto new_value = [&](const uint32_t i, const uint32_t ix, const uint32_t iy,
+                         const uint32_t iz) -> int32_t {
+        int32_t value = -1;
+        for (int k = 0; k != nb.nr; ++k) {
+            const int64_t x = static_cast<int64_t>(ix) + nb.dx[k];
+            const int64_t y = static_cast<int64_t>(iy) + nb.dy[k];
+            const int64_t z = static_cast<int64_t>(iz) + nb.dz[k];
+            if (x >= 0 && y >= 0 && z >= 0 && x < size_x && y < size_y && z < size_z) {
+                const int16_t v = *(data + i + nb.offset[k]);
+                if (is_source(v)) {
+                    value = v;
+                }
+            }
+        }
+        return value;
+    };
+
+    // First frontier: target voxels next to a source voxel
+    vector<vector<uint32_t>> slab_front(size_z);
+    parallel_for(size_z, nr_threads, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t iz = begin; iz != end; ++iz) {
+            uint32_t i = iz * size_x * size_y;
+            for (uint32_t iy = 0; iy != size_y; ++iy) {
+                for (uint32_t ix = 0; ix != size_x; ++ix, ++i) {
+                    if (is_target(*(data + i)) && new_value(i, ix, iy, iz) >= 0) {
+                        slab_front[iz].push_back(i);
+                    }
+                }
+            }
+        }
+    });
+    vector<uint32_t> front;
+    for (uint32_t iz = 0; iz != size_z; ++iz) {
+        front.insert(front.end(), slab_front[iz].begin(), slab_front[iz].end());
+    }
+    vector<vector<uint32_t>>().swap(slab_front);
+
+    vector<int16_t> front_value;
+    vector<uint8_t> queued(nr_voxels, 0);
+    vector<uint32_t> next;
+    for (int n = 0; n < steps && !front.empty(); ++n) {
+        front_value.resize(front.size());
+        parallel_for(front.size(), nr_threads, [&](uint32_t begin, uint32_t end) {
+            uint32_t ix, iy, iz;
+            for (uint32_t f = begin; f != end; ++f) {
+                tie(ix, iy, iz) = ind2sub_3D(front[f], size_x, size_y);
+                front_value[f] = new_value(front[f], ix, iy, iz);
+            }
+        });
+        for (uint32_t f = 0; f != front.size(); ++f) {
+            *(data + front[f]) = front_value[f];
+        }
+
+        // Next frontier: target neighbours of the voxels that changed
+        next.clear();
+        for (uint32_t f = 0; f != front.size(); ++f) {
+            uint32_t ix, iy, iz;
+            tie(ix, iy, iz) = ind2sub_3D(front[f], size_x, size_y);
+            for (int k = 0; k != nb.nr; ++k) {
+                const int64_t x = static_cast<int64_t>(ix) + nb.dx[k];
+                const int64_t y = static_cast<int64_t>(iy) + nb.dy[k];
+                const int64_t z = static_cast<int64_t>(iz) + nb.dz[k];
+                if (x >= 0 && y >= 0 && z >= 0 && x < size_x && y < size_y && z < size_z) {
+                    const uint32_t j = front[f] + nb.offset[k];
+                    if (is_target(*(data + j)) && !queued[j]) {
+                        queued[j] = 1;
+                        next.push_back(j);
+                    }
+                }
+            }
+        }
+        for (uint32_t f = 0; f != next.size(); ++f) {
+            queued[next[f]] = 0;
+        }
+        front.swap(next);
+    }
+}
+
 int main(int argc, char *argv[]) {
     bool use_outpath = false, mode_debug=false;
     char *fin = NULL, *fout = NULL;
     int ac;
-    int steps=1, iter_smooth=6, steps_voronoi=5;
+    int steps=1, iter_smooth=6, steps_voronoi=5, nr_threads=1;
 
     if (argc < 3) return show_help();
 
@@ -67,7 +169,17 @@ int main(int argc, char *argv[]) {
             }
             iter_smooth = std::stoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-steps_voronoi")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -steps_voronoi\n");
+                return 2;
+            }
             steps_voronoi = std::stoi(argv[ac]);
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 2;
+            }
+            nr_threads = std::max(1, atoi(argv[ac]));
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -105,76 +217,15 @@ int main(int argc, char *argv[]) {
     const int size_z = nii_in->nz;
     const int nr_voxels = size_z * size_y * size_x;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
-    // Prepare images
+    // Prepare images (input is kept as the original rim)
+    nifti_data_as<int16_t>(nii_in);
     nifti_image *nii_rim = copy_nifti_as_int16(nii_in);
     int16_t* nii_rim_data = static_cast<int16_t*>(nii_rim->data);
 
     // ========================================================================
     // Voronoi dilate initial segmentation (useful for partial segmentations)
     // ========================================================================
-    nifti_image* nii_temp = copy_nifti_as_int16(nii_rim);
-    int16_t* nii_temp_data = static_cast<int16_t*>(nii_temp->data);
-
-    uint32_t ix, iy, iz, j;
-    for (uint32_t n = 0; n != steps_voronoi; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 0) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_rim_data + i);
-        }
-    }
-
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_rim_data + i);
-    }
+    grow_front(nii_rim_data, steps_voronoi, false, size_x, size_y, size_z, nr_threads);
 
     if (mode_debug == true) {
         save_output_nifti(fout, "voronoi_dilated", nii_rim, false);
@@ -217,63 +268,7 @@ int main(int argc, char *argv[]) {
     cout << "  Polishing white matter (wm)..." << endl;
     cout << "    Dilating..." << endl;
 
-    // Clean temporary nifti
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wm_data + i);
-    }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 0) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wm_data + i);
-        }
-    }
+    grow_front(nii_wm_data, steps, false, size_x, size_y, size_z, nr_threads);
 
     if (mode_debug == true) {
         save_output_nifti(fout, "wm_dilated", nii_wm, false);
@@ -298,7 +293,7 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    nii_wm_smth = iterative_smoothing(nii_wm_smth, iter_smooth, nii_mask, 1);
+    nii_wm_smth = iterative_smoothing(nii_wm_smth, iter_smooth, nii_mask, 1, nr_threads);
     nii_wm_smth_data = static_cast<float*>(nii_wm_smth->data);
 
     if (mode_debug == true) {
@@ -326,63 +321,7 @@ int main(int argc, char *argv[]) {
     // Erode back wm
     // ------------------------------------------------------------------------
     cout << "    Eroding..." << endl;
-    // Clean temporary nifti
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wm_data + i);
-    }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 1) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wm_data + i);
-        }
-    }
+    grow_front(nii_wm_data, steps, true, size_x, size_y, size_z, nr_threads);
 
     if (mode_debug == true) {
         save_output_nifti(fout, "wm_dilated_smoothed_binarized_eroded", nii_wm, false);
@@ -394,63 +333,7 @@ int main(int argc, char *argv[]) {
     cout << "  Polishing white + gray matter (wmgm)..." << endl;
     cout << "    Eroding..." << endl;
 
-    // Clean temporary nifti
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wmgm_data + i);
-    }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 1) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wmgm_data + i);
-        }
-    }
+    grow_front(nii_wmgm_data, steps, true, size_x, size_y, size_z, nr_threads);
 
     if (mode_debug == true) {
         save_output_nifti(fout, "wmgm_eroded", nii_wmgm, false);
@@ -464,7 +347,7 @@ int main(int argc, char *argv[]) {
     nifti_image* nii_wmgm_smth = copy_nifti_as_float32(nii_wmgm);
     float* nii_wmgm_smth_data = static_cast<float*>(nii_wmgm_smth->data);
 
-    nii_wmgm_smth = iterative_smoothing(nii_wmgm_smth, iter_smooth, nii_mask, 1);
+    nii_wmgm_smth = iterative_smoothing(nii_wmgm_smth, iter_smooth, nii_mask, 1, nr_threads);
     nii_wmgm_smth_data = static_cast<float*>(nii_wmgm_smth->data);
 
     if (mode_debug == true) {
@@ -492,63 +375,7 @@ int main(int argc, char *argv[]) {
     // ------------------------------------------------------------------------
     cout << "    Eroding..." << endl;
 
-    // Clean temporary nifti
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wmgm_data + i);
-    }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 0) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wmgm_data + i);
-        }
-    }
+    grow_front(nii_wmgm_data, steps, false, size_x, size_y, size_z, nr_threads);
 
     if (mode_debug == true) {
         save_output_nifti(fout, "wmgm_eroded_smoothed_binarized_dilated", nii_wmgm, false);
@@ -559,8 +386,10 @@ int main(int argc, char *argv[]) {
     // ========================================================================
     cout << "  Combining..." << endl;
 
-    nifti_image *nii_rim_orig = copy_nifti_as_int16(nii_in);
+    nifti_image *nii_rim_orig = nii_in;
     int16_t* nii_rim_orig_data = static_cast<int16_t*>(nii_rim_orig->data);
+    nifti_image* nii_temp = copy_nifti_as_int16(nii_rim);
+    int16_t* nii_temp_data = static_cast<int16_t*>(nii_temp->data);
 
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         if (*(nii_rim_orig_data + i) != 0) {
@@ -40,6 +40,12 @@ int show_help(void) {
     "    -peak_d        : (Optional) Take depth of the maximum value in the window.\n"
     "    -count_uniques : (Optional) Count number of uniquely labeled voxels within\n"
     "                     each window.\n"
+    "    -threads       : (Optional) Number of threads. Default is 1.\n"
+    "    -uv_index      : (Optional) Cache the UV point cloud index in a file next\n"
+    "                     to the '-coord_uv' file (named '*_UVindex.bin'). When\n"
+    "                     the file exists and matches the inputs, it is loaded and\n"
+    "                     the UV coordinates file is not read. Useful when the same\n"
+    "                     UV coordinates are filtered many times.\n"
     "    -output        : (Optional) Output basename for all outputs.\n"
     "\n");
     return 0;
@@ -51,6 +57,8 @@ int main(int argc, char* argv[]) {
     char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL, *fin4=NULL;
     int ac;
     float radius = 3, height = 0.25;
+    int nr_threads = 1;
+    bool use_uv_index = false;
     bool mode_median = true, mode_min = false, mode_max = false;
     bool mode_cols = false, mode_peak = false, mode_count_uniques = false;
 
@@ -139,6 +147,14 @@ int main(int argc, char* argv[]) {
             mode_max = false;
             mode_peak = false;
             mode_count_uniques = true;
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            nr_threads = std::max(1, atoi(argv[ac]));
+        } else if (!strcmp(argv[ac], "-uv_index")) {
+            use_uv_index = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -174,25 +190,19 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
         return 2;
     }
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
-    }
     nii3 = nifti_image_read(fin3, 1);
     if (!nii3) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin3);
         return 2;
     }
     nii4 = nifti_image_read(fin4, 1);
-    if (!nii3) {
+    if (!nii4) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin4);
         return 2;
     }
 
     log_welcome("LN2_UVD_FILTER");
     log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
     log_nifti_descriptives(nii3);
     log_nifti_descriptives(nii4);
 
@@ -201,14 +211,12 @@ int main(int argc, char* argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
-    float* nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* coords_uv = copy_nifti_as_float32(nii2);
-    float* coords_uv_data = static_cast<float*>(coords_uv->data);
-    nifti_image* coords_d = copy_nifti_as_float32(nii3);
-    float* coords_d_data = static_cast<float*>(coords_d->data);
-    nifti_image* domain = copy_nifti_as_float32(nii4);
-    float* domain_data = static_cast<float*>(domain->data);
+    nifti_image* nii_input = nii1;
+    float* nii_input_data = nifti_data_as<float>(nii_input);
+    nifti_image* coords_d = nii3;
+    float* coords_d_data = nifti_data_as<float>(coords_d);
+    nifti_image* domain = nii4;
+    float* domain_data = nifti_data_as<float>(domain);
 
     // ========================================================================
     // Prepare outputs
@@ -242,13 +250,11 @@ int main(int argc, char* argv[]) {
     // speed boost.
     // Find the subset voxels that will be used many times
     int nr_voi = 0;  // Voxels of interest
-    vector <int> vec_voi_id;
-    vector <float> vec_u, vec_v, vec_d, vec_val;
+    vector <int> domain_voi_id;
+    vector <float> vec_d, vec_val;
     for (int i = 0; i != nr_voxels; ++i) {
         if (*(domain_data + i) != 0){
-            vec_voi_id.push_back(i);
-            vec_u.push_back(*(coords_uv_data + nr_voxels*0 + i));
-            vec_v.push_back(*(coords_uv_data + nr_voxels*1 + i));
+            domain_voi_id.push_back(i);
             vec_d.push_back(*(coords_d_data + i));
             vec_val.push_back(*(nii_input_data + i));
             nr_voi += 1;
@@ -256,189 +262,231 @@ int main(int argc, char* argv[]) {
     }
 
     // ========================================================================
-    // Visit each voxel to check their coordinate
+    // Bucket UV coordinates into a uniform grid
     // ========================================================================
-    float half_height = height / 2;
-    float radius_sqr = radius * radius;
-    for (int i = 0; i != nr_voi; ++i) {
-        cout << "\r    " << i * 100 / nr_voi << " %" << flush;
-        vector <float> temp_vec;
-        vector <int> temp_vec_id;
-        vector <float> temp_vec_d;
-
-        // --------------------------------------------------------------------
-        // Cylinder windowing in UVD space
-        // --------------------------------------------------------------------
-        for (int j = 0; j != nr_voi; ++j) {
-            // Compute distances relative to reference UVD
-            if (abs(vec_d[i] - vec_d[j]) < half_height) {  // Check height
-                float dist_uv = (vec_u[i] - vec_u[j])*(vec_u[i] - vec_u[j])
-                    + (vec_v[i] - vec_v[j])*(vec_v[i] - vec_v[j]);
-                if (dist_uv < radius_sqr) {  // Check Euclidean distance
-                    temp_vec.push_back(vec_val[j]);
-                    temp_vec_id.push_back(vec_voi_id[j]);
-                    temp_vec_d.push_back(vec_d[j]);
+    // NOTE: Cells are as large as the cylinder radius. Each window only
+    // visits the neighbouring cells instead of all voxels of interest.
+    UVIndex index;
+    bool index_loaded = false;
+    string index_path = uv_index_path(fin2);
+    uint64_t index_key = uv_index_key(fin2, domain_voi_id);
+    if (use_uv_index) {
+        index_loaded = uv_index_load(index_path, index_key, index)
+            && index.nr_voxels == static_cast<uint32_t>(nr_voxels);
+    }
 
-                }
+    if (index_loaded) {
+        cout << "  Loaded UV index from:\n    " << index_path << endl;
+        // Cell size follows the radius the index was built with. Queries are
+        // exact for any radius, re-bucket only when it is far off.
+        if (index.grid.cell_size < radius / 2 || index.grid.cell_size > radius * 2) {
+            uv_grid_build(index.grid, index.vec_u, index.vec_v, radius);
+        }
+    } else {
+        nii2 = nifti_image_read(fin2, 1);
+        if (!nii2) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+            return 2;
+        }
+        log_nifti_descriptives(nii2);
+        nifti_image* coords_uv = nii2;
+        float* coords_uv_data = nifti_data_as<float>(coords_uv);
+        uv_index_build(index, coords_uv_data, nr_voxels, domain_voi_id, radius);
+        nifti_image_free(coords_uv);
+
+        if (use_uv_index) {
+            if (uv_index_save(index_path, index_key, index)) {
+                cout << "  Saved UV index as:\n    " << index_path << endl;
+            } else {
+                cout << "  WARNING: Could not save UV index as:\n    " << index_path << endl;
             }
         }
+    }
+    const UVGrid& grid = index.grid;
+    const vector <int>& vec_voi_id = index.voi_id;
+    const vector <float>& vec_u = index.vec_u;
+    const vector <float>& vec_v = index.vec_v;
+    cout << "  UV grid: " << grid.size_u << " x " << grid.size_v << " cells" << endl;
 
-        int n = temp_vec.size();
-        // --------------------------------------------------------------------
-        // Find median
-        // --------------------------------------------------------------------
-        if (mode_median) {
-            float m;
-            if (n % 2 == 0) {  // even
-                std::nth_element(temp_vec.begin(),
-                temp_vec.begin() + n / 2,
-                temp_vec.end());
-
-                std::nth_element(temp_vec.begin(),
-                temp_vec.begin() + (n - 1) / 2,
-                temp_vec.end());
-
-                m = (temp_vec[n / 2] + temp_vec[(n - 1) / 2]) / 2.0;
-
-            } else {  // odd
-                std::nth_element(temp_vec.begin(),
-                temp_vec.begin() + n / 2,
-                temp_vec.end());
-
-                m = temp_vec[n / 2];
+    // ========================================================================
+    // Visit each voxel to check their coordinate
+    // ========================================================================
+    parallel_for(nr_voi, nr_threads, [&](uint32_t begin, uint32_t end) {
+        vector <uint32_t> found;
+        for (uint32_t i = begin; i != end; ++i) {
+            if (begin == 0) {  // Report progress of the first chunk
+                cout << "\r    " << i * 100 / end << " %" << flush;
+            }
+            vector <float> temp_vec;
+            vector <int> temp_vec_id;
+            vector <float> temp_vec_d;
+
+            // ----------------------------------------------------------------
+            // Cylinder windowing in UVD space
+            // ----------------------------------------------------------------
+            uv_grid_query(grid, vec_u, vec_v, vec_d, i, radius, height, found);
+            for (uint32_t k = 0; k != found.size(); ++k) {
+                int j = found[k];
+                temp_vec.push_back(vec_val[j]);
+                temp_vec_id.push_back(vec_voi_id[j]);
+                temp_vec_d.push_back(vec_d[j]);
             }
 
-            *(nii_output_data + vec_voi_id[i]) = m;
-        }
-
-        // --------------------------------------------------------------------
-        // Find minimum
-        // --------------------------------------------------------------------
-        if (mode_min) {
-            float temp_ref = vec_val[i];
-            float temp_min = vec_val[i];
-            for (int j = 0; j != n; ++j) {
-                if (temp_vec[j] < temp_min) {
-                    temp_min = temp_vec[j];
+            int n = temp_vec.size();
+            // ----------------------------------------------------------------
+            // Find median
+            // ----------------------------------------------------------------
+            if (mode_median) {
+                float m;
+                if (n % 2 == 0) {  // even
+                    std::nth_element(temp_vec.begin(),
+                    temp_vec.begin() + n / 2,
+                    temp_vec.end());
+
+                    std::nth_element(temp_vec.begin(),
+                    temp_vec.begin() + (n - 1) / 2,
+                    temp_vec.end());
+
+                    m = (temp_vec[n / 2] + temp_vec[(n - 1) / 2]) / 2.0;
+
+                } else {  // odd
+                    std::nth_element(temp_vec.begin(),
+                    temp_vec.begin() + n / 2,
+                    temp_vec.end());
+
+                    m = temp_vec[n / 2];
                 }
-            }
 
-            if (temp_min < temp_ref) {
-                *(nii_output_data + vec_voi_id[i]) = 0;
-            } else {
-                *(nii_output_data + vec_voi_id[i]) = 1;
+                *(nii_output_data + vec_voi_id[i]) = m;
             }
-        }
 
-        // --------------------------------------------------------------------
-        // Find maximum (Works with binary mask)
-        // NOTE: temp_mask = 1 or 0
-        // --------------------------------------------------------------------
-        if (mode_max) {
-            float temp_ref = vec_val[i];
-            float temp_max = vec_val[i];
-            for (int j = 0; j != n; ++j) {
-                if (temp_vec[j] > temp_max) {
-                    temp_max = temp_vec[j];
+            // ----------------------------------------------------------------
+            // Find minimum
+            // ----------------------------------------------------------------
+            if (mode_min) {
+                float temp_ref = vec_val[i];
+                float temp_min = vec_val[i];
+                for (int j = 0; j != n; ++j) {
+                    if (temp_vec[j] < temp_min) {
+                        temp_min = temp_vec[j];
+                    }
                 }
-            }
-            *(nii_output_data + vec_voi_id[i]) = temp_max;
-            *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(n);
-        }
 
-        // --------------------------------------------------------------------
-        // A) Find functional columns: write back to a single voxel
-        // TODO[Faruk]: Code review this part.
-        // --------------------------------------------------------------------
-        if (mode_cols) {
-            int count1 = 0, count2 = 0,  count3 = 0, count4 = 0;
-            int m, c, t;
-            // Count occurrences
-            for (int j = 0; j != n; ++j) {
-                if (temp_vec[j] == 1) {
-                    count1 += 1;
-                } else if (temp_vec[j] == 2) {
-                    count2 += 1;
-                } else if (temp_vec[j] == 3) {
-                    count3 += 1;
-                } else if (temp_vec[j] == 4) {
-                    count4 += 1;
+                if (temp_min < temp_ref) {
+                    *(nii_output_data + vec_voi_id[i]) = 0;
+                } else {
+                    *(nii_output_data + vec_voi_id[i]) = 1;
                 }
             }
 
-            // Find the maximum (most common label)
-            if (count1 > count2 && count1 > count3 && count1 > count4) {
-                m = 1; c = count1;
-            } else if (count2 > count1 && count2 > count3 && count2 > count4) {
-                m = 2; c = count2;
-            } else if (count3 > count1 && count3 > count2 && count3 > count4) {
-                m = 3; c = count3;
-            } else if (count4 > count1 && count4 > count2 && count4 > count3) {
-                m = 4; c = count4;
+            // ----------------------------------------------------------------
+            // Find maximum (Works with binary mask)
+            // NOTE: temp_mask = 1 or 0
+            // ----------------------------------------------------------------
+            if (mode_max) {
+                float temp_max = vec_val[i];
+                for (int j = 0; j != n; ++j) {
+                    if (temp_vec[j] > temp_max) {
+                        temp_max = temp_vec[j];
+                    }
+                }
+                *(nii_output_data + vec_voi_id[i]) = temp_max;
+                *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(n);
             }
-            t = count1 + count2 + count3 + count4;
 
-            // Write the output (voxel wise)
-            *(nii_output_data + vec_voi_id[i]) = m;
-            *(nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(c)/t;
-            *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(t);
-        }
-        // --------------------------------------------------------------------
-        // B) Find functional columns (strict definition): Write back to all
-        // window
-        // TODO[Faruk]: This section might be redundant or needs to be
-        // reimplemented.
-        // --------------------------------------------------------------------
-        // if (mode_cols) {
-        //     float temp_ref = vec_val[i];
-        //     bool iscolumn = true;
-        //     for (int j = 0; j != n; ++j) {
-        //         if (temp_vec[j] != temp_ref) {
-        //             iscolumn = false;
-        //             break;
-        //         }
-        //     }
-        //
-        //     if (iscolumn && temp_ref > 0) {
-        //         for (int j = 0; j != n; ++j) {
-        //             *(nii_output_data + temp_vec_id[j]) = temp_ref;
-        //             *(nii_output_extra_data + temp_vec_id[j]) = n;
-        //         }
-        //     }
-        // }
-
-        // --------------------------------------------------------------------
-        // Find peak depth of maximum (Works with binary mask)
-        // NOTE: temp_mask = 1 or 0
-        // --------------------------------------------------------------------
-        if (mode_peak) {
-            float temp_ref = vec_val[i];
-            float temp_max = vec_val[i];
-            float temp_peak = vec_d[i];
-
-            for (int j = 0; j != n; ++j) {
-                if (temp_vec[j] > temp_max) {
-                    temp_max = temp_vec[j];
-                    temp_peak = temp_vec_d[j];
+            // ----------------------------------------------------------------
+            // A) Find functional columns: write back to a single voxel
+            // TODO[Faruk]: Code review this part.
+            // ----------------------------------------------------------------
+            if (mode_cols) {
+                int count1 = 0, count2 = 0,  count3 = 0, count4 = 0;
+                int m = 0, c = 0, t;
+                // Count occurrences
+                for (int j = 0; j != n; ++j) {
+                    if (temp_vec[j] == 1) {
+                        count1 += 1;
+                    } else if (temp_vec[j] == 2) {
+                        count2 += 1;
+                    } else if (temp_vec[j] == 3) {
+                        count3 += 1;
+                    } else if (temp_vec[j] == 4) {
+                        count4 += 1;
+                    }
                 }
+
+                // Find the maximum (most common label)
+                if (count1 > count2 && count1 > count3 && count1 > count4) {
+                    m = 1; c = count1;
+                } else if (count2 > count1 && count2 > count3 && count2 > count4) {
+                    m = 2; c = count2;
+                } else if (count3 > count1 && count3 > count2 && count3 > count4) {
+                    m = 3; c = count3;
+                } else if (count4 > count1 && count4 > count2 && count4 > count3) {
+                    m = 4; c = count4;
+                }
+                t = count1 + count2 + count3 + count4;
+
+                // Write the output (voxel wise)
+                *(nii_output_data + vec_voi_id[i]) = m;
+                *(nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(c)/t;
+                *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(t);
+            }
+            // ----------------------------------------------------------------
+            // B) Find functional columns (strict definition): Write back to all
+            // window
+            // TODO[Faruk]: This section might be redundant or needs to be
+            // reimplemented.
+            // ----------------------------------------------------------------
+            // if (mode_cols) {
+            //     float temp_ref = vec_val[i];
+            //     bool iscolumn = true;
+            //     for (int j = 0; j != n; ++j) {
+            //         if (temp_vec[j] != temp_ref) {
+            //             iscolumn = false;
+            //             break;
+            //         }
+            //     }
+            //
+            //     if (iscolumn && temp_ref > 0) {
+            //         for (int j = 0; j != n; ++j) {
+            //             *(nii_output_data + temp_vec_id[j]) = temp_ref;
+            //             *(nii_output_extra_data + temp_vec_id[j]) = n;
+            //         }
+            //     }
+            // }
+
+            // ----------------------------------------------------------------
+            // Find peak depth of maximum (Works with binary mask)
+            // NOTE: temp_mask = 1 or 0
+            // ----------------------------------------------------------------
+            if (mode_peak) {
+                float temp_max = vec_val[i];
+                float temp_peak = vec_d[i];
+
+                for (int j = 0; j != n; ++j) {
+                    if (temp_vec[j] > temp_max) {
+                        temp_max = temp_vec[j];
+                        temp_peak = temp_vec_d[j];
+                    }
+                }
+                *(nii_output_data + vec_voi_id[i]) = temp_peak;
+                *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(n);
             }
-            *(nii_output_data + vec_voi_id[i]) = temp_peak;
-            *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(n);
-        }
 
-        // --------------------------------------------------------------------
-        // Count number of unique labels within each window
-        // --------------------------------------------------------------------
-        if (mode_count_uniques) {
-            unordered_set<int> unique_elements;
-            for (int j = 0; j != n; ++j) {
-                unique_elements.insert(temp_vec[j]);
+            // ----------------------------------------------------------------
+            // Count number of unique labels within each window
+            // ----------------------------------------------------------------
+            if (mode_count_uniques) {
+                unordered_set<int> unique_elements;
+                for (int j = 0; j != n; ++j) {
+                    unique_elements.insert(temp_vec[j]);
+                }
+                *(nii_output_data + vec_voi_id[i]) = unique_elements.size();
+                *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(n);
             }
-            *(nii_output_data + vec_voi_id[i]) = unique_elements.size();
-            *(temp_nii_output_extra_data + vec_voi_id[i]) = static_cast<float>(n);
         }
-    }
-    cout << endl;
+    });
+    cout << "\r    100 %" << endl;
 
     if (mode_median) {
         save_output_nifti(fout, "UVD_median_filter", nii_output, true);
@@ -455,6 +503,9 @@ int main(int argc, char* argv[]) {
         save_output_nifti(fout, "UVD_columns_mode_filter", nii_output, true);
         save_output_nifti(fout, "UVD_columns_mode_filter_window_count_ratio", nii_output_extra, true);
         save_output_nifti(fout, "UVD_columns_mode_filter_window_count", temp_nii_output_extra, true);
+    } else if (mode_count_uniques) {
+        save_output_nifti(fout, "UVD_count_uniques_filter", nii_output, true);
+        save_output_nifti(fout, "UVD_count_uniques_filter_window_count", temp_nii_output_extra, true);
     }
 
     cout << "\n  Finished." << endl;
@@ -47,6 +47,10 @@ int show_help(void) {
     "                are often in 0-1 range. The cylinder is centered around each voxel\n"
     "                therefore, to ensure all depth is included, this parameter should be\n"
     "                set to 2 when normalized depth metrics are being used.\n"
+    "    -uv_index : (Optional) Cache the UV point cloud index in a file next to\n"
+    "                the '-coord_uv' file (named '*_UVindex.bin'). When the file\n"
+    "                exists and matches the inputs, it is loaded and the UV\n"
+    "                coordinates file is not read.\n"
     "    -output   : (Optional) Output basename for all outputs.\n"
     "\n");
     return 0;
@@ -58,6 +62,7 @@ int main(int argc, char* argv[]) {
     char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL;
     int ac;
     float radius = 3, height = 0.25;
+    bool use_uv_index = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -96,6 +101,8 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             height = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-uv_index")) {
+            use_uv_index = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -127,11 +134,6 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
         return 2;
     }
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
-    }
     nii3 = nifti_image_read(fin3, 1);
     if (!nii3) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin3);
@@ -140,7 +142,6 @@ int main(int argc, char* argv[]) {
 
     log_welcome("LN2_UVD_LSTSQR");
     log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
     log_nifti_descriptives(nii3);
 
     // Get dimensions of input
@@ -148,12 +149,10 @@ int main(int argc, char* argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
-    float* nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* coords_uv = copy_nifti_as_float32(nii2);
-    float* coords_uv_data = static_cast<float*>(coords_uv->data);
-    nifti_image* coords_d = copy_nifti_as_float32(nii3);
-    float* coords_d_data = static_cast<float*>(coords_d->data);
+    nifti_image* nii_input = nii1;
+    float* nii_input_data = nifti_data_as<float>(nii_input);
+    nifti_image* coords_d = nii3;
+    float* coords_d_data = nifti_data_as<float>(coords_d);
 
     // ========================================================================
     // Prepare outputs
@@ -178,43 +177,76 @@ int main(int argc, char* argv[]) {
     // NOTE(Faruk): This section is required for substantial
     // speed boost.
     // Find the subset voxels that will be used many times
-    int nr_voi = 0;  // Voxels of interest
-    vector <int> vec_voi_id;
-    vector <float> vec_u, vec_v, vec_d, vec_val;
-    for (int i = 0; i != nr_voxels; ++i) {
-        if (*(coords_uv_data + i) != 0){
-            vec_voi_id.push_back(i);
-            vec_u.push_back(*(coords_uv_data + nr_voxels*0 + i));
-            vec_v.push_back(*(coords_uv_data + nr_voxels*1 + i));
-            vec_d.push_back(*(coords_d_data + i));
-            vec_val.push_back(*(nii_input_data + i));
-            nr_voi += 1;
+    // NOTE: Voxels of interest are the ones with non-zero U coordinate. The
+    // index is keyed on the UV file alone (empty voxel list).
+    UVIndex index;
+    bool index_loaded = false;
+    string index_path = uv_index_path(fin2);
+    uint64_t index_key = uv_index_key(fin2, vector<int>());
+    if (use_uv_index) {
+        index_loaded = uv_index_load(index_path, index_key, index)
+            && index.nr_voxels == static_cast<uint32_t>(nr_voxels);
+    }
+
+    if (index_loaded) {
+        cout << "  Loaded UV index from:\n    " << index_path << endl;
+        // Cell size follows the radius the index was built with. Queries are
+        // exact for any radius, re-bucket only when it is far off.
+        if (index.grid.cell_size < radius / 2 || index.grid.cell_size > radius * 2) {
+            uv_grid_build(index.grid, index.vec_u, index.vec_v, radius);
+        }
+    } else {
+        nii2 = nifti_image_read(fin2, 1);
+        if (!nii2) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+            return 2;
+        }
+        log_nifti_descriptives(nii2);
+        nifti_image* coords_uv = nii2;
+        float* coords_uv_data = nifti_data_as<float>(coords_uv);
+        vector <int> uv_voi_id;
+        for (int i = 0; i != nr_voxels; ++i) {
+            if (*(coords_uv_data + i) != 0){
+                uv_voi_id.push_back(i);
+            }
+        }
+        uv_index_build(index, coords_uv_data, nr_voxels, uv_voi_id, radius);
+        nifti_image_free(coords_uv);
+
+        if (use_uv_index) {
+            if (uv_index_save(index_path, index_key, index)) {
+                cout << "  Saved UV index as:\n    " << index_path << endl;
+            } else {
+                cout << "  WARNING: Could not save UV index as:\n    " << index_path << endl;
+            }
         }
     }
+    const vector <int>& vec_voi_id = index.voi_id;
+    int nr_voi = vec_voi_id.size();  // Voxels of interest
+    vector <float> vec_d(nr_voi), vec_val(nr_voi);
+    for (int i = 0; i != nr_voi; ++i) {
+        vec_d[i] = *(coords_d_data + vec_voi_id[i]);
+        vec_val[i] = *(nii_input_data + vec_voi_id[i]);
+    }
 
     // ========================================================================
     // Visit each voxel
     // ========================================================================
     cout << "  Fitting..." << endl;
 
-    float half_height = height / 2;
-    float radius_sqr = radius * radius;
+    vector <uint32_t> found;
     for (int i = 0; i != nr_voi; ++i) {
+        cout << "\r    " << i << "/" << nr_voi << flush;
+
         // --------------------------------------------------------------------
         // Cylinder windowing in UVD space
         // --------------------------------------------------------------------
-        vector <float> vec_y;
-        for (int j = 0; j != nr_voi; ++j) {
-            cout << "\r    " << i << "/" << nr_voi << flush;
-
-            // Compute distances relative to reference UVD
-            if (abs(vec_d[i] - vec_d[j]) < half_height) {  // Check height
-                float dist_uv = (vec_u[i] - vec_u[j])*(vec_u[i] - vec_u[j])
-                    + (vec_v[i] - vec_v[j])*(vec_v[i] - vec_v[j]);
-                if (dist_uv < radius_sqr) {  // Check Euclidean distance
-                    vec_y.push_back(vec_val[j]);
-                }
-            }
+        uv_grid_query(index.grid, index.vec_u, index.vec_v, vec_d, i, radius,
+                      height, found);
+        vector <float> vec_y, vec_y_d;
+        for (uint32_t k = 0; k != found.size(); ++k) {
+            vec_y.push_back(vec_val[found[k]]);
+            vec_y_d.push_back(vec_d[found[k]]);
         }
 
         int n = vec_y.size();
@@ -224,7 +256,7 @@ int main(int argc, char* argv[]) {
             // ----------------------------------------------------------------
             vector <float> vec_y_sorted(n);
             int k = 0;
-            for (auto j: sort_indexes(vec_d)) {
+            for (auto j: sort_indexes(vec_y_d)) {
               vec_y_sorted[k] = vec_y[j];
               k += 1;
             }
@@ -17,6 +17,12 @@ int show_help(void) {
     "    -init         : Initial voxels.\n"
     "    -max_dist     : (Optional) Maximum distance from the initial voxels\n"
     "                    where Voronoi cells will be propagated.\n"
+    "    -dijkstra     : (Optional) Label each domain voxel with its nearest\n"
+    "                    initial voxel in a single pass over a priority queue\n"
+    "                    (26-neighbourhood). Propagation stops at '-max_dist'.\n"
+    "                    Much faster on large domains. Cell borders can differ\n"
+    "                    slightly from the default propagation, which only\n"
+    "                    takes diagonal steps away from the domain edges.\n"
     "    -iter_smooth  : (Optional) Number of smoothing iterations. Default\n"
     "                    is 0 (no smoothing).\n"
     "    -debug        : (Optional) Save extra intermediate outputs.\n"
@@ -30,6 +36,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL, *fin2=NULL;
     int ac;
     bool mode_debug = false, mode_initialize_with_centroids = false;
+    bool mode_dijkstra = false;
     float max_dist = std::numeric_limits<float>::max();
     int iter_smooth = 0;
 
@@ -70,6 +77,8 @@ int main(int argc, char*  argv[]) {
             } else {
                 iter_smooth = atof(argv[ac]);
             }
+        } else if (!strcmp(argv[ac], "-dijkstra")) {
+            mode_dijkstra = true;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else {
@@ -115,27 +124,22 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
-    const float dX = nii1->pixdim[1];
-    const float dY = nii1->pixdim[2];
-    const float dZ = nii1->pixdim[3];
-
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
+    float dX = nii1->pixdim[1];
+    float dY = nii1->pixdim[2];
+    float dZ = nii1->pixdim[3];
+    // NOTE: Dijkstra buckets are as wide as the shortest voxel side
+    if (mode_dijkstra && !(dX > 0 && dY > 0 && dZ > 0)) {
+        cout << "  WARNING: Voxel sizes are not positive (" << dX << ", " << dY
+            << ", " << dZ << "). Using 1 for all dimensions." << endl;
+        dX = 1, dY = 1, dZ = 1;
+    }
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_domain = copy_nifti_as_int32(nii1);
-    int32_t* nii_domain_data = static_cast<int32_t*>(nii_domain->data);
+    nifti_image* nii_domain = nii1;
+    int32_t* nii_domain_data = nifti_data_as<int32_t>(nii_domain);
     // Binarize
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         if (*(nii_domain_data + i) != 0) {
@@ -146,8 +150,8 @@ int main(int argc, char*  argv[]) {
     }
 
     // Prepare required nifti images
-    nifti_image* nii_init  = copy_nifti_as_int32(nii2);
-    int32_t* nii_init_data = static_cast<int32_t*>(nii_init->data);
+    nifti_image* nii_init = nii2;
+    int32_t* nii_init_data = nifti_data_as<int32_t>(nii_init);
 
     nifti_image* flood_step = copy_nifti_as_int32(nii_init);
     int32_t* flood_step_data = static_cast<int32_t*>(flood_step->data);
@@ -202,359 +206,81 @@ int main(int argc, char*  argv[]) {
         }
     }
 
-    int32_t grow_step = 1;
-    uint32_t ix, iy, iz, j;
-    float d;
-    int voxel_counter = nr_voxels;
-    while (voxel_counter != 0) {
-        voxel_counter = 0;
+    if (mode_dijkstra) {
+        // NOTE: All initial voxels are sources of one multi-source Dijkstra
+        // pass. Voxels farther than the maximum distance are never visited.
+        vector<uint32_t> sources;
+        uint8_t* domain_mask = (uint8_t*) calloc(nr_voxels, sizeof(uint8_t));
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
             i = *(voi_id + ii);
-            if (*(flood_step_data + i) == grow_step && *(flood_dist_data + i) < max_dist) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-                bool jump_lock = false;
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dX;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_init_data + j) = *(nii_init_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dX;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_init_data + j) = *(nii_init_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dY;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_init_data + j) = *(nii_init_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dY;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_init_data + j) = *(nii_init_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dZ;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_init_data + j) = *(nii_init_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dZ;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_init_data + j) = *(nii_init_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (jump_lock == false) {
+            *(domain_mask + i) = 1;
+            *(flood_dist_data + i) = std::numeric_limits<float>::infinity();
+            if (*(nii_init_data + i) != 0) {
+                sources.push_back(i);
+            }
+        }
+        grow_dijkstra(domain_mask, sources, size_x, size_y, size_z, dX, dY, dZ,
+                      flood_dist_data, nii_init_data, max_dist);
+        free(domain_mask);
 
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
+        // Unreached voxels get zero distance, same as the propagation below
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            i = *(voi_id + ii);
+            if (*(flood_dist_data + i) == std::numeric_limits<float>::infinity()) {
+                *(flood_dist_data + i) = 0;
+                *(flood_step_data + i) = 0;
+            } else {
+                *(flood_step_data + i) = 1;
+            }
+        }
+    } else {
+        // NOTE: Padding is marked with 2 so that only face neighbours inside
+        // the image but outside of the domain lock the 2 and 3-jump neighbours.
+        const Neighbourhood nb = make_neighbourhood(26, size_x, size_y, dX, dY, dZ);
+        const vector<uint8_t> domain_pad = make_padded_mask(
+            nii_domain_data, size_x, size_y, size_z,
+            [](int32_t v) {return v != 0;}, 2);
+        uint32_t* voi_pad = (uint32_t*) malloc(nr_voi*sizeof(uint32_t));
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            *(voi_pad + ii) = pad_index(*(voi_id + ii), size_x, size_y);
+        }
 
-                    // ------------------------------------------------------------
-                    // 3-jump neighbours
-                    // ------------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
+        int32_t grow_step = 1;
+        uint32_t j, p;
+        float d;
+        int voxel_counter = nr_voxels;
+        while (voxel_counter != 0) {
+            voxel_counter = 0;
+            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+                i = *(voi_id + ii);
+                if (*(flood_step_data + i) == grow_step && *(flood_dist_data + i) < max_dist) {
+                    p = *(voi_pad + ii);
+                    voxel_counter += 1;
+                    bool jump_lock = false;
+                    for (int k = 0; k != nb.nr; ++k) {
+                        // 2 and 3-jump neighbours only when no face is locked
+                        if (k == 6 && jump_lock) {
+                            break;
                         }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_init_data + j) = *(nii_init_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
+                        uint8_t m = domain_pad[p + nb.pad_offset[k]];
+                        if (m == 1) {
+                            j = i + nb.offset[k];
+                            d = *(flood_dist_data + i) + nb.dist[k];
                             if (d < *(flood_dist_data + j)
                                 || *(flood_dist_data + j) == 0) {
                                 *(flood_dist_data + j) = d;
                                 *(flood_step_data + j) = grow_step + 1;
                                 *(nii_init_data + j) = *(nii_init_data + i);
                             }
+                        } else if (m == 0 && k < 6) {
+                            jump_lock = true;
                         }
                     }
                 }
             }
+            grow_step += 1;
         }
-        grow_step += 1;
+        free(voi_pad);
     }
 
     if (mode_debug) {
@@ -95,8 +95,8 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii1 = copy_nifti_as_int32(nii_input);
-    int32_t* nii1_data = static_cast<int32_t*>(nii1->data);
+    nifti_image* nii1 = nii_input;
+    int32_t* nii1_data = nifti_data_as<int32_t>(nii1);
 
     // Prepare output nifti
     nifti_image* nii2 = copy_nifti_as_int32(nii1);
@@ -95,21 +95,17 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
-    nifti_image* nii_values = copy_nifti_as_float32(nii1);
-    float* nii_values_data = static_cast<float*>(nii_values->data);
-    nifti_image* nii_domain = copy_nifti_as_int32(nii2);
-    int32_t* nii_domain_data = static_cast<int32_t*>(nii_domain->data);
-    free(nii2);
+    nifti_image* nii_values = nii1;
+    float* nii_values_data = nifti_data_as<float>(nii_values);
+    nifti_image* nii_domain = nii2;
+    int32_t* nii_domain_data = nifti_data_as<int32_t>(nii_domain);
 
-    // Output nifti
-    nifti_image* nii_out = copy_nifti_as_int32(nii1);
+    // Output nifti (all zeros)
+    nifti_image* nii_out = nifti_copy_nim_info(nii_values);
+    nii_out->datatype = NIFTI_TYPE_INT32;
+    nii_out->nbyper = sizeof(int32_t);
+    nii_out->data = calloc(nii_out->nvox, nii_out->nbyper);
     int32_t* nii_out_data = static_cast<int32_t*>(nii_out->data);
-    free(nii1);
-
-    // Clean output array
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_out_data + i) = 0;
-    }
 
     // ------------------------------------------------------------------------
     // NOTE(Faruk): This section is written to constrain the big iterative
@@ -25,6 +25,9 @@ int show_help(void) {
     "                 The parameter is the trial duration in TRs.\n"
     "    -alt       : (Optional, !EXPERIMENTAL!) Alternative BOLD correction.\n"
     "                 Guaranteed to give values within 0-1 range.\n"
+    "    -max_mem   : (Optional) Memory in MB for the time series that are\n"
+    "                 processed at once with -shift or -trialBOCO. The data\n"
+    "                 is read in slabs of z slices. Default is 2048.\n"
     "    -output    : (Optional) Output basename, including .nii or\n"
     "                 .nii.gz, and path if needed. Overwrites existing files.\n"
     "                 Note different to other LayNii programs in LN_COCO \n"
@@ -45,6 +48,7 @@ int main(int argc, char * argv[]) {
     bool use_outpath = true, mode_alt = false;
     int ac, shift = 0;
     int trialdur = 0;
+    uint64_t max_mem = 2048;
     if (argc < 2) return show_help();
 
     // Process user options: 4 are valid presently
@@ -72,6 +76,12 @@ int main(int argc, char * argv[]) {
         } else if (!strcmp(argv[ac], "-shift")) {
             shift = 1;
             cout << "Do a correlation analysis with temporal shifts."  << endl;
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            max_mem = atoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -96,277 +106,298 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image* nii1 = nifti_image_read(fin_1, 1);
-    if (!nii1) {
+    // Read input headers, data is streamed
+    NiftiReader reader1, reader2;
+    if (!nifti_reader_open(reader1, fin_1)) {
         fprintf(stderr, "** failed to read NIfTI from '%s'.\n", fin_1);
         return 2;
     }
-    nifti_image* nii2 = nifti_image_read(fin_2, 1);
-    if (!nii2) {
+    if (!nifti_reader_open(reader2, fin_2)) {
         fprintf(stderr, "** failed to read NIfTI from '%s'.\n", fin_2);
         return 2;
     }
+    nifti_image* nii1 = reader1.nii;
+    nifti_image* nii2 = reader2.nii;
 
     log_welcome("LN_BOCO");
     log_nifti_descriptives(nii1);
     log_nifti_descriptives(nii2);
 
     // Get dimensions of input
-    const int size_x = nii1->nx;
-    const int size_y = nii1->ny;
     const int size_z = nii1->nz;
     const int size_time = nii1->nt;
-    const int nx = nii1->nx;
     const int nxy = nii1->nx * nii1->ny;
     const int nxyz = nii1->nx * nii1->ny * nii1->nz;
-    const int nr_voxels = size_time * size_z * size_y * size_x;
-
-    // ========================================================================
-    // Fix datatype issues
-    nifti_image *nii_nulled = copy_nifti_as_float32(nii1);
-    float *nii_nulled_data = static_cast<float*>(nii_nulled->data);
-    nifti_image *nii_bold = copy_nifti_as_float32(nii2);
-    float *nii_bold_data = static_cast<float*>(nii_bold->data);
-
-    // Allocate new nifti
-    nifti_image *nii_boco_vaso = copy_nifti_as_float32(nii1);
-    float *nii_boco_vaso_data = static_cast<float*>(nii_boco_vaso->data);
-    
-    
-
+    const int nr_voxels = size_time * nxyz;
 
     // ========================================================================
     // Handle scaling factor effects
     // TODO(Faruk): I am not sure we need this part anymore. Need to check.
-    
-    float scl_slope1=nii_nulled->scl_slope, scl_slope2=nii_bold->scl_slope;
+    float scl_slope1 = nii1->scl_slope, scl_slope2 = nii2->scl_slope;
     if (scl_slope2 != 0 || scl_slope1 != 0 ) { 
         cout << "    !!!Warning!!! Input nifti header contains scl_scale !=0.\n"
              << "    Make sure to check the resulting output image.\n"<< endl;
     }
-    if (scl_slope1 != 0 ) {
-        for (int i = 0; i != nr_voxels; ++i) {
-            *(nii_nulled_data + i) *= scl_slope1;
-        }
-    } 
-    if (scl_slope2 != 0) {
-        for (int i = 0; i != nr_voxels; ++i) {
-            *(nii_bold_data + i) *= scl_slope2;
-        }
-    }
 
-    // We can set scaling factor to 1 because we have accounted for them above
-    nii_nulled->scl_slope = 1.;
-    nii_bold->scl_slope = 1.;
+    // We can set scaling factor to 1 because we account for them below
+    nifti_image* nii_boco_vaso = nifti_copy_nim_info(nii1);
     nii_boco_vaso->scl_slope = 1.;
-    
+
     // ========================================================================
-    // BOLD correction
+    // Prepare streaming
     // ========================================================================
-    if (mode_alt) {
-        int nr_invalid_voxels = 0, nr_zero_voxels = 0;
-        for (int i = 0; i != nr_voxels; ++i) {
-            float nc = *(nii_nulled_data + i);  // Nulled condition
-            float nn = (*(nii_bold_data + i));  // Not nulled condition (a.k.a BOLD)
-
-            float S_ex = nc;  // Approximately extravascular signal
-            float S_in = nn - nc;  // Approximately intravascular signal
-
-            if (nc <= 0 || nn <= 0) {
-                *(nii_boco_vaso_data + i) = 0;
-                nr_zero_voxels += 1;
-            }  else {
-                if (S_in <= 0) {
-                    // VASO assumptions invalid S_in should not be negative.
-                    S_in *= -1;
-                    nr_invalid_voxels += 1;
-                }
-                // Compute relative contribution (always between -1 to 1)
-                *(nii_boco_vaso_data + i) =  S_ex / (S_ex + S_in);
-            }
-        }
-        float term1 = static_cast<float>(nr_invalid_voxels);
-        float term2 = static_cast<float>(nr_voxels - nr_zero_voxels);
+    // NOTE: Without -shift and -trialBOCO every value is corrected on its
+    // own, so the data is processed volume by volume. Otherwise the time
+    // series of one slab of z slices are in memory at a time ([time][slab
+    // voxel] for nulled, BOLD and VASO).
+    const bool mode_slab = shift == 1 || trialdur != 0;
+    const int slab_z = mode_slab ? nifti_slab_size(nii1, max_mem << 20, 3) : size_z;
+    const int nr_chunks = mode_slab ? (size_z + slab_z - 1) / slab_z : size_time;
+    const int nr_chunk_max = mode_slab ? nxy * slab_z * size_time : nxyz;
+    float* nii_nulled_data = static_cast<float*>(malloc(nr_chunk_max * sizeof(float)));
+    float* nii_bold_data = static_cast<float*>(malloc(nr_chunk_max * sizeof(float)));
+    float* nii_boco_vaso_data = static_cast<float*>(malloc(nr_chunk_max * sizeof(float)));
+    if (mode_slab && slab_z < size_z) {
+        cout << "    Slabs of " << slab_z << " slices" << endl;
+    }
 
-        cout << "  Voxels with invalid VASO assumption:" << endl;
-        cout << "    "
-            << nr_invalid_voxels << "/" << nr_voxels - nr_zero_voxels
-            << "\n    " << (term1 / term2) * 100 << "%\n" << endl;
+    NiftiWriter writer_vaso;
+    if (use_outpath) {
+        if (!nifti_writer_open(writer_vaso, nii_boco_vaso, size_time,
+                               output_path("VASO_LN", "", true))) return 2;
     } else {
-
-        for (int i = 0; i != nr_voxels; ++i) {
-            float nc = *(nii_nulled_data + i);  // Nulled condition
-            float nn = *(nii_bold_data + i);  // Not nulled condition (a.k.a BOLD)
-
-            if (nc <= 0 || nn <= 0) {  // Skip masked-out or invalid voxels
-                *(nii_boco_vaso_data + i) = 0;
-            }  else {  // BOLD correction is happening here
-                *(nii_boco_vaso_data + i) = nc / nn;
-            }
-        }
-        // Clip VASO values that are unrealistic
-        for (int i = 0; i != nr_voxels; ++i) {
-            if (*(nii_boco_vaso_data + i) <= 0) {
-                *(nii_boco_vaso_data + i) = 0;
-            }
-            if (*(nii_boco_vaso_data + i) >= 5) {
-                *(nii_boco_vaso_data + i) = 5;
-            }
-        }
+        if (!nifti_writer_open(writer_vaso, nii_boco_vaso, size_time,
+                               output_path(fout, "VASO_LN", false))) return 2;
     }
 
-    // ========================================================================
-    // Shift
-    // ========================================================================
+    nifti_image* correl_file = NULL;
+    float* correl_file_data = NULL;
     if (shift == 1) {
-        nifti_image* correl_file  = nifti_copy_nim_info(nii_nulled);
+        correl_file  = nifti_copy_nim_info(nii_boco_vaso);
         correl_file->nt = 7;
-        correl_file->nvox = nii_nulled->nvox / size_time *7;
+        correl_file->nvox = nii1->nvox / size_time *7;
         correl_file->datatype = NIFTI_TYPE_FLOAT32;
         correl_file->nbyper = sizeof(float);
         correl_file->data = calloc(correl_file->nvox, correl_file->nbyper);
-        float* correl_file_data = static_cast<float*>(correl_file->data);
-
-        double vec_file1[size_time];
-        double vec_file2[size_time];
+        correl_file_data = static_cast<float*>(correl_file->data);
+    }
 
-        for (int shift = -3; shift <= 3; ++shift) {
-            cout << "  Calculating shift = " << shift << endl;
-            for (int j = 0; j != size_z * size_y * size_x; ++j) {
-                for (int t = 3; t < size_time-3; ++t) {
-                    *(nii_boco_vaso_data + nxyz * t + j)  =      *(nii_nulled_data + nxyz * t + j)  / *(nii_bold_data + nxyz * (t + shift) + j);
-                }
-                for (int t = 0; t < size_time; ++t) {
-                    vec_file1[t] = *(nii_boco_vaso_data + nxyz * t + j);
-                    vec_file2[t] = *(nii_bold_data + nxyz * t + j);
-                }
-                *(correl_file_data + nxyz * (shift + 3) + j) =  ren_correl(vec_file1, vec_file2, size_time);
-            }
+    // Trial averave files
+    int nr_trials = 0;
+    NiftiWriter writer_avg1, writer_avg2;
+    float* nii_avg1_data = NULL;
+    float* nii_avg1_B_data = NULL;
+    if (trialdur != 0) {
+        nr_trials = size_time / trialdur;
+        nii_avg1_data = static_cast<float*>(malloc(nxy * slab_z * trialdur * sizeof(float)));
+        nii_avg1_B_data = static_cast<float*>(malloc(nxy * slab_z * trialdur * sizeof(float)));
+        if (use_outpath) {
+            if (!nifti_writer_open(writer_avg1, nii1, trialdur,
+                                   output_path("VASO_trialAV_LN", "", true))) return 2;
+            if (!nifti_writer_open(writer_avg2, nii1, trialdur,
+                                   output_path("BOLD_trialAV_LN", "", true))) return 2;
+        } else {
+            if (!nifti_writer_open(writer_avg1, nii1, trialdur,
+                                   output_path(fout, "VASO_trialAV_LN", false))) return 2;
+            if (!nifti_writer_open(writer_avg2, nii1, trialdur,
+                                   output_path(fout, "BOLD_trialAV_LN", false))) return 2;
         }
+    }
 
-
-
-        // Get back to default
-        for (int i = 0; i != nr_voxels; ++i) {
-            *(nii_boco_vaso_data + i) = *(nii_nulled_data + i)
-                                        / *(nii_bold_data + i);
+    int nr_invalid_voxels = 0, nr_zero_voxels = 0;
+    for (int c = 0; c < nr_chunks; ++c) {
+        const int z0 = c * slab_z;
+        const int nr_slab = mode_slab ? nxy * min(slab_z, size_z - z0) : nxyz;
+        const int nr_chunk = mode_slab ? nr_slab * size_time : nxyz;
+        if (mode_slab) {
+            if (!nifti_reader_read_slab(reader1, z0, nr_slab / nxy, nii_nulled_data)) return 2;
+            if (!nifti_reader_read_slab(reader2, z0, nr_slab / nxy, nii_bold_data)) return 2;
+        } else {
+            if (!nifti_reader_read_volume(reader1, c, nii_nulled_data)) return 2;
+            if (!nifti_reader_read_volume(reader2, c, nii_bold_data)) return 2;
         }
 
-        // Clean VASO values that are unrealistic
-        for (int i = 0; i != nr_voxels; ++i) {
-           if (*(nii_boco_vaso_data + i) <= 0) {
-                *(nii_boco_vaso_data + i) = 0;
+        if (scl_slope1 != 0 ) {
+            for (int i = 0; i != nr_chunk; ++i) {
+                *(nii_nulled_data + i) *= scl_slope1;
             }
-            if (*(nii_boco_vaso_data + i) >= 2) {
-                *(nii_boco_vaso_data + i) = 2;
+        } 
+        if (scl_slope2 != 0) {
+            for (int i = 0; i != nr_chunk; ++i) {
+                *(nii_bold_data + i) *= scl_slope2;
             }
         }
 
-            // Replace nans with zeros
-        for (int i = 0; i < nr_voxels; ++i) {
-            if (*(correl_file_data + i)!= *(correl_file_data + i)) {
-               *(correl_file_data + i) = 0;
+        // ====================================================================
+        // BOLD correction
+        // ====================================================================
+        if (mode_alt) {
+            for (int i = 0; i != nr_chunk; ++i) {
+                float nc = *(nii_nulled_data + i);  // Nulled condition
+                float nn = (*(nii_bold_data + i));  // Not nulled condition (a.k.a BOLD)
+                float S_ex = nc;  // Approximately extravascular signal
+                float S_in = nn - nc;  // Approximately intravascular signal
+                if (nc <= 0 || nn <= 0) {
+                    *(nii_boco_vaso_data + i) = 0;
+                    nr_zero_voxels += 1;
+                }  else {
+                    if (S_in <= 0) {
+                        // VASO assumptions invalid S_in should not be negative.
+                        S_in *= -1;
+                        nr_invalid_voxels += 1;
+                    }
+                    // Compute relative contribution (always between -1 to 1)
+                    *(nii_boco_vaso_data + i) =  S_ex / (S_ex + S_in);
+                }
+            }
+        } else {
+            for (int i = 0; i != nr_chunk; ++i) {
+                float nc = *(nii_nulled_data + i);  // Nulled condition
+                float nn = *(nii_bold_data + i);  // Not nulled condition (a.k.a BOLD)
+                if (nc <= 0 || nn <= 0) {  // Skip masked-out or invalid voxels
+                    *(nii_boco_vaso_data + i) = 0;
+                }  else {  // BOLD correction is happening here
+                    *(nii_boco_vaso_data + i) = nc / nn;
+                }
+            }
+            // Clip VASO values that are unrealistic
+            for (int i = 0; i != nr_chunk; ++i) {
+                if (*(nii_boco_vaso_data + i) <= 0) {
+                    *(nii_boco_vaso_data + i) = 0;
+                }
+                if (*(nii_boco_vaso_data + i) >= 5) {
+                    *(nii_boco_vaso_data + i) = 5;
+                }
             }
         }
 
-        save_output_nifti(fout, "shift_correlated", correl_file, false);
-    }
-
-    // ========================================================================
-    // Trial average
-    // ========================================================================
-    if (trialdur != 0) {
-        cout << "  Doing BOLD correction after trial average..." << endl;
-        cout << "    Trial duration is " << trialdur
-             << ". This means there are " << (float)size_time / (float)trialdur
-             <<  " trials recorded here." << endl;
-
-        int nr_trials = size_time / trialdur;
-        // Trial averave file
-        nifti_image *nii_avg1 = nifti_copy_nim_info(nii1);
-        nii_avg1->nt = trialdur;
-        nii_avg1->nvox = nii1->nvox / size_time * trialdur;
-        nii_avg1->datatype = NIFTI_TYPE_FLOAT32;
-        nii_avg1->nbyper = sizeof(float);
-        nii_avg1->data = calloc(nii_avg1->nvox, nii_avg1->nbyper);
-        float  *nii_avg1_data  = static_cast<float*>(nii_avg1->data);
+        // ====================================================================
+        // Shift
+        // ====================================================================
+        if (shift == 1) {
+            double vec_file1[size_time];
+            double vec_file2[size_time];
+            for (int shift = -3; shift <= 3; ++shift) {
+                if (c == 0) cout << "  Calculating shift = " << shift << endl;
+                for (int j = 0; j != nr_slab; ++j) {
+                    for (int t = 0; t < size_time; ++t) {
+                        vec_file2[t] = *(nii_bold_data + nr_slab * t + j);
+                        if (t >= 3 && t < size_time - 3) {
+                            vec_file1[t] = *(nii_nulled_data + nr_slab * t + j)
+                                           / *(nii_bold_data + nr_slab * (t + shift) + j);
+                        } else {
+                            vec_file1[t] = *(nii_boco_vaso_data + nr_slab * t + j);
+                        }
+                    }
+                    *(correl_file_data + nxyz * (shift + 3) + nxy * z0 + j) =  ren_correl(vec_file1, vec_file2, size_time);
+                }
+            }
 
-        nifti_image *nii_avg2 = nifti_copy_nim_info(nii1);
-        nii_avg2->nt = trialdur;
-        nii_avg2->nvox = nii1->nvox / size_time * trialdur;
-        nii_avg2->datatype = NIFTI_TYPE_FLOAT32;
-        nii_avg2->nbyper = sizeof(float);
-        nii_avg2->data = calloc(nii_avg2->nvox, nii_avg2->nbyper);
-        float  *nii_avg1_B_data  = static_cast<float*>(nii_avg2->data);
+            // Get back to default
+            for (int i = 0; i != nr_chunk; ++i) {
+                *(nii_boco_vaso_data + i) = *(nii_nulled_data + i)
+                                            / *(nii_bold_data + i);
+            }
+            // Clean VASO values that are unrealistic
+            for (int i = 0; i != nr_chunk; ++i) {
+               if (*(nii_boco_vaso_data + i) <= 0) {
+                    *(nii_boco_vaso_data + i) = 0;
+                }
+                if (*(nii_boco_vaso_data + i) >= 2) {
+                    *(nii_boco_vaso_data + i) = 2;
+                }
+            }
+        }
 
-        float avg_Nulled[trialdur];
-        float avg_BOLD[trialdur];
+        // ====================================================================
+        // Trial average
+        // ====================================================================
+        if (trialdur != 0) {
+            if (c == 0) {
+                cout << "  Doing BOLD correction after trial average..." << endl;
+                cout << "    Trial duration is " << trialdur
+                     << ". This means there are " << (float)size_time / (float)trialdur
+                     <<  " trials recorded here." << endl;
+            }
 
-        for (int iz = 0; iz < size_z; ++iz) {
-            for (int iy = 0; iy < size_y; ++iy) {
-                for (int ix = 0; ix < size_x; ++ix) {
-                    for (int it = 0; it < trialdur; ++it) {
-                        avg_Nulled[it] = 0;
-                        avg_BOLD[it] = 0;
-                    }
-                    for (int it = 0; it < trialdur * nr_trials; ++it) {
-                        int voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
-                        avg_Nulled[it % trialdur] +=
-                            *(nii_nulled_data + voxel_i) / nr_trials;
-                        avg_BOLD[it % trialdur] +=
-                            *(nii_bold_data + voxel_i) / nr_trials;
-                    }
+            float avg_Nulled[trialdur];
+            float avg_BOLD[trialdur];
 
-                    for (int it = 0; it < trialdur; ++it) {
-                        int voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
-                        *(nii_avg1_data + voxel_i) = avg_Nulled[it] / avg_BOLD[it];
-                        *(nii_avg1_B_data + voxel_i) = avg_BOLD[it];
+            for (int j = 0; j != nr_slab; ++j) {
+                for (int it = 0; it < trialdur; ++it) {
+                    avg_Nulled[it] = 0;
+                    avg_BOLD[it] = 0;
+                }
+                for (int it = 0; it < trialdur * nr_trials; ++it) {
+                    int voxel_i = nr_slab * it + j;
+                    avg_Nulled[it % trialdur] +=
+                        *(nii_nulled_data + voxel_i) / nr_trials;
+                    avg_BOLD[it % trialdur] +=
+                        *(nii_bold_data + voxel_i) / nr_trials;
+                }
+                for (int it = 0; it < trialdur; ++it) {
+                    int voxel_i = nr_slab * it + j;
+                    *(nii_avg1_data + voxel_i) = avg_Nulled[it] / avg_BOLD[it];
+                    *(nii_avg1_B_data + voxel_i) = avg_BOLD[it];
+                }
+            }
 
-                    }
+            // Clean VASO values that are unrealistic
+            for (int i = 0; i != nr_slab * trialdur; ++i) {
+                if (*(nii_avg1_data + i) <= 0) {
+                    *(nii_avg1_data + i) = 0;
+                }
+                if (*(nii_avg1_data + i) >= 2) {
+                    *(nii_avg1_data + i) = 2;
                 }
             }
+            if (!nifti_writer_write_slab(writer_avg1, z0, nr_slab / nxy, nii_avg1_data)) return 2;
+            if (!nifti_writer_write_slab(writer_avg2, z0, nr_slab / nxy, nii_avg1_B_data)) return 2;
         }
 
-        // Clean VASO values that are unrealistic
-        for (int iz = 0; iz < size_z; ++iz) {
-            for (int iy = 0; iy < size_y; ++iy) {
-                for (int ix = 0; ix < size_x; ++ix) {
-                    for (int it = 0; it < trialdur; ++it) {
-                        int voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
-
-                        if (*(nii_avg1_data + voxel_i) <= 0) {
-                            *(nii_avg1_data + voxel_i) = 0;
-                        }
-                        if (*(nii_avg1_data + voxel_i) >= 2) {
-                            *(nii_avg1_data + voxel_i) = 2;
-                        }
-                    }
-                }
+        // Replace nans with zeros
+        for (int i = 0; i < nr_chunk; ++i) {
+            if (*(nii_boco_vaso_data + i)!= *(nii_boco_vaso_data + i)) {
+               *(nii_boco_vaso_data + i) = 0;
             }
         }
-        if (use_outpath) {
-            save_output_nifti("VASO_trialAV_LN", "", nii_avg1, true, true);
-            save_output_nifti("BOLD_trialAV_LN", "", nii_avg2, true, true);
+        if (mode_slab) {
+            if (!nifti_writer_write_slab(writer_vaso, z0, nr_slab / nxy, nii_boco_vaso_data)) return 2;
         } else {
-            save_output_nifti(fout, "VASO_trialAV_LN", nii_avg1, true);
-            save_output_nifti(fout, "BOLD_trialAV_LN", nii_avg2, true);
+            if (!nifti_writer_write_volume(writer_vaso, c, nii_boco_vaso_data)) return 2;
         }
     }
+    free(nii_nulled_data);
+    free(nii_bold_data);
+    free(nii_boco_vaso_data);
+    nifti_reader_close(reader1);
+    nifti_reader_close(reader2);
 
+    if (mode_alt) {
+        float term1 = static_cast<float>(nr_invalid_voxels);
+        float term2 = static_cast<float>(nr_voxels - nr_zero_voxels);
+        cout << "  Voxels with invalid VASO assumption:" << endl;
+        cout << "    "
+            << nr_invalid_voxels << "/" << nr_voxels - nr_zero_voxels
+            << "\n    " << (term1 / term2) * 100 << "%\n" << endl;
+    }
 
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_boco_vaso_data + i)!= *(nii_boco_vaso_data + i)) {
-           *(nii_boco_vaso_data + i) = 0;
+    if (shift == 1) {
+        // Replace nans with zeros
+        for (int i = 0; i < nxyz * 7; ++i) {
+            if (*(correl_file_data + i)!= *(correl_file_data + i)) {
+               *(correl_file_data + i) = 0;
+            }
         }
+        save_output_nifti(fout, "shift_correlated", correl_file, false);
     }
-
-    if (use_outpath) {
-        save_output_nifti("VASO_LN", "", nii_boco_vaso, true, true);
-    } else {
-        save_output_nifti(fout, "VASO_LN", nii_boco_vaso, true);
+    if (trialdur != 0) {
+        free(nii_avg1_data);
+        free(nii_avg1_B_data);
+        if (!nifti_writer_close(writer_avg1)) return 2;
+        if (!nifti_writer_close(writer_avg2)) return 2;
     }
+    if (!nifti_writer_close(writer_vaso)) return 2;
 
     cout << "  Finished." << endl;
     return 0;
@@ -1,23 +1,36 @@
-
-
-
 #include "../dep/laynii_lib.h"
 
 int show_help(void) {
     printf(
     "LN_CORREL2FILES: Estimate the voxel wise correlation of two timeseries.\n"
+    "                 Alternatively, estimate the correlation of every voxel\n"
+    "                 with the mean timeseries of a seed region.\n"
     "\n"
     "Usage:\n"
     "    LN_CORREL2FILES -file1 file1.nii -file2 file2.nii \n"
+    "    LN_CORREL2FILES -file1 file1.nii -seed seed_mask.nii \n"
     "    ../LN_CORREL2FILES -file1 lo_Nulled_intemp.nii -file2 lo_BOLD_intemp.nii \n"
     "\n"
     "Options:\n"
-    "    -help   : Show this help.\n"
-    "    -file1  : First time series.\n"
-    "    -file2  : Second time series with should have the same dimensions \n"
-    "              as first time series.\n"
-    "    -output : (Optional) Output filename, including .nii or\n"
-    "              .nii.gz, and path if needed. Overwrites existing files.\n"
+    "    -help       : Show this help.\n"
+    "    -file1      : First time series.\n"
+    "    -file2      : Second time series with should have the same dimensions \n"
+    "                  as first time series.\n"
+    "    -seed       : (Optional) Seed region (non-zero voxels) with the same\n"
+    "                  x, y, z dimensions as the time series. Every voxel of\n"
+    "                  file1 is correlated with the mean time course of the\n"
+    "                  seed region. Replaces '-file2'.\n"
+    "    -seed_voxel : (Optional) Same as '-seed' for a single voxel. Needs\n"
+    "                  three arguments: x y z voxel indices (starting from 0).\n"
+    "    -window     : (Optional) Sliding window correlation. Number of time\n"
+    "                  points per window. The output has one volume for every\n"
+    "                  window position (nr. time points - window + 1).\n"
+    "    -threads    : (Optional) Number of threads. Default is 1.\n"
+    "    -max_mem    : (Optional) Memory in MB for the time series that are\n"
+    "                  processed at once. The data is read in slabs of z\n"
+    "                  slices. Default is 2048.\n"
+    "    -output     : (Optional) Output filename, including .nii or\n"
+    "                  .nii.gz, and path if needed. Overwrites existing files.\n"
     "\n"
     "Notes:\n"
     "    - This program is motivated by Eli Merriam comparing in hunting down \n"
@@ -28,11 +41,134 @@ int show_help(void) {
     return 0;
 }
 
+// ============================================================================
+// Correlation of blocks of voxels
+// ============================================================================
+// Slab time series are ordered as [time][slab voxel]. The inner loops run
+// over contiguous voxels of a block for one time point, so all voxels of the
+// block are updated together. Without y_data every voxel is correlated with
+// the (mean centered) seed time course seed_c.
+
+void correlate_block(const float* x_data, const float* y_data,
+                     const double* seed_c, const uint32_t nr_slab,
+                     const int size_time, const uint32_t begin,
+                     const uint32_t end, float* out) {
+    const uint32_t n = end - begin;
+    vector<double> mean_x(n, 0), mean_y(n, 0);
+    for (int t = 0; t < size_time; ++t) {
+        const float* x = x_data + static_cast<size_t>(nr_slab) * t + begin;
+        for (uint32_t i = 0; i != n; ++i) {
+            mean_x[i] += x[i];
+        }
+        if (y_data) {
+            const float* y = y_data + static_cast<size_t>(nr_slab) * t + begin;
+            for (uint32_t i = 0; i != n; ++i) {
+                mean_y[i] += y[i];
+            }
+        }
+    }
+    for (uint32_t i = 0; i != n; ++i) {
+        mean_x[i] /= size_time;
+        mean_y[i] /= size_time;
+    }
+
+    // Same sums as ren_correl
+    vector<double> sum_xy(n, 0), sum_xx(n, 0), sum_yy(n, 0);
+    for (int t = 0; t < size_time; ++t) {
+        const float* x = x_data + static_cast<size_t>(nr_slab) * t + begin;
+        if (y_data) {
+            const float* y = y_data + static_cast<size_t>(nr_slab) * t + begin;
+            for (uint32_t i = 0; i != n; ++i) {
+                const double dx = x[i] - mean_x[i];
+                const double dy = y[i] - mean_y[i];
+                sum_xy[i] += dx * dy;
+                sum_xx[i] += dx * dx;
+                sum_yy[i] += dy * dy;
+            }
+        } else {
+            const double dy = seed_c[t];
+            for (uint32_t i = 0; i != n; ++i) {
+                const double dx = x[i] - mean_x[i];
+                sum_xy[i] += dx * dy;
+                sum_xx[i] += dx * dx;
+                sum_yy[i] += dy * dy;
+            }
+        }
+    }
+    for (uint32_t i = 0; i != n; ++i) {
+        *(out + begin + i) = static_cast<float>(sum_xy[i] / sqrt(sum_xx[i] * sum_yy[i]));
+    }
+}
+
+void correlate_block_windows(const float* x_data, const float* y_data,
+                             const double* seed_c, const uint32_t nr_slab,
+                             const int size_time, const int window,
+                             const uint32_t begin, const uint32_t end,
+                             float* out) {
+    // Running sums over the window, updated by one time point per step.
+    // Values are centered with the mean of the whole time series first to
+    // keep the running sums small. Output is [window position][slab voxel].
+    const uint32_t n = end - begin;
+    vector<double> mean_x(n, 0), mean_y(n, 0);
+    for (int t = 0; t < size_time; ++t) {
+        const float* x = x_data + static_cast<size_t>(nr_slab) * t + begin;
+        for (uint32_t i = 0; i != n; ++i) {
+            mean_x[i] += x[i];
+        }
+        if (y_data) {
+            const float* y = y_data + static_cast<size_t>(nr_slab) * t + begin;
+            for (uint32_t i = 0; i != n; ++i) {
+                mean_y[i] += y[i];
+            }
+        }
+    }
+    for (uint32_t i = 0; i != n; ++i) {
+        mean_x[i] /= size_time;
+        mean_y[i] /= size_time;
+    }
+
+    vector<double> sum_x(n, 0), sum_y(n, 0), sum_xy(n, 0), sum_xx(n, 0), sum_yy(n, 0);
+    for (int t = 0; t < size_time; ++t) {
+        // Add time point t and drop time point t - window
+        for (int k = 0; k != 2; ++k) {
+            const int tk = k == 0 ? t : t - window;
+            if (tk < 0) break;
+            const double sign = k == 0 ? 1. : -1.;
+            const float* x = x_data + static_cast<size_t>(nr_slab) * tk + begin;
+            const float* y = y_data ? y_data + static_cast<size_t>(nr_slab) * tk + begin : NULL;
+            for (uint32_t i = 0; i != n; ++i) {
+                const double dx = x[i] - mean_x[i];
+                const double dy = y ? y[i] - mean_y[i] : seed_c[tk];
+                sum_x[i] += sign * dx;
+                sum_y[i] += sign * dy;
+                sum_xy[i] += sign * dx * dy;
+                sum_xx[i] += sign * dx * dx;
+                sum_yy[i] += sign * dy * dy;
+            }
+        }
+
+        if (t >= window - 1) {
+            float* o = out + static_cast<size_t>(nr_slab) * (t - window + 1) + begin;
+            for (uint32_t i = 0; i != n; ++i) {
+                const double cov = sum_xy[i] - sum_x[i] * sum_y[i] / window;
+                const double var_x = sum_xx[i] - sum_x[i] * sum_x[i] / window;
+                const double var_y = sum_yy[i] - sum_y[i] * sum_y[i] / window;
+                o[i] = static_cast<float>(cov / sqrt(var_x * var_y));
+            }
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
     bool use_outpath = false ;
     char  *fout = NULL ;
-    char *fin_1 = NULL, *fin_2 = NULL;
+    char *fin_1 = NULL, *fin_2 = NULL, *fin_seed = NULL;
     int ac;
+    bool use_seed_voxel = false;
+    int seed_voxel[3] = {0, 0, 0};
+    int window = 0;
+    int nr_threads = 1;
+    uint64_t max_mem = 2048;
     if (argc < 2) return show_help();
 
     // Process user options
@@ -40,7 +176,6 @@ int main(int argc, char *argv[]) {
         if (!strncmp(argv[ac], "-h", 2)) {
             return show_help();
         } else if (!strcmp(argv[ac], "-file1")) {
-            cout << "Hello " << endl;
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -file1\n");
                 return 1;
@@ -52,6 +187,39 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
             fin_2 = argv[ac];
+        } else if (!strcmp(argv[ac], "-seed")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -seed\n");
+                return 1;
+            }
+            fin_seed = argv[ac];
+        } else if (!strcmp(argv[ac], "-seed_voxel")) {
+            if (ac + 3 >= argc) {
+                fprintf(stderr, "** missing argument for -seed_voxel\n");
+                return 1;
+            }
+            for (int k = 0; k != 3; ++k) {
+                seed_voxel[k] = atoi(argv[++ac]);
+            }
+            use_seed_voxel = true;
+        } else if (!strcmp(argv[ac], "-window")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -window\n");
+                return 1;
+            }
+            window = atoi(argv[ac]);
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            nr_threads = std::max(1, atoi(argv[ac]));
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            max_mem = atoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -65,73 +233,221 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    const bool mode_seed = fin_seed || use_seed_voxel;
     if (!fin_1) {
         fprintf(stderr, "** missing option '-file1'\n");
         return 1;
     }
-    if (!fin_2) {
+    if (!fin_2 && !mode_seed) {
         fprintf(stderr, "** missing option '-file2'\n");
         return 1;
     }
+    if (fin_2 && mode_seed) {
+        fprintf(stderr, "** '-file2' can not be combined with '-seed' or '-seed_voxel'\n");
+        return 1;
+    }
+    if (fin_seed && use_seed_voxel) {
+        fprintf(stderr, "** '-seed' can not be combined with '-seed_voxel'\n");
+        return 1;
+    }
 
-    // Read input dataset
-    nifti_image* nii1 = nifti_image_read(fin_1, 1);
-    if (!nii1) {
+    // Read input headers, data is streamed in slabs
+    NiftiReader reader1, reader2;
+    if (!nifti_reader_open(reader1, fin_1)) {
         fprintf(stderr, "** failed to read NIfTI image from '%s'\n", fin_1);
         return 2;
     }
-    nifti_image*nii2 = nifti_image_read(fin_2, 1);
-    if (!nii2) {
+    if (fin_2 && !nifti_reader_open(reader2, fin_2)) {
         fprintf(stderr, "** failed to read NIfTI image from '%s'\n", fin_2);
         return 2;
     }
+    nifti_image* nii1 = reader1.nii;
 
     log_welcome("LN_CORREL2FILES");
     log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
+    if (fin_2) log_nifti_descriptives(reader2.nii);
 
     // Get dimensions of input
     int size_z = nii1->nz;
     int size_x = nii1->nx;
     int size_y = nii1->ny;
     int size_time = nii1->nt;
-    int nx = nii1->nx;
     int nxy = nii1->nx * nii1->ny;
     int nxyz = nii1->nx * nii1->ny * nii1->nz;
 
+    if (fin_2 && (reader2.nii->nx != size_x || reader2.nii->ny != size_y
+                  || reader2.nii->nz != size_z || reader2.nii->nt != size_time)) {
+        fprintf(stderr, "** '%s' and '%s' have different dimensions\n", fin_1, fin_2);
+        return 1;
+    }
+    if (window != 0 && (window < 2 || window > size_time)) {
+        fprintf(stderr, "** window must be between 2 and %d time points\n", size_time);
+        return 1;
+    }
+    const int nr_windows = window > 0 ? size_time - window + 1 : 1;
+
+    // ========================================================================
+    // Seed voxels
+    // ========================================================================
+    vector<uint32_t> seed_id;
+    if (fin_seed) {
+        nifti_image* nii_seed = nifti_image_read(fin_seed, 1);
+        if (!nii_seed) {
+            fprintf(stderr, "** failed to read NIfTI image from '%s'\n", fin_seed);
+            return 2;
+        }
+        log_nifti_descriptives(nii_seed);
+        if (nii_seed->nx != size_x || nii_seed->ny != size_y || nii_seed->nz != size_z) {
+            fprintf(stderr, "** '%s' and '%s' have different dimensions\n", fin_1, fin_seed);
+            return 1;
+        }
+        int32_t* nii_seed_data = nifti_data_as<int32_t>(nii_seed);
+        for (int i = 0; i != nxyz; ++i) {
+            if (*(nii_seed_data + i) != 0) seed_id.push_back(i);
+        }
+        nifti_image_free(nii_seed);
+    } else if (mode_seed) {
+        if (seed_voxel[0] < 0 || seed_voxel[0] >= size_x || seed_voxel[1] < 0 || seed_voxel[1] >= size_y
+            || seed_voxel[2] < 0 || seed_voxel[2] >= size_z) {
+            fprintf(stderr, "** seed voxel is outside of the image\n");
+            return 1;
+        }
+        seed_id.push_back(sub2ind_3D(seed_voxel[0], seed_voxel[1], seed_voxel[2],
+                                     size_x, size_y));
+    }
+    if (mode_seed) {
+        cout << "  Seed has " << seed_id.size() << " voxels." << endl;
+        if (seed_id.empty()) {
+            fprintf(stderr, "** seed region is empty\n");
+            return 1;
+        }
+    }
+
+    // ========================================================================
+    // Allocate memory
     // ========================================================================
-    // Fix datatype issues
-    nifti_image* nii1_temp = copy_nifti_as_float32(nii1);
-    float* nii1_temp_data = static_cast<float*>(nii1_temp->data);
-    nifti_image* nii2_temp = copy_nifti_as_float32(nii2);
-    float* nii2_temp_data = static_cast<float*>(nii2_temp->data);
-
-    // Allocate new nifti
-    nifti_image *correl_file = nifti_copy_nim_info(nii1_temp);
+    // NOTE: Time series of one slab of z slices are in memory at a time,
+    // ordered as [time][slab voxel], for each input and the windowed output.
+    const uint32_t slab_z = nifti_slab_size(nii1, max_mem << 20,
+                                            1 + (fin_2 ? 1 : 0) + (window > 0 ? 1 : 0));
+    const int nr_slab_max = nxy * slab_z;
+    float* nii1_data = static_cast<float*>(
+        malloc(static_cast<size_t>(nr_slab_max) * size_time * sizeof(float)));
+    float* nii2_data = NULL;
+    if (fin_2) {
+        nii2_data = static_cast<float*>(
+            malloc(static_cast<size_t>(nr_slab_max) * size_time * sizeof(float)));
+    }
+    if (slab_z < static_cast<uint32_t>(size_z)) {
+        cout << "    Slabs of " << slab_z << " slices" << endl;
+    }
+
+    // Output has no scaling, correlations are scale invariant
+    nifti_image* correl_file = nifti_copy_nim_info(nii1);
     correl_file->nt = 1;
-    correl_file->nvox = size_x * size_y * size_z;
-    correl_file->data = calloc(correl_file->nvox, correl_file->nbyper);
-    float *correl_file_data = static_cast<float*>(correl_file->data);
+    correl_file->nvox = nxyz;
+    correl_file->datatype = NIFTI_TYPE_FLOAT32;
+    correl_file->nbyper = sizeof(float);
+    correl_file->scl_slope = 1;
+    correl_file->scl_inter = 0;
+
+    if (!use_outpath) fout = fin_1;
+    const string tag = string(mode_seed ? "seed_" : "") + "correlated"
+                       + (window > 0 ? "_window" : "");
+
+    float* correl_file_data = NULL;
+    NiftiWriter writer;
+    if (window > 0) {
+        correl_file_data = static_cast<float*>(
+            malloc(static_cast<size_t>(nr_slab_max) * nr_windows * sizeof(float)));
+        if (!nifti_writer_open(writer, correl_file, nr_windows,
+                               output_path(fout, tag, use_outpath))) return 2;
+    } else {
+        correl_file->data = calloc(correl_file->nvox, correl_file->nbyper);
+        correl_file_data = static_cast<float*>(correl_file->data);
+    }
+
+    // ========================================================================
+    // Mean time course of the seed voxels
     // ========================================================================
+    vector<double> seed_c;
+    bool is_loaded = false;  // First slab is still in memory
+    if (mode_seed) {
+        seed_c.assign(size_time, 0);
+        uint32_t k = 0;
+        for (int z0 = 0; z0 < size_z && k != seed_id.size(); z0 += slab_z) {
+            const int nr_slices = min(static_cast<int>(slab_z), size_z - z0);
+            const uint32_t nr_slab = nxy * nr_slices;
+            const uint32_t slab_end = nxy * (z0 + nr_slices);
+            if (seed_id[k] >= slab_end) continue;
 
-    double vec1[size_time], vec2[size_time];
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix < size_x; ++ix) {
-                int voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it) {
-                    int voxel_j = nxyz * it + nxy * iz + nx * iy + ix;
-                    vec1[it] = *(nii1_temp_data + voxel_j);
-                    vec2[it] = *(nii2_temp_data + voxel_j);
+            if (!nifti_reader_read_slab(reader1, z0, nr_slices, nii1_data)) return 2;
+            is_loaded = z0 == 0;
+            for (; k != seed_id.size() && seed_id[k] < slab_end; ++k) {
+                const uint32_t i = seed_id[k] - nxy * z0;
+                for (int t = 0; t < size_time; ++t) {
+                    seed_c[t] += *(nii1_data + static_cast<size_t>(nr_slab) * t + i);
                 }
-                *(correl_file_data + voxel_i) =
-                    static_cast<float>(ren_correl(vec1, vec2, size_time));
             }
         }
+        double seed_mean = 0;
+        for (int t = 0; t < size_time; ++t) {
+            seed_c[t] /= seed_id.size();
+            seed_mean += seed_c[t];
+        }
+        seed_mean /= size_time;
+        for (int t = 0; t < size_time; ++t) {
+            seed_c[t] -= seed_mean;
+        }
     }
 
-    if (!use_outpath) fout = fin_1;
-    save_output_nifti(fout, "correlated", correl_file, true, use_outpath);
+    // ========================================================================
+    // Correlate
+    // ========================================================================
+    cout << "  Calculating correlations..." << endl;
+    for (int z0 = 0; z0 < size_z; z0 += slab_z) {
+        const int nr_slices = min(static_cast<int>(slab_z), size_z - z0);
+        const uint32_t nr_slab = nxy * nr_slices;
+        if (!(is_loaded && z0 == 0)) {
+            if (!nifti_reader_read_slab(reader1, z0, nr_slices, nii1_data)) return 2;
+        }
+        if (fin_2) {
+            if (!nifti_reader_read_slab(reader2, z0, nr_slices, nii2_data)) return 2;
+        }
+
+        parallel_for(nr_slab, nr_threads, [&](uint32_t begin, uint32_t end) {
+            // Blocks of voxels keep the per voxel sums in cache
+            const uint32_t block_size = 1024;
+            for (uint32_t b = begin; b < end; b += block_size) {
+                const uint32_t b_end = min(b + block_size, end);
+                if (window > 0) {
+                    correlate_block_windows(nii1_data, nii2_data, seed_c.data(),
+                                            nr_slab, size_time, window, b, b_end,
+                                            correl_file_data);
+                } else {
+                    correlate_block(nii1_data, nii2_data, seed_c.data(), nr_slab,
+                                    size_time, b, b_end,
+                                    correl_file_data + static_cast<size_t>(nxy) * z0);
+                }
+            }
+        });
+
+        if (window > 0) {
+            if (!nifti_writer_write_slab(writer, z0, nr_slices, correl_file_data)) return 2;
+        }
+    }
+    free(nii1_data);
+    free(nii2_data);
+    nifti_reader_close(reader1);
+    if (fin_2) nifti_reader_close(reader2);
+
+    if (window > 0) {
+        if (!nifti_writer_close(writer)) return 2;
+        free(correl_file_data);
+        nifti_image_free(correl_file);
+    } else {
+        save_output_nifti(fout, tag, correl_file, true, use_outpath);
+    }
 
     cout << "  Finished." << endl;
     return 0;
@@ -26,6 +26,8 @@ int show_help(void){
     "                  Note, that this is best done with not too manny layers,  \n"
     "                  otherwise a single layer has wholes and is not connected.  \n"
     "                  This option can only smooth within layers and removes signal outside the layer mask  \n"
+    "    -threads    : (Optional) Number of threads for smoothing within layers.\n"
+    "                  Default is 1. Not used with -NoKissing.\n"
     "    -output     : (Optional) Output filename, including .nii or\n"
     "                  .nii.gz, and path if needed. Overwrites existing files.\n"
     "\n"
@@ -43,6 +45,7 @@ int main(int argc, char * argv[])
    char       * fmaski=NULL, * fout=NULL, * finfi=NULL ;
    int          ac, twodim=0, do_masking=0 , sulctouch = 0 ;
    float 		FWHM_val=0 ;
+   int          nr_threads = 1 ;
    if( argc < 3 ) return show_help();   // typing '-help' is sooo much work
 
    // process user options: 4 are valid presently
@@ -79,6 +82,13 @@ int main(int argc, char * argv[])
          sulctouch = 1;
          cout << "I will not smooth across sluci, this might make it longer though"  << endl;
       }
+      else if( ! strcmp(argv[ac], "-threads") ) {
+         if( ++ac >= argc ) {
+            fprintf(stderr, "** missing argument for -threads\n");
+            return 1;
+         }
+         nr_threads = std::max(1, atoi(argv[ac]));
+      }
      else if( ! strcmp(argv[ac], "-mask") ) {
          do_masking = 1;
          cout << "I will set every thing to zero outside the layers (masking option)"  << endl;
@@ -320,54 +330,90 @@ if (sulctouch == 0 ){
  cout << " smoothing in layer not considering sulci  " << flush ;
 
 
- for(int layernumber_i=1; layernumber_i<=layernumber; ++layernumber_i){
- cout << "\r  " <<  layernumber_i << " of  " << layernumber<<  flush ;
-
-	for(int iz=0; iz<sizeSlice; ++iz){
-      for(int iy=0; iy<sizePhase; ++iy){
-        for(int ix=0; ix<sizeRead-0; ++ix){
-          *(gausweight_data  + nxy*iz + nx*ix  + iy  )  = 0 ;
-		  //*(smoothed_data    + nxy*iz + nx*ix  + iy  )  = 0 ;
-
-	     if (*(nim_mask_data   +  nxy*iz + nx*ix  + iy  )  == layernumber_i ){
-
-			for(int iz_i=max(0,iz-vinc); iz_i<min(iz+vinc+1,sizeSlice-1); ++iz_i){
-	    		for(int iy_i=max(0,iy-vinc); iy_i<min(iy+vinc+1,sizePhase-1); ++iy_i){
-	      			for(int ix_i=max(0,ix-vinc); ix_i<min(ix+vinc+1,sizeRead-1); ++ix_i){
-	      			  if (*(nim_mask_data   +  nxy*iz_i + nx*ix_i  + iy_i  )  == layernumber_i ){
-		  				dist_i = dist((float)ix,(float)iy,(float)iz,(float)ix_i,(float)iy_i,(float)iz_i,dX,dY,dZ);
-		  				//cout << "debug  4 " <<  gaus(dist_i ,FWHM_val ) <<   endl;
-		  			    //cout << "debug  5 " <<  dist_i  <<   endl;
-						//if ( *(nim_input_data   +  nxy*iz + nx*ix  + iy  )  == 3 ) cout << "debug  4b " << endl;
-							//dummy = *(layer_data  + nxy*iz_i + nx*ix_i  + iy_i  );
-
-                            for (int time_i = 0 ; time_i < nrep ; ++time_i){
-                                *(smoothed_data + nxyz *time_i    + nxy*iz + nx*ix  + iy  ) = *(smoothed_data  +  nxyz *time_i    + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data +  nxyz *time_i  + nxy*iz_i + nx*ix_i  + iy_i  ) * gaus(dist_i ,FWHM_val ) ;
-                            }
-                              //  *(smoothed_data     + nxy*iz + nx*ix  + iy  ) = *(smoothed_data     + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data  + nxy*iz_i + nx*ix_i  + iy_i  ) * gaus(dist_i ,FWHM_val ) ;
-
-		    				*(gausweight_data  + nxy*iz + nx*ix  + iy  ) = *(gausweight_data  + nxy*iz + nx*ix  + iy  ) + gaus(dist_i ,FWHM_val ) ;
-			  		  }
-		            }
-	      	    }
-	       }
-                for (int time_i = 0 ; time_i < nrep ; ++time_i){
-                    if (*(gausweight_data  + nxy*iz + nx*ix  + iy  ) > 0 ) *(smoothed_data + nxyz *time_i     + nxy*iz + nx*ix  + iy  )  = *(smoothed_data  + nxyz *time_i  + nxy*iz + nx*ix  + iy  )/ *(gausweight_data  + nxy*iz + nx*ix  + iy  );
-                }
-	     }
-
-	     if (*(nim_mask_data   +  nxy*iz + nx*ix  + iy  )  <= 0 )	 {
-
-                for (int time_i = 0 ; time_i < nrep ; ++time_i){
-                 	*(smoothed_data +  nxyz *time_i   + nxy*iz + nx*ix  + iy  ) =  *(nim_inputf_data  +  nxyz *time_i + nxy*iz + nx*ix  + iy  ) ;
+ // NOTE: Time series of the layer voxels are stored voxel-major (all
+ // timepoints of a voxel next to each other). The Gaussian weight of each
+ // neighbour is computed once and applied to the whole time series.
+ // Neighbours are visited in the same order as before, so the sums are the
+ // same up to the last bit.
+ vector<int32_t> compact_id(nxyz, -1);
+ vector<int> layer_voxels;
+ for (int i = 0; i < nxyz; ++i) {
+     if (*(nim_mask_data + i) > 0) {
+         compact_id[i] = layer_voxels.size();
+         layer_voxels.push_back(i);
+     } else {
+         for (int time_i = 0; time_i < nrep; ++time_i) {
+             *(smoothed_data + nxyz * time_i + i) = *(nim_inputf_data + nxyz * time_i + i);
+         }
+     }
+ }
+ const uint64_t nr_layer_voxels = layer_voxels.size();
+ float* series = (float*) malloc(nr_layer_voxels * nrep * sizeof(float));
+ for (uint64_t c = 0; c < nr_layer_voxels; ++c) {
+     for (int time_i = 0; time_i < nrep; ++time_i) {
+         *(series + c * nrep + time_i) = *(nim_inputf_data + nxyz * time_i + layer_voxels[c]);
+     }
+ }
+ const int nr_window = (2 * vinc + 1) * (2 * vinc + 1) * (2 * vinc + 1);
+
+ parallel_for(sizeSlice, nr_threads, [&](uint32_t begin, uint32_t end) {
+    float* acc = (float*) malloc(nrep * sizeof(float));
+    float** nb_series = (float**) malloc(nr_window * sizeof(float*));
+    float* nb_w = (float*) malloc(nr_window * sizeof(float));
+    for (int iz = begin; iz < (int) end; ++iz) {
+      if (begin == 0) {  // Report progress of the first chunk
+          cout << "\r  " << (iz - begin) * 100 / (end - begin) << "%" << flush;
+      }
+      for (int iy = 0; iy < sizePhase; ++iy) {
+        for (int ix = 0; ix < sizeRead; ++ix) {
+          int voxel_i = nxy*iz + nx*ix + iy;
+          int layer_i = *(nim_mask_data + voxel_i);
+          if (layer_i <= 0) continue;
+
+          // Weights of the neighbours within the same layer
+          int nr_nb = 0;
+          float gausweight = 0;
+          for (int iz_i = max(0, iz-vinc); iz_i < min(iz+vinc+1, sizeSlice-1); ++iz_i) {
+            for (int iy_i = max(0, iy-vinc); iy_i < min(iy+vinc+1, sizePhase-1); ++iy_i) {
+              for (int ix_i = max(0, ix-vinc); ix_i < min(ix+vinc+1, sizeRead-1); ++ix_i) {
+                int voxel_j = nxy*iz_i + nx*ix_i + iy_i;
+                if (*(nim_mask_data + voxel_j) == layer_i) {
+                  float g = gaus(dist((float)ix, (float)iy, (float)iz,
+                                      (float)ix_i, (float)iy_i, (float)iz_i,
+                                      dX, dY, dZ), FWHM_val);
+                  *(nb_series + nr_nb) = series + (uint64_t) compact_id[voxel_j] * nrep;
+                  *(nb_w + nr_nb) = g;
+                  nr_nb += 1;
+                  gausweight += g;
                 }
+              }
             }
-
-
+          }
+          *(gausweight_data + voxel_i) = gausweight;
+
+          // Weighted sum over whole time series
+          for (int time_i = 0; time_i < nrep; ++time_i) {
+            *(acc + time_i) = 0;
+          }
+          for (int n = 0; n < nr_nb; ++n) {
+            const float* s = *(nb_series + n);
+            const float g = *(nb_w + n);
+            for (int time_i = 0; time_i < nrep; ++time_i) {
+              *(acc + time_i) += *(s + time_i) * g;
+            }
+          }
+          for (int time_i = 0; time_i < nrep; ++time_i) {
+            if (gausweight > 0) *(acc + time_i) /= gausweight;
+            *(smoothed_data + nxyz * time_i + voxel_i) = *(acc + time_i);
+          }
         }
       }
     }
-  }// for layer loop closed
+    free(acc);
+    free(nb_series);
+    free(nb_w);
+ });
+ free(series);
 
    cout << endl;
 
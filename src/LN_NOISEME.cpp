@@ -77,33 +77,44 @@ int main(int argc, char * argv[]) {
         fprintf(stderr, "** missing option '-input'\n");
         return 1;
     }
-    // Read input dataset, including data
-    nifti_image* nii_input = nifti_image_read(fin, 1);
-    if (!nii_input) {
+    // Read input header, data is streamed volume by volume
+    NiftiReader reader;
+    if (!nifti_reader_open(reader, fin)) {
         fprintf(stderr, "** failed to read NIfTI image from '%s'\n", fin);
         return 2;
     }
+    nifti_image* nii_input = reader.nii;
 
     log_welcome("LN_NOISEME");
     log_nifti_descriptives(nii_input);
     cout << "  Variance chosen to " << std_val << endl;
 
+    const int size_time = nii_input->nt;
+    const int nr_voxels = nii_input->nx * nii_input->ny * nii_input->nz;
+
     // ========================================================================
     // Allocating new nifti
-    nifti_image* nii_new = copy_nifti_as_float32(nii_input);
-    float* nii_new_data = static_cast<float*>(nii_new->data);
+    if (!use_outpath) fout = fin;
+    NiftiWriter writer;
+    if (!nifti_writer_open(writer, nii_input, size_time,
+                           output_path(fout, "noised", use_outpath))) {
+        return 2;
+    }
+    float* nii_new_data = static_cast<float*>(malloc(nr_voxels * sizeof(float)));
     // ========================================================================
 
-    int nr_voxels = nii_input->nvox;
-    for (int i = 0; i < nr_voxels; ++i) {
-        *(nii_new_data + i) +=
-            adjusted_rand_numbers(0, std_val,
-                                  arb_pdf_num(N_rand, pFunc, lower, upper));
+    for (int t = 0; t < size_time; ++t) {
+        if (!nifti_reader_read_volume(reader, t, nii_new_data)) return 2;
+        for (int i = 0; i < nr_voxels; ++i) {
+            *(nii_new_data + i) +=
+                adjusted_rand_numbers(0, std_val,
+                                      arb_pdf_num(N_rand, pFunc, lower, upper));
+        }
+        if (!nifti_writer_write_volume(writer, t, nii_new_data)) return 2;
     }
-
-
-    if (!use_outpath) fout = fin;
-    save_output_nifti(fout, "noised", nii_new, true, use_outpath);
+    free(nii_new_data);
+    nifti_reader_close(reader);
+    if (!nifti_writer_close(writer)) return 2;
 
     cout << "  Finished." << endl;
     return 0;
@@ -20,6 +20,9 @@ int show_help(void) {
     "Options:\n"
     "    -help   : Show this help.\n"
     "    -input  : Nifti (.nii or nii.gz) time series.\n"
+    "    -max_mem: (Optional) Memory in MB for the time series that are\n"
+    "              processed at once. The data is read in slabs of z slices.\n"
+    "              Default is 2048.\n"
     "    -output : (Optional) Output filename, including .nii or\n"
     "              .nii.gz, and path if needed. Overwrites existing files.\n"    
     "\n"
@@ -35,6 +38,7 @@ int main(int argc, char * argv[]) {
     char  *fout = NULL ;
     char *fin = NULL;
     int ac;
+    uint64_t max_mem = 2048;
     if (argc < 2) return show_help();
 
     // Process user options
@@ -47,6 +51,12 @@ int main(int argc, char * argv[]) {
                 return 1;
             }
             fin = argv[ac];
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            max_mem = atoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -65,12 +75,13 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image * nii_input = nifti_image_read(fin, 1);
-    if (!nii_input) {
+    // Read input header, data is streamed in slabs
+    NiftiReader reader;
+    if (!nifti_reader_open(reader, fin)) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
         return 2;
     }
+    nifti_image* nii_input = reader.nii;
 
     log_welcome("LN_SKEW");
     log_nifti_descriptives(nii_input);
@@ -85,14 +96,10 @@ int main(int argc, char * argv[]) {
     int nxyz = nii_input->nx * nii_input->ny * nii_input->nz;
 
     // ========================================================================
-    // Fix data type issues
-    nifti_image* nii = copy_nifti_as_float32(nii_input);
-    float* nii_data = static_cast<float*>(nii->data);
-
     // Allocate new nifti
-    nifti_image* nii_skew = nifti_copy_nim_info(nii);
+    nifti_image* nii_skew = nifti_copy_nim_info(nii_input);
     nii_skew->nt = 1;
-    nii_skew->nvox = nii->nvox / size_time;
+    nii_skew->nvox = nii_input->nvox / size_time;
     nii_skew->datatype = NIFTI_TYPE_FLOAT32;
     nii_skew->nbyper = sizeof(float);
     nii_skew->data = calloc(nii_skew->nvox, nii_skew->nbyper);
@@ -125,28 +132,60 @@ int main(int argc, char * argv[]) {
     nifti_image* nii_NOISESTDEV = copy_nifti_as_float32(nii_skew);
     float* nii_NOISESTDEV_data = static_cast<float*>(nii_NOISESTDEV->data);
 
+    // NOTE: Time series of one slab of z slices are in memory at a time,
+    // ordered as [time][slab voxel]. The correlation with the mean time
+    // course needs a second pass, unless all slices fit into one slab.
+    const uint32_t slab_z = nifti_slab_size(nii_input, max_mem << 20, 1);
+    const int nr_slab_max = nxy * slab_z;
+    float* nii_data = static_cast<float*>(
+        malloc(static_cast<size_t>(nr_slab_max) * size_time * sizeof(float)));
+    if (slab_z < static_cast<uint32_t>(size_z)) {
+        cout << "    Slabs of " << slab_z << " slices" << endl;
+    }
+
+    // Image SNR uses an even number of time points
+    const int size_time_even = size_time - size_time % 2;
+
     // ========================================================================
     cout << "  Calculating skew, kurtosis, and autocorrelation..." << endl;
 
     double vec1[size_time];
     double vecl[27]; // local vector for spatial gradient (number of voxel's noigbour)
     double vec2[size_time];
+    double vec_mean[size_time];  // Mean time course of everything
     int voxel_i = 0; 
 
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix < size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it) {
-                    vec1[it] =
-                        static_cast<double>(*(nii_data + nxyz * it + voxel_i));
-                }
-                *(nii_skew_data + voxel_i) = ren_skew(vec1, size_time);
-                *(nii_kurt_data + voxel_i) = ren_kurt(vec1, size_time);
-                *(nii_autocorr_data + voxel_i) = ren_autocor(vec1, size_time);
-                *(nii_mean_data + voxel_i) =  ren_average(vec1, size_time);
-                *(nii_stdev_data + voxel_i) = ren_stdev(vec1, size_time);
-                *(nii_tSNR_data + voxel_i) = ren_average(vec1, size_time)/ren_stdev(vec1, size_time);
+    for (int it = 0; it < size_time; ++it) {
+        vec_mean[it] = 0;
+    }
+
+    for (int z0 = 0; z0 < size_z; z0 += slab_z) {
+        const int nr_slices = min(static_cast<int>(slab_z), size_z - z0);
+        const int nr_slab = nxy * nr_slices;
+        if (!nifti_reader_read_slab(reader, z0, nr_slices, nii_data)) return 2;
+
+        for (int i = 0; i < nr_slab; ++i) {
+            voxel_i = nxy * z0 + i;
+            for (int it = 0; it < size_time; ++it) {
+                vec1[it] = static_cast<double>(*(nii_data + nr_slab * it + i));
+            }
+            const Moments m = ren_moments(vec1, size_time);
+            *(nii_skew_data + voxel_i) = m.skew;
+            *(nii_kurt_data + voxel_i) = m.kurt;
+            *(nii_autocorr_data + voxel_i) = m.autocor;
+            *(nii_mean_data + voxel_i) =  m.mean;
+            *(nii_stdev_data + voxel_i) = m.stdev;
+            *(nii_tSNR_data + voxel_i) = m.mean / m.stdev;
+
+            for (int it = 0; it < size_time; ++it) {
+                vec_mean[it] +=
+                    static_cast<double>(*(nii_data + nr_slab * it + i) / nxyz);
+            }
+
+            // Difference of even and odd time points for image SNR
+            for (int it = 0; it < size_time_even - 1; it = it + 2) {
+                *(nii_NOISE_data + voxel_i) += static_cast<double>(*(nii_data + nr_slab * it       + i));
+                *(nii_NOISE_data + voxel_i) -= static_cast<double>(*(nii_data + nr_slab * (it + 1) + i));
             }
         }
     }
@@ -166,38 +205,24 @@ int main(int argc, char * argv[]) {
     // ========================================================================
     cout << "  Calculating correlation with everything..." << endl;
 
-    for (int it = 0; it < size_time; ++it) {
-        vec1[it] = 0;
-        vec2[it] = 0;
-    }
-
-    // Mean time course of everything
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix < size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it) {
-                    vec1[it] +=
-                        static_cast<double>(*(nii_data + nxyz * it + voxel_i)
-                                            / nxyz);
-                }
-            }
+    // Voxel-wise corelation to mean of everything
+    for (int z0 = 0; z0 < size_z; z0 += slab_z) {
+        const int nr_slices = min(static_cast<int>(slab_z), size_z - z0);
+        const int nr_slab = nxy * nr_slices;
+        if (slab_z < static_cast<uint32_t>(size_z)) {
+            if (!nifti_reader_read_slab(reader, z0, nr_slices, nii_data)) return 2;
         }
-    }
 
-    // Voxel-wise corelation to mean of everything
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix <size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it)   {
-                    vec2[it] =
-                        static_cast<double>(*(nii_data + nxyz * it + voxel_i));
-                }
-                *(nii_conc_data + voxel_i) = ren_correl(vec1, vec2, size_time);
+        for (int i = 0; i < nr_slab; ++i) {
+            voxel_i = nxy * z0 + i;
+            for (int it = 0; it < size_time; ++it)   {
+                vec2[it] = static_cast<double>(*(nii_data + nr_slab * it + i));
             }
+            *(nii_conc_data + voxel_i) = ren_correl(vec_mean, vec2, size_time);
         }
     }
+    free(nii_data);
+    nifti_reader_close(reader);
     save_output_nifti(fout, "overall_correl", nii_conc, true);
     
     
@@ -205,16 +230,7 @@ int main(int argc, char * argv[]) {
     
     // ========================================================================
     cout << "  Calculating image SNR ..." << endl;
-    //size_time = 20;
-    if (size_time%2 == 1) size_time = size_time -1  ;  // make sure its and odd number of time points 
-    
-    for (int it = 0; it < size_time-1 ; it = it + 2 )   {
-        for (int voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
-                    //vec2[it] =  static_cast<double>(*(nii_data + nxyz * it + voxel_i));
-                *(nii_NOISE_data + voxel_i) += static_cast<double>(*(nii_data + nxyz * it     + voxel_i)) ;
-                *(nii_NOISE_data + voxel_i) -= static_cast<double>(*(nii_data + nxyz * (it+1) + voxel_i)) ;
-        }
-    }
+    size_time = size_time_even;  // make sure its and odd number of time points 
   
   // normalicing to time course duration
     for (int voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
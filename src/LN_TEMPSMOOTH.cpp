@@ -1,6 +1,7 @@
 
 
 #include "../dep/laynii_lib.h"
+#include <complex>
 
 int show_help(void) {
     printf(
@@ -23,6 +24,20 @@ int show_help(void) {
     "    -box    : Doing the smoothing with a box-var. Specify the value \n"
     "              of the box sice (integer value). This is like a \n"
     "              running average sliding window.\n"
+    "    -kernel : Doing the smoothing with custom weights. Specify a text\n"
+    "              file with an odd number of weights (separated by spaces\n"
+    "              or new lines). The middle weight is for the time point\n"
+    "              itself, the others for the time points before and after.\n"
+    "              Weights are normalized by their sum within the series.\n"
+    "    -recursive: (Optional) Use a recursive Gaussian filter (Young and\n"
+    "              van Vliet 1995) for '-gaus'. Its cost does not depend\n"
+    "              on the Gaussian size. It is an approximation of the\n"
+    "              Gaussian that is not truncated at 2 sigma. Used for\n"
+    "              Gaussian sizes of 2 and more.\n"
+    "    -threads: (Optional) Number of threads. Default is 1.\n"
+    "    -max_mem: (Optional) Memory in MB for the time series that are\n"
+    "              processed at once. The data is read and written in slabs\n"
+    "              of z slices. Default is 2048.\n"
     "    -output : (Optional) Output filename, including .nii or\n"
     "              .nii.gz, and path if needed. Overwrites existing files.\n"    
     "\n"
@@ -33,12 +48,227 @@ int show_help(void) {
     return 0;
 }
 
+// ============================================================================
+// Filters for blocks of voxels
+// ============================================================================
+// Slab time series are ordered as [time][slab voxel]. All filters run the
+// time loop outside and the voxel loop inside, so each inner loop works on
+// contiguous voxels of a block. Kernel weights are normalized by the sum of
+// the weights that fall inside the time series (norm), so the first and
+// last time points are not darkened.
+
+void smooth_block_direct(const float* in, float* out, const uint32_t nr_slab,
+                         const int size_time, const vector<float>& kernel,
+                         const vector<float>& norm, const uint32_t begin,
+                         const uint32_t end) {
+    // Weight kernel[h + d] is applied to time point it + d
+    const int h = kernel.size() / 2;
+    for (int it = 0; it < size_time; ++it) {
+        float* o = out + static_cast<size_t>(nr_slab) * it;
+        for (uint32_t i = begin; i != end; ++i) {
+            o[i] = 0;
+        }
+        int jt_start = max(0, it - h);
+        int jt_stop = min(it + h + 1, size_time);
+        for (int jt = jt_start; jt < jt_stop; ++jt) {
+            const float* x = in + static_cast<size_t>(nr_slab) * jt;
+            const float g = kernel[h + jt - it];
+            for (uint32_t i = begin; i != end; ++i) {
+                o[i] += x[i] * g;
+            }
+        }
+        for (uint32_t i = begin; i != end; ++i) {
+            o[i] /= norm[it];
+        }
+    }
+}
+
+void smooth_block_box(const float* in, float* out, const uint32_t nr_slab,
+                      const int size_time, const int vic, const uint32_t begin,
+                      const uint32_t end) {
+    // Running sum over [it - vic, it + vic], one time point in and one out
+    vector<double> sum(end - begin, 0);
+    for (int jt = 0; jt < min(vic, size_time); ++jt) {
+        const float* x = in + static_cast<size_t>(nr_slab) * jt;
+        for (uint32_t i = begin; i != end; ++i) {
+            sum[i - begin] += x[i];
+        }
+    }
+    for (int it = 0; it < size_time; ++it) {
+        if (it + vic < size_time) {
+            const float* x = in + static_cast<size_t>(nr_slab) * (it + vic);
+            for (uint32_t i = begin; i != end; ++i) {
+                sum[i - begin] += x[i];
+            }
+        }
+        if (it - vic - 1 >= 0) {
+            const float* x = in + static_cast<size_t>(nr_slab) * (it - vic - 1);
+            for (uint32_t i = begin; i != end; ++i) {
+                sum[i - begin] -= x[i];
+            }
+        }
+        const double count = min(it + vic + 1, size_time) - max(0, it - vic);
+        float* o = out + static_cast<size_t>(nr_slab) * it;
+        for (uint32_t i = begin; i != end; ++i) {
+            o[i] = sum[i - begin] / count;
+        }
+    }
+}
+
+// Young and van Vliet (1995) recursive Gaussian, coefficients b[0..3]
+void recursive_gaussian_coefficients(const float sigma, double* b) {
+    double q;
+    if (sigma >= 2.5) {
+        q = 0.98711 * sigma - 0.96330;
+    } else {
+        q = 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    }
+    b[0] = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    b[1] = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    b[2] = -(1.4281 * q * q + 1.26661 * q * q * q);
+    b[3] = 0.422205 * q * q * q;
+}
+
+void smooth_block_recursive(const float* in, float* out, const uint32_t nr_slab,
+                            const int size_time, const double* b,
+                            const vector<float>& norm, const uint32_t begin,
+                            const uint32_t end, vector<double>& work) {
+    // Causal pass forward and anti-causal pass backward in time. Samples
+    // outside of the time series are zero, norm is the filtered series of
+    // ones. work holds the intermediate [time][block voxel] values.
+    const uint32_t n = end - begin;
+    const double B = 1 - (b[1] + b[2] + b[3]) / b[0];
+    const double a1 = b[1] / b[0], a2 = b[2] / b[0], a3 = b[3] / b[0];
+    work.assign(static_cast<size_t>(size_time) * n, 0);
+    for (int it = 0; it < size_time; ++it) {
+        const float* x = in + static_cast<size_t>(nr_slab) * it + begin;
+        double* w = work.data() + static_cast<size_t>(n) * it;
+        const double* w1 = it >= 1 ? w - n : NULL;
+        const double* w2 = it >= 2 ? w - 2 * n : NULL;
+        const double* w3 = it >= 3 ? w - 3 * n : NULL;
+        for (uint32_t i = 0; i != n; ++i) {
+            w[i] = B * x[i] + a1 * (w1 ? w1[i] : 0) + a2 * (w2 ? w2[i] : 0)
+                   + a3 * (w3 ? w3[i] : 0);
+        }
+    }
+    for (int it = size_time - 1; it >= 0; --it) {
+        double* w = work.data() + static_cast<size_t>(n) * it;
+        const double* y1 = it + 1 < size_time ? w + n : NULL;
+        const double* y2 = it + 2 < size_time ? w + 2 * n : NULL;
+        const double* y3 = it + 3 < size_time ? w + 3 * n : NULL;
+        for (uint32_t i = 0; i != n; ++i) {
+            w[i] = B * w[i] + a1 * (y1 ? y1[i] : 0) + a2 * (y2 ? y2[i] : 0)
+                   + a3 * (y3 ? y3[i] : 0);
+        }
+        float* o = out + static_cast<size_t>(nr_slab) * it + begin;
+        for (uint32_t i = 0; i != n; ++i) {
+            o[i] = w[i] / norm[it];
+        }
+    }
+}
+
+vector<float> recursive_gaussian_norm(const int size_time, const double* b) {
+    // Filtered series of ones, the sum of the weights inside the series
+    const float one = 1;
+    vector<float> ones(size_time, one), norm(size_time, one), out(size_time);
+    vector<double> work;
+    smooth_block_recursive(ones.data(), out.data(), 1, size_time, b, norm, 0, 1, work);
+    return out;
+}
+
+// ----------------------------------------------------------------------------
+// FFT convolution for wide kernels
+// ----------------------------------------------------------------------------
+struct FFTPlan {
+    uint32_t size;                      // Power of two
+    vector<uint32_t> rev;               // Bit reversed indices
+    vector<std::complex<double> > tw;   // exp(-2 pi i k / size), k < size / 2
+};
+
+FFTPlan fft_plan(const uint32_t min_size) {
+    FFTPlan plan;
+    uint32_t bits = 0;
+    plan.size = 1;
+    while (plan.size < min_size) {
+        plan.size <<= 1;
+        bits += 1;
+    }
+    plan.rev.resize(plan.size);
+    for (uint32_t k = 0; k != plan.size; ++k) {
+        uint32_t r = 0;
+        for (uint32_t bit = 0; bit != bits; ++bit) {
+            r |= ((k >> bit) & 1) << (bits - 1 - bit);
+        }
+        plan.rev[k] = r;
+    }
+    plan.tw.resize(plan.size / 2);
+    for (uint32_t k = 0; k != plan.size / 2; ++k) {
+        const double phi = -2. * 3.14159265358979323846 * k / plan.size;
+        plan.tw[k] = std::complex<double>(cos(phi), sin(phi));
+    }
+    return plan;
+}
+
+void fft(const FFTPlan& plan, vector<std::complex<double> >& data,
+         const bool inverse) {
+    // Iterative radix-2 transform. The inverse is not scaled by 1 / size.
+    const uint32_t n = plan.size;
+    for (uint32_t k = 0; k != n; ++k) {
+        if (k < plan.rev[k]) std::swap(data[k], data[plan.rev[k]]);
+    }
+    for (uint32_t len = 2; len <= n; len <<= 1) {
+        const uint32_t step = n / len;
+        for (uint32_t start = 0; start < n; start += len) {
+            for (uint32_t k = 0; k != len / 2; ++k) {
+                std::complex<double> w = plan.tw[k * step];
+                if (inverse) w = std::conj(w);
+                const std::complex<double> u = data[start + k];
+                const std::complex<double> v = data[start + k + len / 2] * w;
+                data[start + k] = u + v;
+                data[start + k + len / 2] = u - v;
+            }
+        }
+    }
+}
+
+void smooth_block_fft(const float* in, float* out, const uint32_t nr_slab,
+                      const int size_time, const FFTPlan& plan,
+                      const vector<std::complex<double> >& kernel_spectrum,
+                      const vector<float>& norm, const uint32_t begin,
+                      const uint32_t end, vector<std::complex<double> >& work) {
+    // The kernel is real, so two voxels are filtered at once as the real and
+    // imaginary part of one complex series.
+    const double scale = 1. / plan.size;
+    for (uint32_t i = begin; i < end; i += 2) {
+        const bool pair = i + 1 < end;
+        work.assign(plan.size, std::complex<double>(0, 0));
+        for (int it = 0; it < size_time; ++it) {
+            const float* x = in + static_cast<size_t>(nr_slab) * it + i;
+            work[it] = std::complex<double>(x[0], pair ? x[1] : 0);
+        }
+        fft(plan, work, false);
+        for (uint32_t k = 0; k != plan.size; ++k) {
+            work[k] *= kernel_spectrum[k];
+        }
+        fft(plan, work, true);
+        for (int it = 0; it < size_time; ++it) {
+            float* o = out + static_cast<size_t>(nr_slab) * it + i;
+            o[0] = work[it].real() * scale / norm[it];
+            if (pair) o[1] = work[it].imag() * scale / norm[it];
+        }
+    }
+}
+
 int main(int argc, char * argv[]) {
     bool use_outpath = false ;
     char  *fout = NULL ;
     char* fin = NULL;
-    int ac, do_gaus = 0, do_box = 0, bFWHM_val = 0;
+    char* fin_kernel = NULL;
+    int ac, do_gaus = 0, do_box = 0, do_kernel = 0, bFWHM_val = 0;
+    bool use_recursive = false;
     float gFWHM_val = 0.0;
+    int nr_threads = 1;
+    uint64_t max_mem = 2048;
     if (argc  <  3) return show_help();
 
     // Process user options
@@ -59,12 +289,33 @@ int main(int argc, char * argv[]) {
             }
             bFWHM_val = atoi(argv[ac]);
             do_box = 1;
+        } else if (!strcmp(argv[ac], "-kernel")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -kernel\n");
+                return 1;
+            }
+            fin_kernel = argv[ac];
+            do_kernel = 1;
+        } else if (!strcmp(argv[ac], "-recursive")) {
+            use_recursive = true;
         } else if (!strcmp(argv[ac], "-input")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -input\n");
                 return 1;
             }
             fin = argv[ac];
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            nr_threads = std::max(1, atoi(argv[ac]));
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            max_mem = atoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -83,101 +334,199 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image * nii_input = nifti_image_read(fin, 1);
-    if (!nii_input) {
+    // Read input header, data is streamed in slabs
+    NiftiReader reader;
+    if (!nifti_reader_open(reader, fin)) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
         return 2;
     }
-    if (do_box + do_gaus !=1) {
-        cout << "  Invalid smoothing option. Select gaus or box." << endl;
+    nifti_image* nii_input = reader.nii;
+    if (do_box + do_gaus + do_kernel != 1) {
+        cout << "  Invalid smoothing option. Select gaus, box or kernel." << endl;
         return 2;
     }
 
+    // Custom weights
+    vector<float> kernel;
+    if (do_kernel) {
+        FILE* fp = fopen(fin_kernel, "r");
+        if (!fp) {
+            fprintf(stderr, "** failed to read kernel from '%s'\n", fin_kernel);
+            return 2;
+        }
+        float value;
+        while (fscanf(fp, "%f", &value) == 1) {
+            kernel.push_back(value);
+        }
+        fclose(fp);
+        if (kernel.size() % 2 != 1) {
+            fprintf(stderr, "** kernel in '%s' needs an odd number of weights\n", fin_kernel);
+            return 2;
+        }
+    }
+
     log_welcome("LN_TEMPSMOOTH");
     log_nifti_descriptives(nii_input);
     if (do_gaus) {
         cout << "Selected temporal smoothing: Gaussian" << endl;
     } else if (do_box) {
         cout << "Selected temporal smoothing: Box-car" << endl;
+    } else if (do_kernel) {
+        cout << "Selected temporal smoothing: Custom kernel" << endl;
     }
 
     // Get dimensions of input
-    int size_x = nii_input->nx;
-    int size_y = nii_input->ny;
     int size_z = nii_input->nz;
     int size_time = nii_input->nt;
-    int nr_voxels = size_x * size_y * size_z;
-    // int nx = nii_input->nx;
-    // int nxy = nii_input->nx * nii_input->ny;
-    int nxyz = nii_input->nx * nii_input->ny * nii_input->nz;
+    int nxy = nii_input->nx * nii_input->ny;
     float dT = 1;
 
     // ========================================================================
-    // Fixing potential problems with different input datatypes
-    nifti_image* nii = copy_nifti_as_float32(nii_input);
-    float* nii_data = static_cast<float*>(nii->data);
-
     // Allocating necessary files
-    nifti_image* nii_smooth = copy_nifti_as_float32(nii);
-    float* nii_smooth_data = static_cast<float*>(nii_smooth->data);
+    // NOTE: Time series of one slab of z slices are in memory at a time.
+    // Input and output slab are [time][slab voxel].
+    const uint32_t slab_z = nifti_slab_size(nii_input, max_mem << 20, 2);
+    const int nr_slab_max = nxy * slab_z;
+    float* nii_data = static_cast<float*>(
+        malloc(static_cast<size_t>(nr_slab_max) * size_time * sizeof(float)));
+    float* nii_smooth_data = static_cast<float*>(
+        malloc(static_cast<size_t>(nr_slab_max) * size_time * sizeof(float)));
 
-    nifti_image* nii_weight = nifti_copy_nim_info(nii);
-    nii_weight->nt = 1;
-    nii_weight->datatype = NIFTI_TYPE_FLOAT32;
-    nii_weight->nbyper = sizeof(float);
-    nii_weight->nvox = size_x * size_y * size_z;
-    nii_weight->data = calloc(nii_weight->nvox, nii_weight->nbyper);
-    float* nii_weight_data = static_cast<float*>(nii_weight->data);
+    if (!use_outpath) fout = fin;
+    NiftiWriter writer;
+    if (!nifti_writer_open(writer, nii_input, size_time,
+                           output_path(fout, "tempsmooth", use_outpath))) {
+        return 2;
+    }
 
     // ========================================================================
     // Smoothing loop
     // ========================================================================
-    int vic;
+    int vic = 0;
     if (do_gaus) {
         vic = max(1., 2. * gFWHM_val / dT);  // Ignore if voxel is too far
     } else if (do_box) {
         vic = bFWHM_val;
+    } else if (do_kernel) {
+        vic = kernel.size() / 2;
     }
     cout << "    vic " << vic << endl;
     cout << "    FWHM_val " << gFWHM_val << endl;
+    if (slab_z < static_cast<uint32_t>(size_z)) {
+        cout << "    Slabs of " << slab_z << " slices" << endl;
+    }
 
-    for (int i = 0; i < nr_voxels; ++i) {
-        *(nii_weight_data + i) = 0;
-        if (*(nii_data + i) != 0) {
-            for (int it = 0; it < size_time; ++it) {
-                int j = nxyz * it + i;
-                *(nii_smooth_data + j) = 0;
-
-                if (do_gaus) {
-                    float weight = 0;
-                    int jt_start = max(0, it - vic);
-                    int jt_stop = min(it + vic + 1, size_time);
-                    for (int jt = jt_start; jt < jt_stop; ++jt) {
-                        int k = nxyz * jt + i;
-                        float dist = abs(it - jt);
-                        float g = gaus(dist, gFWHM_val);
-                        *(nii_smooth_data + j) += (*(nii_data + k) * g);
-                        weight += g;
-                    }
-                    *(nii_smooth_data + j) /= weight;
-                } else if (do_box) {
-                    float weight = 0;
-                    int jt_start = max(0, it - vic);
-                    int jt_stop = min(it + vic + 1, size_time);
-                    for (int jt = jt_start; jt < jt_stop; ++jt) {
-                        int k = nxyz * jt + i;
-                        *(nii_smooth_data + j) += *(nii_data + k);
-                        weight += 1;
+    // Gaussian weights only depend on the time difference
+    if (do_gaus) {
+        kernel.resize(2 * vic + 1);
+        for (int d = -vic; d <= vic; ++d) {
+            kernel[vic + d] = gaus(static_cast<float>(abs(d)), gFWHM_val);
+        }
+    }
+
+    // NOTE: The recursive filter is a poor fit of narrow Gaussians, which are
+    // cheap to apply directly anyway. Kernels that are wide compared to the
+    // length of the FFT are convolved in the frequency domain, which gives
+    // the same result up to rounding.
+    enum Method { DIRECT, BOX, RECURSIVE, FFT };
+    Method method = DIRECT;
+    if (do_box) {
+        method = BOX;
+    } else if (do_gaus && use_recursive && gFWHM_val >= 2) {
+        method = RECURSIVE;
+    }
+    // Weights further away than the length of the series are never used
+    const int vic_used = min(vic, size_time - 1);
+    FFTPlan plan;
+    if (method == DIRECT) {
+        plan = fft_plan(size_time + vic_used);
+        uint32_t log2_size = 0;
+        while ((1u << log2_size) < plan.size) log2_size += 1;
+        if (2 * vic_used + 1 > 4 * static_cast<int>(log2_size)) method = FFT;
+    }
+    if (do_gaus && use_recursive && method != RECURSIVE) {
+        cout << "    Gaussian size is below 2, using the direct filter." << endl;
+    }
+
+    // Sum of weights inside the time series for each time point
+    vector<float> norm(size_time, 0);
+    double b_recursive[4];
+    vector<std::complex<double> > kernel_spectrum;
+    if (method == RECURSIVE) {
+        cout << "    Recursive Gaussian" << endl;
+        recursive_gaussian_coefficients(gFWHM_val, b_recursive);
+        norm = recursive_gaussian_norm(size_time, b_recursive);
+    } else if (method != BOX) {
+        for (int it = 0; it < size_time; ++it) {
+            for (int jt = max(0, it - vic); jt < min(it + vic + 1, size_time); ++jt) {
+                norm[it] += kernel[vic + jt - it];
+            }
+        }
+    }
+    if (method == FFT) {
+        cout << "    FFT convolution, " << plan.size << " points" << endl;
+        // Output at t sums input at t + d with weight kernel[vic + d], which
+        // is a convolution with the mirrored kernel
+        kernel_spectrum.assign(plan.size, std::complex<double>(0, 0));
+        for (int d = -vic_used; d <= vic_used; ++d) {
+            kernel_spectrum[(plan.size - d) % plan.size] = kernel[vic + d];
+        }
+        fft(plan, kernel_spectrum, false);
+    }
+
+    for (int z0 = 0; z0 < size_z; z0 += slab_z) {
+        const int nr_slices = min(static_cast<int>(slab_z), size_z - z0);
+        const uint32_t nr_slab = nxy * nr_slices;
+        if (!nifti_reader_read_slab(reader, z0, nr_slices, nii_data)) return 2;
+
+        parallel_for(nr_slab, nr_threads, [&](uint32_t begin, uint32_t end) {
+            // Blocks of voxels keep the per voxel state in cache
+            const uint32_t block_size = 256;
+            vector<double> work;
+            vector<std::complex<double> > work_fft;
+            for (uint32_t b = begin; b < end; b += block_size) {
+                const uint32_t b_end = min(b + block_size, end);
+                switch (method) {
+                    case DIRECT:
+                        smooth_block_direct(nii_data, nii_smooth_data, nr_slab,
+                                            size_time, kernel, norm, b, b_end);
+                        break;
+                    case BOX:
+                        smooth_block_box(nii_data, nii_smooth_data, nr_slab,
+                                         size_time, vic, b, b_end);
+                        break;
+                    case RECURSIVE:
+                        smooth_block_recursive(nii_data, nii_smooth_data, nr_slab,
+                                               size_time, b_recursive, norm, b,
+                                               b_end, work);
+                        break;
+                    case FFT:
+                        smooth_block_fft(nii_data, nii_smooth_data, nr_slab,
+                                         size_time, plan, kernel_spectrum, norm,
+                                         b, b_end, work_fft);
+                        break;
+                }
+            }
+
+            // Voxels that are zero at the first time point are not smoothed
+            for (uint32_t i = begin; i != end; ++i) {
+                if (*(nii_data + i) == 0) {
+                    for (int it = 0; it < size_time; ++it) {
+                        const size_t j = static_cast<size_t>(nr_slab) * it + i;
+                        *(nii_smooth_data + j) = *(nii_data + j);
                     }
-                    *(nii_smooth_data + j) /= weight;
                 }
             }
+        });
+
+        if (!nifti_writer_write_slab(writer, z0, nr_slices, nii_smooth_data)) {
+            return 2;
         }
     }
-
-    if (!use_outpath) fout = fin;
-    save_output_nifti(fout, "tempsmooth", nii_smooth, true, use_outpath);
+    free(nii_data);
+    free(nii_smooth_data);
+    nifti_reader_close(reader);
+    if (!nifti_writer_close(writer)) return 2;
 
     cout << "  Finished." << endl;
     return 0;
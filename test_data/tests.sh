@@ -2,15 +2,24 @@
 # For internal testing. Just to check whether programs execute.
 
 ../LN2_LAYER_SMOOTH -input sc_VASO_act.nii.gz -layer_file sc_layers.nii.gz -FWHM 1
+../LN2_LAYER_SMOOTH -input lo_BOLD_act.nii.gz -layer_file lo_layers.nii.gz -FWHM 1 -separable -threads 4
 ../LN_LAYER_SMOOTH -input sc_VASO_act.nii.gz -layer_file sc_layers.nii.gz -FWHM 0.3 -NoKissing
+../LN_LAYER_SMOOTH -input lo_BOLD_act.nii.gz -layer_file lo_layers.nii.gz -FWHM 0.3 -threads 4
 
 ../LN_BOCO -Nulled lo_Nulled_intemp.nii.gz -BOLD lo_BOLD_intemp.nii.gz -trialBOCO 40 -shift
+../LN_BOCO -Nulled lo_Nulled_intemp.nii.gz -BOLD lo_BOLD_intemp.nii.gz -trialBOCO 40 -shift -max_mem 1
 ../LN_MP2RAGE_DNOISE -INV1 sc_INV1.nii.gz -INV2 sc_INV2.nii.gz -UNI sc_UNI.nii.gz
 
 ../LN2_LAYERS -rim sc_rim.nii.gz -nr_layers 10 -equivol
+../LN2_LAYERS -rim sc_rim.nii.gz -nr_layers 10 -equivol -threads 4
+../LN2_LAYERS -rim sc_rim.nii.gz -nr_layers 10 -equivol -geometry_cache
 
 ../LN_3DCOLUMNS -layers sc_layers_3dcolumns.nii.gz -landmarks sc_landmarks_3dcolumns.nii.gz
 ../LN_CORREL2FILES -file1 lo_Nulled_intemp.nii.gz -file2 lo_BOLD_intemp.nii.gz
+../LN_CORREL2FILES -file1 lo_Nulled_intemp.nii.gz -file2 lo_BOLD_intemp.nii.gz -window 10 -threads 4
+../LN_CORREL2FILES -file1 lo_Nulled_intemp.nii.gz -file2 lo_BOLD_intemp.nii.gz -max_mem 1
+../LN_CORREL2FILES -file1 lo_BOLD_intemp.nii.gz -seed_voxel 80 80 1 -output correl_seed_voxel.nii.gz
+../LN_CORREL2FILES -file1 lo_BOLD_intemp.nii.gz -seed lo_columns.nii.gz -output correl_seed.nii.gz
 ../LN_COLUMNAR_DIST -layers sc_layers_3dcolumns.nii.gz -landmarks sc_landmarks.nii.gz
 ../LN_DIRECT_SMOOTH -input sc_UNI.nii.gz -FWHM 2 -direction 3
 ../LN_EXTREMETR -input lo_BOLD_intemp.nii.gz
@@ -27,18 +36,37 @@
 ../LN_NOISEME -input lo_VASO_act.nii.gz -std 1
 ../LN_RAGRUG -input sc_rim.nii.gz
 ../LN_SKEW -input lo_BOLD_intemp.nii.gz
+../LN_SKEW -input lo_BOLD_intemp.nii.gz -max_mem 1
 ../LN_TEMPSMOOTH -input lo_BOLD_intemp.nii.gz -box 1
 ../LN_TEMPSMOOTH -input lo_BOLD_intemp.nii.gz -gaus 1
+../LN_TEMPSMOOTH -input lo_BOLD_intemp.nii.gz -gaus 1 -max_mem 1
+../LN_TEMPSMOOTH -input lo_BOLD_intemp.nii.gz -gaus 2 -recursive -threads 4
+../LN_TEMPSMOOTH -input lo_BOLD_intemp.nii.gz -kernel lo_tempsmooth_kernel.txt
 ../LN_TRIAL -input lo_BOLD_intemp.nii.gz -trialdur 20
 ../LN_ZOOM -mask sc_layers_3dcolumns.nii.gz -input sc_UNI.nii.gz
 ../LN_LOITUMA -equidist sc_distlay_1000.nii.gz -leaky sc_leakylay_1000.nii.gz -FWHM 1 -nr_layers 10
 ../LN_NOISE_KERNEL -input lo_Nulled_intemp.nii.gz -kernel_size 7
 ../LN2_DEVEIN -layer_file lo_layers.nii.gz -column_file lo_columns.nii.gz -input lo_BOLD_act.nii.gz -ALF lo_ALF.nii.gz
+../LN2_DEVEIN -layer_file lo_layers.nii.gz -column_file lo_columns.nii.gz -input lo_BOLD_act.nii.gz -ALF lo_ALF.nii.gz -threads 4
+../LN2_DEVEIN -layer_file lo_layers.nii.gz -column_file lo_columns.nii.gz -input lo_BOLD_act.nii.gz -ALF lo_ALF.nii.gz -column_index
 ../LN2_RIMIFY -input sc_rim.nii.gz -innergm 2 -outergm 1 -gm 3 -output rimified_tim.nii.gz
+../LN2_RIM_POLISH -rim sc_rim.nii.gz -threads 4
 ../LN_INFO -input lo_T1EPI.nii.gz
 ../LN_CONLAY -layers lo_sc_layers.nii.gz -ref lo_T1EPI.nii.gz -subsample -output lo_layers_out.nii.gz
 ../LN2_COLUMNS -rim sc_rim.nii.gz -midgm sc_midGM.nii.gz -nr_columns 300
+../LN2_COLUMNS -rim sc_rim.nii.gz -geometry_cache -nr_columns 300
 ../LN2_CHOLMO -layers sc_layers.nii.gz -outer -nr_layers 3 -layer_thickness 0.4 -output padded_layers.nii.gz
 ../LN2_PROFILE -input sc_VASO_act.nii.gz -layers sc_layers.nii.gz -plot
+../LN2_PROFILE -input lo_BOLD_act.nii.gz -layers lo_layers.nii.gz -layers lo_columns.nii.gz -median
 ../LN2_LAYERDIMENSION -values lo_BOLD_act.nii.gz -layers lo_layers.nii.gz -columns lo_columns.nii.gz
 ../LN2_MASK -scores lo_BOLD_act.nii.gz -columns lo_columns.nii.gz -mean_thr 1 -output mask.nii.gz -abs
+../LN2_DIRECTIONALITY_BIN -input mask.nii.gz -layers lo_layers.nii.gz -columns lo_columns.nii.gz -threads 4
+../LN2_VORONOI -domain sc_rim.nii.gz -init sc_midGM.nii.gz -dijkstra -max_dist 3
+../LN2_CONNECTED_CLUSTERS -input sc_midGM.nii.gz -connectivity 6 -stats
+../LN2_LAYERS -rim Ding2016_occip_rim.nii.gz -nr_layers 3
+../LN2_MULTILATERATE -rim Ding2016_occip_rim.nii.gz -control_points Ding2016_occipital_rim_midGM_equidist_control_point0.nii.gz -radius 10
+../LN2_UVD_FILTER -values Ding2016_occip_ROI.nii.gz -coord_uv Ding2016_occip_rim_UV_coordinates.nii.gz -coord_d Ding2016_occip_rim_metric_equidist.nii.gz -domain Ding2016_occip_rim_perimeter_chunk.nii.gz -radius 3 -height 0.25 -threads 4
+../LN2_UVD_FILTER -values Ding2016_occip_ROI.nii.gz -coord_uv Ding2016_occip_rim_UV_coordinates.nii.gz -coord_d Ding2016_occip_rim_metric_equidist.nii.gz -domain Ding2016_occip_rim_perimeter_chunk.nii.gz -radius 3 -height 0.25 -uv_index
+../LN2_UVD_LSTSQR -values Ding2016_occip_ROI.nii.gz -coord_uv Ding2016_occip_rim_UV_coordinates.nii.gz -coord_d Ding2016_occip_rim_metric_equidist.nii.gz -radius 3 -height 0.25 -uv_index
+../LN2_LAYERS -rim Ding2016_occip_rim.nii.gz -nr_layers 3 -geometry_cache
+../LN2_MULTILATERATE -rim Ding2016_occip_rim.nii.gz -control_points Ding2016_occipital_rim_midGM_equidist_control_point0.nii.gz -radius 10 -geometry_cache